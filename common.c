@@ -36,6 +36,8 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include <stdarg.h>
 #include <errno.h>
 #include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #if PLATFORM == PLATFORM_WIN32
   #include <memory.h>  // memset()
 #else
@@ -43,12 +45,39 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
   #include <unistd.h>
 #endif
 #include <math.h>
+#if USE_SIMD == 2
+  #include <immintrin.h>
+#elif USE_SIMD == 1
+  #include <xmmintrin.h>
+#endif
 
 void Z_Free(void *);
 void Z_Stats_f(void);
 void Z_FreeTags(int);
-static void *Z_TagMalloc(int, int);
-void *Z_Malloc(int);
+static void Z_Init(void);
+void *(Z_TagMalloc)(int, int);
+void *(Z_TagMallocUninit)(int, int);
+void *(Z_Malloc)(int);
+void *(Z_MallocUninit)(int);
+#if Z_PROFILE
+void *Z_TagMallocSite(int, int, boolean_t, const char *, int);
+void Z_Profile_f(void);
+void Z_ProfileDump(char *);
+#endif
+static void Z_PoolInit(void);
+void *Z_PoolMalloc(int);
+void Z_PoolFree(void *);
+static void Z_PoolStats(void);
+void *Z_FrameAlloc(int, int);
+void Z_FrameReset(void);
+static void Z_FrameStats(void);
+void Z_SetBudget(int, char *);
+void Z_SetEvictCallback(int, zevictfunc_t);
+void Z_RunEvictions(void);
+static void Z_DetachBudgets(void);
+void Z_EnableThreads(void);
+void Z_ThreadShutdown(void);
+void Z_Benchmark_f(void);
 void Common_PreFrame(void);
 void Common_PostFrame(void);
 void Common_snprintf(char *, int, char *, ...);
@@ -68,6 +97,7 @@ INLINE real_t M_Vec3Dot(vec3_t *, vec3_t *);
 INLINE void M_Vec3Cross(vec3_t *, vec3_t *, vec3_t *);
 INLINE void M_Vec3Normalize(vec3_t *, vec3_t *);
 INLINE void M_MakeIdentity4x4(mat4x4_t *);
+void M_MultMatrix4x4(mat4x4_t *, mat4x4_t *, mat4x4_t *);
 static cvar_t *Cvar_FindVar(char *);
 real_t Cvar_VariableValue(char *);
 char *Cvar_VariableString(char *);
@@ -79,21 +109,128 @@ void Cvar_Init(void);
 void Cvar_Cleanup(void);
 boolean_t IMG_LoadTGA(image_t *, char *);
 boolean_t MDL_Load3DS(mesh_t *, char *);
-static void ProcessNextChunk(mesh_t *, chunk_t *);
-static void ProcessNextObjectChunk(mesh_t *, submesh_t *, chunk_t *);
-static void ProcessNextMaterialChunk(material_t *, chunk_t *);
-static void AddMaterialMapfile(char *, material_t *, chunk_t *);
-static void ReadNextChunk(chunk_t *);
-static int GetString(char *);
+boolean_t MDL_Parse3DS(mdlload_t *, mesh_t *, char *);
+void MDL_Finish3DS(mdlload_t *);
+void MDL_Abort3DS(mdlload_t *);
+void MDL_LoadTest(char **, int *, int, int);
+int MDL_NumFaces(submesh_t *);
+static void CullBounds(real_t *, int, vec4_t *, int, unsigned char *);
+int MDL_CullSubmeshes(mesh_t *, vec4_t *, int);
+static unsigned int MDL_ChecksumBytes(unsigned int, const void *, int);
+static unsigned int MDL_Checksum(mdlload_t *);
+static unsigned int MDL_ParseSum(char *, int);
+static void MDL_LoadTestThread(void *);
+static void ProcessNextChunk(mdlload_t *, chunk_t *);
+static void ProcessNextObjectChunk(mdlload_t *, submesh_t *, chunk_t *);
+static void ProcessNextMaterialChunk(mdlload_t *, material_t *, chunk_t *);
+static void AddMaterialMapfile(mdlload_t *, char *, material_t *, chunk_t *);
+static INLINE unsigned int GetShort(unsigned char *);
+static INLINE unsigned int GetLong(unsigned char *);
+static INLINE real_t GetFloat(unsigned char *);
+static boolean_t ReadNextChunk(chunk_t *, unsigned char **, unsigned char *);
+static int GetString(char *, int, unsigned char *, unsigned char *);
+static int ReadArrayCount(chunk_t *, int);
 static void ReadColorChunk(material_t *, chunk_t *);
-static void ReadVertexIndices(submesh_t *, chunk_t *);
+static void ReadVertexIndices(mdlload_t *, submesh_t *, chunk_t *);
 static void ReadUVCoordinates(submesh_t *, chunk_t *);
 static void ReadVertices(submesh_t *, chunk_t *);
-static void ReadObjectMaterial(mesh_t *, submesh_t *, chunk_t *);
-static void ComputeNormals(mesh_t *);
+static void ReadObjectMaterial(mdlload_t *, submesh_t *, chunk_t *);
+static void ReadSmoothingGroups(submesh_t *, chunk_t *);
+static void ReadObjectMatrix(mdlload_t *, submesh_t *, chunk_t *);
+static void ProcessNextKeyframeChunk(mdlload_t *, chunk_t *);
+static void ProcessNextNodeChunk(mdlload_t *, mdlnode_t *, chunk_t *);
+static void ReadTrack(mdltrack_t *, int, chunk_t *);
+static void BuildAnimation(mdlload_t *, mesh_t *);
+static void BuildNodeInverse(animnode_t *, mdlnode_t *, real_t *);
+static void FreeParseNodes(mdlload_t *);
+static void EvaluateTrack(animation_t *, animtrack_t *, real_t, vec4_t *, vec4_t *, real_t *);
+static void GatherCurves(animation_t *, real_t);
+static void ProcessSubmeshes(mesh_t *, void (*)(submesh_t *));
+static void ProcessSubmeshesThread(void *);
+static void PrepareSubmesh(submesh_t *);
+static void ComputeSubmeshNormals(submesh_t *);
+static void FaceNormals(submesh_t *, real_t *, real_t *, real_t *);
+static real_t *SumFaceNormals(submesh_t *, real_t *, real_t *, real_t *);
+static real_t *SumSmoothedNormals(submesh_t *, real_t *, real_t *, real_t *);
+static void NormalizeNormals(submesh_t *, real_t *, real_t *, real_t *);
+static void OptimizeSubmesh(submesh_t *);
+static void WeldVertices(submesh_t *);
+static void ReorderFaces(face_t *, int, int);
+static real_t VertexCacheScore(int, int);
+static void ReorderVertices(submesh_t *);
+static real_t MeshACMR(submesh_t *);
+static void MeshBounds(mesh_t *);
+void MDL_SubmeshSphere(submesh_t *);
+static void BuildSubmeshLods(submesh_t *);
+struct lodbuild_s;
+static void LodWeldPositions(struct lodbuild_s *);
+static void LodQuadrics(struct lodbuild_s *);
+static real_t LodCollapseCost(struct lodbuild_s *, int, int);
+static void LodBorders(struct lodbuild_s *);
+static int LodEdgeCompare(const void *, const void *);
+static int LodCollapseCompare(const void *, const void *);
+static int LodCollapsePass(struct lodbuild_s *, int);
+static boolean_t LodCollapseFlips(struct lodbuild_s *, int, int);
+static void BuildSubmeshBvh(submesh_t *);
+struct bvhbuild_s;
+static void BvhBuildNode(struct bvhbuild_s *, int, int, int, int);
+static real_t BvhArea(vec3_t *, vec3_t *);
+static boolean_t SubmeshRays(submesh_t *, trace_t *, int, real_t *);
+static int TraceSubmesh(bvh_t *, real_t *, int, real_t *, int *);
+void MDL_TraceMesh(mesh_t *, trace_t *, int);
+static void TraceMeshBrute(mesh_t *, trace_t *, int);
+static real_t BenchRandom(unsigned int *);
+void MDL_TraceBenchmark(mesh_t *);
+void MDL_ClearOcclusion(occlusion_t *);
+void MDL_DrawOccluders(occlusion_t *, mesh_t *, mat4x4_t *);
+void MDL_ShutdownOcclusion(void);
+static void StartOccluderWorkers(void);
+static void OccluderWorker(void *);
+static int OccluderCompare(const void *, const void *);
+struct occtriangle_s;
+static int SetupOccluder(bvh_t *, real_t *, struct occtriangle_s *);
+static int SetupOccluderTriangle(vec4_t *, vec4_t *, vec4_t *, struct occtriangle_s *);
+static void RasteriseOccluders(void *);
+struct occjob_s;
+static void RasteriseTileRow(struct occjob_s *, int);
+int MDL_OccludeSubmeshes(occlusion_t *, mesh_t *, mat4x4_t *);
+static boolean_t OccludedBox(occlusion_t *, real_t *, vec3_t *, vec3_t *);
+static void ReadCellObject(mdlload_t *, char *, chunk_t *);
+static void ReadCellFile(mdlload_t *, char *);
+static void BuildCells(mdlload_t *, mesh_t *);
+static int PortalPointCompare(const void *, const void *);
+static boolean_t BuildPortal(cellgraph_t *, mdlcellobject_t *, portal_t *);
+static int PortalCell(cellgraph_t *, vec3_t *, vec3_t *, real_t);
+static int CellAt(cellgraph_t *, vec3_t *);
+static void LinkCellPortals(cellgraph_t *);
+static void LinkCells(mesh_t *);
+void MDL_FreeCells(cellgraph_t *);
+int MDL_CullCells(mesh_t *, vec3_t *, vec4_t *, int, real_t);
+submesh_t *MDL_FirstShown(mesh_t *, int *);
+submesh_t *MDL_NextShown(mesh_t *, submesh_t *, int *);
+struct cellvisit_s;
+static void UncullSubmeshes(struct cellvisit_s *, submesh_t **, int, vec4_t *, int);
+static void VisitCell(struct cellvisit_s *, int, vec4_t *, int, int, int);
+static int ClipPortal(portal_t *, vec4_t *, int, vec3_t *);
+static int NarrowFrustum(vec3_t *, vec3_t *, int, vec4_t *, int, vec4_t *);
+struct mdlcacheheader_s;
+boolean_t MDL_ParseCached(mdlload_t *, mesh_t *, char *, int);
+static boolean_t CacheArray(filemap_t *, int, int, int);
+static char *CacheName(filemap_t *, int);
+static boolean_t CheckMeshCache(filemap_t *, struct mdlcacheheader_s *);
+static boolean_t ReadMeshCache(mdlload_t *, mesh_t *, char *, struct mdlcacheheader_s *);
+static int CacheNameOfs(char *, int *);
+static boolean_t CachePad(FILE *, int);
+static boolean_t CacheWrite(FILE *, const void *, int);
+static boolean_t CacheWriteName(FILE *, char *);
+static void WriteMeshCache(mdlload_t *, mesh_t *, char *, struct mdlcacheheader_s *);
 int FS_FileLength(FILE *);
 void FS_FCloseFile(FILE *);
 int FS_FOpenFile(char *, FILE **, const char *);
+static void FS_DataPath(char *, char *);
+boolean_t FS_RenameFile(char *, char *);
+boolean_t FS_MapFile(char *, filemap_t *);
+void FS_UnmapFile(filemap_t *);
 
 extern int errno;
 
@@ -111,1529 +248,8993 @@ static time_t startuptime;
                 Zone Memory Allocation
 
 From the (GPL'd) Quake 2 sources
+
+Each tag owns a chunked bump arena. Small blocks are
+carved out of the arena pages with a pointer increment,
+blocks bigger than Z_LARGEBLOCK get their own malloc.
+A page goes back to the system once every block in it
+has been Z_Free()'d, and Z_FreeTags() releases all of
+a tag's pages at once without looking at the blocks.
+
+Blocks of z_mmapthreshold kilobytes or more are mapped
+straight from the system with Sys_PageAlloc() so that
+freeing them really lowers the process footprint.
+
+A tag can be given a named budget whose limit, in
+kilobytes, is the z_budget_<name> cvar. An allocation that
+would cross it warns once per crossing and notes how much
+the tag is over; Z_RunEvictions() hands that to the tag's
+eviction callback on the main thread at the end of the
+frame. The allocation itself is never refused.
+
+The zone may be used from any thread. Until the first
+Sys_CreateThread() there is only one, so the arenas go
+unlocked; after that every arena operation takes z_mutex.
 =======================================================
 */
 #define	Z_MAGIC		0x2D2D
+#define Z_ALIGN         16
+#define Z_PAGESIZE      65536
+#define Z_LARGEBLOCK    (Z_PAGESIZE / 4)
+#define Z_ALIGNSIZE(x)  (((x) + (Z_ALIGN - 1)) & ~(Z_ALIGN - 1))
+#define Z_MAPPED        0x01
+
+struct zpage_s;
+struct zsite_s;
 
 typedef struct zhead_s
 {
-	struct zhead_s *prev, *next;
+	struct zhead_s *prev, *next; // large blocks only
+	struct zpage_s *page;        // NULL for large blocks
+#if Z_PROFILE
+	struct zsite_s *site;
+#endif
 	short magic;
-	short tag; // for group free
+	unsigned char tag; // for group free
+	unsigned char flags;
 	int size;
 } zhead_t;
 
-static zhead_t z_chain;
+typedef struct zpage_s
+{
+	struct zpage_s *prev, *next;
+	int used;  // bump offset into the page
+	int live;  // blocks not yet freed
+} zpage_t;
+
+typedef struct
+{
+	zpage_t pages; // pages.next is the page being bumped
+	zhead_t large;
+	int numpages;
+	int nummapped;
+	int count;
+	int bytes;
+	char budget[32];     // budget name, empty if none
+	cvar_t *limit;       // z_budget_<name>
+	zevictfunc_t evict;
+	int evictbytes;      // owed to evict at the end of the frame
+	boolean_t overbudget;
+} zarena_t;
+
+#define Z_HEADSIZE      Z_ALIGNSIZE(sizeof(zhead_t))
+#define Z_PAGEHEADSIZE  Z_ALIGNSIZE(sizeof(zpage_t))
+#define Z_PAGEDATA(p)   ((char *) (p) + Z_PAGEHEADSIZE)
+#define Z_BLOCKHEAD(p)  ((zhead_t *) ((char *) (p) - Z_HEADSIZE))
+
+static zarena_t z_arenas[Z_MAXTAGS];
 static int z_count, z_bytes;
+static boolean_t z_threaded;  // never cleared once set
+static void *z_mutex;
 
 /*
 ==========================
-Z_Free()
+Z_Lock()
 ==========================
 */
-void Z_Free(void *ptr)
+static INLINE void Z_Lock(void)
 {
-	zhead_t	*z;
-
-	z = ((zhead_t *) ptr) - 1;
-
-	if(z->magic != Z_MAGIC)
-		Sys_Error("Z_Free: bad magic\n");
-
-	z->prev->next = z->next;
-	z->next->prev = z->prev;
-
-	z_count--;
-	z_bytes -= z->size;
-	free(z);
+	if(z_threaded)
+		Sys_LockMutex(z_mutex);
 }
 
 /*
 ==========================
-Z_Stats_f()
+Z_Unlock()
 ==========================
 */
-void Z_Stats_f(void)
+static INLINE void Z_Unlock(void)
 {
-	Sys_Printf("Z_Stats_f: %i bytes in %i blocks\n", z_bytes, z_count);
+	if(z_threaded)
+		Sys_UnlockMutex(z_mutex);
 }
 
 /*
 ==========================
-Z_FreeTags()
+Z_EnableThreads()
+
+Called by Sys_CreateThread() before it starts a thread
 ==========================
 */
-void Z_FreeTags(int tag)
+void Z_EnableThreads(void)
 {
-	zhead_t	*z, *next;
-
-	for(z = z_chain.next; z != &z_chain; z = next)
-	{
-		next = z->next;
-		if(z->tag == tag)
-			Z_Free((void *) (z + 1));
-	}
+	if(z_threaded)
+		return;
+	z_mutex = Sys_CreateMutex();
+	z_threaded = true;
 }
 
 /*
-==========================
-Z_TagMalloc()
-==========================
+=======================================================
+                 Zone heap profiler
+
+Built only with Z_PROFILE. Z_Malloc() and friends are
+then macros that pass __FILE__/__LINE__ down, and every
+block remembers the site it came from so live bytes,
+counts, peak and a power-of-two size histogram can be
+kept per call site and tag.
+=======================================================
 */
-static void *Z_TagMalloc(int size, int tag)
-{
-	zhead_t	*z;
-	
-	size = size + sizeof(*z);
-	z = malloc(size);
-	if(!z)
-		Sys_Error("Z_TagMalloc: failed on allocation of %i bytes", size);
-	memset(z, 0, size);
-	z_count++;
-	z_bytes += size;
-	z->magic = Z_MAGIC;
-	z->tag = tag;
-	z->size = size;
+#if Z_PROFILE
 
-	z->next = z_chain.next;
-	z->prev = &z_chain;
-	z_chain.next->prev = z;
-	z_chain.next = z;
+#define Z_MAXSITES      1024
+#define Z_HISTBUCKETS   16   // < 16 bytes, < 32 bytes, .. >= 256 KB
 
-	return (void *) (z + 1);
-}
+typedef struct zsite_s
+{
+	const char *file;
+	int line;
+	int tag;
+	int live;        // live bytes
+	int livecount;
+	int peak;        // peak live bytes
+	int total;       // allocations ever made
+	int histogram[Z_HISTBUCKETS];
+} zsite_t;
+
+static zsite_t z_sites[Z_MAXSITES];
+static int z_numsites;
 
 /*
 ==========================
-Z_Malloc()
+Z_ProfileSite()
+
+Finds or adds the entry for a call site. The last slot
+is kept out of the hash, and once the rest fill up every
+new site is counted in it as "(overflow)"
 ==========================
 */
-void *Z_Malloc(int size)
+static zsite_t *Z_ProfileSite(const char *file, int line, int tag)
 {
-	return Z_TagMalloc(size, 0);
+	zsite_t *site;
+	unsigned int hash;
+	int i;
+
+	hash = (unsigned int) line * 31 + (unsigned int) tag;
+	for(i = 0; i < Z_MAXSITES - 1; i++)
+	{
+		site = &z_sites[(hash + i) % (Z_MAXSITES - 1)];
+		if(!site->file)
+		{
+			site->file = file;
+			site->line = line;
+			site->tag = tag;
+			z_numsites++;
+			return site;
+		}
+		if(site->line == line && site->tag == tag &&
+		   (site->file == file || !strcmp(site->file, file)))
+			return site;
+	}
+	site = &z_sites[Z_MAXSITES - 1];
+	if(!site->file)
+	{
+		site->file = "(overflow)";
+		site->line = 0;
+		site->tag = -1;
+	}
+	return site;
 }
 
 /*
 ==========================
-Common_PreFrame()
+Z_ProfileAlloc()
 ==========================
 */
-void Common_PreFrame(void)
+static void Z_ProfileAlloc(zhead_t *z, const char *file, int line)
 {
-	IN_MouseMove();
-	GL_UpdateCamera();
+	zsite_t *site;
+	int bucket, size;
+
+	site = Z_ProfileSite(file, line, z->tag);
+	z->site = site;
+	site->live += z->size;
+	site->livecount++;
+	site->total++;
+	if(site->live > site->peak)
+		site->peak = site->live;
+	size = (z->size - Z_HEADSIZE) >> 4;
+	for(bucket = 0; size > 0 && bucket < Z_HISTBUCKETS - 1; bucket++)
+		size >>= 1;
+	site->histogram[bucket]++;
 }
 
 /*
 ==========================
-Common_PostFrame()
+Z_ProfileFree()
 ==========================
 */
-void Common_PostFrame(void)
+static void Z_ProfileFree(zhead_t *z)
 {
-	GL_CalcFPS();
+	if(!z->site)
+		return;
+	z->site->live -= z->size;
+	z->site->livecount--;
 }
 
 /*
 ==========================
-Common_snprintf()
+Z_ProfileCompare()
+
+qsort() callback, biggest live byte count first
 ==========================
 */
-void Common_snprintf(char *dest, int size, char *fmt, ...)
+static int Z_ProfileCompare(const void *a, const void *b)
 {
-	int len;
-	va_list argptr;
-	char bigbuffer[BIGBUFFERLEN];
+	const zsite_t *sa = *(const zsite_t **) a;
+	const zsite_t *sb = *(const zsite_t **) b;
 
-	va_start(argptr, fmt);
-	len = vsprintf(bigbuffer, fmt, argptr);
-	va_end(argptr);
-	if(len >= size)
-		Sys_Warn("Common_snprintf: overflow of %i in %i\n", len, size);
-	strncpy(dest, bigbuffer, size - 1);
+	if(sa->live != sb->live)
+		return (sa->live < sb->live) ? 1 : -1;
+	return (sa->peak < sb->peak) ? 1 : ((sa->peak > sb->peak) ? -1 : 0);
 }
 
 /*
 ==========================
-Common_ProcessCommandLine()
+Z_ProfileSorted()
+
+Fills sorted with the used sites, returns the count
 ==========================
 */
-void Common_ProcessCommandLine(int argc, char *argv[])
+static int Z_ProfileSorted(zsite_t **sorted)
 {
-	unsigned int i;
-
-	nolog = Cvar_Get("nolog", "0");
-	nostdout = Cvar_Get("nostdout", "0");
-
-	Common_snprintf(appname, STRINGLEN, argv[0]);
-
-	for(i = 1; i < argc; i++)
-	{
-		if(strstr(argv[i], "-nolog"))
-			Cvar_Set("nolog", "1");
-		else if(strstr(argv[i], "-nostdout"))
-			Cvar_Set("nostdout", "1");
-		else
-			Sys_Printf("Unrecognized command line option: %s\n", argv[i]);
-	}
+	int i, num;
+
+	num = 0;
+	for(i = 0; i < Z_MAXSITES; i++)
+		if(z_sites[i].file)
+			sorted[num++] = &z_sites[i];
+	qsort(sorted, num, sizeof(*sorted), Z_ProfileCompare);
+	return num;
 }
 
 /*
 ==========================
-Common_Init()
+Z_Profile_f()
+
+Prints the per-site report
 ==========================
 */
-static FILE *logfile_fp;
-
-void Common_Init(int argc, char *argv[], char *logfile, char *demoname2,
-				 char *demoversion, char *democopy1, char *democopy2,
-				 char *datadir2)
+void Z_Profile_f(void)
 {
-	common.curfps = 0.0f;
-	common.frameinterval = 0.0f;
-	Sys_Init();
-	common.up.x = 0.0f;
-	common.up.y = 1.0f;
-	common.up.z = 0.0f;
-	common.cam_moveforward = 0;
-	common.cam_sidestep = 0;
-	common.cam_viewanglesdelta[PITCH] = 0.0f;
-	common.cam_viewanglesdelta[YAW] = 0.0f;
-	common.cam_viewanglesdelta[ROLL] = 0.0f;
-	z_chain.next = z_chain.prev = &z_chain;
-	startuptime = time(NULL);
-	Common_snprintf(logfile_name, STRINGLEN, logfile);
-	Common_snprintf(demoname, STRINGLEN, demoname2);
-	Common_snprintf(datadir, STRINGLEN, datadir2);
-
-	Common_ProcessCommandLine(argc, argv);
-
-	if(!nolog || !nolog->value)
+	zsite_t *sorted[Z_MAXSITES];
+	zsite_t *site;
+	char hist[BIGSTRINGLEN];
+	char bucket[STRINGLEN];
+	int i, j, num;
+
+	Z_Lock();
+	num = Z_ProfileSorted(sorted);
+	Sys_Printf("Z_Profile_f: %i allocation sites\n", num);
+	Sys_Printf("Z_Profile_f: %10s %7s %10s %8s %4s  %s\n",
+			   "live", "blocks", "peak", "allocs", "tag", "site");
+	for(i = 0; i < num; i++)
 	{
-		if(FS_FOpenFile(logfile, &logfile_fp, "a+") < 0)
+		site = sorted[i];
+		Sys_Printf("Z_Profile_f: %10i %7i %10i %8i %4i  %s:%i\n", site->live, site->livecount,
+				   site->peak, site->total, site->tag, site->file, site->line);
+		hist[0] = 0;
+		for(j = 0; j < Z_HISTBUCKETS; j++)
 		{
-			Sys_Warn("unable to open logfile: %s .. disabling logging to file\n", logfile, strerror(errno));
-			Cvar_Set("nolog", "1");
+			if(!site->histogram[j])
+				continue;
+			if(j < Z_HISTBUCKETS - 1)
+				Common_snprintf(bucket, STRINGLEN, " <%i:%i", 16 << j, site->histogram[j]);
+			else
+				Common_snprintf(bucket, STRINGLEN, " >=%i:%i", 16 << (j - 1), site->histogram[j]);
+			strncat(hist, bucket, BIGSTRINGLEN - strlen(hist) - 1);
 		}
+		Sys_Printf("Z_Profile_f:   sizes%s\n", hist);
 	}
-	Sys_Printf("---- demo started at %s\n", Sys_GetTimeString());
-	Sys_Printf("%s v%s\n", demoname, demoversion);
-	Sys_Printf("%s\n", democopy1);
-	Sys_Printf("\n");
-	Sys_Printf("%s\n\n", democopy2);
-	if(DEBUG_MODE)
-		Sys_Printf("** Running in debug mode\n\n");
-
-	Cvar_Init();
+	Z_Unlock();
 }
 
 /*
 ==========================
-Common_Shutdown()
+Z_ProfileWriteString()
+
+Writes str as a quoted JSON string. MSVC's __FILE__ has
+backslashes in it
 ==========================
 */
-void Common_Shutdown(void)
+static void Z_ProfileWriteString(FILE *fp, const char *str)
 {
-	char runtimestring[STRINGLEN + 1];
-	time_t shutdowntime;
-	time_t runtime;
-
-	Cvar_Cleanup();
-	Z_Stats_f();
-	// figure out runtime
-	shutdowntime = time(NULL);
-	runtime = shutdowntime - startuptime;
-	Common_SecondsToString((unsigned long int) runtime, runtimestring, STRINGLEN);
-	Sys_Printf("---- runtime: %s\n\n", runtimestring);
-	if(logfile_fp)
+	fputc('"', fp);
+	for(; *str; str++)
 	{
-		fflush(logfile_fp);
-		FS_FCloseFile(logfile_fp);
+		if(*str == '\\' || *str == '"')
+			fputc('\\', fp);
+		fputc(*str, fp);
 	}
+	fputc('"', fp);
 }
 
 /*
 ==========================
-Common_SecondsToString()
+Z_ProfileDump()
 
-From the oer irc bot, http://oer.equnet.org
+Writes the report to a file in the data dir, as JSON
+if the name ends in .json and as plain text otherwise
 ==========================
 */
-void Common_SecondsToString(unsigned long int seconds2, char *string, int maxlen)
+void Z_ProfileDump(char *filename)
 {
-	boolean_t morethansec;
-	int fields;
-	time_t seconds;
-	time_t safe;
-	time_t days;
-	time_t hours;
-	time_t minutes;
-	char stringbuffer[STRINGLEN + 1];
-
-	seconds = (time_t) seconds2;
-
-	safe = seconds;
-	days = seconds / 3600 / 24;
-	seconds -= days * (3600 * 24);
-	hours = seconds / 3600;
-	seconds -= hours * (3600);
-	minutes = seconds / 60;
-	seconds -= minutes * 60;
-	memset(string, 0, maxlen);
-	fields = 0;
-	// handle < 1sec runtimes
-	morethansec = false;
+	zsite_t *sorted[Z_MAXSITES];
+	zsite_t *site;
+	boolean_t json;
+	char *ext;
+	FILE *fp;
+	int i, j, num;
 
-	if(days > 0)
-	{
-		Common_snprintf(string, maxlen, "%lu %s ", days, (days == 1) ? "day" : "days");
-		fields++;
-		fields++;
-		morethansec = true;
-	}
-	if(hours > 0)
-	{
-		Common_snprintf(stringbuffer, STRINGLEN, "%lu %s ", hours, (hours == 1) ? "hour" : "hours");
-		strncat(string, stringbuffer, maxlen - strlen(string));
-		fields++;
-		morethansec = true;
-	}
-	if(minutes > 0)
+	if(!filename || !filename[0])
+		return;
+	if(FS_FOpenFile(filename, &fp, "w") < 0)
 	{
-		Common_snprintf(stringbuffer, STRINGLEN, "%lu %s ", minutes, (minutes == 1) ? "minute" : "minutes");
-		strncat(string, stringbuffer, maxlen - strlen(string));
-		fields++;
-		morethansec = true;
+		Sys_Warn("Z_ProfileDump: unable to open %s: %s\n", filename, strerror(errno));
+		return;
 	}
-	if(seconds > 0)
+	ext = strrchr(filename, '.');
+	json = (boolean_t) (ext && !strcasecmp(ext, ".json"));
+
+	Z_Lock();
+	num = Z_ProfileSorted(sorted);
+	if(json)
+		fprintf(fp, "{\n  \"bytes\": %i,\n  \"blocks\": %i,\n  \"sites\": [\n", z_bytes, z_count);
+	else
+		fprintf(fp, "# %i bytes in %i blocks, %i sites\n# live blocks peak allocs tag site histogram\n",
+				z_bytes, z_count, num);
+	for(i = 0; i < num; i++)
 	{
-		if(fields > 0)
-			Common_snprintf(stringbuffer, STRINGLEN, "and %lu %s", seconds, (seconds == 1) ? "second" : "seconds");
+		site = sorted[i];
+		if(json)
+		{
+			fprintf(fp, "    { \"file\": ");
+			Z_ProfileWriteString(fp, site->file);
+			fprintf(fp, ", \"line\": %i, \"tag\": %i, \"live\": %i, "
+					"\"blocks\": %i, \"peak\": %i, \"allocs\": %i, \"histogram\": [",
+					site->line, site->tag, site->live,
+					site->livecount, site->peak, site->total);
+			for(j = 0; j < Z_HISTBUCKETS; j++)
+				fprintf(fp, j ? ", %i" : "%i", site->histogram[j]);
+			fprintf(fp, "] }%s\n", (i < num - 1) ? "," : "");
+		}
 		else
-			Common_snprintf(stringbuffer, STRINGLEN, "%lu %s", seconds, (seconds == 1) ? "second" : "seconds");
-		strncat(string, stringbuffer, maxlen - strlen(string));
-		fields++;
-		morethansec = true;
+		{
+			fprintf(fp, "%i %i %i %i %i %s:%i", site->live, site->livecount, site->peak,
+					site->total, site->tag, site->file, site->line);
+			for(j = 0; j < Z_HISTBUCKETS; j++)
+				fprintf(fp, " %i", site->histogram[j]);
+			fprintf(fp, "\n");
+		}
 	}
-	if(!morethansec)
-		Common_snprintf(string, STRINGLEN, "< 1 second");
+	if(json)
+		fprintf(fp, "  ]\n}\n");
+	Z_Unlock();
+	FS_FCloseFile(fp);
+	Sys_Printf("Z_ProfileDump: wrote %i sites to %s\n", num, filename);
 }
 
+#endif // Z_PROFILE
+
+
 /*
 ==========================
-Common_CopyString()
-
-String must be Z_Free()'d explicitly!
+Z_Init()
 ==========================
 */
-char *Common_CopyString(char *in)
+static void Z_Init(void)
 {
-	char *out;
-	
-	out = Z_Malloc(strlen(in) + 1);
-	strcpy(out, in);
-	return out;
+	zarena_t *arena;
+	int i;
+
+	for(i = 0; i < Z_MAXTAGS; i++)
+	{
+		arena = &z_arenas[i];
+		arena->pages.next = arena->pages.prev = &arena->pages;
+		arena->large.next = arena->large.prev = &arena->large;
+		arena->numpages = 0;
+		arena->nummapped = 0;
+		arena->count = 0;
+		arena->bytes = 0;
+		arena->budget[0] = 0;
+		arena->limit = NULL;
+		arena->evict = NULL;
+		arena->evictbytes = 0;
+		arena->overbudget = false;
+	}
+	z_count = 0;
+	z_bytes = 0;
+	Z_PoolInit();
 }
 
 /*
 ==========================
-Common_strtolower()
+Z_NewPage()
 ==========================
 */
-void Common_strtolower(char *str)
+static zpage_t *Z_NewPage(zarena_t *arena)
 {
-	unsigned char tmp;
-	unsigned int i;
+	zpage_t *page;
 
-	if(!str)
-		return;
+	page = malloc(Z_PAGESIZE);
+	if(!page)
+		Sys_Error("Z_NewPage: failed on allocation of %i bytes", Z_PAGESIZE);
+	page->used = 0;
+	page->live = 0;
 
-	for(i = 0; i < strlen(str); i++)
-	{
-		tmp = (unsigned char) str[i];
-		if((tmp >= 'A' && tmp <= 'Z'))
-		{
-			str[i] = tmp + 32;
-		}
-	}
+	page->next = arena->pages.next;
+	page->prev = &arena->pages;
+	arena->pages.next->prev = page;
+	arena->pages.next = page;
+	arena->numpages++;
+
+	return page;
 }
 
 /*
-==============================================
-
-                   SYS common
-
-==============================================
+==========================
+Z_FreePage()
+==========================
 */
+static void Z_FreePage(zarena_t *arena, zpage_t *page)
+{
+	page->prev->next = page->next;
+	page->next->prev = page->prev;
+	arena->numpages--;
+	free(page);
+}
 
 /*
 ==========================
-Sys_Log()
+Z_FreeLarge()
 ==========================
 */
-void Sys_Log(const char *logstring, int level)
+static void Z_FreeLarge(zarena_t *arena, zhead_t *z)
 {
-	if((!nolog || !nolog->value) && logfile_fp)
+	if(z->flags & Z_MAPPED)
 	{
-		if(level == LOG_NORMAL)
-			fprintf(logfile_fp, logstring);
-		else if(level == LOG_WARN)
-			fprintf(logfile_fp, "Warning: %s", logstring);
-		else if(level == LOG_ERROR)
-			fprintf(logfile_fp, "Error: %s", logstring);
-		else // default to NORMAL
-			fprintf(logfile_fp, logstring);
+		arena->nummapped--;
+		Sys_PageFree(z, z->size);
+	}
+	else
+	{
+		free(z);
 	}
 }
 
 /*
 ==========================
-Sys_GetTimeString()
+Z_Free()
 ==========================
 */
-char *Sys_GetTimeString(void)
+void Z_Free(void *ptr)
 {
-	time_t curtime = time(NULL);
-	return ctime(&curtime);
-}
+	zhead_t	*z;
+	zpage_t *page;
+	zarena_t *arena;
 
-/*
-==============================================
+	z = Z_BLOCKHEAD(ptr);
 
-                   MATH
+	Z_Lock();
+	if(z->magic != Z_MAGIC)
+		Sys_Error("Z_Free: bad magic\n");
+	z->magic = 0;
+#if Z_PROFILE
+	Z_ProfileFree(z);
+#endif
 
-==============================================
-*/
+	arena = &z_arenas[z->tag];
+	arena->count--;
+	arena->bytes -= z->size;
+	z_count--;
+	z_bytes -= z->size;
+
+	page = z->page;
+	if(!page)
+	{
+		z->prev->next = z->next;
+		z->next->prev = z->prev;
+		Z_FreeLarge(arena, z);
+	}
+	else if(--page->live == 0)
+	{
+		// the page is empty; rewind it if we are still bumping
+		// through it, otherwise hand it back to the system
+		if(page == arena->pages.next)
+			page->used = 0;
+		else
+			Z_FreePage(arena, page);
+	}
+	Z_Unlock();
+}
 
 /*
 ==========================
-M_Vec3Magnitude()
+Z_Stats_f()
 ==========================
 */
-INLINE real_t M_Vec3Magnitude(vec3_t *vec)
+void Z_Stats_f(void)
 {
-	return ((real_t) sqrt((vec->x * vec->x) +
-						  (vec->y * vec->y) +
-						  (vec->z * vec->z)));
+	zarena_t *arena;
+	int i;
+
+	Z_Lock();
+	Sys_Printf("Z_Stats_f: %i bytes in %i blocks\n", z_bytes, z_count);
+	for(i = 0; i < Z_MAXTAGS; i++)
+	{
+		arena = &z_arenas[i];
+		if(!arena->count && !arena->numpages)
+			continue;
+		Sys_Printf("Z_Stats_f:   tag %i: %i bytes in %i blocks, %i arena pages, %i mapped\n",
+				   i, arena->bytes, arena->count, arena->numpages, arena->nummapped);
+	}
+	for(i = 0; i < Z_MAXTAGS; i++)
+	{
+		arena = &z_arenas[i];
+		if(!arena->budget[0])
+			continue;
+		if(arena->limit && arena->limit->value > 0)
+			Sys_Printf("Z_Stats_f:   budget %s: %i of %i KB (%i%%)%s\n", arena->budget,
+					   arena->bytes / 1024, (int) arena->limit->value,
+					   (int) (arena->bytes / (arena->limit->value * 10.24f)),
+					   arena->overbudget ? ", over" : "");
+		else
+			Sys_Printf("Z_Stats_f:   budget %s: %i KB, no limit\n", arena->budget, arena->bytes / 1024);
+	}
+	Z_PoolStats();
+	Z_FrameStats();
+	Z_Unlock();
 }
 
 /*
 ==========================
-M_Vec3Add()
+Z_FreeTags()
+
+Releases every block allocated with the tag.
+Arena pages are dropped whole; only blocks too
+large for a page are visited one at a time.
 ==========================
 */
-INLINE void M_Vec3Add(vec3_t *v1, vec3_t *v2, vec3_t *result)
+void Z_FreeTags(int tag)
 {
-	result->x = v1->x + v2->x;
-	result->y = v1->y + v2->y;
-	result->z = v1->z + v2->z;
+	zarena_t *arena;
+	zpage_t *page, *nextpage;
+	zhead_t	*z, *next;
+#if Z_PROFILE
+	int offset;
+#endif
+
+	if(tag < 0 || tag >= Z_MAXTAGS)
+		Sys_Error("Z_FreeTags: bad tag %i\n", tag);
+	arena = &z_arenas[tag];
+
+	Z_Lock();
+	for(page = arena->pages.next; page != &arena->pages; page = nextpage)
+	{
+		nextpage = page->next;
+#if Z_PROFILE
+		// profiled builds still have to credit every live block
+		for(offset = 0; offset < page->used; offset += z->size)
+		{
+			z = (zhead_t *) (Z_PAGEDATA(page) + offset);
+			if(z->magic == Z_MAGIC)
+				Z_ProfileFree(z);
+		}
+#endif
+		free(page);
+	}
+	arena->pages.next = arena->pages.prev = &arena->pages;
+	arena->numpages = 0;
+
+	for(z = arena->large.next; z != &arena->large; z = next)
+	{
+		next = z->next;
+#if Z_PROFILE
+		Z_ProfileFree(z);
+#endif
+		Z_FreeLarge(arena, z);
+	}
+	arena->large.next = arena->large.prev = &arena->large;
+
+	z_count -= arena->count;
+	z_bytes -= arena->bytes;
+	arena->count = 0;
+	arena->bytes = 0;
+	Z_Unlock();
 }
 
 /*
 ==========================
-M_Vec3Subtract()
+Z_SetBudget()
+
+Attaches a named budget to a tag and creates its
+z_budget_<name> cvar, 0 meaning no limit
 ==========================
 */
-INLINE void M_Vec3Subtract(vec3_t *v1, vec3_t *v2, vec3_t *result)
+void Z_SetBudget(int tag, char *name)
 {
-	result->x = v1->x - v2->x;
-	result->y = v1->y - v2->y;
-	result->z = v1->z - v2->z;
+	char cvarname[STRINGLEN];
+	cvar_t *limit;
+
+	if(tag < 0 || tag >= Z_MAXTAGS)
+		Sys_Error("Z_SetBudget: bad tag %i\n", tag);
+	Common_snprintf(cvarname, STRINGLEN, "z_budget_%s", name);
+	// the cvar strings are zone allocated, so no lock yet
+	limit = Cvar_Get(cvarname, "0");
+
+	Z_Lock();
+	Common_snprintf(z_arenas[tag].budget, sizeof(z_arenas[tag].budget), name);
+	z_arenas[tag].limit = limit;
+	z_arenas[tag].overbudget = false;
+	Z_Unlock();
 }
 
 /*
 ==========================
-M_Vec3Divide()
+Z_SetEvictCallback()
+
+evict(tag, bytes) is asked to release at least bytes of
+the tag and returns false once it has nothing left to
+give. It is only ever called by Z_RunEvictions(), on the
+main thread and without the zone lock, so it may free GL
+objects and anything else the main thread owns
 ==========================
 */
-INLINE void M_Vec3Divide(vec3_t *vec, real_t scalar, vec3_t *result)
+void Z_SetEvictCallback(int tag, zevictfunc_t evict)
 {
-	result->x = vec->x / scalar;
-	result->y = vec->y / scalar;
-	result->z = vec->z / scalar;
+	if(tag < 0 || tag >= Z_MAXTAGS)
+		Sys_Error("Z_SetEvictCallback: bad tag %i\n", tag);
+	Z_Lock();
+	z_arenas[tag].evict = evict;
+	Z_Unlock();
 }
 
 /*
 ==========================
-M_Vec3Dot()
+Z_RunEvictions()
+
+Called once a frame on the main thread. Each tag that
+went over its budget since the last call asks its
+callback for what it was over by, until that's made up
+or the callback gives up
 ==========================
 */
-INLINE real_t M_Vec3Dot(vec3_t *v1, vec3_t *v2)
+void Z_RunEvictions(void)
 {
-	return ((v1->x * v2->x) + (v1->y * v2->y) + (v1->z * v2->z));
+	zarena_t *arena;
+	zevictfunc_t evict;
+	int i, bytes, before, after;
+
+	for(i = 0; i < Z_MAXTAGS; i++)
+	{
+		arena = &z_arenas[i];
+		Z_Lock();
+		bytes = arena->evictbytes;
+		arena->evictbytes = 0;
+		evict = arena->evict;
+		before = arena->bytes;
+		Z_Unlock();
+		while(evict && bytes > 0)
+		{
+			if(!evict(i, bytes))
+				break;
+			Z_Lock();
+			after = arena->bytes;
+			Z_Unlock();
+			if(after >= before) // released nothing the zone can see
+				break;
+			bytes -= before - after;
+			before = after;
+		}
+	}
 }
 
 /*
 ==========================
-M_Vec3Cross()
+Z_DetachBudgets()
+
+Cvar_Cleanup() is about to free the limit cvars
 ==========================
 */
-INLINE void M_Vec3Cross(vec3_t *v1, vec3_t *v2, vec3_t *result)
+static void Z_DetachBudgets(void)
 {
-	real_t v1x = v1->x;
-	real_t v1y = v1->y;
-	real_t v1z = v1->z;
-	real_t v2x = v2->x;
-	real_t v2y = v2->y;
-	real_t v2z = v2->z;
-	result->x = (v1y * v2z) - (v1z * v2y);
-	result->y = (v1z * v2x) - (v1x * v2z);
-	result->z = (v1x * v2y) - (v1y * v2x);
+	int i;
+
+	Z_Lock();
+	for(i = 0; i < Z_MAXTAGS; i++)
+		z_arenas[i].limit = NULL;
+	Z_Unlock();
 }
 
 /*
 ==========================
-M_Vec3Normalize()
+Z_CheckBudget()
+
+Makes room for size more bytes in a budgeted tag
 ==========================
 */
-INLINE void M_Vec3Normalize(vec3_t *vec, vec3_t *result)
+static void Z_CheckBudget(zarena_t *arena, int tag, int size)
 {
-	real_t magnitude;
-	magnitude = M_Vec3Magnitude(vec);
-	result->x = vec->x / magnitude;
-	result->y = vec->y / magnitude;
-	result->z = vec->z / magnitude;
-}
+	int limit;
 
-INLINE void M_MakeIdentity4x4(mat4x4_t *m)
-{
-	m->m11 = 1.0f; m->m21 = 0.0f; m->m31 = 0.0f; m->m41 = 0.0f;
-	m->m12 = 0.0f; m->m22 = 1.0f; m->m32 = 0.0f; m->m42 = 0.0f;
-	m->m13 = 0.0f; m->m23 = 0.0f; m->m33 = 1.0f; m->m43 = 0.0f;
-	m->m14 = 0.0f; m->m24 = 0.0f; m->m34 = 0.0f; m->m44 = 1.0f;
+	limit = (int) (arena->limit->value * 1024);
+	if(limit <= 0 || arena->bytes + size <= limit)
+	{
+		arena->overbudget = false;
+		return;
+	}
+	// whoever allocates may hold locks of its own, so the
+	// callback waits for the main thread
+	if(arena->evict && arena->bytes + size - limit > arena->evictbytes)
+		arena->evictbytes = arena->bytes + size - limit;
+	if(!arena->overbudget)
+		Sys_Warn("Z_TagMalloc: %s over budget, %i KB with a limit of %i KB\n",
+				 arena->budget, (arena->bytes + size) / 1024, limit / 1024);
+	arena->overbudget = true;
 }
 
 /*
-==============================================
-
-                   CVAR
+==========================
+Z_MapLarge()
 
-==============================================
+Maps a block directly from the system if it is over
+z_mmapthreshold. Fresh mappings are already zeroed
+==========================
 */
-cvar_t *cvar_vars = NULL;
+static zhead_t *Z_MapLarge(int size)
+{
+	cvar_t *threshold, *populate, *hugepages;
+	zhead_t *z;
+
+	threshold = Cvar_Get("z_mmapthreshold", 0);
+	if(!threshold || threshold->value <= 0 || size < threshold->value * 1024)
+		return NULL;
+	populate = Cvar_Get("z_mmappopulate", 0);
+	hugepages = Cvar_Get("z_hugepages", 0);
+	z = (zhead_t *) Sys_PageAlloc(size,
+								  (boolean_t) (populate && populate->value),
+								  (boolean_t) (hugepages && hugepages->value));
+	if(z)
+		z->flags = Z_MAPPED;
+	return z;
+}
 
 /*
 ==========================
-Cvar_FindVar()
+Z_TagAlloc()
+
+Callers hold the zone lock
 ==========================
 */
-static cvar_t *Cvar_FindVar(char *var_name)
+static void *Z_TagAlloc(int size, int tag, boolean_t clear)
 {
-	cvar_t	*var;
+	zhead_t	*z;
+	zpage_t *page;
+	zarena_t *arena;
 	
-	for(var = cvar_vars; var; var = var->next)
-		if(!strcmp(var_name, var->name))
-			return var;
+	if(tag < 0 || tag >= Z_MAXTAGS)
+		Sys_Error("Z_TagMalloc: bad tag %i\n", tag);
+	arena = &z_arenas[tag];
+
+	size = Z_HEADSIZE + Z_ALIGNSIZE(size);
+	if(arena->limit)
+		Z_CheckBudget(arena, tag, size);
+	if(size > Z_LARGEBLOCK)
+	{
+		if((z = Z_MapLarge(size)) != NULL)
+		{
+			arena->nummapped++;
+		}
+		else
+		{
+			z = malloc(size);
+			if(!z)
+				Sys_Error("Z_TagMalloc: failed on allocation of %i bytes", size);
+			if(clear)
+				memset(z, 0, size);
+			z->flags = 0;
+		}
+		z->page = NULL;
+		z->next = arena->large.next;
+		z->prev = &arena->large;
+		arena->large.next->prev = z;
+		arena->large.next = z;
+	}
+	else
+	{
+		page = arena->pages.next;
+		if(page == &arena->pages ||
+		   Z_PAGEHEADSIZE + page->used + size > Z_PAGESIZE)
+			page = Z_NewPage(arena);
+		z = (zhead_t *) (Z_PAGEDATA(page) + page->used);
+		page->used += size;
+		page->live++;
+		if(clear)
+			memset(z, 0, size);
+		z->page = page;
+		z->flags = 0;
+	}
+	arena->count++;
+	arena->bytes += size;
+	z_count++;
+	z_bytes += size;
+	z->magic = Z_MAGIC;
+	z->tag = tag;
+	z->size = size;
+#if Z_PROFILE
+	z->site = NULL;
+#endif
 
-	return NULL;
+	return (void *) ((char *) z + Z_HEADSIZE);
 }
 
 /*
 ==========================
-Cvar_VariableValue()
+Z_TagMalloc()
+
+The allocator entry points are defined with their names
+in parentheses so that the Z_PROFILE wrapper macros in
+common.h do not expand them
 ==========================
 */
-real_t Cvar_VariableValue(char *var_name)
+void *(Z_TagMalloc)(int size, int tag)
 {
-	cvar_t	*var;
-	
-	var = Cvar_FindVar(var_name);
-	if(!var)
-		return 0;
-	return (real_t) atof(var->string);
+	void *ptr;
+
+	Z_Lock();
+	ptr = Z_TagAlloc(size, tag, true);
+	Z_Unlock();
+	return ptr;
 }
 
 /*
 ==========================
-Cvar_VariableString()
+Z_TagMallocUninit()
+
+Like Z_TagMalloc() but leaves the block contents
+undefined, for buffers that are about to be filled
+completely anyway
 ==========================
 */
-char *Cvar_VariableString(char *var_name)
+void *(Z_TagMallocUninit)(int size, int tag)
 {
-	cvar_t *var;
-	
-	var = Cvar_FindVar(var_name);
-	if(!var)
-		return "";
-	return var->string;
+	void *ptr;
+
+	Z_Lock();
+	ptr = Z_TagAlloc(size, tag, false);
+	Z_Unlock();
+	return ptr;
 }
 
 /*
 ==========================
-Cvar_Get()
-
-If the variable already exists, the value will not be set
+Z_Malloc()
 ==========================
 */
-cvar_t *Cvar_Get(char *var_name, char *var_value)
+void *(Z_Malloc)(int size)
 {
-	cvar_t	*var;
-	
-	var = Cvar_FindVar (var_name);
-	if(var)
-		return var;
+	void *ptr;
 
-	if(!var_value)
-		return NULL;
-
-	var = (cvar_t *) Z_Malloc(sizeof(*var));
-	var->name = Common_CopyString(var_name);
-	var->string = Common_CopyString(var_value);
-	var->value = (real_t) atof(var->string);
+	Z_Lock();
+	ptr = Z_TagAlloc(size, TAG_GENERAL, true);
+	Z_Unlock();
+	return ptr;
+}
 
-	// link the variable in
-	var->next = cvar_vars;
-	cvar_vars = var;
+/*
+==========================
+Z_MallocUninit()
+==========================
+*/
+void *(Z_MallocUninit)(int size)
+{
+	void *ptr;
 
-	return var;
+	Z_Lock();
+	ptr = Z_TagAlloc(size, TAG_GENERAL, false);
+	Z_Unlock();
+	return ptr;
 }
 
+#if Z_PROFILE
 /*
 ==========================
-Cvar_Set()
+Z_TagMallocSite()
+
+What the Z_Malloc() family expands to in profiled
+builds
 ==========================
 */
-cvar_t *Cvar_Set(char *var_name, char *value)
+void *Z_TagMallocSite(int size, int tag, boolean_t clear, const char *file, int line)
 {
-	cvar_t	*var;
+	void *ptr;
 
-	var = Cvar_FindVar(var_name);
-	if(!var)
-	{	// create it
-		return Cvar_Get(var_name, value);
-	}
+	Z_Lock();
+	ptr = Z_TagAlloc(size, tag, clear);
+	Z_ProfileAlloc(Z_BLOCKHEAD(ptr), file, line);
+	Z_Unlock();
+	return ptr;
+}
+#endif
 
-	if(!strcmp(value, var->string))
-		return var;		// not changed
+/*
+=======================================================
+                  Small object pools
+
+Fixed-size engine objects (chunks, submeshes, materials,
+meshes, cvars) come from per-size-class freelists. Slabs
+are carved into blocks the first time a class runs dry
+and are never handed back, so once the pools have warmed
+up allocating and freeing an object never calls malloc.
+
+Every thread that uses the pools gets a cache with its own
+freelists, refilled from and trimmed back to the shared
+ones Z_POOLBATCH blocks at a time under the zone lock.
+A block freed on a thread other than the one that
+allocated it is pushed onto the owning cache's remote
+list with a compare-and-swap; the owner takes the whole
+list back when its freelist runs dry. Caches outlive their
+threads and are handed to the next thread that starts.
+=======================================================
+*/
+#define Z_POOLMAGIC     0x2E2E
+#define Z_POOLSLABSIZE  16384
+#define Z_POOLALIGN     8
+#define Z_POOLBATCH     32
 
-	Z_Free(var->string);	// free the old value string
-	
-	var->string = Common_CopyString(value);
-	var->value = (real_t) atof(var->string);
+struct zpoolcache_s;
 
-	return var;
-}
+typedef struct zpoolhead_s
+{
+	struct zpoolcache_s *cache; // owner of the block
+	short magic;
+	short sizeclass;
+} zpoolhead_t;
+
+typedef struct zpoolfree_s
+{
+	struct zpoolfree_s *next;
+} zpoolfree_t;
+
+typedef struct zpool_s
+{
+	int size;      // largest payload this class holds
+	int stride;    // header + payload, rounded up
+	zpoolfree_t *freelist;
+	int numslabs;
+	int capacity;  // blocks carved from slabs
+} zpool_t;
+
+static zpool_t z_pools[] = {
+	{ 16 }, { 32 }, { 48 }, { 64 }, { 96 }, { 128 },
+	{ 192 }, { 256 }, { 384 }, { 512 }
+};
+#define Z_NUMPOOLS      ((int) (sizeof(z_pools) / sizeof(z_pools[0])))
+
+typedef struct zpoolcache_s
+{
+	zpoolfree_t *freelist[Z_NUMPOOLS];
+	int numfree[Z_NUMPOOLS];
+	int inuse[Z_NUMPOOLS];  // includes blocks still on the remote list
+	int peak[Z_NUMPOOLS];
+	void *volatile remote;  // zpoolfree_t chain freed by other threads
+	boolean_t active;
+	struct zpoolcache_s *next;
+} zpoolcache_t;
+
+static zpoolcache_t *z_poolcaches;
+static THREADLOCAL zpoolcache_t *z_poolcache;
 
 /*
 ==========================
-Cvar_SetValue()
+Z_PoolInit()
 ==========================
 */
-void Cvar_SetValue (char *var_name, real_t value)
+static void Z_PoolInit(void)
 {
-	char val[STRINGLEN];
-
-	if(value == (int) value)
-		Common_snprintf(val, STRINGLEN, "%i", (int) value);
-	else
-		Common_snprintf(val, STRINGLEN, "%f", value);
+	zpool_t *pool;
+	int i;
 
-	Cvar_Set(var_name, val);
+	for(i = 0; i < Z_NUMPOOLS; i++)
+	{
+		pool = &z_pools[i];
+		pool->stride = (sizeof(zpoolhead_t) + pool->size + (Z_POOLALIGN - 1)) & ~(Z_POOLALIGN - 1);
+		pool->freelist = NULL;
+		pool->numslabs = 0;
+		pool->capacity = 0;
+	}
 }
 
 /*
 ==========================
-Cvar_ExecAutoexec()
+Z_PoolGrow()
 
-Execs autoexec.cfg
+Carves a new slab into free blocks
+==========================
+*/
+static void Z_PoolGrow(zpool_t *pool)
+{
+	char *slab;
+	zpoolfree_t *block;
+	int i, numblocks;
+
+	slab = malloc(Z_POOLSLABSIZE);
+	if(!slab)
+		Sys_Error("Z_PoolGrow: failed on allocation of %i bytes", Z_POOLSLABSIZE);
+	numblocks = Z_POOLSLABSIZE / pool->stride;
+	// link back to front so blocks are handed out in address order
+	for(i = numblocks - 1; i >= 0; i--)
+	{
+		block = (zpoolfree_t *) (slab + i * pool->stride + sizeof(zpoolhead_t));
+		block->next = pool->freelist;
+		pool->freelist = block;
+	}
+	pool->numslabs++;
+	pool->capacity += numblocks;
+}
+
+/*
+==========================
+Z_PoolAttach()
+
+Gives the calling thread a cache, reusing one left
+behind by a finished thread if there is any
+==========================
+*/
+static zpoolcache_t *Z_PoolAttach(void)
+{
+	zpoolcache_t *cache;
+
+	Z_Lock();
+	for(cache = z_poolcaches; cache; cache = cache->next)
+		if(!cache->active)
+			break;
+	if(!cache)
+	{
+		cache = malloc(sizeof(zpoolcache_t));
+		if(!cache)
+			Sys_Error("Z_PoolAttach: failed on allocation of %i bytes", (int) sizeof(zpoolcache_t));
+		memset(cache, 0, sizeof(zpoolcache_t));
+		cache->next = z_poolcaches;
+		z_poolcaches = cache;
+	}
+	cache->active = true;
+	Z_Unlock();
+
+	z_poolcache = cache;
+	return cache;
+}
+
+/*
+==========================
+Z_PoolDrainRemote()
+
+Moves the blocks other threads have freed onto
+the local freelists
+==========================
+*/
+static void Z_PoolDrainRemote(zpoolcache_t *cache)
+{
+	zpoolfree_t *block, *next;
+	int i;
+
+	if(!cache->remote)
+		return;
+	block = (zpoolfree_t *) Sys_AtomicExchangePtr(&cache->remote, NULL);
+	for(; block; block = next)
+	{
+		next = block->next;
+		i = (((zpoolhead_t *) block) - 1)->sizeclass;
+		block->next = cache->freelist[i];
+		cache->freelist[i] = block;
+		cache->numfree[i]++;
+		cache->inuse[i]--;
+	}
+}
+
+/*
+==========================
+Z_PoolRefill()
+==========================
+*/
+static void Z_PoolRefill(zpoolcache_t *cache, int i)
+{
+	zpool_t *pool;
+	zpoolfree_t *block;
+	int n;
+
+	Z_PoolDrainRemote(cache);
+	if(cache->freelist[i])
+		return;
+
+	pool = &z_pools[i];
+	Z_Lock();
+	if(!pool->freelist)
+		Z_PoolGrow(pool);
+	for(n = 0; n < Z_POOLBATCH && pool->freelist; n++)
+	{
+		block = pool->freelist;
+		pool->freelist = block->next;
+		block->next = cache->freelist[i];
+		cache->freelist[i] = block;
+	}
+	Z_Unlock();
+	cache->numfree[i] += n;
+}
+
+/*
+==========================
+Z_PoolTrim()
+
+Hands all but keep of a cache's free blocks in class i
+back to the shared freelist
+==========================
+*/
+static void Z_PoolTrim(zpoolcache_t *cache, int i, int keep)
+{
+	zpool_t *pool;
+	zpoolfree_t *block;
+
+	pool = &z_pools[i];
+	Z_Lock();
+	while(cache->numfree[i] > keep)
+	{
+		block = cache->freelist[i];
+		cache->freelist[i] = block->next;
+		block->next = pool->freelist;
+		pool->freelist = block;
+		cache->numfree[i]--;
+	}
+	Z_Unlock();
+}
+
+/*
+==========================
+Z_PoolMalloc()
+
+Returns a zeroed block from the smallest size class
+that fits. Must be released with Z_PoolFree()
+==========================
+*/
+void *Z_PoolMalloc(int size)
+{
+	zpoolcache_t *cache;
+	zpoolhead_t *z;
+	zpoolfree_t *block;
+	int i;
+
+	for(i = 0; i < Z_NUMPOOLS; i++)
+		if(size <= z_pools[i].size)
+			break;
+	if(i == Z_NUMPOOLS)
+		Sys_Error("Z_PoolMalloc: %i bytes is too large for the object pools\n", size);
+
+	cache = z_poolcache;
+	if(!cache)
+		cache = Z_PoolAttach();
+	if(!cache->freelist[i])
+		Z_PoolRefill(cache, i);
+	block = cache->freelist[i];
+	cache->freelist[i] = block->next;
+	cache->numfree[i]--;
+	if(++cache->inuse[i] > cache->peak[i])
+		cache->peak[i] = cache->inuse[i];
+
+	z = ((zpoolhead_t *) block) - 1;
+	z->cache = cache;
+	z->magic = Z_POOLMAGIC;
+	z->sizeclass = i;
+	memset(block, 0, z_pools[i].size);
+
+	return (void *) block;
+}
+
+/*
+==========================
+Z_PoolFree()
+
+Safe to call from any thread
+==========================
+*/
+void Z_PoolFree(void *ptr)
+{
+	zpoolcache_t *cache;
+	zpoolhead_t *z;
+	zpoolfree_t *block;
+	void *head;
+	int i;
+
+	z = ((zpoolhead_t *) ptr) - 1;
+	if(z->magic != Z_POOLMAGIC)
+		Sys_Error("Z_PoolFree: bad magic\n");
+	z->magic = 0;
+
+	cache = z->cache;
+	block = (zpoolfree_t *) ptr;
+	if(cache != z_poolcache)
+	{
+		// someone else's block, leave it on their remote list
+		do
+		{
+			head = cache->remote;
+			block->next = (zpoolfree_t *) head;
+		} while(Sys_AtomicCompareExchangePtr(&cache->remote, block, head) != head);
+		return;
+	}
+
+	i = z->sizeclass;
+	block->next = cache->freelist[i];
+	cache->freelist[i] = block;
+	cache->inuse[i]--;
+	// don't let one thread sit on blocks the others are short of
+	if(++cache->numfree[i] > 2 * Z_POOLBATCH && z_threaded)
+		Z_PoolTrim(cache, i, Z_POOLBATCH);
+}
+
+/*
+==========================
+Z_ThreadShutdown()
+
+Called by the Sys_CreateThread() wrapper as a thread
+exits. Returns the thread's free blocks and retires its
+cache; blocks it still owns can be freed from anywhere
+==========================
+*/
+void Z_ThreadShutdown(void)
+{
+	zpoolcache_t *cache;
+	int i;
+
+	cache = z_poolcache;
+	if(!cache)
+		return;
+	Z_PoolDrainRemote(cache);
+	for(i = 0; i < Z_NUMPOOLS; i++)
+		Z_PoolTrim(cache, i, 0);
+	Z_Lock();
+	cache->active = false;
+	Z_Unlock();
+	z_poolcache = NULL;
+}
+
+/*
+==========================
+Z_PoolStats()
+
+Called with the zone lock held. Peaks are summed over
+the thread caches, so they are an upper bound
+==========================
+*/
+static void Z_PoolStats(void)
+{
+	zpool_t *pool;
+	zpoolcache_t *cache;
+	int i, inuse, peak, numcaches;
+
+	numcaches = 0;
+	for(cache = z_poolcaches; cache; cache = cache->next)
+		numcaches++;
+	for(i = 0; i < Z_NUMPOOLS; i++)
+	{
+		pool = &z_pools[i];
+		if(!pool->numslabs)
+			continue;
+		inuse = peak = 0;
+		for(cache = z_poolcaches; cache; cache = cache->next)
+		{
+			inuse += cache->inuse[i];
+			peak += cache->peak[i];
+		}
+		Sys_Printf("Z_Stats_f:   pool %3i: %i/%i blocks in use (peak %i), %i slabs\n",
+				   pool->size, inuse, pool->capacity, peak, pool->numslabs);
+	}
+	if(numcaches > 1)
+		Sys_Printf("Z_Stats_f:   pool caches: %i threads\n", numcaches);
+}
+
+/*
+=======================================================
+                 Per-frame scratch memory
+
+Two linear buffers take turns: Z_FrameAlloc() bumps through
+the current one and Common_PostFrame() swaps them, so a
+block stays valid until the end of the frame after the one
+it was allocated in. Nothing is freed individually.
+The buffer size comes from z_framemem (in kilobytes).
+Main thread only.
+=======================================================
+*/
+#define Z_FRAMEDEFAULTSIZE  (1024 * 1024)
+
+typedef struct
+{
+	char *base;
+	int size;
+	int used;
+} zframebuf_t;
+
+static zframebuf_t z_framebufs[2];
+static int z_framecur;
+static int z_framehighwater;
+
+/*
+==========================
+Z_FrameResize()
+
+(Re)allocates a frame buffer if z_framemem has changed.
+Only ever called on a buffer that has just been reset
+==========================
+*/
+static void Z_FrameResize(zframebuf_t *buf)
+{
+	cvar_t *framemem;
+	int size;
+
+	framemem = Cvar_Get("z_framemem", 0);
+	size = (framemem && framemem->value >= 1) ? (int) framemem->value * 1024 : Z_FRAMEDEFAULTSIZE;
+	if(buf->base && buf->size == size)
+		return;
+
+	if(buf->base)
+		free(buf->base);
+	buf->base = malloc(size);
+	if(!buf->base)
+		Sys_Error("Z_FrameResize: failed on allocation of %i bytes", size);
+	buf->size = size;
+	buf->used = 0;
+}
+
+/*
+==========================
+Z_FrameAlloc()
+
+align must be a power of two. The memory is not
+cleared and must not be Z_Free()'d
+==========================
+*/
+void *Z_FrameAlloc(int size, int align)
+{
+	zframebuf_t *buf;
+	char *ptr;
+
+	buf = &z_framebufs[z_framecur];
+	if(!buf->base)
+		Z_FrameResize(buf);
+	if(align < 1)
+		align = 1;
+
+	ptr = (char *) (((size_t) (buf->base + buf->used) + (align - 1)) & ~((size_t) align - 1));
+	if(ptr + size > buf->base + buf->size)
+		Sys_Error("Z_FrameAlloc: overflow of %i bytes in a %i byte frame buffer, raise z_framemem\n",
+				  (int) (ptr - buf->base) + size, buf->size);
+	buf->used = (int) (ptr - buf->base) + size;
+	if(buf->used > z_framehighwater)
+		z_framehighwater = buf->used;
+
+	return (void *) ptr;
+}
+
+/*
+==========================
+Z_FrameReset()
+
+Releases everything allocated the frame before last
+==========================
+*/
+void Z_FrameReset(void)
+{
+	z_framecur ^= 1;
+	Z_FrameResize(&z_framebufs[z_framecur]);
+	z_framebufs[z_framecur].used = 0;
+}
+
+/*
+==========================
+Z_FrameStats()
+==========================
+*/
+static void Z_FrameStats(void)
+{
+	if(!z_framebufs[0].base && !z_framebufs[1].base)
+		return;
+	Sys_Printf("Z_Stats_f:   frame: 2 x %i bytes, high-water %i bytes\n",
+			   z_framebufs[z_framecur].size, z_framehighwater);
+}
+
+/*
+=======================================================
+               Allocator stress benchmark
+
+Run at startup with -zbench, once on the main thread
+alone and then on a worker per processor. Each worker
+keeps a window of live blocks and replaces a random one
+per step, mixing pool and arena allocations. Every
+eighth pool block is posted to the next worker's mailbox
+so that it gets freed on a thread that did not
+allocate it.
+=======================================================
+*/
+#define Z_BENCHSTEPS       200000
+#define Z_BENCHSLOTS       256
+#define Z_BENCHMAXTHREADS  16
+
+typedef struct
+{
+	unsigned int seed;
+	int ops;               // allocations + frees
+	void *volatile inbox;  // a pool block from the previous worker
+	void *volatile *outbox;
+} zbench_t;
+
+static boolean_t z_benchmark;
+
+/*
+==========================
+Z_BenchThread()
+==========================
+*/
+static void Z_BenchThread(void *data)
+{
+	zbench_t *bench;
+	void *slots[Z_BENCHSLOTS];
+	boolean_t pooled[Z_BENCHSLOTS];
+	void *block;
+	unsigned int seed;
+	int i, step, size;
+
+	bench = (zbench_t *) data;
+	seed = bench->seed;
+	memset(slots, 0, sizeof(slots));
+
+	for(step = 0; step < Z_BENCHSTEPS; step++)
+	{
+		seed = seed * 1103515245 + 12345;
+		i = (seed >> 16) % Z_BENCHSLOTS;
+		if(slots[i])
+		{
+			if(pooled[i])
+				Z_PoolFree(slots[i]);
+			else
+				Z_Free(slots[i]);
+			bench->ops++;
+		}
+
+		seed = seed * 1103515245 + 12345;
+		size = 8 + (seed >> 16) % 505;
+		pooled[i] = (boolean_t) (((seed >> 8) & 3) != 0);
+		if(pooled[i])
+			slots[i] = Z_PoolMalloc(size);
+		else
+			slots[i] = Z_MallocUninit(size * 8);
+		bench->ops++;
+
+		if(pooled[i] && !(step & 7))
+		{
+			block = Sys_AtomicExchangePtr(bench->outbox, slots[i]);
+			slots[i] = NULL;
+			if(block)
+			{
+				Z_PoolFree(block);
+				bench->ops++;
+			}
+		}
+		if(bench->inbox)
+		{
+			block = Sys_AtomicExchangePtr(&bench->inbox, NULL);
+			if(block)
+			{
+				Z_PoolFree(block);
+				bench->ops++;
+			}
+		}
+	}
+
+	for(i = 0; i < Z_BENCHSLOTS; i++)
+	{
+		if(!slots[i])
+			continue;
+		if(pooled[i])
+			Z_PoolFree(slots[i]);
+		else
+			Z_Free(slots[i]);
+		bench->ops++;
+	}
+}
+
+/*
+==========================
+Z_BenchRun()
+==========================
+*/
+static void Z_BenchRun(int numthreads)
+{
+	zbench_t bench[Z_BENCHMAXTHREADS];
+	void *threads[Z_BENCHMAXTHREADS];
+	unsigned long int start, msec;
+	int i, ops;
+
+	for(i = 0; i < numthreads; i++)
+	{
+		bench[i].seed = 0x9E3779B9u * (i + 1);
+		bench[i].ops = 0;
+		bench[i].inbox = NULL;
+		bench[i].outbox = &bench[(i + 1) % numthreads].inbox;
+	}
+
+	start = Sys_GetMilliseconds();
+	if(numthreads == 1)
+	{
+		Z_BenchThread(&bench[0]);
+	}
+	else
+	{
+		for(i = 0; i < numthreads; i++)
+			if((threads[i] = Sys_CreateThread(Z_BenchThread, &bench[i])) == NULL)
+				Sys_Error("Z_Benchmark_f: unable to start worker %i\n", i);
+		for(i = 0; i < numthreads; i++)
+			Sys_JoinThread(threads[i]);
+	}
+	msec = Sys_GetMilliseconds() - start;
+
+	ops = 0;
+	for(i = 0; i < numthreads; i++)
+	{
+		if(bench[i].inbox)
+		{
+			Z_PoolFree(bench[i].inbox);
+			bench[i].ops++;
+		}
+		ops += bench[i].ops;
+	}
+	Sys_Printf("Z_Benchmark_f: %2i thread%s %9i ops in %5lu ms, %i ops/ms\n",
+			   numthreads, (numthreads == 1) ? ": " : "s:", ops, msec,
+			   (int) (ops / (msec ? msec : 1)));
+}
+
+/*
+==========================
+Z_Benchmark_f()
+==========================
+*/
+void Z_Benchmark_f(void)
+{
+	int numthreads;
+
+	numthreads = Sys_NumProcessors();
+	if(numthreads < 2)
+		numthreads = 2;
+	if(numthreads > Z_BENCHMAXTHREADS)
+		numthreads = Z_BENCHMAXTHREADS;
+
+	Sys_Printf("Z_Benchmark_f: %i steps per thread, %i live blocks each\n",
+			   Z_BENCHSTEPS, Z_BENCHSLOTS);
+	// the single threaded run comes first, while the zone is still unlocked
+	Z_BenchRun(1);
+	Z_BenchRun(numthreads);
+	Z_Stats_f();
+}
+
+/*
+==========================
+Common_PreFrame()
+==========================
+*/
+void Common_PreFrame(void)
+{
+	IN_MouseMove();
+	GL_UpdateCamera();
+}
+
+/*
+==========================
+Common_PostFrame()
+==========================
+*/
+void Common_PostFrame(void)
+{
+	GL_CalcFPS();
+	Z_RunEvictions();
+	Z_FrameReset();
+}
+
+/*
+==========================
+Common_snprintf()
+==========================
+*/
+void Common_snprintf(char *dest, int size, char *fmt, ...)
+{
+	int len;
+	va_list argptr;
+	char bigbuffer[BIGBUFFERLEN];
+
+	va_start(argptr, fmt);
+	len = vsprintf(bigbuffer, fmt, argptr);
+	va_end(argptr);
+	if(len >= size)
+		Sys_Warn("Common_snprintf: overflow of %i in %i\n", len, size);
+	strncpy(dest, bigbuffer, size - 1);
+}
+
+/*
+==========================
+Common_ProcessCommandLine()
+==========================
+*/
+void Common_ProcessCommandLine(int argc, char *argv[])
+{
+	unsigned int i;
+
+	nolog = Cvar_Get("nolog", "0");
+	nostdout = Cvar_Get("nostdout", "0");
+
+	Common_snprintf(appname, STRINGLEN, argv[0]);
+
+	for(i = 1; i < argc; i++)
+	{
+		if(strstr(argv[i], "-nolog"))
+			Cvar_Set("nolog", "1");
+		else if(strstr(argv[i], "-nostdout"))
+			Cvar_Set("nostdout", "1");
+		else if(strstr(argv[i], "-zbench"))
+			z_benchmark = true;
+		else if(strstr(argv[i], "-loadtest"))
+			Cvar_Set("loadtest", "1");
+		else if(strstr(argv[i], "-tracebench"))
+			Cvar_Set("tracebench", "1");
+		else
+			Sys_Printf("Unrecognized command line option: %s\n", argv[i]);
+	}
+}
+
+/*
+==========================
+Common_Init()
+==========================
+*/
+static FILE *logfile_fp;
+
+void Common_Init(int argc, char *argv[], char *logfile, char *demoname2,
+				 char *demoversion, char *democopy1, char *democopy2,
+				 char *datadir2)
+{
+	common.curfps = 0.0f;
+	common.frameinterval = 0.0f;
+	Sys_Init();
+	common.up.x = 0.0f;
+	common.up.y = 1.0f;
+	common.up.z = 0.0f;
+	common.cam_moveforward = 0;
+	common.cam_sidestep = 0;
+	common.cam_viewanglesdelta[PITCH] = 0.0f;
+	common.cam_viewanglesdelta[YAW] = 0.0f;
+	common.cam_viewanglesdelta[ROLL] = 0.0f;
+	Z_Init();
+	startuptime = time(NULL);
+	Common_snprintf(logfile_name, STRINGLEN, logfile);
+	Common_snprintf(demoname, STRINGLEN, demoname2);
+	Common_snprintf(datadir, STRINGLEN, datadir2);
+
+	Common_ProcessCommandLine(argc, argv);
+
+	if(!nolog || !nolog->value)
+	{
+		if(FS_FOpenFile(logfile, &logfile_fp, "a+") < 0)
+		{
+			Sys_Warn("unable to open logfile: %s .. disabling logging to file\n", logfile, strerror(errno));
+			Cvar_Set("nolog", "1");
+		}
+	}
+	Sys_Printf("---- demo started at %s\n", Sys_GetTimeString());
+	Sys_Printf("%s v%s\n", demoname, demoversion);
+	Sys_Printf("%s\n", democopy1);
+	Sys_Printf("\n");
+	Sys_Printf("%s\n\n", democopy2);
+	if(DEBUG_MODE)
+		Sys_Printf("** Running in debug mode\n\n");
+
+	Cvar_Init();
+	if(z_benchmark)
+		Z_Benchmark_f();
+}
+
+/*
+==========================
+Common_Shutdown()
+==========================
+*/
+void Common_Shutdown(void)
+{
+	char runtimestring[STRINGLEN + 1];
+	time_t shutdowntime;
+	time_t runtime;
+#if Z_PROFILE
+	char profilefile[STRINGLEN];
+
+	// cvars are gone after Cvar_Cleanup(), but dumping after it
+	// means everything still live in the report is a leak
+	Common_snprintf(profilefile, STRINGLEN, Cvar_VariableString("z_profilefile"));
+#endif
+
+	Cvar_Cleanup();
+	Z_Stats_f();
+#if Z_PROFILE
+	Z_Profile_f();
+	Z_ProfileDump(profilefile);
+#endif
+	// figure out runtime
+	shutdowntime = time(NULL);
+	runtime = shutdowntime - startuptime;
+	Common_SecondsToString((unsigned long int) runtime, runtimestring, STRINGLEN);
+	Sys_Printf("---- runtime: %s\n\n", runtimestring);
+	if(logfile_fp)
+	{
+		fflush(logfile_fp);
+		FS_FCloseFile(logfile_fp);
+	}
+}
+
+/*
+==========================
+Common_SecondsToString()
+
+From the oer irc bot, http://oer.equnet.org
+==========================
+*/
+void Common_SecondsToString(unsigned long int seconds2, char *string, int maxlen)
+{
+	boolean_t morethansec;
+	int fields;
+	time_t seconds;
+	time_t safe;
+	time_t days;
+	time_t hours;
+	time_t minutes;
+	char stringbuffer[STRINGLEN + 1];
+
+	seconds = (time_t) seconds2;
+
+	safe = seconds;
+	days = seconds / 3600 / 24;
+	seconds -= days * (3600 * 24);
+	hours = seconds / 3600;
+	seconds -= hours * (3600);
+	minutes = seconds / 60;
+	seconds -= minutes * 60;
+	memset(string, 0, maxlen);
+	fields = 0;
+	// handle < 1sec runtimes
+	morethansec = false;
+
+	if(days > 0)
+	{
+		Common_snprintf(string, maxlen, "%lu %s ", days, (days == 1) ? "day" : "days");
+		fields++;
+		fields++;
+		morethansec = true;
+	}
+	if(hours > 0)
+	{
+		Common_snprintf(stringbuffer, STRINGLEN, "%lu %s ", hours, (hours == 1) ? "hour" : "hours");
+		strncat(string, stringbuffer, maxlen - strlen(string));
+		fields++;
+		morethansec = true;
+	}
+	if(minutes > 0)
+	{
+		Common_snprintf(stringbuffer, STRINGLEN, "%lu %s ", minutes, (minutes == 1) ? "minute" : "minutes");
+		strncat(string, stringbuffer, maxlen - strlen(string));
+		fields++;
+		morethansec = true;
+	}
+	if(seconds > 0)
+	{
+		if(fields > 0)
+			Common_snprintf(stringbuffer, STRINGLEN, "and %lu %s", seconds, (seconds == 1) ? "second" : "seconds");
+		else
+			Common_snprintf(stringbuffer, STRINGLEN, "%lu %s", seconds, (seconds == 1) ? "second" : "seconds");
+		strncat(string, stringbuffer, maxlen - strlen(string));
+		fields++;
+		morethansec = true;
+	}
+	if(!morethansec)
+		Common_snprintf(string, STRINGLEN, "< 1 second");
+}
+
+/*
+==========================
+Common_CopyString()
+
+String must be Z_Free()'d explicitly!
+==========================
+*/
+char *Common_CopyString(char *in)
+{
+	char *out;
+	
+	out = Z_TagMallocUninit(strlen(in) + 1, TAG_STRING);
+	strcpy(out, in);
+	return out;
+}
+
+/*
+==========================
+Common_strtolower()
+==========================
+*/
+void Common_strtolower(char *str)
+{
+	unsigned char tmp;
+	unsigned int i;
+
+	if(!str)
+		return;
+
+	for(i = 0; i < strlen(str); i++)
+	{
+		tmp = (unsigned char) str[i];
+		if((tmp >= 'A' && tmp <= 'Z'))
+		{
+			str[i] = tmp + 32;
+		}
+	}
+}
+
+/*
+==============================================
+
+                   SYS common
+
+==============================================
+*/
+
+/*
+==========================
+Sys_Log()
+==========================
+*/
+void Sys_Log(const char *logstring, int level)
+{
+	if((!nolog || !nolog->value) && logfile_fp)
+	{
+		if(level == LOG_NORMAL)
+			fprintf(logfile_fp, logstring);
+		else if(level == LOG_WARN)
+			fprintf(logfile_fp, "Warning: %s", logstring);
+		else if(level == LOG_ERROR)
+			fprintf(logfile_fp, "Error: %s", logstring);
+		else // default to NORMAL
+			fprintf(logfile_fp, logstring);
+	}
+}
+
+/*
+==========================
+Sys_GetTimeString()
+==========================
+*/
+char *Sys_GetTimeString(void)
+{
+	time_t curtime = time(NULL);
+	return ctime(&curtime);
+}
+
+/*
+==============================================
+
+                   MATH
+
+==============================================
+*/
+
+/*
+==========================
+M_Vec3Magnitude()
+==========================
+*/
+INLINE real_t M_Vec3Magnitude(vec3_t *vec)
+{
+	return ((real_t) sqrt((vec->x * vec->x) +
+						  (vec->y * vec->y) +
+						  (vec->z * vec->z)));
+}
+
+/*
+==========================
+M_Vec3Add()
+==========================
+*/
+INLINE void M_Vec3Add(vec3_t *v1, vec3_t *v2, vec3_t *result)
+{
+	result->x = v1->x + v2->x;
+	result->y = v1->y + v2->y;
+	result->z = v1->z + v2->z;
+}
+
+/*
+==========================
+M_Vec3Subtract()
+==========================
+*/
+INLINE void M_Vec3Subtract(vec3_t *v1, vec3_t *v2, vec3_t *result)
+{
+	result->x = v1->x - v2->x;
+	result->y = v1->y - v2->y;
+	result->z = v1->z - v2->z;
+}
+
+/*
+==========================
+M_Vec3Divide()
+==========================
+*/
+INLINE void M_Vec3Divide(vec3_t *vec, real_t scalar, vec3_t *result)
+{
+	result->x = vec->x / scalar;
+	result->y = vec->y / scalar;
+	result->z = vec->z / scalar;
+}
+
+/*
+==========================
+M_Vec3Dot()
+==========================
+*/
+INLINE real_t M_Vec3Dot(vec3_t *v1, vec3_t *v2)
+{
+	return ((v1->x * v2->x) + (v1->y * v2->y) + (v1->z * v2->z));
+}
+
+/*
+==========================
+M_Vec3Cross()
+==========================
+*/
+INLINE void M_Vec3Cross(vec3_t *v1, vec3_t *v2, vec3_t *result)
+{
+	real_t v1x = v1->x;
+	real_t v1y = v1->y;
+	real_t v1z = v1->z;
+	real_t v2x = v2->x;
+	real_t v2y = v2->y;
+	real_t v2z = v2->z;
+	result->x = (v1y * v2z) - (v1z * v2y);
+	result->y = (v1z * v2x) - (v1x * v2z);
+	result->z = (v1x * v2y) - (v1y * v2x);
+}
+
+/*
+==========================
+M_Vec3Normalize()
+==========================
+*/
+INLINE void M_Vec3Normalize(vec3_t *vec, vec3_t *result)
+{
+	real_t magnitude;
+	magnitude = M_Vec3Magnitude(vec);
+	result->x = vec->x / magnitude;
+	result->y = vec->y / magnitude;
+	result->z = vec->z / magnitude;
+}
+
+INLINE void M_MakeIdentity4x4(mat4x4_t *m)
+{
+	m->m11 = 1.0f; m->m21 = 0.0f; m->m31 = 0.0f; m->m41 = 0.0f;
+	m->m12 = 0.0f; m->m22 = 1.0f; m->m32 = 0.0f; m->m42 = 0.0f;
+	m->m13 = 0.0f; m->m23 = 0.0f; m->m33 = 1.0f; m->m43 = 0.0f;
+	m->m14 = 0.0f; m->m24 = 0.0f; m->m34 = 0.0f; m->m44 = 1.0f;
+}
+
+/*
+==========================
+M_MultMatrix4x4()
+
+result = a * b, in the GL's column major order, so the
+result transforms by b first. result may not be a or b
+==========================
+*/
+void M_MultMatrix4x4(mat4x4_t *a, mat4x4_t *b, mat4x4_t *result)
+{
+	real_t *x, *y, *r;
+	int col, row;
+
+	x = (real_t *) a;
+	y = (real_t *) b;
+	r = (real_t *) result;
+	for(col = 0; col < 4; col++)
+		for(row = 0; row < 4; row++)
+			r[col * 4 + row] = x[row] * y[col * 4] + x[4 + row] * y[col * 4 + 1] +
+				x[8 + row] * y[col * 4 + 2] + x[12 + row] * y[col * 4 + 3];
+}
+
+/*
+==============================================
+
+                   CVAR
+
+==============================================
+*/
+cvar_t *cvar_vars = NULL;
+
+/*
+==========================
+Cvar_FindVar()
+==========================
+*/
+static cvar_t *Cvar_FindVar(char *var_name)
+{
+	cvar_t	*var;
+	
+	for(var = cvar_vars; var; var = var->next)
+		if(!strcmp(var_name, var->name))
+			return var;
+
+	return NULL;
+}
+
+/*
+==========================
+Cvar_VariableValue()
+==========================
+*/
+real_t Cvar_VariableValue(char *var_name)
+{
+	cvar_t	*var;
+	
+	var = Cvar_FindVar(var_name);
+	if(!var)
+		return 0;
+	return (real_t) atof(var->string);
+}
+
+/*
+==========================
+Cvar_VariableString()
+==========================
+*/
+char *Cvar_VariableString(char *var_name)
+{
+	cvar_t *var;
+	
+	var = Cvar_FindVar(var_name);
+	if(!var)
+		return "";
+	return var->string;
+}
+
+/*
+==========================
+Cvar_Get()
+
+If the variable already exists, the value will not be set
+==========================
+*/
+cvar_t *Cvar_Get(char *var_name, char *var_value)
+{
+	cvar_t	*var;
+	
+	var = Cvar_FindVar (var_name);
+	if(var)
+		return var;
+
+	if(!var_value)
+		return NULL;
+
+	var = (cvar_t *) Z_PoolMalloc(sizeof(*var));
+	var->name = Common_CopyString(var_name);
+	var->string = Common_CopyString(var_value);
+	var->value = (real_t) atof(var->string);
+
+	// link the variable in
+	var->next = cvar_vars;
+	cvar_vars = var;
+
+	return var;
+}
+
+/*
+==========================
+Cvar_Set()
+==========================
+*/
+cvar_t *Cvar_Set(char *var_name, char *value)
+{
+	cvar_t	*var;
+
+	var = Cvar_FindVar(var_name);
+	if(!var)
+	{	// create it
+		return Cvar_Get(var_name, value);
+	}
+
+	if(!strcmp(value, var->string))
+		return var;		// not changed
+
+	Z_Free(var->string);	// free the old value string
+	
+	var->string = Common_CopyString(value);
+	var->value = (real_t) atof(var->string);
+
+	return var;
+}
+
+/*
+==========================
+Cvar_SetValue()
+==========================
+*/
+void Cvar_SetValue (char *var_name, real_t value)
+{
+	char val[STRINGLEN];
+
+	if(value == (int) value)
+		Common_snprintf(val, STRINGLEN, "%i", (int) value);
+	else
+		Common_snprintf(val, STRINGLEN, "%f", value);
+
+	Cvar_Set(var_name, val);
+}
+
+/*
+==========================
+Cvar_ExecAutoexec()
+
+Execs autoexec.cfg
 ==========================
 */
 #define AUTOEXEC_CFG "autoexec.cfg"
 
-void Cvar_ExecAutoexec(void)
+void Cvar_ExecAutoexec(void)
+{
+	char line[STRINGLEN];
+	char cvar[STRINGLEN];
+	char stringvalue[STRINGLEN];
+	real_t floatvalue;
+	int numvalue;
+	int linenr;
+	FILE *fp;
+
+	if(FS_FOpenFile(AUTOEXEC_CFG, &fp, "r") < 0)
+		return;
+	Sys_Printf("execing %s..\n", AUTOEXEC_CFG);
+	linenr = 0;
+	// parse all lines
+	while(fgets(line, 256, fp))
+	{
+		memset(stringvalue, 0, STRINGLEN);
+		floatvalue = 0.0f;
+		numvalue = 0;
+		// cvar, numerical floating point argument, enclosed in double quotes
+		if(sscanf(line, "%s \"%f\"", cvar, &floatvalue) == 2)
+		{
+			// Is it a valid cvar?
+			if(Cvar_FindVar(cvar))
+			{
+				Cvar_SetValue(cvar, floatvalue);
+				// goto next line
+				linenr++;
+				continue;
+			}
+		}
+		// cvar, numerical integer argument, enclosed in double quotes
+		if(sscanf(line, "%s \"%d\"", cvar, &numvalue) == 2)
+		{
+			// Is it a valid cvar?
+			if(Cvar_FindVar(cvar))
+			{
+				// yes, set it
+				Cvar_SetValue(cvar, numvalue);
+				// goto next line
+				linenr++;
+				continue;
+			}
+		}
+		// cvar, string argument
+		if(sscanf(line, "%s \"%s\"", cvar, stringvalue) == 2)
+		{
+			// Is it a valid cvar?
+			if(Cvar_FindVar(cvar))
+			{
+				/*
+				** The above sscanf seems to take the ending double quote with
+				** it sometimes for some reason.. chop it off
+				*/
+				if(stringvalue[strlen(stringvalue) - 1] == '"')
+					stringvalue[strlen(stringvalue) - 1] = 0;
+				Cvar_Set(cvar, stringvalue);
+				// goto next line
+				linenr++;
+				continue;
+			}
+		}
+		// cvar, numerical floating point argument, not enclosed in double quotes
+		if(sscanf(line, "%s %f", cvar, &floatvalue) == 2)
+		{
+			// Is it a valid cvar?
+			if(Cvar_FindVar(cvar))
+			{
+				// yes, set it
+				Cvar_SetValue(cvar, floatvalue);
+				// goto next line
+				linenr++;
+				continue;
+			}
+		}
+		// cvar, numerical integer argument, not enclosed in double quotes
+		if(sscanf(line, "%s %d", cvar, &numvalue) == 2)
+		{
+			// Is it a valid cvar?
+			if(Cvar_FindVar(cvar))
+			{
+				// yes, set it
+				Cvar_SetValue(cvar, numvalue);
+				// goto next line
+				linenr++;
+				continue;
+			}
+		}
+		// eat comments
+		if(strstr(line, "//"))
+			continue;
+		/*
+		** If we get here we have an unrecognized line
+		*/
+		// FIXME: should we Sys_Printf here?
+		// nolog/logfile/nostdout maybe not yet initialized
+		//Sys_Printf("unrecognized variable and/or variable value at line %d\n", linenr);
+		linenr++;
+	}
+}
+
+/*
+==========================
+Cvar_Init()
+==========================
+*/
+void Cvar_Init(void)
+{
+	// init default settings
+	Cvar_Get("developer", "0");
+	Cvar_Get("z_framemem", "1024");
+	Cvar_Get("z_mmapthreshold", "256");
+	Cvar_Get("z_mmappopulate", "0");
+	Cvar_Get("z_hugepages", "0");
+	Z_SetBudget(TAG_TEXTURE, "textures");
+	Z_SetBudget(TAG_MESH, "meshes");
+	Z_SetBudget(TAG_STRING, "strings");
+#if Z_PROFILE
+	Cvar_Get("z_profilefile", "zprofile.txt");
+#endif
+	Cvar_Get("scr_height", "480");
+	Cvar_Get("scr_width", "640");
+	Cvar_Get("scr_fullscreen", "0");
+	Cvar_Get("scr_xpos", "100");
+	Cvar_Get("scr_ypos", "100");
+	Cvar_Get("r_nearclip", "0.1");
+	Cvar_Get("r_farclip", "4000");
+	Cvar_Get("r_texanisotropy", "0.0");
+	Cvar_Get("r_uploadbudget", "1024");
+	Cvar_Get("r_mergesubmeshes", "1");
+	Cvar_Get("r_meshcache", "1");
+	Cvar_Get("r_lod", "1");
+	Cvar_Get("r_lodbias", "1");
+	Cvar_Get("r_cull", "1");
+	Cvar_Get("r_portals", "1");
+	Cvar_Get("r_showportals", "0");
+	Cvar_Get("r_speeds", "0");
+	Cvar_Get("r_occlusion", "1");
+	Cvar_Get("r_showocclusion", "0");
+	Cvar_Get("r_queries", "1");
+	Cvar_Get("r_queryinterval", "8");
+	Cvar_Get("r_renderqueue", "1");
+	Cvar_Get("r_interleave", "1");
+	Cvar_Get("r_vertexformat", "0");
+	Cvar_Get("writecfg", "1");
+	Cvar_Get("in_mouse", "1");
+	Cvar_Get("in_dgamouse", "1");
+	Cvar_Get("sensitivity", "0.5");
+	Cvar_Get("m_filter", "0");
+	Cvar_Get("m_yaw", "0.022");
+	Cvar_Get("m_pitch", "0.022");
+}
+
+/*
+==========================
+Cvar_Cleanup()
+
+Writes new autoexec.cfg with current
+cvar values and then deletes all cvars
+in memory
+==========================
+*/
+void Cvar_Cleanup(void)
+{
+	cvar_t *writecfg;
+	FILE *fp;
+	cvar_t *var, *var2;
+	char *cur_var;
+	int i;
+	boolean_t skip;
+	// variables that we don't want to write
+	const char *vars_to_skip[] = {
+		"nolog",
+		"nostdout",
+		"loadtest",
+		"tracebench",
+		NULL
+	};
+	
+	writecfg = Cvar_Get("writecfg", 0);
+	if(writecfg && writecfg->value)
+	{
+		FS_FOpenFile(AUTOEXEC_CFG, &fp, "w");
+		fprintf(fp, "// generated by %s on %s\n", appname, Sys_GetTimeString());
+		for(var = cvar_vars; var; var = var->next)
+		{
+			skip = false;
+			i = 0;
+			// see if we should skip this
+			while((cur_var = (char *) vars_to_skip[i]) != NULL)
+			{
+				if(!strcmp(cur_var, var->name))
+				{
+					skip = true;
+					break;
+				}
+				i++;
+			}
+			if(skip)
+				continue;
+			fprintf(fp, "%s \"%s\"\n", var->name, var->string);
+		}
+		FS_FCloseFile(fp);
+	}
+
+	// free cvars
+	Z_DetachBudgets();
+	var = cvar_vars;
+	while(var != NULL)
+	{
+		var2 = var->next;
+		if(var->name)
+			Z_Free(var->name);
+		if(var->string)
+			Z_Free(var->string);
+		Z_PoolFree(var);
+		var = var2;
+	}
+	// windows seems to think !nolog is false if we don't
+	// explicitly null these
+	nolog = NULL;
+	nostdout = NULL;
+}
+
+/*
+==========================
+IMG_LoadTGA()
+==========================
+*/
+#define  TGA_RGB      2   // uncompressed RGB
+#define  TGA_RLERGB   10  // run-lenght encoded RGB
+
+typedef struct {
+	unsigned char imageIDLength;
+	unsigned char colorMapType;
+	unsigned char imageTypeCode;
+	signed char colorMapOrigin;
+	signed short colorMapLength;
+	signed short colorMapEntrySize;
+	signed short imageXOrigin;
+	signed short imageYOrigin;
+	signed short imageWidth;
+	signed short imageHeight;
+	unsigned char bitCount;
+	unsigned char imageDescriptor;
+} tgaheader_t;
+
+boolean_t IMG_LoadTGA(image_t *newimage, char *imagefile)
+{
+	tgaheader_t tgaheader;
+	FILE *imgfd;
+	int channels;
+	int tgasize;
+	int i;
+	unsigned char *tempbuf;
+	unsigned char colorswap;
+	unsigned char *tgadata;
+	unsigned short pixels;
+	unsigned char r, g, b;
+	unsigned char rleid;
+	int colorsread;
+	unsigned char *pcolors;
+
+	tgadata = NULL;
+	channels = 0;
+	tgasize = 0;
+	i = 0;
+
+	if(FS_FOpenFile(imagefile, &imgfd, "rb") < 0)
+	{
+		Sys_Warn("IMG_LoadTGA: unable to open %s: %s\n", imagefile, strerror(errno));
+		return false;
+	}
+
+	// fill in the tga header
+	tempbuf = (unsigned char *) Z_Malloc(18 * sizeof(unsigned char));
+	fread(tempbuf, 18, 1, imgfd);
+	memcpy(&tgaheader.imageIDLength, tempbuf, sizeof(tgaheader.imageIDLength));
+	memcpy(&tgaheader.colorMapType, tempbuf + 1, sizeof(tgaheader.colorMapType));
+	memcpy(&tgaheader.imageTypeCode, tempbuf + 2, sizeof(tgaheader.imageTypeCode));
+	memcpy(&tgaheader.colorMapOrigin, tempbuf + 3, sizeof(tgaheader.colorMapOrigin));
+	memcpy(&tgaheader.colorMapLength, tempbuf + 5, sizeof(tgaheader.colorMapLength));
+	memcpy(&tgaheader.colorMapEntrySize, tempbuf + 7, sizeof(tgaheader.colorMapEntrySize));
+	memcpy(&tgaheader.imageXOrigin, tempbuf + 9, sizeof(tgaheader.imageXOrigin));
+	memcpy(&tgaheader.imageYOrigin, tempbuf + 11, sizeof(tgaheader.imageYOrigin));
+	memcpy(&tgaheader.imageWidth, tempbuf + 12, sizeof(tgaheader.imageWidth));
+	memcpy(&tgaheader.imageHeight, tempbuf + 14, sizeof(tgaheader.imageHeight));
+	memcpy(&tgaheader.bitCount, tempbuf + 16, sizeof(tgaheader.bitCount));
+	memcpy(&tgaheader.imageDescriptor, tempbuf + 17, sizeof(tgaheader.imageDescriptor));
+	Z_Free(tempbuf);
+
+	// see if this is a supported TGA file
+	if((tgaheader.imageTypeCode != TGA_RGB) &&
+	   (tgaheader.imageTypeCode != TGA_RLERGB))
+	{
+		Sys_Warn("IMG_LoadTGA: %s doesn't look like a TGA image, skipping\n", imagefile);
+		FS_FCloseFile(imgfd);
+		return false;
+	}
+
+	// Check if the image is RLE compressed or not
+	if(tgaheader.imageTypeCode != TGA_RLERGB)
+	{
+		// Check if the image is a 24 or 32-bit image
+		if(tgaheader.bitCount == 24 || tgaheader.bitCount == 32)
+		{
+			channels = tgaheader.bitCount / 8;
+			tgasize = tgaheader.imageWidth * tgaheader.imageHeight * channels;
+			tgadata = (unsigned char *) Z_TagMallocUninit(tgasize * sizeof(unsigned char), TAG_TEXTURE);
+
+			// Read in the TGA image data
+			fread(tgadata, sizeof(unsigned char), tgasize, imgfd);
+
+			// Change BGR to RGB
+			for(i = 0; i < tgasize; i += channels)
+			{
+				colorswap = tgadata[i];
+				tgadata[i] = tgadata[i + 2];
+				tgadata[i + 2] = colorswap;
+			}
+		}
+		// Check if the image is a 16 bit image (RGB stored in 1 unsigned short)
+		else if(tgaheader.bitCount == 16)
+		{
+			pixels = 0;
+			r = g = b = 0;
+
+			// Since we convert 16-bit images to 24 bit, we hardcode the channels to 3.
+			channels = 3;
+			tgasize = tgaheader.imageWidth * tgaheader.imageHeight * channels;
+			tgadata = (unsigned char *) Z_TagMallocUninit(tgasize * sizeof(unsigned char), TAG_TEXTURE);
+
+			// Load in all the pixel data pixel by pixel
+			for(i = 0; i < tgaheader.imageWidth * tgaheader.imageHeight; i++)
+			{
+				// Read in the current pixel
+				fread(&pixels, sizeof(unsigned short), 1, imgfd);
+
+				// To convert a 16-bit pixel into an R, G, B, we need to
+				// do some masking and such to isolate each color value.
+				// 0x1f = 11111 in binary, so since 5 bits are reserved in
+				// each unsigned short for the R, G and B, we bit shift and mask
+				// to find each value.  We then bit shift up by 3 to get the full color.
+				b = (pixels & 0x1f) << 3;
+				g = ((pixels >> 5) & 0x1f) << 3;
+				r = ((pixels >> 10) & 0x1f) << 3;
+
+				// This essentially assigns the color to our array and swaps the
+				// B and R values at the same time.
+				tgadata[i * 3 + 0] = r;
+				tgadata[i * 3 + 1] = g;
+				tgadata[i * 3 + 2] = b;
+			}
+		}
+		else
+		{
+			Sys_Warn("IMG_LoadTGA: %s has unsupported pixel format, not loading\n");
+			return false;
+		}
+	}
+	// Else, it must be Run-Length Encoded (RLE)
+	else
+	{
+		rleid = 0;
+		i = 0;
+		colorsread = 0;
+		channels = tgaheader.bitCount / 8;
+		tgasize = tgaheader.imageWidth * tgaheader.imageHeight * channels;
+
+		tgadata = (unsigned char *) Z_TagMalloc(tgasize * sizeof(unsigned char), TAG_TEXTURE);
+		pcolors = (unsigned char *) Z_Malloc(channels * sizeof(unsigned char));
+
+		// Load in all the pixel data
+		while(i < tgaheader.imageWidth * tgaheader.imageHeight) {
+			// Read in the current color count + 1
+			fread(&rleid, sizeof(unsigned char), 1, imgfd);
+
+			// Check if we don't have an encoded string of colors
+			if(rleid < 128)
+			{
+				// Increase the count by 1
+				rleid++;
+
+				// Go through and read all the unique colors found
+				while(rleid)
+				{
+					// Read in the current color
+					fread(pcolors, sizeof(unsigned char) * channels, 1, imgfd);
+
+					// Store the current pixel in our image array
+					tgadata[colorsread + 0] = pcolors[2];
+					tgadata[colorsread + 1] = pcolors[1];
+					tgadata[colorsread + 2] = pcolors[0];
+
+					// If we have a 4 channel 32-bit image, assign one more for the alpha
+					if(tgaheader.bitCount == 32)
+						tgadata[colorsread + 3] = pcolors[3];
+
+					// Increase the current pixels read, decrease the amount
+					// of pixels left, and increase the starting index for the next pixel.
+					i++;
+					rleid--;
+					colorsread += channels;
+				}
+			}
+			// Else, let's read in a string of the same character
+			else
+			{
+				// Minus the 128 ID + 1 (127) to get the color count that needs to be read
+				rleid -= 127;
+
+				// Read in the current color, which is the same for a while
+				fread(pcolors, sizeof(unsigned char) * channels, 1, imgfd);
+
+				// Go and read as many pixels as are the same
+				while(rleid) {
+                   // Assign the current pixel to the current index in our pixel array
+                   tgadata[colorsread + 0] = pcolors[2];
+                   tgadata[colorsread + 1] = pcolors[1];
+                   tgadata[colorsread + 2] = pcolors[0];
+
+                   // If we have a 4 channel 32-bit image, assign one more for the alpha
+                   if(tgaheader.bitCount == 32)
+                       tgadata[colorsread + 3] = pcolors[3];
+
+                   // Increase the current pixels read, decrease the amount
+                   // of pixels left, and increase the starting index for the next pixel.
+                   i++;
+                   rleid--;
+                   colorsread += channels;
+				}
+			}
+		}
+		Z_Free(pcolors);
+	}
+
+	FS_FCloseFile(imgfd);
+
+	newimage->format = (channels == 3) ? IMG_RGB : IMG_RGBA;
+	newimage->width = tgaheader.imageWidth;
+	newimage->height = tgaheader.imageHeight;
+	newimage->data = tgadata;
+
+	return true;
+}
+
+/*
+=========================================================
+
+3DS to mesh_t loader
+
+REFERENCES:
+
+  "3DS File Loader", www.gametutorials.com
+   http://www.gametutorials.com/Tutorials/opengl/OpenGL_Pg4.htm
+
+   "3D Studio File Format Information", Jochen Wilhelmy
+   Available at http://www.wotsit.org/search.asp?s=3d
+
+   "3ds format file reader", www.spacesimulator.net
+   http://www.spacesimulator.net/tut4_3dsloader.html
+
+=========================================================
+*/
+
+/*
+** 3ds chunks
+*/
+#define CHUNK_MAIN                        0x4D4D    // main
+#define   CHUNK_VERSION                   0x0002    // 3ds version
+#define   CHUNK_OBJECTINFO                0x3D3D    // 3D editor
+#define     CHUNK_MATERIAL                0xAFFF    // material block
+#define       CHUNK_MATNAME               0xA000    // - material name
+#define       CHUNK_MATAMBIENT            0xA010    // - material ambient
+#define       CHUNK_MATDIFFUSE            0xA020    // - material diffuse
+#define       CHUNK_MATSPECULAR           0xA030    // - material specular
+#define       CHUNK_MATSHININESS          0xA040    // - material specular shininess
+#define       CHUNK_MATTEXMAP1            0xA200    // - material texture map 1
+#define       CHUNK_MATTEXMAP2            0xA33A    // - material texture map 2
+#define       CHUNK_MATBUMPMAP            0xA230    // - material bump map
+#define         CHUNK_MATMAPFILE          0xA300    //   - material tex/bump map texture filename
+#define     CHUNK_OBJECT                  0x4000    // object block 
+#define       CHUNK_OBJECT_MESH           0x4100    // - triangle mesh
+#define         CHUNK_OBJECT_VERTICES     0x4110    //   - vertex list
+#define         CHUNK_OBJECT_FACES        0x4120    //   - face list
+#define           CHUNK_OBJECT_MATERIAL   0x4130    //     - faces material list
+#define           CHUNK_OBJECT_SMOOTH     0x4150    //     - faces smoothing groups
+#define         CHUNK_OBJECT_UV           0x4140    //   - UV tex coords
+#define         CHUNK_OBJECT_MATRIX       0x4160    //   - object to mesh space matrix
+#define   CHUNK_EDITKEYFRAME              0xB000    // keyframer block
+#define     CHUNK_KFOBJECT                0xB002    // object node
+#define       CHUNK_KFNODEHDR             0xB010    // - name and parent
+#define       CHUNK_KFPIVOT               0xB013    // - pivot point
+#define       CHUNK_KFPOSTRACK            0xB020    // - position track
+#define       CHUNK_KFROTTRACK            0xB021    // - rotation track
+#define       CHUNK_KFSCLTRACK            0xB022    // - scale track
+#define       CHUNK_KFNODEID              0xB030    // - hierarchy number
+#define     CHUNK_KFSEGMENT               0xB008    // first and last frame
+
+#define CHUNK_COLOR_F                     0x0010    // color, 3 floats
+#define CHUNK_COLOR_24                    0x0011    // color, 3 bytes
+#define CHUNK_LINCOLOR_24                 0x0012    // gamma corrected color, 3 bytes
+#define CHUNK_LINCOLOR_F                  0x0013    // gamma corrected color, 3 floats
+
+/*
+==========================
+MDL_Load3DS()
+==========================
+*/
+boolean_t MDL_Load3DS(mesh_t *newmesh, char *modelfile)
+{
+	mdlload_t load;
+	int flags;
+
+	flags = MDL_BVH;
+	if(Cvar_VariableValue("r_mergesubmeshes"))
+		flags |= MDL_MERGE;
+	if(!Cvar_VariableValue("r_meshcache"))
+		flags |= MDL_NOCACHE;
+	if(Cvar_VariableValue("r_lod"))
+		flags |= MDL_LOD;
+	if(!MDL_ParseCached(&load, newmesh, modelfile, flags))
+		return false;
+	MDL_Finish3DS(&load);
+	GL_PostProcessMesh(newmesh);
+
+	return true;
+}
+
+/*
+==========================
+MDL_Parse3DS()
+
+Everything that can be done without GL: the file is
+parsed straight out of a read-only mapping and normals
+are built. All state lives in load, mesh and the zone,
+so any number of these can run on different threads.
+Chunks are walked by pointer, so skipping one costs
+nothing however large it is.
+
+A successful parse must be followed by MDL_Finish3DS()
+on the main thread, or by MDL_Abort3DS()
+==========================
+*/
+boolean_t MDL_Parse3DS(mdlload_t *load, mesh_t *newmesh, char *modelfile)
+{
+	filemap_t map;
+	chunk_t mainchunk;
+	unsigned char *pos;
+
+	load->filename = modelfile;
+	load->mesh = newmesh;
+	load->materials = NULL;
+	load->mapfiles = NULL;
+	load->nodes = NULL;
+	load->meshmatrices = NULL;
+	load->cellobjects = NULL;
+	load->firstframe = load->lastframe = 0;
+
+	if(!FS_MapFile(modelfile, &map))
+	{
+		Sys_Warn("MDL_Load3DS: unable to open %s: %s\n", modelfile, strerror(errno));
+		return false;
+	}
+
+	pos = map.data;
+	if(!ReadNextChunk(&mainchunk, &pos, map.data + map.length) || mainchunk.id != CHUNK_MAIN)
+	{
+		Sys_Warn("MDL_Load3DS: invalid main chunk (!=0x4D4D) for %s, not loading\n", modelfile);
+		FS_UnmapFile(&map);
+		return false;
+	}
+
+	ProcessNextChunk(load, &mainchunk);
+	// everything needed has been copied out of the file by now
+	FS_UnmapFile(&map);
+	ReadCellFile(load, modelfile);
+	ProcessSubmeshes(newmesh, PrepareSubmesh);
+	MeshBounds(newmesh);
+	BuildAnimation(load, newmesh);
+	BuildCells(load, newmesh);
+
+	return true;
+}
+
+/*
+==========================
+MDL_Finish3DS()
+
+Main thread half of a load: hands the materials to the
+material pool and loads their textures. The mesh is left
+for the caller to upload with GL_PostProcessMesh()
+==========================
+*/
+void MDL_Finish3DS(mdlload_t *load)
+{
+	material_t *mat, *nextmat;
+	mdlmapfile_t *mapfile, *nextmap;
+	cvar_t *dev;
+
+	for(mat = load->materials; mat; mat = nextmat)
+	{
+		nextmat = mat->next;
+		GL_AddMaterial(mat);
+	}
+	load->materials = NULL;
+
+	dev = Cvar_Get("developer", 0);
+	for(mapfile = load->mapfiles; mapfile; mapfile = nextmap)
+	{
+		nextmap = mapfile->next;
+		mat = mapfile->material;
+		switch(mapfile->id)
+		{
+		case CHUNK_MATTEXMAP1:
+			if(dev && dev->value)
+				Sys_Printf("AddMaterialMapFile: texmap1\n");
+			GL_LoadTexture(&mat->texmap1, mapfile->name, true);
+			mat->hastexmap1 = true;
+			break;
+		case CHUNK_MATTEXMAP2:
+			if(dev && dev->value)
+				Sys_Printf("AddMaterialMapFile: texmap2\n");
+			GL_LoadTexture(&mat->texmap2, mapfile->name, true);
+			mat->hastexmap2 = true;
+			break;
+		case CHUNK_MATBUMPMAP:
+			if(dev && dev->value)
+				Sys_Printf("AddMaterialMapFile: bumpmap\n");
+			GL_LoadTexture(&mat->bumpmap, mapfile->name, true);
+			mat->hasbumpmap = true;
+			break;
+		default:
+			break;
+		}
+		Z_Free(mapfile->name);
+		Z_PoolFree(mapfile);
+	}
+	load->mapfiles = NULL;
+}
+
+/*
+==========================
+MDL_Abort3DS()
+
+Drops what a parse created apart from the mesh itself,
+which belongs to the caller. Safe on any thread
+==========================
+*/
+void MDL_Abort3DS(mdlload_t *load)
+{
+	material_t *mat, *nextmat;
+	mdlmapfile_t *mapfile, *nextmap;
+
+	for(mat = load->materials; mat; mat = nextmat)
+	{
+		nextmat = mat->next;
+		GL_FreeMaterial(mat);
+	}
+	load->materials = NULL;
+	for(mapfile = load->mapfiles; mapfile; mapfile = nextmap)
+	{
+		nextmap = mapfile->next;
+		Z_Free(mapfile->name);
+		Z_PoolFree(mapfile);
+	}
+	load->mapfiles = NULL;
+}
+
+/*
+==========================
+MDL_ChecksumBytes()
+
+FNV-1a
+==========================
+*/
+unsigned int MDL_ChecksumBytes(unsigned int sum, const void *data, int len)
+{
+	const unsigned char *p;
+
+	for(p = (const unsigned char *) data; len > 0; len--, p++)
+		sum = (sum ^ *p) * 16777619u;
+	return sum;
+}
+
+/*
+==========================
+MDL_Checksum()
+
+Covers everything a parse produces
+==========================
+*/
+unsigned int MDL_Checksum(mdlload_t *load)
+{
+	submesh_t *submesh;
+	material_t *mat;
+	mdlmapfile_t *mapfile;
+	unsigned int sum;
+
+	sum = 2166136261u;
+	for(submesh = load->mesh->submeshpool; submesh; submesh = submesh->next)
+	{
+		if(submesh->name)
+			sum = MDL_ChecksumBytes(sum, submesh->name, strlen(submesh->name));
+		if(submesh->material && submesh->material->name)
+			sum = MDL_ChecksumBytes(sum, submesh->material->name, strlen(submesh->material->name));
+		sum = MDL_ChecksumBytes(sum, &submesh->numvertices, sizeof(int));
+		sum = MDL_ChecksumBytes(sum, &submesh->numfaces, sizeof(int));
+		sum = MDL_ChecksumBytes(sum, &submesh->numtexcoords, sizeof(int));
+		sum = MDL_ChecksumBytes(sum, submesh->vertexdata, submesh->numvertices * sizeof(vec3_t));
+		sum = MDL_ChecksumBytes(sum, submesh->normaldata, submesh->numvertices * sizeof(vec3_t));
+		sum = MDL_ChecksumBytes(sum, submesh->texcoords, submesh->numtexcoords * sizeof(vec2_t));
+		sum = MDL_ChecksumBytes(sum, submesh->faces, MDL_NumFaces(submesh) * sizeof(face_t));
+		sum = MDL_ChecksumBytes(sum, submesh->lods, submesh->numlods * sizeof(submeshlod_t));
+	}
+	for(mat = load->materials; mat; mat = mat->next)
+	{
+		if(mat->name)
+			sum = MDL_ChecksumBytes(sum, mat->name, strlen(mat->name));
+		sum = MDL_ChecksumBytes(sum, &mat->ambient, sizeof(color4_t));
+		sum = MDL_ChecksumBytes(sum, &mat->diffuse, sizeof(color4_t));
+		sum = MDL_ChecksumBytes(sum, &mat->specular, sizeof(color4_t));
+	}
+	for(mapfile = load->mapfiles; mapfile; mapfile = mapfile->next)
+		sum = MDL_ChecksumBytes(sum, mapfile->name, strlen(mapfile->name));
+	if(load->mesh->anim)
+	{
+		sum = MDL_ChecksumBytes(sum, load->mesh->anim->keyframes, load->mesh->anim->numkeys * sizeof(real_t));
+		sum = MDL_ChecksumBytes(sum, load->mesh->anim->keyvalues, load->mesh->anim->numkeys * sizeof(vec4_t));
+		sum = MDL_ChecksumBytes(sum, load->mesh->anim->skin, load->mesh->anim->numnodes * 12 * sizeof(real_t));
+	}
+	return sum;
+}
+
+/*
+==========================
+MDL_ParseSum()
+
+Parses a file with the MDL_ flags, checksums the result
+and throws it away. The cache is left alone, since every
+thread would be writing the same file. Returns 0 if the
+file did not load
+==========================
+*/
+unsigned int MDL_ParseSum(char *modelfile, int flags)
+{
+	mdlload_t load;
+	mesh_t *mesh;
+	unsigned int sum;
+
+	mesh = GL_CreateMesh(NULL);
+	sum = 0;
+	if(MDL_ParseCached(&load, mesh, modelfile, flags | MDL_NOCACHE))
+	{
+		sum = MDL_Checksum(&load);
+		MDL_Abort3DS(&load);
+	}
+	GL_FreeMesh(mesh);
+	return sum;
+}
+
+/*
+==========================
+MDL_LoadTestThread()
+==========================
+*/
+#define MDL_TESTROUNDS      4
+#define MDL_TESTMAXTHREADS  16
+#define MDL_TESTMAXFILES    16
+
+typedef struct
+{
+	char **files;
+	int *flags;
+	int numfiles;
+	int first;
+	unsigned int *reference;
+	int mismatches;
+} mdltest_t;
+
+void MDL_LoadTestThread(void *data)
+{
+	mdltest_t *test;
+	int i, file;
+
+	test = (mdltest_t *) data;
+	for(i = 0; i < test->numfiles * MDL_TESTROUNDS; i++)
+	{
+		file = (test->first + i) % test->numfiles;
+		if(MDL_ParseSum(test->files[file], test->flags[file]) != test->reference[file])
+			test->mismatches++;
+	}
+}
+
+/*
+==========================
+MDL_LoadTest()
+
+Run with -loadtest. Parses each file with its MDL_ flags
+once as a reference, then has numthreads threads parse
+all of them at the same time, each starting from a
+different file, and checks that every result matches its
+reference. A file may be listed more than once with
+different flags, so threads build different meshes from
+the same source at once
+==========================
+*/
+void MDL_LoadTest(char **files, int *flags, int numfiles, int numthreads)
+{
+	mdltest_t tests[MDL_TESTMAXTHREADS];
+	void *threads[MDL_TESTMAXTHREADS];
+	unsigned int reference[MDL_TESTMAXFILES];
+	unsigned long int start;
+	int i, mismatches;
+
+	if(numfiles > MDL_TESTMAXFILES)
+		numfiles = MDL_TESTMAXFILES;
+	if(numthreads > MDL_TESTMAXTHREADS)
+		numthreads = MDL_TESTMAXTHREADS;
+	if(numthreads < 2)
+		numthreads = 2;
+
+	for(i = 0; i < numfiles; i++)
+		reference[i] = MDL_ParseSum(files[i], flags[i]);
+
+	start = Sys_GetMilliseconds();
+	for(i = 0; i < numthreads; i++)
+	{
+		tests[i].files = files;
+		tests[i].flags = flags;
+		tests[i].numfiles = numfiles;
+		tests[i].first = i % numfiles;
+		tests[i].reference = reference;
+		tests[i].mismatches = 0;
+		threads[i] = Sys_CreateThread(MDL_LoadTestThread, &tests[i]);
+	}
+	mismatches = 0;
+	for(i = 0; i < numthreads; i++)
+	{
+		if(threads[i])
+			Sys_JoinThread(threads[i]);
+		else
+			MDL_LoadTestThread(&tests[i]);
+		mismatches += tests[i].mismatches;
+	}
+
+	if(mismatches)
+		Sys_Warn("MDL_LoadTest: %i of %i concurrent loads differed from the serial load\n",
+				 mismatches, numthreads * numfiles * MDL_TESTROUNDS);
+	else
+		Sys_Printf("MDL_LoadTest: %i loads x %i threads x %i rounds matched in %lu ms\n",
+				   numfiles, numthreads, MDL_TESTROUNDS, Sys_GetMilliseconds() - start);
+}
+
+/*
+==========================
+ProcessNextChunk()
+==========================
+*/
+void ProcessNextChunk(mdlload_t *load, chunk_t *parentchunk)
+{
+	chunk_t chunk;
+	material_t *tmpmat;
+	submesh_t *newsubmesh;
+	unsigned char *pos;
+	char strbuffer[STRINGLEN + 1];
+
+	pos = parentchunk->data;
+	while(ReadNextChunk(&chunk, &pos, parentchunk->end))
+	{
+		switch(chunk.id)
+		{
+		case CHUNK_VERSION:
+			if(chunk.end - chunk.data >= 4 && GetLong(chunk.data) > 0x03)
+				Sys_Warn("ProcessNextChunk: version > 3\n");
+			break;
+		case CHUNK_OBJECTINFO:
+			ProcessNextChunk(load, &chunk);
+			break;
+		case CHUNK_MATERIAL:
+			tmpmat = GL_NewMaterial();
+			tmpmat->next = load->materials;
+			load->materials = tmpmat;
+			ProcessNextMaterialChunk(load, tmpmat, &chunk);
+			break;
+		case CHUNK_OBJECT:
+			chunk.data += GetString(strbuffer, sizeof(strbuffer), chunk.data, chunk.end);
+			if(!strncmp(strbuffer, CELL_OBJECT, strlen(CELL_OBJECT)) ||
+			   !strncmp(strbuffer, CELL_PORTALOBJECT, strlen(CELL_PORTALOBJECT)))
+			{
+				ReadCellObject(load, strbuffer, &chunk);
+				break;
+			}
+			newsubmesh = (submesh_t *) Z_PoolMalloc(sizeof(*newsubmesh));
+			newsubmesh->name = Common_CopyString(strbuffer);
+			newsubmesh->parent = load->mesh;
+			newsubmesh->next = NULL;
+			GL_AddSubmesh(load->mesh, newsubmesh);
+			ProcessNextObjectChunk(load, newsubmesh, &chunk);
+			break;
+		case CHUNK_EDITKEYFRAME:
+			ProcessNextKeyframeChunk(load, &chunk);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/*
+==========================
+ProcessNextObjectChunk()
+==========================
+*/
+void ProcessNextObjectChunk(mdlload_t *load, submesh_t *submesh, chunk_t *parentchunk)
+{
+	chunk_t chunk;
+	unsigned char *pos;
+
+	pos = parentchunk->data;
+	while(ReadNextChunk(&chunk, &pos, parentchunk->end))
+	{
+		switch (chunk.id)
+		{
+		case CHUNK_OBJECT_MESH:
+			ProcessNextObjectChunk(load, submesh, &chunk);
+			break;
+		case CHUNK_OBJECT_VERTICES:
+			ReadVertices(submesh, &chunk);
+			break;
+		case CHUNK_OBJECT_FACES:
+			ReadVertexIndices(load, submesh, &chunk);
+			break;
+		case CHUNK_OBJECT_MATERIAL:
+			ReadObjectMaterial(load, submesh, &chunk);
+			break;
+		case CHUNK_OBJECT_SMOOTH:
+			ReadSmoothingGroups(submesh, &chunk);
+			break;
+		case CHUNK_OBJECT_UV:
+			ReadUVCoordinates(submesh, &chunk);
+			break;
+		case CHUNK_OBJECT_MATRIX:
+			ReadObjectMatrix(load, submesh, &chunk);
+			break;
+		default:  
+			break;
+		}
+	}
+}
+
+/*
+==========================
+ProcessNextMaterialChunk()
+==========================
+*/
+void ProcessNextMaterialChunk(mdlload_t *load, material_t *material, chunk_t *parentchunk)
+{
+	chunk_t chunk;
+	unsigned char *pos;
+	char strbuffer[STRINGLEN + 1];
+
+	pos = parentchunk->data;
+	while(ReadNextChunk(&chunk, &pos, parentchunk->end))
+	{
+		switch (chunk.id)
+		{
+		case CHUNK_MATNAME:
+			GetString(strbuffer, sizeof(strbuffer), chunk.data, chunk.end);
+			if(material->name)
+				Z_Free(material->name);
+			material->name = Common_CopyString(strbuffer);
+			break;
+		case CHUNK_MATAMBIENT:
+		case CHUNK_MATDIFFUSE:
+		case CHUNK_MATSPECULAR:
+			ReadColorChunk(material, &chunk);
+			break;
+		case CHUNK_MATTEXMAP1:
+		case CHUNK_MATTEXMAP2:
+		case CHUNK_MATBUMPMAP:
+			ProcessNextMaterialChunk(load, material, &chunk);
+			break;
+		case CHUNK_MATMAPFILE:
+			GetString(strbuffer, sizeof(strbuffer), chunk.data, chunk.end);
+			AddMaterialMapfile(load, strbuffer, material, parentchunk);
+			break;
+		default:  
+			break;
+		}
+	}
+}
+
+/*
+==========================
+AddMaterialMapfile()
+
+Textures need GL, so they are only noted here and
+loaded by MDL_Finish3DS()
+==========================
+*/
+void AddMaterialMapfile(mdlload_t *load, char *mapfile, material_t *material, chunk_t *chunk)
+{
+	mdlmapfile_t *newmapfile;
+
+	switch(chunk->id)
+	{
+	case CHUNK_MATTEXMAP1:
+	case CHUNK_MATTEXMAP2:
+	case CHUNK_MATBUMPMAP:
+		break;
+	default:
+		return;
+	}
+	Common_strtolower(mapfile);
+	newmapfile = (mdlmapfile_t *) Z_PoolMalloc(sizeof(*newmapfile));
+	newmapfile->material = material;
+	newmapfile->id = chunk->id;
+	newmapfile->name = Common_CopyString(mapfile);
+	newmapfile->next = load->mapfiles;
+	load->mapfiles = newmapfile;
+}
+
+/*
+==========================
+GetShort()
+
+3ds files are little endian and nothing in them is
+aligned, so values are put together a byte at a time
+==========================
+*/
+INLINE unsigned int GetShort(unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+/*
+==========================
+GetLong()
+==========================
+*/
+INLINE unsigned int GetLong(unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+/*
+==========================
+GetFloat()
+==========================
+*/
+INLINE real_t GetFloat(unsigned char *p)
+{
+	union
+	{
+		unsigned int i;
+		float f;
+	} u;
+
+	u.i = GetLong(p);
+	return (real_t) u.f;
+}
+
+/*
+==========================
+ReadNextChunk()
+
+Reads the chunk header at *pos and steps *pos over the
+whole chunk. Returns false at the end of the parent
+==========================
+*/
+boolean_t ReadNextChunk(chunk_t *chunk, unsigned char **pos, unsigned char *end)
+{
+	if(end - *pos < 6)
+		return false;
+	chunk->id = (unsigned short int) GetShort(*pos);
+	chunk->length = GetLong(*pos + 2);
+	if(chunk->length < 6)
+	{
+		Sys_Warn("ReadNextChunk: bad length %u for chunk 0x%04x\n", chunk->length, chunk->id);
+		return false;
+	}
+	if(chunk->length > (unsigned int) (end - *pos))
+	{
+		Sys_Warn("ReadNextChunk: chunk 0x%04x is truncated\n", chunk->id);
+		chunk->length = (unsigned int) (end - *pos);
+	}
+	chunk->data = *pos + 6;
+	chunk->end = *pos + chunk->length;
+	*pos = chunk->end;
+	return true;
+}
+
+/*
+==========================
+GetString()
+
+Copies a zero terminated string of at most size - 1
+characters. Returns the number of bytes it took up
+in the file
+==========================
+*/
+int GetString(char *buffer, int size, unsigned char *data, unsigned char *end)
+{
+	unsigned char *p;
+	int len;
+
+	for(p = data; p < end && *p; p++)
+		;
+	len = (int) (p - data);
+	if(len > size - 1)
+		len = size - 1;
+	memcpy(buffer, data, len);
+	buffer[len] = 0;
+
+	return (p < end) ? (int) (p - data) + 1 : (int) (p - data);
+}
+
+/*
+==========================
+ReadColorChunk()
+==========================
+*/
+void ReadColorChunk(material_t *material, chunk_t *chunk)
+{
+	chunk_t colorchunk;
+	unsigned char *pos;
+	color4_t matcolor;
+
+	pos = chunk->data;
+	if(!ReadNextChunk(&colorchunk, &pos, chunk->end))
+		return;
+	switch(colorchunk.id)
+	{
+	case CHUNK_COLOR_F:
+	case CHUNK_LINCOLOR_F:
+		if(colorchunk.end - colorchunk.data < 12)
+			return;
+		matcolor.r = GetFloat(colorchunk.data);
+		matcolor.g = GetFloat(colorchunk.data + 4);
+		matcolor.b = GetFloat(colorchunk.data + 8);
+		break;
+	case CHUNK_COLOR_24:
+	case CHUNK_LINCOLOR_24:
+		if(colorchunk.end - colorchunk.data < 3)
+			return;
+		matcolor.r = (real_t) ((real_t) colorchunk.data[0] / 255.0f);
+		matcolor.g = (real_t) ((real_t) colorchunk.data[1] / 255.0f);
+		matcolor.b = (real_t) ((real_t) colorchunk.data[2] / 255.0f);
+		break;
+	default:
+		return;
+	}
+	matcolor.a = (real_t) 1.0f;
+
+	switch(chunk->id)
+	{
+	case CHUNK_MATAMBIENT:
+		material->ambient = matcolor;
+		break;
+	case CHUNK_MATDIFFUSE:
+		material->diffuse = matcolor;
+		break;
+	case CHUNK_MATSPECULAR:
+		material->specular = matcolor;
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+==========================
+ReadArrayCount()
+
+Reads the 16-bit element count that starts vertex, UV
+and face lists, clamped to what the chunk can hold
+==========================
+*/
+int ReadArrayCount(chunk_t *chunk, int elementsize)
+{
+	int count, room;
+
+	if(chunk->end - chunk->data < 2)
+		return 0;
+	count = GetShort(chunk->data);
+	room = (int) (chunk->end - chunk->data - 2) / elementsize;
+	if(count > room)
+	{
+		Sys_Warn("ReadArrayCount: chunk 0x%04x holds %i of %i elements\n", chunk->id, room, count);
+		count = room;
+	}
+	return count;
+}
+
+/*
+==========================
+ReadVertexIndices()
+
+Each face is three indices and a flags word. The face
+material and smoothing chunks follow the face array
+inside the same chunk
+==========================
+*/
+void ReadVertexIndices(mdlload_t *load, submesh_t *submesh, chunk_t *chunk)
+{
+	chunk_t subchunks;
+	unsigned char *p;
+	int i;
+
+	submesh->numfaces = ReadArrayCount(chunk, 8);
+	submesh->faces = (face_t *) Z_TagMallocUninit(sizeof(face_t) * submesh->numfaces, TAG_MESH);
+
+	p = chunk->data + 2;
+	for(i = 0; i < submesh->numfaces; i++, p += 8)
+	{
+		submesh->faces[i].vertexindex[0] = GetShort(p);
+		submesh->faces[i].vertexindex[1] = GetShort(p + 2);
+		submesh->faces[i].vertexindex[2] = GetShort(p + 4);
+	}
+
+	subchunks = *chunk;
+	subchunks.data = p;
+	ProcessNextObjectChunk(load, submesh, &subchunks);
+}
+
+/*
+==========================
+ReadUVCoordinates()
+==========================
+*/
+void ReadUVCoordinates(submesh_t *submesh, chunk_t *chunk)
+{
+	unsigned char *p;
+	int i;
+
+	submesh->numtexcoords = ReadArrayCount(chunk, 8);
+	submesh->texcoords = (vec2_t *) Z_TagMallocUninit(sizeof(vec2_t) * submesh->numtexcoords, TAG_MESH);
+
+	p = chunk->data + 2;
+	for(i = 0; i < submesh->numtexcoords; i++, p += 8)
+	{
+		submesh->texcoords[i].x = GetFloat(p);
+		submesh->texcoords[i].y = GetFloat(p + 4);
+	}
+}
+
+/*
+==========================
+ReadVertices()
+==========================
+*/
+void ReadVertices(submesh_t *submesh, chunk_t *chunk)
+{
+	unsigned char *p;
+	int i;
+
+	submesh->numvertices = ReadArrayCount(chunk, 12);
+	submesh->vertexdata = (vec3_t *) Z_TagMallocUninit(sizeof(vec3_t) * submesh->numvertices, TAG_MESH);
+
+	// swap Y and Z on the way in
+	p = chunk->data + 2;
+	for(i = 0; i < submesh->numvertices; i++, p += 12)
+	{
+		submesh->vertexdata[i].x = GetFloat(p);
+		submesh->vertexdata[i].y = GetFloat(p + 8);
+		submesh->vertexdata[i].z = -GetFloat(p + 4);
+	}
+}
+
+/*
+==========================
+ReadObjectMaterial()
+
+Objects can only name materials from their own file
+==========================
+*/
+void ReadObjectMaterial(mdlload_t *load, submesh_t *submesh, chunk_t *chunk)
+{
+	char matname[BIGSTRINGLEN + 1];
+	material_t *mat;
+
+	GetString(matname, sizeof(matname), chunk->data, chunk->end);
+	for(mat = load->materials; mat; mat = mat->next)
+		if(mat->name && !strcmp(matname, mat->name))
+			break;
+	if(!mat)
+		Sys_Warn("ReadObjectMaterial: %s: no material %s\n", load->filename, matname);
+	submesh->material = mat;
+}
+
+/*
+==========================
+ReadSmoothingGroups()
+
+One group mask per face. Faces that share a group are
+smoothed together, faces in no group are drawn flat
+==========================
+*/
+void ReadSmoothingGroups(submesh_t *submesh, chunk_t *chunk)
+{
+	unsigned char *p;
+	int i, count;
+
+	if(submesh->smoothgroups || submesh->numfaces <= 0)
+		return;
+	count = (int) (chunk->end - chunk->data) / 4;
+	if(count < submesh->numfaces)
+		Sys_Warn("ReadSmoothingGroups: chunk 0x%04x holds %i of %i elements\n",
+				 chunk->id, count, submesh->numfaces);
+	else
+		count = submesh->numfaces;
+
+	// faces the chunk leaves out stay flat
+	submesh->smoothgroups = (unsigned int *) Z_TagMalloc(sizeof(unsigned int) * submesh->numfaces, TAG_MESH);
+	p = chunk->data;
+	for(i = 0; i < count; i++, p += 4)
+		submesh->smoothgroups[i] = GetLong(p);
+}
+
+/*
+==========================
+ReadObjectMatrix()
+
+The axes and origin of the object's own space. Only
+needed to find where an animated object's vertices are
+relative to its node, so it's kept until the nodes are
+read. Y and Z are swapped like the vertices
+==========================
+*/
+void ReadObjectMatrix(mdlload_t *load, submesh_t *submesh, chunk_t *chunk)
+{
+	mdlmeshmatrix_t *meshmatrix;
+	real_t v[12];
+	int i;
+
+	if(chunk->end - chunk->data < 48)
+		return;
+	for(i = 0; i < 12; i++)
+		v[i] = GetFloat(chunk->data + i * 4);
+
+	// columns are the x, y and z axes and the origin
+	meshmatrix = (mdlmeshmatrix_t *) Z_PoolMalloc(sizeof(*meshmatrix));
+	meshmatrix->submesh = submesh;
+	for(i = 0; i < 4; i++)
+	{
+		meshmatrix->matrix[i] = v[i * 3];
+		meshmatrix->matrix[4 + i] = v[i * 3 + 2];
+		meshmatrix->matrix[8 + i] = -v[i * 3 + 1];
+	}
+	// and the y and z axes trade places too
+	for(i = 0; i < 3; i++)
+	{
+		v[0] = meshmatrix->matrix[i * 4 + 1];
+		meshmatrix->matrix[i * 4 + 1] = meshmatrix->matrix[i * 4 + 2];
+		meshmatrix->matrix[i * 4 + 2] = -v[0];
+	}
+	meshmatrix->next = load->meshmatrices;
+	load->meshmatrices = meshmatrix;
+}
+
+/*
+==========================
+ReadCellObject()
+
+Cells and portals are outlines rather than something to
+draw, so only their vertices are kept, for BuildCells().
+The object is gone from the mesh, so say so in case the
+name was meant for something else
+==========================
+*/
+void ReadCellObject(mdlload_t *load, char *name, chunk_t *parentchunk)
+{
+	chunk_t chunk, meshchunk;
+	unsigned char *pos, *meshpos;
+	submesh_t outline;
+	mdlcellobject_t *object;
+
+	memset(&outline, 0, sizeof(outline));
+	pos = parentchunk->data;
+	while(ReadNextChunk(&chunk, &pos, parentchunk->end))
+	{
+		if(chunk.id != CHUNK_OBJECT_MESH)
+			continue;
+		meshpos = chunk.data;
+		while(ReadNextChunk(&meshchunk, &meshpos, chunk.end))
+			if(meshchunk.id == CHUNK_OBJECT_VERTICES && !outline.vertexdata)
+				ReadVertices(&outline, &meshchunk);
+	}
+	if(outline.numvertices <= 0)
+	{
+		Sys_Warn("ReadCellObject: %s has no vertices, ignored\n", name);
+		if(outline.vertexdata)
+			Z_Free(outline.vertexdata);
+		return;
+	}
+
+	object = (mdlcellobject_t *) Z_PoolMalloc(sizeof(*object));
+	object->name = Common_CopyString(name);
+	object->portal = strncmp(name, CELL_PORTALOBJECT, strlen(CELL_PORTALOBJECT)) ? false : true;
+	Sys_Warn("ReadCellObject: %s is taken as a %s and not drawn\n", name, object->portal ? "portal" : "cell");
+	object->numpoints = outline.numvertices;
+	object->points = outline.vertexdata;
+	object->next = load->cellobjects;
+	load->cellobjects = object;
+}
+
+/*
+==========================
+ProcessNextKeyframeChunk()
+
+Only object nodes are read, cameras and lights don't
+move anything that's drawn
+==========================
+*/
+void ProcessNextKeyframeChunk(mdlload_t *load, chunk_t *parentchunk)
+{
+	chunk_t chunk;
+	mdlnode_t *node;
+	unsigned char *pos;
+	int numnodes;
+
+	numnodes = 0;
+	pos = parentchunk->data;
+	while(ReadNextChunk(&chunk, &pos, parentchunk->end))
+	{
+		switch(chunk.id)
+		{
+		case CHUNK_KFSEGMENT:
+			if(chunk.end - chunk.data < 8)
+				break;
+			load->firstframe = (int) GetLong(chunk.data);
+			load->lastframe = (int) GetLong(chunk.data + 4);
+			break;
+		case CHUNK_KFOBJECT:
+			// files without node ids number nodes in order
+			node = (mdlnode_t *) Z_PoolMalloc(sizeof(*node));
+			node->id = numnodes++;
+			node->parentid = -1;
+			ProcessNextNodeChunk(load, node, &chunk);
+			node->next = load->nodes;
+			load->nodes = node;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/*
+==========================
+ProcessNextNodeChunk()
+==========================
+*/
+void ProcessNextNodeChunk(mdlload_t *load, mdlnode_t *node, chunk_t *parentchunk)
+{
+	chunk_t chunk;
+	unsigned char *pos, *p;
+	char strbuffer[STRINGLEN + 1];
+	int parentid;
+
+	pos = parentchunk->data;
+	while(ReadNextChunk(&chunk, &pos, parentchunk->end))
+	{
+		switch(chunk.id)
+		{
+		case CHUNK_KFNODEID:
+			if(chunk.end - chunk.data >= 2)
+				node->id = GetShort(chunk.data);
+			break;
+		case CHUNK_KFNODEHDR:
+			// name, two flag words and the parent, 0xffff for none
+			p = chunk.data + GetString(strbuffer, sizeof(strbuffer), chunk.data, chunk.end);
+			if(node->name)
+				Z_Free(node->name);
+			node->name = Common_CopyString(strbuffer);
+			if(chunk.end - p >= 6)
+			{
+				parentid = GetShort(p + 4);
+				node->parentid = parentid == 0xffff ? -1 : parentid;
+			}
+			break;
+		case CHUNK_KFPIVOT:
+			if(chunk.end - chunk.data < 12)
+				break;
+			node->pivot.x = GetFloat(chunk.data);
+			node->pivot.y = GetFloat(chunk.data + 8);
+			node->pivot.z = -GetFloat(chunk.data + 4);
+			break;
+		case CHUNK_KFPOSTRACK:
+			ReadTrack(&node->tracks[ANIM_POSITION], ANIM_POSITION, &chunk);
+			break;
+		case CHUNK_KFROTTRACK:
+			ReadTrack(&node->tracks[ANIM_ROTATION], ANIM_ROTATION, &chunk);
+			break;
+		case CHUNK_KFSCLTRACK:
+			ReadTrack(&node->tracks[ANIM_SCALE], ANIM_SCALE, &chunk);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/*
+==========================
+ReadTrack()
+
+A flags word, eight unused bytes and the key count, then
+per key its frame, a word saying which of the five TCB
+spline parameters follow, those and the value. Keys are
+interpolated linearly, so the spline parameters are only
+stepped over.
+
+Rotation keys are an angle and an axis, each turning on
+from the key before it. They are made into absolute
+quaternions here
+==========================
+*/
+void ReadTrack(mdltrack_t *track, int type, chunk_t *chunk)
+{
+	unsigned char *p;
+	int numkeys, valuesize, i, bits;
+	vec4_t *value, rot;
+	vec3_t axis;
+	real_t angle, len, s;
+
+	if(track->numkeys || chunk->end - chunk->data < 14)
+		return;
+	valuesize = (type == ANIM_ROTATION) ? 16 : 12;
+	numkeys = (int) GetLong(chunk->data + 10);
+	// don't trust the count further than the chunk goes
+	if(numkeys < 0 || numkeys > (chunk->end - chunk->data - 14) / (6 + valuesize))
+		numkeys = (int) (chunk->end - chunk->data - 14) / (6 + valuesize);
+	if(!numkeys)
+		return;
+	track->frames = (real_t *) Z_TagMallocUninit(sizeof(real_t) * numkeys, TAG_MESH);
+	track->values = (vec4_t *) Z_TagMallocUninit(sizeof(vec4_t) * numkeys, TAG_MESH);
+
+	p = chunk->data + 14;
+	for(i = 0; i < numkeys; i++)
+	{
+		if(chunk->end - p < 6)
+			break;
+		track->frames[i] = (real_t) (int) GetLong(p);
+		for(bits = GetShort(p + 4) & 0x1f, p += 6; bits; bits >>= 1)
+			if(bits & 1)
+				p += 4;
+		if(chunk->end - p < valuesize)
+			break;
+
+		value = &track->values[i];
+		switch(type)
+		{
+		case ANIM_POSITION:
+			value->x = GetFloat(p);
+			value->y = GetFloat(p + 8);
+			value->z = -GetFloat(p + 4);
+			value->w = 1;
+			break;
+		case ANIM_SCALE:
+			// the y and z scales trade places with the axes
+			value->x = GetFloat(p);
+			value->y = GetFloat(p + 8);
+			value->z = GetFloat(p + 4);
+			value->w = 1;
+			break;
+		case ANIM_ROTATION:
+			angle = GetFloat(p);
+			axis.x = GetFloat(p + 4);
+			axis.y = GetFloat(p + 12);
+			axis.z = -GetFloat(p + 8);
+			len = (real_t) sqrt(axis.x * axis.x + axis.y * axis.y + axis.z * axis.z);
+			s = len > 0 ? (real_t) sin(angle * 0.5f) / len : 0;
+			rot.x = axis.x * s;
+			rot.y = axis.y * s;
+			rot.z = axis.z * s;
+			rot.w = (real_t) cos(angle * 0.5f);
+			if(i == 0)
+				*value = rot;
+			else
+			{
+				value->x = value[-1].w * rot.x + value[-1].x * rot.w + value[-1].y * rot.z - value[-1].z * rot.y;
+				value->y = value[-1].w * rot.y + value[-1].y * rot.w + value[-1].z * rot.x - value[-1].x * rot.z;
+				value->z = value[-1].w * rot.z + value[-1].z * rot.w + value[-1].x * rot.y - value[-1].y * rot.x;
+				value->w = value[-1].w * rot.w - value[-1].x * rot.x - value[-1].y * rot.y - value[-1].z * rot.z;
+			}
+			break;
+		default:
+			break;
+		}
+		p += valuesize;
+	}
+	track->numkeys = i;
+}
+
+/*
+=======================================================
+
+                     Vertex normals
+
+=======================================================
+*/
+
+#if USE_SIMD == 2
+typedef __m256 simd_t;
+#define SIMD_WIDTH          8
+#define SIMD_LOAD(p)        _mm256_loadu_ps(p)
+#define SIMD_STORE(p, a)    _mm256_storeu_ps((p), (a))
+#define SIMD_SET1(x)        _mm256_set1_ps(x)
+#define SIMD_ADD(a, b)      _mm256_add_ps((a), (b))
+#define SIMD_SUB(a, b)      _mm256_sub_ps((a), (b))
+#define SIMD_MUL(a, b)      _mm256_mul_ps((a), (b))
+#define SIMD_DIV(a, b)      _mm256_div_ps((a), (b))
+#define SIMD_SQRT(a)        _mm256_sqrt_ps(a)
+#define SIMD_AND(a, b)      _mm256_and_ps((a), (b))
+#define SIMD_CMPGT(a, b)    _mm256_cmp_ps((a), (b), _CMP_GT_OQ)
+#define SIMD_MIN(a, b)      _mm256_min_ps((a), (b))
+#define SIMD_MAX(a, b)      _mm256_max_ps((a), (b))
+#define SIMD_OR(a, b)       _mm256_or_ps((a), (b))
+#define SIMD_MASK(a)        _mm256_movemask_ps(a)
+#define SIMD_MASKGT(a, b)   SIMD_MASK(_mm256_cmp_ps((a), (b), _CMP_GT_OQ))
+#define SIMD_MASKGE(a, b)   SIMD_MASK(_mm256_cmp_ps((a), (b), _CMP_GE_OQ))
+#define SIMD_SELECTGE(a, b, x)  _mm256_and_ps(_mm256_cmp_ps((a), (b), _CMP_GE_OQ), (x))
+#elif USE_SIMD == 1
+typedef __m128 simd_t;
+#define SIMD_WIDTH          4
+#define SIMD_LOAD(p)        _mm_loadu_ps(p)
+#define SIMD_STORE(p, a)    _mm_storeu_ps((p), (a))
+#define SIMD_SET1(x)        _mm_set1_ps(x)
+#define SIMD_ADD(a, b)      _mm_add_ps((a), (b))
+#define SIMD_SUB(a, b)      _mm_sub_ps((a), (b))
+#define SIMD_MUL(a, b)      _mm_mul_ps((a), (b))
+#define SIMD_DIV(a, b)      _mm_div_ps((a), (b))
+#define SIMD_SQRT(a)        _mm_sqrt_ps(a)
+#define SIMD_AND(a, b)      _mm_and_ps((a), (b))
+#define SIMD_CMPGT(a, b)    _mm_cmpgt_ps((a), (b))
+#define SIMD_MIN(a, b)      _mm_min_ps((a), (b))
+#define SIMD_MAX(a, b)      _mm_max_ps((a), (b))
+#define SIMD_OR(a, b)       _mm_or_ps((a), (b))
+#define SIMD_MASK(a)        _mm_movemask_ps(a)
+#define SIMD_MASKGT(a, b)   SIMD_MASK(_mm_cmpgt_ps((a), (b)))
+#define SIMD_MASKGE(a, b)   SIMD_MASK(_mm_cmpge_ps((a), (b)))
+#define SIMD_SELECTGE(a, b, x)  _mm_and_ps(_mm_cmpge_ps((a), (b)), (x))
+#else
+// scalar stand-ins, so a kernel can be written once for any width
+typedef real_t simd_t;
+#define SIMD_WIDTH          1
+#define SIMD_LOAD(p)        (*(p))
+#define SIMD_STORE(p, a)    (*(p) = (a))
+#define SIMD_SET1(x)        ((real_t) (x))
+#define SIMD_ADD(a, b)      ((a) + (b))
+#define SIMD_SUB(a, b)      ((a) - (b))
+#define SIMD_MUL(a, b)      ((a) * (b))
+#define SIMD_DIV(a, b)      ((a) / (b))
+#define SIMD_SQRT(a)        ((real_t) sqrt(a))
+#define SIMD_MIN(a, b)      ((a) < (b) ? (a) : (b))
+#define SIMD_MAX(a, b)      ((a) > (b) ? (a) : (b))
+#define SIMD_MASKGT(a, b)   ((a) > (b))  // a bit per lane, as the SIMD ones
+#define SIMD_MASKGE(a, b)   ((a) >= (b))
+#define SIMD_SELECTGE(a, b, x)  ((a) >= (b) ? (x) : 0.0f)  // x in lanes where a >= b, else 0
+#endif
+// SoA arrays are padded so the kernels never need a tail
+#define SIMD_PAD(n)         (((n) + SIMD_WIDTH - 1) & ~(SIMD_WIDTH - 1))
+
+#define SUBMESH_THREADFACES 8192  // smaller meshes aren't worth a thread
+#define SUBMESH_MAXTHREADS  16
+
+typedef struct
+{
+	submesh_t **submeshes;
+	int numsubmeshes;
+	void (*process)(submesh_t *);
+	volatile int next;
+} submeshjob_t;
+
+/*
+==========================
+ProcessSubmeshes()
+
+Runs process on each submesh. Submeshes are independent,
+so large meshes hand them out to worker threads
+==========================
+*/
+void ProcessSubmeshes(mesh_t *mesh, void (*process)(submesh_t *))
+{
+	submeshjob_t job;
+	void *threads[SUBMESH_MAXTHREADS];
+	submesh_t *submesh;
+	int i, numfaces, numthreads;
+
+	job.numsubmeshes = 0;
+	numfaces = 0;
+	for(submesh = mesh->submeshpool; submesh; submesh = submesh->next)
+	{
+		job.numsubmeshes++;
+		numfaces += submesh->numfaces;
+	}
+	if(!job.numsubmeshes)
+		return;
+
+	job.submeshes = (submesh_t **) Z_MallocUninit(sizeof(submesh_t *) * job.numsubmeshes);
+	for(i = 0, submesh = mesh->submeshpool; submesh; submesh = submesh->next)
+		job.submeshes[i++] = submesh;
+	job.process = process;
+	job.next = 0;
+
+	// this thread works too, so it's one less to start
+	numthreads = 0;
+	if(numfaces >= SUBMESH_THREADFACES)
+	{
+		numthreads = Sys_NumProcessors();
+		if(numthreads > job.numsubmeshes)
+			numthreads = job.numsubmeshes;
+		if(numthreads > SUBMESH_MAXTHREADS)
+			numthreads = SUBMESH_MAXTHREADS;
+		numthreads--;
+	}
+	for(i = 0; i < numthreads; i++)
+		threads[i] = Sys_CreateThread(ProcessSubmeshesThread, &job);
+	ProcessSubmeshesThread(&job);
+	for(i = 0; i < numthreads; i++)
+		if(threads[i])
+			Sys_JoinThread(threads[i]);
+
+	Z_Free(job.submeshes);
+}
+
+/*
+==========================
+ProcessSubmeshesThread()
+==========================
+*/
+void ProcessSubmeshesThread(void *data)
+{
+	submeshjob_t *job;
+	int i;
+
+	job = (submeshjob_t *) data;
+	while((i = Sys_AtomicAdd(&job->next, 1) - 1) < job->numsubmeshes)
+		job->process(job->submeshes[i]);
+}
+
+/*
+==========================
+PrepareSubmesh()
+
+Builds the normals of a freshly parsed submesh and
+optimises it for drawing
+==========================
+*/
+void PrepareSubmesh(submesh_t *submesh)
+{
+	ComputeSubmeshNormals(submesh);
+	OptimizeSubmesh(submesh);
+}
+
+/*
+==========================
+ComputeSubmeshNormals()
+
+Vertex normals are the area weighted sum of the normals
+of the faces around them, built in one pass over the faces
+==========================
+*/
+void ComputeSubmeshNormals(submesh_t *submesh)
+{
+	face_t *face;
+	real_t *facenormals, *normals;
+	unsigned int numvertices;
+	int i, j, pad;
+
+	// a face indexing past the vertices would be read and
+	// written out of bounds, drop it
+	numvertices = (unsigned int) submesh->numvertices;
+	for(i = j = 0; i < submesh->numfaces; i++)
+	{
+		face = &submesh->faces[i];
+		if(face->vertexindex[0] >= numvertices || face->vertexindex[1] >= numvertices ||
+		   face->vertexindex[2] >= numvertices)
+			continue;
+		submesh->faces[j] = *face;
+		if(submesh->smoothgroups)
+			submesh->smoothgroups[j] = submesh->smoothgroups[i];
+		j++;
+	}
+	if(j < submesh->numfaces)
+	{
+		Sys_Warn("ComputeSubmeshNormals: %s: dropped %i faces with bad vertex indices\n",
+				 submesh->name, submesh->numfaces - j);
+		submesh->numfaces = j;
+	}
+
+	pad = SIMD_PAD(submesh->numfaces);
+	facenormals = (real_t *) Z_MallocUninit(3 * pad * sizeof(real_t));
+	FaceNormals(submesh, facenormals, facenormals + pad, facenormals + 2 * pad);
+
+	if(submesh->smoothgroups)
+	{
+		normals = SumSmoothedNormals(submesh, facenormals, facenormals + pad, facenormals + 2 * pad);
+		Z_Free(submesh->smoothgroups);
+		submesh->smoothgroups = NULL;
+	}
+	else
+		normals = SumFaceNormals(submesh, facenormals, facenormals + pad, facenormals + 2 * pad);
+	Z_Free(facenormals);
+
+	pad = SIMD_PAD(submesh->numvertices);
+	NormalizeNormals(submesh, normals, normals + pad, normals + 2 * pad);
+	Z_Free(normals);
+}
+
+/*
+==========================
+FaceNormals()
+
+Unnormalised, so their length is twice the face area.
+Corners are gathered SIMD_WIDTH faces at a time into
+SoA form for the cross products
+==========================
+*/
+void FaceNormals(submesh_t *submesh, real_t *fx, real_t *fy, real_t *fz)
+{
+	vec3_t *p0, *p1, *p2, v1, v2, normal;
+	face_t *face;
+	int i;
+#if USE_SIMD
+	real_t g[9][SIMD_WIDTH];
+	simd_t ax, ay, az, bx, by, bz;
+	int j;
+#endif
+
+	i = 0;
+#if USE_SIMD
+	for(; i + SIMD_WIDTH <= submesh->numfaces; i += SIMD_WIDTH)
+	{
+		for(j = 0; j < SIMD_WIDTH; j++)
+		{
+			face = &submesh->faces[i + j];
+			p0 = &submesh->vertexdata[face->vertexindex[0]];
+			p1 = &submesh->vertexdata[face->vertexindex[1]];
+			p2 = &submesh->vertexdata[face->vertexindex[2]];
+			g[0][j] = p0->x; g[1][j] = p0->y; g[2][j] = p0->z;
+			g[3][j] = p1->x; g[4][j] = p1->y; g[5][j] = p1->z;
+			g[6][j] = p2->x; g[7][j] = p2->y; g[8][j] = p2->z;
+		}
+		// (p0 - p2) x (p2 - p1)
+		ax = SIMD_SUB(SIMD_LOAD(g[0]), SIMD_LOAD(g[6]));
+		ay = SIMD_SUB(SIMD_LOAD(g[1]), SIMD_LOAD(g[7]));
+		az = SIMD_SUB(SIMD_LOAD(g[2]), SIMD_LOAD(g[8]));
+		bx = SIMD_SUB(SIMD_LOAD(g[6]), SIMD_LOAD(g[3]));
+		by = SIMD_SUB(SIMD_LOAD(g[7]), SIMD_LOAD(g[4]));
+		bz = SIMD_SUB(SIMD_LOAD(g[8]), SIMD_LOAD(g[5]));
+		SIMD_STORE(fx + i, SIMD_SUB(SIMD_MUL(ay, bz), SIMD_MUL(az, by)));
+		SIMD_STORE(fy + i, SIMD_SUB(SIMD_MUL(az, bx), SIMD_MUL(ax, bz)));
+		SIMD_STORE(fz + i, SIMD_SUB(SIMD_MUL(ax, by), SIMD_MUL(ay, bx)));
+	}
+#endif
+	for(; i < submesh->numfaces; i++)
+	{
+		face = &submesh->faces[i];
+		p0 = &submesh->vertexdata[face->vertexindex[0]];
+		p1 = &submesh->vertexdata[face->vertexindex[1]];
+		p2 = &submesh->vertexdata[face->vertexindex[2]];
+		M_Vec3Subtract(p0, p2, &v1);
+		M_Vec3Subtract(p2, p1, &v2);
+		M_Vec3Cross(&v1, &v2, &normal);
+		fx[i] = normal.x;
+		fy[i] = normal.y;
+		fz[i] = normal.z;
+	}
+}
+
+/*
+==========================
+SumFaceNormals()
+
+Without smoothing groups every face around a vertex
+counts. Returns the sums as padded SoA arrays
+==========================
+*/
+real_t *SumFaceNormals(submesh_t *submesh, real_t *fx, real_t *fy, real_t *fz)
+{
+	real_t *nx, *ny, *nz;
+	face_t *face;
+	unsigned int v;
+	int i, k, pad;
+
+	pad = SIMD_PAD(submesh->numvertices);
+	nx = (real_t *) Z_Malloc(3 * pad * sizeof(real_t));
+	ny = nx + pad;
+	nz = ny + pad;
+
+	for(i = 0, face = submesh->faces; i < submesh->numfaces; i++, face++)
+	{
+		for(k = 0; k < 3; k++)
+		{
+			v = face->vertexindex[k];
+			nx[v] += fx[i];
+			ny[v] += fy[i];
+			nz[v] += fz[i];
+		}
+	}
+	return nx;
+}
+
+/*
+==========================
+SumSmoothedNormals()
+
+A vertex used by faces from different smoothing groups
+needs a normal for each, so it gets a copy per distinct
+group mask (and per flat face). A copy sums the faces
+around the vertex that share a group with its mask.
+
+The first copy keeps the vertex's index, the rest are
+appended, and the faces are renumbered to match.
+Returns the sums as padded SoA arrays
+==========================
+*/
+real_t *SumSmoothedNormals(submesh_t *submesh, real_t *fx, real_t *fy, real_t *fz)
+{
+	int *head, *next, *source, *index, *corner;
+	unsigned int *mask, m;
+	real_t *nx, *ny, *nz;
+	vec3_t *vertexdata;
+	vec2_t *texcoords;
+	face_t *face;
+	int numcorners, numcopies, numvertices, i, k, c, v, pad;
+
+	numvertices = submesh->numvertices;
+	numcorners = 3 * submesh->numfaces;
+	head = (int *) Z_MallocUninit(sizeof(int) * (numvertices + 4 * numcorners));
+	next = head + numvertices;
+	source = next + numcorners;
+	index = source + numcorners;
+	corner = index + numcorners;
+	mask = (unsigned int *) Z_MallocUninit(sizeof(unsigned int) * numcorners);
+
+	for(v = 0; v < numvertices; v++)
+		head[v] = -1;
+	numcopies = 0;
+	for(i = 0, face = submesh->faces; i < submesh->numfaces; i++, face++)
+	{
+		m = submesh->smoothgroups[i];
+		for(k = 0; k < 3; k++)
+		{
+			v = face->vertexindex[k];
+			c = -1;
+			if(m)
+				for(c = head[v]; c >= 0; c = next[c])
+					if(mask[c] == m)
+						break;
+			if(c < 0)
+			{
+				c = numcopies++;
+				mask[c] = m;
+				source[c] = v;
+				index[c] = head[v] < 0 ? v : submesh->numvertices++;
+				next[c] = head[v];
+				head[v] = c;
+			}
+			corner[3 * i + k] = c;
+		}
+	}
+
+	pad = SIMD_PAD(submesh->numvertices);
+	nx = (real_t *) Z_Malloc(3 * pad * sizeof(real_t));
+	ny = nx + pad;
+	nz = ny + pad;
+	for(i = 0, face = submesh->faces; i < submesh->numfaces; i++, face++)
+	{
+		m = submesh->smoothgroups[i];
+		for(k = 0; k < 3; k++)
+		{
+			if(!m)
+			{
+				v = index[corner[3 * i + k]];
+				nx[v] += fx[i];
+				ny[v] += fy[i];
+				nz[v] += fz[i];
+				continue;
+			}
+			for(c = head[face->vertexindex[k]]; c >= 0; c = next[c])
+			{
+				if(!(mask[c] & m))
+					continue;
+				v = index[c];
+				nx[v] += fx[i];
+				ny[v] += fy[i];
+				nz[v] += fz[i];
+			}
+		}
+	}
+
+	if(submesh->numvertices > numvertices)
+	{
+		vertexdata = (vec3_t *) Z_TagMallocUninit(sizeof(vec3_t) * submesh->numvertices, TAG_MESH);
+		memcpy(vertexdata, submesh->vertexdata, sizeof(vec3_t) * numvertices);
+		for(c = 0; c < numcopies; c++)
+			if(index[c] >= numvertices)
+				vertexdata[index[c]] = submesh->vertexdata[source[c]];
+		Z_Free(submesh->vertexdata);
+		submesh->vertexdata = vertexdata;
+
+		// 3DS texcoords are per vertex
+		if(submesh->texcoords && submesh->numtexcoords == numvertices)
+		{
+			texcoords = (vec2_t *) Z_TagMallocUninit(sizeof(vec2_t) * submesh->numvertices, TAG_MESH);
+			memcpy(texcoords, submesh->texcoords, sizeof(vec2_t) * numvertices);
+			for(c = 0; c < numcopies; c++)
+				if(index[c] >= numvertices)
+					texcoords[index[c]] = submesh->texcoords[source[c]];
+			Z_Free(submesh->texcoords);
+			submesh->texcoords = texcoords;
+			submesh->numtexcoords = submesh->numvertices;
+		}
+
+		for(i = 0, face = submesh->faces; i < submesh->numfaces; i++, face++)
+			for(k = 0; k < 3; k++)
+				face->vertexindex[k] = index[corner[3 * i + k]];
+	}
+
+	Z_Free(mask);
+	Z_Free(head);
+	return nx;
+}
+
+/*
+==========================
+NormalizeNormals()
+
+Turns the padded SoA sums into the submesh's normals.
+They point against the face winding, and a vertex no
+face uses gets a zero normal
+==========================
+*/
+void NormalizeNormals(submesh_t *submesh, real_t *nx, real_t *ny, real_t *nz)
+{
+	vec3_t *normal;
+	int i;
+#if USE_SIMD
+	simd_t x, y, z, len2, s;
+	simd_t zero = SIMD_SET1(0.0f);
+	simd_t minusone = SIMD_SET1(-1.0f);
+#else
+	real_t scale;
+#endif
+
+	submesh->normaldata = (vec3_t *) Z_TagMallocUninit(sizeof(vec3_t) * submesh->numvertices, TAG_MESH);
+#if USE_SIMD
+	for(i = 0; i < submesh->numvertices; i += SIMD_WIDTH)
+	{
+		x = SIMD_LOAD(nx + i);
+		y = SIMD_LOAD(ny + i);
+		z = SIMD_LOAD(nz + i);
+		len2 = SIMD_ADD(SIMD_ADD(SIMD_MUL(x, x), SIMD_MUL(y, y)), SIMD_MUL(z, z));
+		s = SIMD_AND(SIMD_DIV(minusone, SIMD_SQRT(len2)), SIMD_CMPGT(len2, zero));
+		SIMD_STORE(nx + i, SIMD_MUL(x, s));
+		SIMD_STORE(ny + i, SIMD_MUL(y, s));
+		SIMD_STORE(nz + i, SIMD_MUL(z, s));
+	}
+	for(i = 0, normal = submesh->normaldata; i < submesh->numvertices; i++, normal++)
+	{
+		normal->x = nx[i];
+		normal->y = ny[i];
+		normal->z = nz[i];
+	}
+#else
+	for(i = 0, normal = submesh->normaldata; i < submesh->numvertices; i++, normal++)
+	{
+		scale = (real_t) sqrt(nx[i] * nx[i] + ny[i] * ny[i] + nz[i] * nz[i]);
+		if(scale > 0)
+			scale = -1 / scale;
+		normal->x = nx[i] * scale;
+		normal->y = ny[i] * scale;
+		normal->z = nz[i] * scale;
+	}
+#endif
+}
+
+/*
+=======================================================
+
+                   Mesh optimisation
+
+=======================================================
+*/
+
+#define VCACHE_SIZE         32  // LRU cache the face order is scored against
+#define VCACHE_FIFOSIZE     16  // FIFO cache ACMR is measured with
+
+/*
+==========================
+OptimizeSubmesh()
+
+Welds duplicate vertices, then orders the faces for the
+post-transform vertex cache and the vertices for fetch
+locality. Submeshes whose texcoords don't line up with
+their vertices are left alone
+==========================
+*/
+void OptimizeSubmesh(submesh_t *submesh)
+{
+	submesh->loadacmr = MeshACMR(submesh);
+	if(submesh->numfaces <= 0 || (submesh->texcoords && submesh->numtexcoords != submesh->numvertices))
+	{
+		submesh->acmr = submesh->loadacmr;
+		return;
+	}
+
+	WeldVertices(submesh);
+	ReorderFaces(submesh->faces, submesh->numfaces, submesh->numvertices);
+	ReorderVertices(submesh);
+	submesh->acmr = MeshACMR(submesh);
+}
+
+/*
+==========================
+WeldVertices()
+
+Points the faces at one copy of each distinct position,
+normal and texcoord, found through a hash of their bits.
+The unused copies are dropped by ReorderVertices(), and
+so are faces that collapse to a line or a point
+==========================
+*/
+void WeldVertices(submesh_t *submesh)
+{
+	int *table, *remap;
+	boolean_t hastexcoords;
+	unsigned int hash;
+	face_t *face;
+	int i, j, k, v, w, size, slot;
+
+	hastexcoords = submesh->texcoords != NULL;
+	for(size = 16; size < 2 * submesh->numvertices; size <<= 1)
+		;
+	table = (int *) Z_MallocUninit(sizeof(int) * (size + submesh->numvertices));
+	remap = table + size;
+	for(i = 0; i < size; i++)
+		table[i] = -1;
+
+	for(v = 0; v < submesh->numvertices; v++)
+	{
+		hash = MDL_ChecksumBytes(2166136261u, &submesh->vertexdata[v], sizeof(vec3_t));
+		hash = MDL_ChecksumBytes(hash, &submesh->normaldata[v], sizeof(vec3_t));
+		if(hastexcoords)
+			hash = MDL_ChecksumBytes(hash, &submesh->texcoords[v], sizeof(vec2_t));
+		for(slot = hash & (size - 1); (w = table[slot]) >= 0; slot = (slot + 1) & (size - 1))
+		{
+			if(!memcmp(&submesh->vertexdata[v], &submesh->vertexdata[w], sizeof(vec3_t)) &&
+			   !memcmp(&submesh->normaldata[v], &submesh->normaldata[w], sizeof(vec3_t)) &&
+			   (!hastexcoords || !memcmp(&submesh->texcoords[v], &submesh->texcoords[w], sizeof(vec2_t))))
+				break;
+		}
+		if(w < 0)
+			table[slot] = w = v;
+		remap[v] = w;
+	}
+
+	for(i = j = 0; i < submesh->numfaces; i++)
+	{
+		face = &submesh->faces[i];
+		for(k = 0; k < 3; k++)
+			face->vertexindex[k] = remap[face->vertexindex[k]];
+		if(face->vertexindex[0] == face->vertexindex[1] || face->vertexindex[1] == face->vertexindex[2] ||
+		   face->vertexindex[2] == face->vertexindex[0])
+			continue;
+		submesh->faces[j++] = *face;
+	}
+	submesh->numfaces = j;
+
+	Z_Free(table);
+}
+
+/*
+==========================
+VertexCacheScore()
+
+Tom Forsyth's "Linear-Speed Vertex Cache Optimisation"
+==========================
+*/
+real_t VertexCacheScore(int cachepos, int valence)
+{
+	real_t score, x;
+
+	if(valence <= 0)
+		return -1;
+
+	score = 0;
+	if(cachepos >= 0)
+	{
+		// the last face's vertices score the same, so it doesn't
+		// matter which of them the next face shares
+		if(cachepos < 3)
+			score = 0.75f;
+		else
+		{
+			// (1 - x)^1.5
+			x = 1.0f - (cachepos - 3) / (real_t) (VCACHE_SIZE - 3);
+			score = x * (real_t) sqrt(x);
+		}
+	}
+	// vertices with few faces left are worth finishing off
+	return score + 2.0f / (real_t) sqrt(valence);
+}
+
+/*
+==========================
+ReorderFaces()
+
+Greedily emits the best scoring face that touches the
+modelled cache, starting a new run from the next unused
+face in file order when none does. Reorders the faces in
+place, so it works on any run of them
+==========================
+*/
+void ReorderFaces(face_t *infaces, int numfaces, int numvertices)
+{
+	int cache[VCACHE_SIZE + 3], newcache[VCACHE_SIZE + 3];
+	int *start, *tris, *valence, *cachepos;
+	real_t *vscore, score, bestscore;
+	unsigned char *added;
+	face_t *faces, *face;
+	int cachesize, newsize, best, cursor, i, j, k, n, v;
+
+	if(numfaces < 2)
+		return;
+
+	// each vertex's remaining faces, valence[v] of them from tris + start[v]
+	start = (int *) Z_MallocUninit(sizeof(int) * (3 * numvertices + 1));
+	valence = start + numvertices + 1;
+	cachepos = valence + numvertices;
+	tris = (int *) Z_MallocUninit(sizeof(int) * 3 * numfaces);
+	vscore = (real_t *) Z_MallocUninit(sizeof(real_t) * numvertices);
+	added = (unsigned char *) Z_Malloc(numfaces);
+	faces = (face_t *) Z_MallocUninit(sizeof(face_t) * numfaces);
+
+	memset(valence, 0, sizeof(int) * numvertices);
+	for(i = 0, face = infaces; i < numfaces; i++, face++)
+		for(k = 0; k < 3; k++)
+			valence[face->vertexindex[k]]++;
+	start[0] = 0;
+	for(v = 0; v < numvertices; v++)
+	{
+		start[v + 1] = start[v] + valence[v];
+		cachepos[v] = start[v];
+	}
+	for(i = 0, face = infaces; i < numfaces; i++, face++)
+		for(k = 0; k < 3; k++)
+			tris[cachepos[face->vertexindex[k]]++] = i;
+	for(v = 0; v < numvertices; v++)
+	{
+		cachepos[v] = -1;
+		vscore[v] = VertexCacheScore(-1, valence[v]);
+	}
+
+	cachesize = 0;
+	best = -1;
+	cursor = 0;
+	for(n = 0; n < numfaces; n++)
+	{
+		if(best < 0)
+		{
+			while(added[cursor])
+				cursor++;
+			best = cursor;
+		}
+		face = &infaces[best];
+		faces[n] = *face;
+		added[best] = 1;
+
+		// its vertices move to the front of the cache
+		newsize = 0;
+		for(k = 0; k < 3; k++)
+		{
+			v = face->vertexindex[k];
+			for(j = start[v]; tris[j] != best; j++)
+				;
+			tris[j] = tris[start[v] + --valence[v]];
+			newcache[newsize++] = v;
+		}
+		for(i = 0; i < cachesize; i++)
+		{
+			v = cache[i];
+			if(v != newcache[0] && v != newcache[1] && v != newcache[2])
+				newcache[newsize++] = v;
+		}
+
+		// rescore everything that moved, including whatever
+		// fell out the end, and pick the next face among theirs
+		for(i = 0; i < newsize; i++)
+		{
+			v = newcache[i];
+			cachepos[v] = i < VCACHE_SIZE ? i : -1;
+			vscore[v] = VertexCacheScore(cachepos[v], valence[v]);
+		}
+		best = -1;
+		bestscore = -1;
+		for(i = 0; i < newsize; i++)
+		{
+			v = newcache[i];
+			for(j = start[v]; j < start[v] + valence[v]; j++)
+			{
+				face = &infaces[tris[j]];
+				score = vscore[face->vertexindex[0]] + vscore[face->vertexindex[1]] + vscore[face->vertexindex[2]];
+				if(score > bestscore)
+				{
+					bestscore = score;
+					best = tris[j];
+				}
+			}
+		}
+
+		cachesize = newsize < VCACHE_SIZE ? newsize : VCACHE_SIZE;
+		memcpy(cache, newcache, sizeof(int) * cachesize);
+	}
+
+	memcpy(infaces, faces, sizeof(face_t) * numfaces);
+	Z_Free(faces);
+	Z_Free(added);
+	Z_Free(vscore);
+	Z_Free(tris);
+	Z_Free(start);
+}
+
+/*
+==========================
+ReorderVertices()
+
+Numbers the vertices in the order the faces first use
+them, dropping any that no face uses
+==========================
+*/
+void ReorderVertices(submesh_t *submesh)
+{
+	int *remap;
+	vec3_t *vertexdata, *normaldata;
+	vec2_t *texcoords;
+	face_t *face;
+	int i, k, v, n;
+
+	remap = (int *) Z_MallocUninit(sizeof(int) * submesh->numvertices);
+	for(v = 0; v < submesh->numvertices; v++)
+		remap[v] = -1;
+	n = 0;
+	for(i = 0, face = submesh->faces; i < submesh->numfaces; i++, face++)
+	{
+		for(k = 0; k < 3; k++)
+		{
+			v = face->vertexindex[k];
+			if(remap[v] < 0)
+				remap[v] = n++;
+			face->vertexindex[k] = remap[v];
+		}
+	}
+
+	vertexdata = (vec3_t *) Z_TagMallocUninit(sizeof(vec3_t) * n, TAG_MESH);
+	normaldata = (vec3_t *) Z_TagMallocUninit(sizeof(vec3_t) * n, TAG_MESH);
+	texcoords = NULL;
+	if(submesh->texcoords)
+		texcoords = (vec2_t *) Z_TagMallocUninit(sizeof(vec2_t) * n, TAG_MESH);
+	for(v = 0; v < submesh->numvertices; v++)
+	{
+		if(remap[v] < 0)
+			continue;
+		vertexdata[remap[v]] = submesh->vertexdata[v];
+		normaldata[remap[v]] = submesh->normaldata[v];
+		if(texcoords)
+			texcoords[remap[v]] = submesh->texcoords[v];
+	}
+
+	Z_Free(submesh->vertexdata);
+	submesh->vertexdata = vertexdata;
+	Z_Free(submesh->normaldata);
+	submesh->normaldata = normaldata;
+	if(texcoords)
+	{
+		Z_Free(submesh->texcoords);
+		submesh->texcoords = texcoords;
+		submesh->numtexcoords = n;
+	}
+	submesh->numvertices = n;
+	Z_Free(remap);
+}
+
+/*
+==========================
+MeshACMR()
+
+Average cache miss ratio: vertices transformed per face
+with a FIFO post-transform cache of VCACHE_FIFOSIZE.
+0.5 is about the best a regular grid can do, 3 is no
+reuse at all
+==========================
+*/
+real_t MeshACMR(submesh_t *submesh)
+{
+	int *stamp;
+	int i, k, v, misses;
+
+	if(submesh->numfaces <= 0)
+		return 0;
+
+	// a vertex is cached if fewer than VCACHE_FIFOSIZE
+	// misses happened since its own
+	stamp = (int *) Z_MallocUninit(sizeof(int) * submesh->numvertices);
+	for(v = 0; v < submesh->numvertices; v++)
+		stamp[v] = -VCACHE_FIFOSIZE;
+	misses = 0;
+	for(i = 0; i < submesh->numfaces; i++)
+	{
+		for(k = 0; k < 3; k++)
+		{
+			v = submesh->faces[i].vertexindex[k];
+			if(misses - stamp[v] >= VCACHE_FIFOSIZE)
+				stamp[v] = ++misses;
+		}
+	}
+	Z_Free(stamp);
+
+	return (real_t) misses / submesh->numfaces;
+}
+
+/*
+==========================
+MeshBounds()
+
+Boxes around each submesh and around the whole mesh, and
+a sphere around each submesh
+==========================
+*/
+void MeshBounds(mesh_t *mesh)
+{
+	submesh_t *submesh;
+	vec3_t *v;
+	int i;
+	boolean_t first;
+
+	first = true;
+	for(submesh = mesh->submeshpool; submesh != NULL; submesh = submesh->next)
+	{
+		if(!submesh->vertexdata || submesh->numvertices <= 0)
+			continue;
+		submesh->mins = submesh->maxs = submesh->vertexdata[0];
+		for(i = 1, v = submesh->vertexdata + 1; i < submesh->numvertices; i++, v++)
+		{
+			if(v->x < submesh->mins.x) submesh->mins.x = v->x;
+			if(v->y < submesh->mins.y) submesh->mins.y = v->y;
+			if(v->z < submesh->mins.z) submesh->mins.z = v->z;
+			if(v->x > submesh->maxs.x) submesh->maxs.x = v->x;
+			if(v->y > submesh->maxs.y) submesh->maxs.y = v->y;
+			if(v->z > submesh->maxs.z) submesh->maxs.z = v->z;
+		}
+		MDL_SubmeshSphere(submesh);
+		if(first)
+		{
+			mesh->mins = submesh->mins;
+			mesh->maxs = submesh->maxs;
+			first = false;
+			continue;
+		}
+		if(submesh->mins.x < mesh->mins.x) mesh->mins.x = submesh->mins.x;
+		if(submesh->mins.y < mesh->mins.y) mesh->mins.y = submesh->mins.y;
+		if(submesh->mins.z < mesh->mins.z) mesh->mins.z = submesh->mins.z;
+		if(submesh->maxs.x > mesh->maxs.x) mesh->maxs.x = submesh->maxs.x;
+		if(submesh->maxs.y > mesh->maxs.y) mesh->maxs.y = submesh->maxs.y;
+		if(submesh->maxs.z > mesh->maxs.z) mesh->maxs.z = submesh->maxs.z;
+	}
+}
+
+/*
+==========================
+MDL_SubmeshSphere()
+
+Sphere around the submesh's vertices, centred on its box,
+which has to be up to date
+==========================
+*/
+void MDL_SubmeshSphere(submesh_t *submesh)
+{
+	vec3_t *v;
+	real_t dx, dy, dz, d, radius2;
+	int i;
+
+	submesh->centre.x = 0.5f * (submesh->mins.x + submesh->maxs.x);
+	submesh->centre.y = 0.5f * (submesh->mins.y + submesh->maxs.y);
+	submesh->centre.z = 0.5f * (submesh->mins.z + submesh->maxs.z);
+	radius2 = 0;
+	for(i = 0, v = submesh->vertexdata; i < submesh->numvertices; i++, v++)
+	{
+		dx = v->x - submesh->centre.x;
+		dy = v->y - submesh->centre.y;
+		dz = v->z - submesh->centre.z;
+		d = dx * dx + dy * dy + dz * dz;
+		if(d > radius2)
+			radius2 = d;
+	}
+	submesh->radius = (real_t) sqrt(radius2);
+}
+
+/*
+=======================================================
+
+                    Levels of detail
+
+Coarser levels are built by collapsing edges cheapest
+first, costed with Garland and Heckbert's quadric error
+metric. A collapse only ever moves a vertex onto one of
+its neighbours, so every level indexes the full level's
+vertices and is just another run of faces after it, in
+the same arrays and the same buffers. Vertices on an
+attribute seam or an open border are never moved, which
+keeps the levels free of cracks and texture swim
+=======================================================
+*/
+
+#define LOD_MINFACES     64     // smaller submeshes only have the full level
+#define LOD_REDUCTION    2      // each level aims for this many times fewer faces..
+#define LOD_MINGAIN      0.8f   // ..and is dropped if it has more than this of the last
+
+// lodbuild_t flags, per vertex
+#define LOD_SEAM         0x01   // shares its position with another vertex
+#define LOD_BORDER       0x02   // on an edge with one face
+#define LOD_TOUCHED      0x04   // next to a collapse made this pass
+
+// a plane quadric: the upper triangle of the symmetric 4x4
+// matrix and the face area summed into it. Doubles, as the
+// squared terms lose a small collapse's error in floats
+typedef struct
+{
+	double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+	double area;
+} lodquadric_t;
+
+typedef struct
+{
+	real_t cost;
+	int from;
+	int to;
+} lodcollapse_t;
+
+typedef struct lodbuild_s
+{
+	submesh_t *submesh;
+	int *position;            // first vertex at the same position as each vertex
+	unsigned char *flags;
+	lodquadric_t *quadrics;   // per position
+	face_t *faces;            // the level being built
+	int numfaces;
+	real_t cost;              // dearest collapse made so far
+	int *start;               // faces around each vertex, adjacent + start[v]
+	int *adjacent;
+	int *remap;
+	unsigned int *edges;      // scratch, two per face corner
+	lodcollapse_t *collapses; // scratch, two per face corner
+} lodbuild_t;
+
+/*
+==========================
+BuildSubmeshLods()
+
+Each level starts from the one before, with the quadrics
+the collapses so far have summed up. A level's error is
+the distance the dearest collapse behind it strays from
+the planes it replaced
+==========================
+*/
+void BuildSubmeshLods(submesh_t *submesh)
+{
+	lodbuild_t build;
+	face_t *levelfaces[MDL_MAXLODS], *faces;
+	int levelcounts[MDL_MAXLODS];
+	real_t levelerrors[MDL_MAXLODS];
+	int numvertices, numfaces, numlevels, target, i;
+
+	submesh->numlods = 0;
+	submesh->lod = 0;
+	numvertices = submesh->numvertices;
+	if(submesh->numfaces < LOD_MINFACES || !submesh->faces || !submesh->vertexdata)
+		return;
+
+	build.submesh = submesh;
+	build.position = (int *) Z_MallocUninit(sizeof(int) * (3 * numvertices + 1));
+	build.remap = build.position + numvertices;
+	build.start = build.remap + numvertices;
+	build.flags = (unsigned char *) Z_Malloc(numvertices);
+	build.quadrics = (lodquadric_t *) Z_Malloc(sizeof(lodquadric_t) * numvertices);
+	build.faces = (face_t *) Z_MallocUninit(sizeof(face_t) * submesh->numfaces);
+	build.adjacent = (int *) Z_MallocUninit(sizeof(int) * 3 * submesh->numfaces);
+	build.edges = (unsigned int *) Z_MallocUninit(sizeof(unsigned int) * 6 * submesh->numfaces);
+	build.collapses = (lodcollapse_t *) Z_MallocUninit(sizeof(lodcollapse_t) * 6 * submesh->numfaces);
+	memcpy(build.faces, submesh->faces, sizeof(face_t) * submesh->numfaces);
+	build.numfaces = submesh->numfaces;
+	build.cost = 0;
+
+	LodWeldPositions(&build);
+	LodQuadrics(&build);
+
+	levelfaces[0] = submesh->faces;
+	levelcounts[0] = submesh->numfaces;
+	levelerrors[0] = 0;
+	for(numlevels = 1; numlevels < MDL_MAXLODS; numlevels++)
+	{
+		target = levelcounts[numlevels - 1] / LOD_REDUCTION;
+		while(build.numfaces > target && LodCollapsePass(&build, target))
+			;
+		if(!build.numfaces || build.numfaces > levelcounts[numlevels - 1] * LOD_MINGAIN)
+			break;
+		levelfaces[numlevels] = (face_t *) Z_MallocUninit(sizeof(face_t) * build.numfaces);
+		memcpy(levelfaces[numlevels], build.faces, sizeof(face_t) * build.numfaces);
+		ReorderFaces(levelfaces[numlevels], build.numfaces, numvertices);
+		levelcounts[numlevels] = build.numfaces;
+		levelerrors[numlevels] = (real_t) sqrt(build.cost);
+	}
+
+	Z_Free(build.collapses);
+	Z_Free(build.edges);
+	Z_Free(build.adjacent);
+	Z_Free(build.faces);
+	Z_Free(build.quadrics);
+	Z_Free(build.flags);
+	Z_Free(build.position);
+	if(numlevels < 2)
+		return;
+
+	numfaces = 0;
+	for(i = 0; i < numlevels; i++)
+		numfaces += levelcounts[i];
+	faces = (face_t *) Z_TagMallocUninit(sizeof(face_t) * numfaces, TAG_MESH);
+	numfaces = 0;
+	for(i = 0; i < numlevels; i++)
+	{
+		memcpy(faces + numfaces, levelfaces[i], sizeof(face_t) * levelcounts[i]);
+		submesh->lods[i].firstface = numfaces;
+		submesh->lods[i].numfaces = levelcounts[i];
+		submesh->lods[i].error = levelerrors[i];
+		numfaces += levelcounts[i];
+		Z_Free(levelfaces[i]);
+	}
+	submesh->faces = faces;
+	submesh->numlods = numlevels;
+}
+
+/*
+==========================
+LodWeldPositions()
+
+Finds the first vertex at each position and flags the
+ones that share it as seams
+==========================
+*/
+void LodWeldPositions(lodbuild_t *build)
+{
+	submesh_t *submesh;
+	int *table;
+	unsigned int hash;
+	int v, w, size, slot;
+
+	submesh = build->submesh;
+	for(size = 16; size < 2 * submesh->numvertices; size <<= 1)
+		;
+	table = (int *) Z_MallocUninit(sizeof(int) * size);
+	for(slot = 0; slot < size; slot++)
+		table[slot] = -1;
+
+	for(v = 0; v < submesh->numvertices; v++)
+	{
+		hash = MDL_ChecksumBytes(2166136261u, &submesh->vertexdata[v], sizeof(vec3_t));
+		for(slot = hash & (size - 1); (w = table[slot]) >= 0; slot = (slot + 1) & (size - 1))
+			if(!memcmp(&submesh->vertexdata[v], &submesh->vertexdata[w], sizeof(vec3_t)))
+				break;
+		if(w < 0)
+			table[slot] = w = v;
+		else
+			build->flags[v] = build->flags[w] = LOD_SEAM;
+		build->position[v] = w;
+	}
+	Z_Free(table);
+}
+
+/*
+==========================
+LodQuadrics()
+
+Sums each face's plane, weighted by its area, into the
+quadrics of its corners
+==========================
+*/
+void LodQuadrics(lodbuild_t *build)
+{
+	vec3_t *p0, *p1, *p2, v1, v2, normal;
+	lodquadric_t *q;
+	face_t *face;
+	double a, b, c, d, area, len;
+	int i, k;
+
+	for(i = 0, face = build->faces; i < build->numfaces; i++, face++)
+	{
+		p0 = &build->submesh->vertexdata[face->vertexindex[0]];
+		p1 = &build->submesh->vertexdata[face->vertexindex[1]];
+		p2 = &build->submesh->vertexdata[face->vertexindex[2]];
+		v1.x = p1->x - p0->x; v1.y = p1->y - p0->y; v1.z = p1->z - p0->z;
+		v2.x = p2->x - p0->x; v2.y = p2->y - p0->y; v2.z = p2->z - p0->z;
+		M_Vec3Cross(&v1, &v2, &normal);
+		len = sqrt((double) normal.x * normal.x + (double) normal.y * normal.y + (double) normal.z * normal.z);
+		if(len <= 0)
+			continue;
+		a = normal.x / len;
+		b = normal.y / len;
+		c = normal.z / len;
+		d = -(a * p0->x + b * p0->y + c * p0->z);
+		area = len * 0.5;
+		for(k = 0; k < 3; k++)
+		{
+			q = &build->quadrics[build->position[face->vertexindex[k]]];
+			q->a2 += area * a * a; q->ab += area * a * b; q->ac += area * a * c; q->ad += area * a * d;
+			q->b2 += area * b * b; q->bc += area * b * c; q->bd += area * b * d;
+			q->c2 += area * c * c; q->cd += area * c * d;
+			q->d2 += area * d * d;
+			q->area += area;
+		}
+	}
+}
+
+/*
+==========================
+LodCollapseCost()
+
+Squared distance, averaged over the area of both
+quadrics, from the vertex to moves onto to the planes
+of the faces around both ends
+==========================
+*/
+real_t LodCollapseCost(lodbuild_t *build, int from, int to)
+{
+	lodquadric_t *q1, *q2;
+	double x, y, z, e, area;
+
+	q1 = &build->quadrics[build->position[from]];
+	q2 = &build->quadrics[build->position[to]];
+	area = q1->area + q2->area;
+	if(area <= 0)
+		return 0;
+	x = build->submesh->vertexdata[to].x;
+	y = build->submesh->vertexdata[to].y;
+	z = build->submesh->vertexdata[to].z;
+	e = (q1->a2 + q2->a2) * x * x + 2 * (q1->ab + q2->ab) * x * y + 2 * (q1->ac + q2->ac) * x * z +
+		2 * (q1->ad + q2->ad) * x + (q1->b2 + q2->b2) * y * y + 2 * (q1->bc + q2->bc) * y * z +
+		2 * (q1->bd + q2->bd) * y + (q1->c2 + q2->c2) * z * z + 2 * (q1->cd + q2->cd) * z +
+		(q1->d2 + q2->d2);
+	// rounding can take a perfect fit just under zero
+	return e > 0 ? (real_t) (e / area) : 0;
+}
+
+/*
+==========================
+LodBorders()
+
+Flags the vertices on edges that only one face has,
+comparing positions so a seam doesn't look like a border
+==========================
+*/
+void LodBorders(lodbuild_t *build)
+{
+	unsigned int *edge, a, b;
+	face_t *face;
+	int i, j, k, numedges;
+
+	numedges = 0;
+	edge = build->edges;
+	for(i = 0, face = build->faces; i < build->numfaces; i++, face++)
+	{
+		for(k = 0; k < 3; k++)
+		{
+			a = (unsigned int) build->position[face->vertexindex[k]];
+			b = (unsigned int) build->position[face->vertexindex[(k + 1) % 3]];
+			*edge++ = a < b ? a : b;
+			*edge++ = a < b ? b : a;
+			numedges++;
+		}
+	}
+	qsort(build->edges, numedges, 2 * sizeof(unsigned int), LodEdgeCompare);
+
+	for(i = 0; i < build->submesh->numvertices; i++)
+		build->flags[i] &= ~LOD_BORDER;
+	for(i = 0; i < numedges; i = j)
+	{
+		edge = build->edges + 2 * i;
+		for(j = i + 1; j < numedges && !LodEdgeCompare(edge, build->edges + 2 * j); j++)
+			;
+		if(j - i == 1)
+		{
+			build->flags[edge[0]] |= LOD_BORDER;
+			build->flags[edge[1]] |= LOD_BORDER;
+		}
+	}
+}
+
+/*
+==========================
+LodEdgeCompare()
+
+qsort() callback, edges by their first then second end
+==========================
+*/
+int LodEdgeCompare(const void *a, const void *b)
+{
+	const unsigned int *ea = (const unsigned int *) a;
+	const unsigned int *eb = (const unsigned int *) b;
+
+	if(ea[0] != eb[0])
+		return ea[0] < eb[0] ? -1 : 1;
+	return ea[1] < eb[1] ? -1 : (ea[1] > eb[1] ? 1 : 0);
+}
+
+/*
+==========================
+LodCollapseCompare()
+
+qsort() callback, cheapest collapse first
+==========================
+*/
+int LodCollapseCompare(const void *a, const void *b)
+{
+	const lodcollapse_t *ca = (const lodcollapse_t *) a;
+	const lodcollapse_t *cb = (const lodcollapse_t *) b;
+
+	return ca->cost < cb->cost ? -1 : (ca->cost > cb->cost ? 1 : 0);
+}
+
+/*
+==========================
+LodCollapsePass()
+
+Costs every edge both ways, then makes the cheapest
+collapses that don't touch each other's faces, up to
+about as many as it takes to get down to target faces.
+Returns how many were made
+==========================
+*/
+int LodCollapsePass(lodbuild_t *build, int target)
+{
+	lodcollapse_t *c;
+	lodquadric_t *qfrom, *qto;
+	face_t *face;
+	unsigned char *flags;
+	int *position;
+	int numvertices, numcollapses, budget, made, from, to, i, j, k, v;
+
+	numvertices = build->submesh->numvertices;
+	flags = build->flags;
+	position = build->position;
+	LodBorders(build);
+
+	// seam and border vertices only ever stay put
+	numcollapses = 0;
+	for(i = 0, face = build->faces; i < build->numfaces; i++, face++)
+	{
+		for(k = 0; k < 3; k++)
+		{
+			from = face->vertexindex[k];
+			to = face->vertexindex[(k + 1) % 3];
+			if(!(flags[from] & (LOD_SEAM | LOD_BORDER)))
+			{
+				c = &build->collapses[numcollapses++];
+				c->from = from;
+				c->to = to;
+				c->cost = LodCollapseCost(build, from, to);
+			}
+			if(!(flags[to] & (LOD_SEAM | LOD_BORDER)))
+			{
+				c = &build->collapses[numcollapses++];
+				c->from = to;
+				c->to = from;
+				c->cost = LodCollapseCost(build, to, from);
+			}
+		}
+	}
+	if(!numcollapses)
+		return 0;
+	qsort(build->collapses, numcollapses, sizeof(lodcollapse_t), LodCollapseCompare);
+
+	memset(build->start, 0, sizeof(int) * (numvertices + 1));
+	for(i = 0, face = build->faces; i < build->numfaces; i++, face++)
+		for(k = 0; k < 3; k++)
+			build->start[face->vertexindex[k] + 1]++;
+	for(v = 0; v < numvertices; v++)
+	{
+		build->start[v + 1] += build->start[v];
+		build->remap[v] = build->start[v];
+	}
+	for(i = 0, face = build->faces; i < build->numfaces; i++, face++)
+		for(k = 0; k < 3; k++)
+			build->adjacent[build->remap[face->vertexindex[k]]++] = i;
+	for(v = 0; v < numvertices; v++)
+	{
+		build->remap[v] = v;
+		flags[v] &= ~LOD_TOUCHED;
+	}
+
+	// a collapse takes two faces with it, or one on a border
+	budget = (build->numfaces - target + 1) / 2;
+	made = 0;
+	for(i = 0, c = build->collapses; i < numcollapses && made < budget; i++, c++)
+	{
+		if((flags[position[c->from]] | flags[position[c->to]]) & LOD_TOUCHED)
+			continue;
+		if(LodCollapseFlips(build, c->from, c->to))
+			continue;
+
+		build->remap[c->from] = c->to;
+		qfrom = &build->quadrics[position[c->from]];
+		qto = &build->quadrics[position[c->to]];
+		qto->a2 += qfrom->a2; qto->ab += qfrom->ab; qto->ac += qfrom->ac; qto->ad += qfrom->ad;
+		qto->b2 += qfrom->b2; qto->bc += qfrom->bc; qto->bd += qfrom->bd;
+		qto->c2 += qfrom->c2; qto->cd += qfrom->cd;
+		qto->d2 += qfrom->d2;
+		qto->area += qfrom->area;
+		if(c->cost > build->cost)
+			build->cost = c->cost;
+		// the faces around from have changed, so everything on
+		// them waits for the next pass, when they are costed again
+		for(j = build->start[c->from]; j < build->start[c->from + 1]; j++)
+			for(k = 0; k < 3; k++)
+				flags[position[build->faces[build->adjacent[j]].vertexindex[k]]] |= LOD_TOUCHED;
+		made++;
+	}
+
+	for(i = j = 0, face = build->faces; i < build->numfaces; i++, face++)
+	{
+		for(k = 0; k < 3; k++)
+			face->vertexindex[k] = build->remap[face->vertexindex[k]];
+		if(position[face->vertexindex[0]] == position[face->vertexindex[1]] ||
+		   position[face->vertexindex[1]] == position[face->vertexindex[2]] ||
+		   position[face->vertexindex[2]] == position[face->vertexindex[0]])
+			continue;
+		build->faces[j++] = *face;
+	}
+	build->numfaces = j;
+
+	return made;
+}
+
+/*
+==========================
+LodCollapseFlips()
+
+True if moving from onto to would turn one of the faces
+around from over, or squash it flat. The faces that have
+both ends go away and don't count
+==========================
+*/
+boolean_t LodCollapseFlips(lodbuild_t *build, int from, int to)
+{
+	vec3_t *p[3], v1, v2, before, after;
+	face_t *face;
+	int j, k, corner;
+
+	for(j = build->start[from]; j < build->start[from + 1]; j++)
+	{
+		face = &build->faces[build->adjacent[j]];
+		corner = -1;
+		for(k = 0; k < 3; k++)
+		{
+			if(build->position[face->vertexindex[k]] == build->position[to])
+				break;
+			if(face->vertexindex[k] == (unsigned int) from)
+				corner = k;
+		}
+		if(k < 3)
+			continue;
+
+		for(k = 0; k < 3; k++)
+			p[k] = &build->submesh->vertexdata[face->vertexindex[k]];
+		v1.x = p[1]->x - p[0]->x; v1.y = p[1]->y - p[0]->y; v1.z = p[1]->z - p[0]->z;
+		v2.x = p[2]->x - p[0]->x; v2.y = p[2]->y - p[0]->y; v2.z = p[2]->z - p[0]->z;
+		M_Vec3Cross(&v1, &v2, &before);
+		p[corner] = &build->submesh->vertexdata[to];
+		v1.x = p[1]->x - p[0]->x; v1.y = p[1]->y - p[0]->y; v1.z = p[1]->z - p[0]->z;
+		v2.x = p[2]->x - p[0]->x; v2.y = p[2]->y - p[0]->y; v2.z = p[2]->z - p[0]->z;
+		M_Vec3Cross(&v1, &v2, &after);
+		if(before.x * after.x + before.y * after.y + before.z * after.z <= 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+==========================
+MDL_NumFaces()
+
+Faces in the submesh's arrays, those of every level
+==========================
+*/
+int MDL_NumFaces(submesh_t *submesh)
+{
+	submeshlod_t *last;
+
+	if(!submesh->numlods)
+		return submesh->numfaces;
+	last = &submesh->lods[submesh->numlods - 1];
+	return last->firstface + last->numfaces;
+}
+
+/*
+=======================================================
+
+                     View culling
+
+Each submesh is bounded by its box and by a sphere on
+the box's centre. Against a plane the smaller of the two
+decides, so long thin submeshes get the box and round
+ones the sphere
+=======================================================
+*/
+
+#define CULL_ARRAYS  7  // centre x y z, radius, half extents x y z
+
+/*
+==========================
+CullBounds()
+
+Tests count bounds against planes whose normals face into
+the volume they bound. bounds is CULL_ARRAYS SoA arrays
+of SIMD_PAD(count) each. A bound is outside when it lies
+wholly behind any one plane, and outside[i] is then 1
+==========================
+*/
+void CullBounds(real_t *bounds, int count, vec4_t *planes, int numplanes, unsigned char *outside)
+{
+	real_t *cx, *cy, *cz, *radius, *ex, *ey, *ez;
+	real_t dist, reach, boxreach;
+	vec4_t *p;
+	int pad, i, j;
+#if USE_SIMD
+	simd_t zero = SIMD_SET1(0.0f);
+	simd_t x, y, z, r, hx, hy, hz, d, e, out;
+	int mask;
+#endif
+
+	pad = SIMD_PAD(count);
+	cx = bounds;
+	cy = cx + pad;
+	cz = cy + pad;
+	radius = cz + pad;
+	ex = radius + pad;
+	ey = ex + pad;
+	ez = ey + pad;
+
+	i = 0;
+#if USE_SIMD
+	for(; i + SIMD_WIDTH <= count; i += SIMD_WIDTH)
+	{
+		x = SIMD_LOAD(cx + i);
+		y = SIMD_LOAD(cy + i);
+		z = SIMD_LOAD(cz + i);
+		r = SIMD_LOAD(radius + i);
+		hx = SIMD_LOAD(ex + i);
+		hy = SIMD_LOAD(ey + i);
+		hz = SIMD_LOAD(ez + i);
+		out = SIMD_CMPGT(zero, zero);
+		for(j = 0, p = planes; j < numplanes; j++, p++)
+		{
+			d = SIMD_ADD(SIMD_ADD(SIMD_MUL(SIMD_SET1(p->x), x), SIMD_MUL(SIMD_SET1(p->y), y)),
+						 SIMD_ADD(SIMD_MUL(SIMD_SET1(p->z), z), SIMD_SET1(p->w)));
+			e = SIMD_ADD(SIMD_ADD(SIMD_MUL(SIMD_SET1((real_t) fabs(p->x)), hx),
+								  SIMD_MUL(SIMD_SET1((real_t) fabs(p->y)), hy)),
+						 SIMD_MUL(SIMD_SET1((real_t) fabs(p->z)), hz));
+			out = SIMD_OR(out, SIMD_CMPGT(SIMD_SUB(zero, SIMD_MIN(r, e)), d));
+		}
+		mask = SIMD_MASK(out);
+		for(j = 0; j < SIMD_WIDTH; j++)
+			outside[i + j] = (unsigned char) ((mask >> j) & 1);
+	}
+#endif
+	for(; i < count; i++)
+	{
+		outside[i] = 0;
+		for(j = 0, p = planes; j < numplanes; j++, p++)
+		{
+			dist = p->x * cx[i] + p->y * cy[i] + p->z * cz[i] + p->w;
+			boxreach = (real_t) (fabs(p->x) * ex[i] + fabs(p->y) * ey[i] + fabs(p->z) * ez[i]);
+			reach = boxreach < radius[i] ? boxreach : radius[i];
+			if(dist < -reach)
+			{
+				outside[i] = 1;
+				break;
+			}
+		}
+	}
+}
+
+/*
+==========================
+MDL_CullSubmeshes()
+
+Sets culled on the submeshes of mesh whose bounds are
+wholly outside the planes, which are in the mesh's space,
+and clears it on the others. Returns how many were culled.
+The bounds are gathered in frame memory, so this is for
+the main thread only
+==========================
+*/
+int MDL_CullSubmeshes(mesh_t *mesh, vec4_t *planes, int numplanes)
+{
+	submesh_t *submesh;
+	real_t *bounds;
+	unsigned char *outside;
+	int count, pad, i, culled;
+
+	count = 0;
+	for(submesh = mesh->submeshpool; submesh != NULL; submesh = submesh->next)
+		count++;
+	if(!count)
+		return 0;
+
+	pad = SIMD_PAD(count);
+	bounds = (real_t *) Z_FrameAlloc(sizeof(real_t) * CULL_ARRAYS * pad, 32);
+	outside = (unsigned char *) Z_FrameAlloc(count, 1);
+	for(i = 0, submesh = mesh->submeshpool; submesh != NULL; submesh = submesh->next, i++)
+	{
+		bounds[i] = submesh->centre.x;
+		bounds[pad + i] = submesh->centre.y;
+		bounds[2 * pad + i] = submesh->centre.z;
+		bounds[3 * pad + i] = submesh->radius;
+		bounds[4 * pad + i] = 0.5f * (submesh->maxs.x - submesh->mins.x);
+		bounds[5 * pad + i] = 0.5f * (submesh->maxs.y - submesh->mins.y);
+		bounds[6 * pad + i] = 0.5f * (submesh->maxs.z - submesh->mins.z);
+	}
+	CullBounds(bounds, count, planes, numplanes, outside);
+
+	culled = 0;
+	for(i = 0, submesh = mesh->submeshpool; submesh != NULL; submesh = submesh->next, i++)
+	{
+		submesh->culled = outside[i] ? true : false;
+		culled += outside[i];
+	}
+
+	return culled;
+}
+
+/*
+=======================================================
+
+                      Ray tracing
+
+Every submesh gets a bounding volume hierarchy over the
+triangles of its full level, split by the surface area
+heuristic over binned centroids. Its nodes are a flat
+depth first array and its triangles are copied out in
+leaf order, so a leaf's triangles are next to each other
+and the hierarchy still works once the submesh's own
+arrays have gone to the GL. Rays go through it
+SIMD_WIDTH at a time, a lane each. Animated submeshes'
+hierarchies are in the rest pose, and rays are moved
+into it by the inverse of their node's transform
+=======================================================
+*/
+
+#define BVH_BINS      16
+#define BVH_MAXLEAF   8     // most triangles a leaf may keep when splitting costs more
+#define BVH_MAXDEPTH  64
+#define BVH_NODECOST  1.0f  // of visiting a node, in triangle tests
+
+typedef struct
+{
+	vec3_t mins;
+	vec3_t maxs;
+	int count;
+} bvhbin_t;
+
+typedef struct bvhbuild_s
+{
+	vec3_t *mins;        // per face bounds..
+	vec3_t *maxs;
+	vec3_t *centroids;   // ..and their centres
+	int *refs;           // faces, sorted into the leaves as the nodes are built
+	bvhnode_t *nodes;
+	int numnodes;
+} bvhbuild_t;
+
+/*
+==========================
+BuildSubmeshBvh()
+==========================
+*/
+void BuildSubmeshBvh(submesh_t *submesh)
+{
+	bvhbuild_t build;
+	bvh_t *bvh;
+	face_t *f;
+	vec3_t *v[3];
+	real_t *tri;
+	int numfaces, header, i, j, k;
+
+	numfaces = submesh->numfaces;
+	if(numfaces <= 0 || !submesh->vertexdata || !submesh->faces)
+		return;
+
+	build.mins = (vec3_t *) Z_MallocUninit(sizeof(vec3_t) * numfaces);
+	build.maxs = (vec3_t *) Z_MallocUninit(sizeof(vec3_t) * numfaces);
+	build.centroids = (vec3_t *) Z_MallocUninit(sizeof(vec3_t) * numfaces);
+	build.refs = (int *) Z_MallocUninit(sizeof(int) * numfaces);
+	// a leaf holds a triangle at least, so there are under twice as many nodes
+	build.nodes = (bvhnode_t *) Z_MallocUninit(sizeof(bvhnode_t) * 2 * numfaces);
+	for(i = 0, f = submesh->faces; i < numfaces; i++, f++)
+	{
+		build.mins[i] = build.maxs[i] = submesh->vertexdata[f->vertexindex[0]];
+		for(k = 1; k < 3; k++)
+		{
+			v[0] = &submesh->vertexdata[f->vertexindex[k]];
+			if(v[0]->x < build.mins[i].x) build.mins[i].x = v[0]->x;
+			if(v[0]->y < build.mins[i].y) build.mins[i].y = v[0]->y;
+			if(v[0]->z < build.mins[i].z) build.mins[i].z = v[0]->z;
+			if(v[0]->x > build.maxs[i].x) build.maxs[i].x = v[0]->x;
+			if(v[0]->y > build.maxs[i].y) build.maxs[i].y = v[0]->y;
+			if(v[0]->z > build.maxs[i].z) build.maxs[i].z = v[0]->z;
+		}
+		build.centroids[i].x = 0.5f * (build.mins[i].x + build.maxs[i].x);
+		build.centroids[i].y = 0.5f * (build.mins[i].y + build.maxs[i].y);
+		build.centroids[i].z = 0.5f * (build.mins[i].z + build.maxs[i].z);
+		build.refs[i] = i;
+	}
+	build.numnodes = 1;
+	BvhBuildNode(&build, 0, 0, numfaces, 0);
+
+	// one block, the arrays after the header
+	header = (sizeof(bvh_t) + 15) & ~15;
+	bvh = (bvh_t *) Z_TagMallocUninit(header + sizeof(bvhnode_t) * build.numnodes +
+									  (sizeof(real_t) * 9 + sizeof(int)) * numfaces, TAG_MESH);
+	bvh->numnodes = build.numnodes;
+	bvh->nodes = (bvhnode_t *) ((unsigned char *) bvh + header);
+	memcpy(bvh->nodes, build.nodes, sizeof(bvhnode_t) * build.numnodes);
+	bvh->numtriangles = numfaces;
+	bvh->triangles = (real_t *) (bvh->nodes + build.numnodes);
+	bvh->faces = (int *) (bvh->triangles + 9 * numfaces);
+	for(i = 0, tri = bvh->triangles; i < numfaces; i++, tri += 9)
+	{
+		f = &submesh->faces[build.refs[i]];
+		for(k = 0; k < 3; k++)
+			v[k] = &submesh->vertexdata[f->vertexindex[k]];
+		tri[0] = v[0]->x;
+		tri[1] = v[0]->y;
+		tri[2] = v[0]->z;
+		for(j = 1; j < 3; j++)
+		{
+			tri[j * 3] = v[j]->x - v[0]->x;
+			tri[j * 3 + 1] = v[j]->y - v[0]->y;
+			tri[j * 3 + 2] = v[j]->z - v[0]->z;
+		}
+		bvh->faces[i] = build.refs[i];
+	}
+
+	Z_Free(build.mins);
+	Z_Free(build.maxs);
+	Z_Free(build.centroids);
+	Z_Free(build.refs);
+	Z_Free(build.nodes);
+	if(submesh->bvh)
+		Z_Free(submesh->bvh);
+	submesh->bvh = bvh;
+}
+
+/*
+==========================
+BvhArea()
+
+Half the surface area of a box, which is all the
+heuristic needs
+==========================
+*/
+real_t BvhArea(vec3_t *mins, vec3_t *maxs)
+{
+	real_t dx, dy, dz;
+
+	dx = maxs->x - mins->x;
+	dy = maxs->y - mins->y;
+	dz = maxs->z - mins->z;
+	return dx * dy + dy * dz + dz * dx;
+}
+
+/*
+==========================
+BvhBuildNode()
+
+Bounds node index around count faces from first in the
+refs, then splits them between two children where the
+surface area heuristic says a ray will do the fewest
+tests, trying BVH_BINS - 1 planes on each axis. The
+children are allocated as they're built, so the first
+always follows its parent. It stays a leaf when that's
+cheaper and it's small, or when there's no split at all
+==========================
+*/
+void BvhBuildNode(bvhbuild_t *build, int index, int first, int count, int depth)
+{
+	bvhnode_t *node;
+	bvhbin_t bins[BVH_BINS];
+	vec3_t cmins, cmaxs, lmins, lmaxs, *c;
+	real_t rightarea[BVH_BINS], area, cost, bestcost, scale, bestscale, lo, bestlo;
+	int rightcount[BVH_BINS], leftcount, axis, bestaxis, bestsplit, bin, i, j, r;
+
+	node = &build->nodes[index];
+	r = build->refs[first];
+	node->mins = build->mins[r];
+	node->maxs = build->maxs[r];
+	cmins = cmaxs = build->centroids[r];
+	for(i = first + 1; i < first + count; i++)
+	{
+		r = build->refs[i];
+		if(build->mins[r].x < node->mins.x) node->mins.x = build->mins[r].x;
+		if(build->mins[r].y < node->mins.y) node->mins.y = build->mins[r].y;
+		if(build->mins[r].z < node->mins.z) node->mins.z = build->mins[r].z;
+		if(build->maxs[r].x > node->maxs.x) node->maxs.x = build->maxs[r].x;
+		if(build->maxs[r].y > node->maxs.y) node->maxs.y = build->maxs[r].y;
+		if(build->maxs[r].z > node->maxs.z) node->maxs.z = build->maxs[r].z;
+		c = &build->centroids[r];
+		if(c->x < cmins.x) cmins.x = c->x;
+		if(c->y < cmins.y) cmins.y = c->y;
+		if(c->z < cmins.z) cmins.z = c->z;
+		if(c->x > cmaxs.x) cmaxs.x = c->x;
+		if(c->y > cmaxs.y) cmaxs.y = c->y;
+		if(c->z > cmaxs.z) cmaxs.z = c->z;
+	}
+	node->first = first;
+	node->count = count;
+	if(count <= 2 || depth >= BVH_MAXDEPTH)
+		return;
+
+	area = BvhArea(&node->mins, &node->maxs);
+	bestcost = (real_t) 1e30f;
+	bestaxis = bestsplit = -1;
+	bestscale = bestlo = 0;
+	for(axis = 0; axis < 3; axis++)
+	{
+		lo = ((real_t *) &cmins)[axis];
+		if(((real_t *) &cmaxs)[axis] <= lo)
+			continue;
+		scale = BVH_BINS / (((real_t *) &cmaxs)[axis] - lo);
+		for(j = 0; j < BVH_BINS; j++)
+		{
+			bins[j].count = 0;
+			bins[j].mins.x = bins[j].mins.y = bins[j].mins.z = (real_t) 1e30f;
+			bins[j].maxs.x = bins[j].maxs.y = bins[j].maxs.z = (real_t) -1e30f;
+		}
+		for(i = first; i < first + count; i++)
+		{
+			r = build->refs[i];
+			bin = (int) ((((real_t *) &build->centroids[r])[axis] - lo) * scale);
+			if(bin > BVH_BINS - 1)
+				bin = BVH_BINS - 1;
+			bins[bin].count++;
+			if(build->mins[r].x < bins[bin].mins.x) bins[bin].mins.x = build->mins[r].x;
+			if(build->mins[r].y < bins[bin].mins.y) bins[bin].mins.y = build->mins[r].y;
+			if(build->mins[r].z < bins[bin].mins.z) bins[bin].mins.z = build->mins[r].z;
+			if(build->maxs[r].x > bins[bin].maxs.x) bins[bin].maxs.x = build->maxs[r].x;
+			if(build->maxs[r].y > bins[bin].maxs.y) bins[bin].maxs.y = build->maxs[r].y;
+			if(build->maxs[r].z > bins[bin].maxs.z) bins[bin].maxs.z = build->maxs[r].z;
+		}
+
+		// sweep in from the right for what lies past each plane..
+		lmins = bins[BVH_BINS - 1].mins;
+		lmaxs = bins[BVH_BINS - 1].maxs;
+		rightcount[BVH_BINS - 1] = bins[BVH_BINS - 1].count;
+		rightarea[BVH_BINS - 1] = BvhArea(&lmins, &lmaxs);
+		for(j = BVH_BINS - 2; j > 0; j--)
+		{
+			if(bins[j].mins.x < lmins.x) lmins.x = bins[j].mins.x;
+			if(bins[j].mins.y < lmins.y) lmins.y = bins[j].mins.y;
+			if(bins[j].mins.z < lmins.z) lmins.z = bins[j].mins.z;
+			if(bins[j].maxs.x > lmaxs.x) lmaxs.x = bins[j].maxs.x;
+			if(bins[j].maxs.y > lmaxs.y) lmaxs.y = bins[j].maxs.y;
+			if(bins[j].maxs.z > lmaxs.z) lmaxs.z = bins[j].maxs.z;
+			rightcount[j] = rightcount[j + 1] + bins[j].count;
+			rightarea[j] = BvhArea(&lmins, &lmaxs);
+		}
+		// ..then in from the left, costing each plane
+		lmins = bins[0].mins;
+		lmaxs = bins[0].maxs;
+		leftcount = 0;
+		for(j = 1; j < BVH_BINS; j++)
+		{
+			leftcount += bins[j - 1].count;
+			if(j > 1)
+			{
+				if(bins[j - 1].mins.x < lmins.x) lmins.x = bins[j - 1].mins.x;
+				if(bins[j - 1].mins.y < lmins.y) lmins.y = bins[j - 1].mins.y;
+				if(bins[j - 1].mins.z < lmins.z) lmins.z = bins[j - 1].mins.z;
+				if(bins[j - 1].maxs.x > lmaxs.x) lmaxs.x = bins[j - 1].maxs.x;
+				if(bins[j - 1].maxs.y > lmaxs.y) lmaxs.y = bins[j - 1].maxs.y;
+				if(bins[j - 1].maxs.z > lmaxs.z) lmaxs.z = bins[j - 1].maxs.z;
+			}
+			if(!leftcount || !rightcount[j])
+				continue;
+			cost = BVH_NODECOST + (BvhArea(&lmins, &lmaxs) * leftcount + rightarea[j] * rightcount[j]) / area;
+			if(cost < bestcost)
+			{
+				bestcost = cost;
+				bestaxis = axis;
+				bestsplit = j;
+				bestscale = scale;
+				bestlo = lo;
+			}
+		}
+	}
+	if(bestaxis < 0 || (count <= BVH_MAXLEAF && bestcost >= count))
+		return;
+
+	// the same sums as the binning, so every face lands on the same side
+	i = first;
+	j = first + count - 1;
+	while(i <= j)
+	{
+		r = build->refs[i];
+		bin = (int) ((((real_t *) &build->centroids[r])[bestaxis] - bestlo) * bestscale);
+		if(bin < bestsplit)
+			i++;
+		else
+		{
+			build->refs[i] = build->refs[j];
+			build->refs[j--] = r;
+		}
+	}
+	leftcount = i - first;
+
+	node->count = -1 - bestaxis;
+	BvhBuildNode(build, build->numnodes++, first, leftcount, depth + 1);
+	node->first = build->numnodes;
+	BvhBuildNode(build, build->numnodes++, first + leftcount, count - leftcount, depth + 1);
+}
+
+/*
+==========================
+SubmeshRays()
+
+Puts count traces into the submesh's space as SoA rays
+for TraceSubmesh(): the x, y and z of the starts, then
+of the deltas, SIMD_WIDTH of each. Returns false if an
+animated submesh's node has squashed it flat
+==========================
+*/
+boolean_t SubmeshRays(submesh_t *submesh, trace_t *traces, int count, real_t *rays)
+{
+	real_t *m, c[9], det, p[3];
+	int i;
+
+	for(i = count; i < SIMD_WIDTH; i++)
+		rays[i] = rays[SIMD_WIDTH + i] = rays[2 * SIMD_WIDTH + i] =
+			rays[3 * SIMD_WIDTH + i] = rays[4 * SIMD_WIDTH + i] = rays[5 * SIMD_WIDTH + i] = 0;
+
+	if(!submesh->animated || !submesh->parent->anim)
+	{
+		for(i = 0; i < count; i++)
+		{
+			rays[i] = traces[i].start.x;
+			rays[SIMD_WIDTH + i] = traces[i].start.y;
+			rays[2 * SIMD_WIDTH + i] = traces[i].start.z;
+			rays[3 * SIMD_WIDTH + i] = traces[i].delta.x;
+			rays[4 * SIMD_WIDTH + i] = traces[i].delta.y;
+			rays[5 * SIMD_WIDTH + i] = traces[i].delta.z;
+		}
+		return true;
+	}
+
+	// the inverse is the transposed cofactors over the determinant
+	m = submesh->parent->anim->skin + submesh->node * 12;
+	c[0] = m[5] * m[10] - m[6] * m[9];
+	c[1] = m[6] * m[8] - m[4] * m[10];
+	c[2] = m[4] * m[9] - m[5] * m[8];
+	c[3] = m[2] * m[9] - m[1] * m[10];
+	c[4] = m[0] * m[10] - m[2] * m[8];
+	c[5] = m[1] * m[8] - m[0] * m[9];
+	c[6] = m[1] * m[6] - m[2] * m[5];
+	c[7] = m[2] * m[4] - m[0] * m[6];
+	c[8] = m[0] * m[5] - m[1] * m[4];
+	det = m[0] * c[0] + m[1] * c[1] + m[2] * c[2];
+	if(det == 0)
+		return false;
+	for(i = 0; i < 9; i++)
+		c[i] /= det;
+	for(i = 0; i < count; i++)
+	{
+		p[0] = traces[i].start.x - m[3];
+		p[1] = traces[i].start.y - m[7];
+		p[2] = traces[i].start.z - m[11];
+		rays[i] = c[0] * p[0] + c[3] * p[1] + c[6] * p[2];
+		rays[SIMD_WIDTH + i] = c[1] * p[0] + c[4] * p[1] + c[7] * p[2];
+		rays[2 * SIMD_WIDTH + i] = c[2] * p[0] + c[5] * p[1] + c[8] * p[2];
+		p[0] = traces[i].delta.x;
+		p[1] = traces[i].delta.y;
+		p[2] = traces[i].delta.z;
+		rays[3 * SIMD_WIDTH + i] = c[0] * p[0] + c[3] * p[1] + c[6] * p[2];
+		rays[4 * SIMD_WIDTH + i] = c[1] * p[0] + c[4] * p[1] + c[7] * p[2];
+		rays[5 * SIMD_WIDTH + i] = c[2] * p[0] + c[5] * p[1] + c[8] * p[2];
+	}
+
+	return true;
+}
+
+/*
+==========================
+TraceSubmesh()
+
+Traces the rays of SubmeshRays() whose bits are set in
+live through a hierarchy. A node is entered when the box
+test passes for any live lane short of that lane's
+nearest hit so far, so rays that start close together
+and go much the same way share their nodes, and its
+children are visited nearest first for the first ray.
+Triangles are Moller-Trumbore tested, both sides. A lane
+that hits gets its fraction and face updated, and the
+returned mask has its bit set
+==========================
+*/
+int TraceSubmesh(bvh_t *bvh, real_t *rays, int live, real_t *fractions, int *faces)
+{
+	bvhnode_t *node;
+	real_t *tri, t[SIMD_WIDTH];
+	simd_t ox, oy, oz, dx, dy, dz, ix, iy, iz, best, t0, t1, tnear, tfar;
+	simd_t e1x, e1y, e1z, e2x, e2y, e2z, px, py, pz, sx, sy, sz, qx, qy, qz, inv, u, v, dist;
+	simd_t zero = SIMD_SET1(0.0f);
+	simd_t one = SIMD_SET1(1.0f);
+	int stack[BVH_MAXDEPTH + 2], sp, index, axis, hits, mask, j, k;
+
+	ox = SIMD_LOAD(rays);
+	oy = SIMD_LOAD(rays + SIMD_WIDTH);
+	oz = SIMD_LOAD(rays + 2 * SIMD_WIDTH);
+	dx = SIMD_LOAD(rays + 3 * SIMD_WIDTH);
+	dy = SIMD_LOAD(rays + 4 * SIMD_WIDTH);
+	dz = SIMD_LOAD(rays + 5 * SIMD_WIDTH);
+	// a zero component makes an infinity, which the slabs cope with
+	ix = SIMD_DIV(one, dx);
+	iy = SIMD_DIV(one, dy);
+	iz = SIMD_DIV(one, dz);
+	best = SIMD_LOAD(fractions);
+
+	hits = 0;
+	sp = 0;
+	stack[sp++] = 0;
+	while(sp)
+	{
+		index = stack[--sp];
+		node = &bvh->nodes[index];
+		t0 = SIMD_MUL(SIMD_SUB(SIMD_SET1(node->mins.x), ox), ix);
+		t1 = SIMD_MUL(SIMD_SUB(SIMD_SET1(node->maxs.x), ox), ix);
+		tnear = SIMD_MIN(t0, t1);
+		tfar = SIMD_MAX(t0, t1);
+		t0 = SIMD_MUL(SIMD_SUB(SIMD_SET1(node->mins.y), oy), iy);
+		t1 = SIMD_MUL(SIMD_SUB(SIMD_SET1(node->maxs.y), oy), iy);
+		tnear = SIMD_MAX(tnear, SIMD_MIN(t0, t1));
+		tfar = SIMD_MIN(tfar, SIMD_MAX(t0, t1));
+		t0 = SIMD_MUL(SIMD_SUB(SIMD_SET1(node->mins.z), oz), iz);
+		t1 = SIMD_MUL(SIMD_SUB(SIMD_SET1(node->maxs.z), oz), iz);
+		tnear = SIMD_MAX(SIMD_MAX(tnear, SIMD_MIN(t0, t1)), zero);
+		tfar = SIMD_MIN(SIMD_MIN(tfar, SIMD_MAX(t0, t1)), best);
+		mask = SIMD_MASKGE(tfar, tnear) & live;
+		if(!mask)
+			continue;
+
+		if(node->count < 0)
+		{
+			// push the far child first, so the near one comes off next
+			axis = -1 - node->count;
+			if(rays[(3 + axis) * SIMD_WIDTH] < 0)
+			{
+				stack[sp++] = index + 1;
+				stack[sp++] = node->first;
+			}
+			else
+			{
+				stack[sp++] = node->first;
+				stack[sp++] = index + 1;
+			}
+			continue;
+		}
+
+		for(k = 0, tri = bvh->triangles + node->first * 9; k < node->count; k++, tri += 9)
+		{
+			e1x = SIMD_SET1(tri[3]);
+			e1y = SIMD_SET1(tri[4]);
+			e1z = SIMD_SET1(tri[5]);
+			e2x = SIMD_SET1(tri[6]);
+			e2y = SIMD_SET1(tri[7]);
+			e2z = SIMD_SET1(tri[8]);
+			px = SIMD_SUB(SIMD_MUL(dy, e2z), SIMD_MUL(dz, e2y));
+			py = SIMD_SUB(SIMD_MUL(dz, e2x), SIMD_MUL(dx, e2z));
+			pz = SIMD_SUB(SIMD_MUL(dx, e2y), SIMD_MUL(dy, e2x));
+			// a ray along the triangle divides by zero, and fails every test after
+			inv = SIMD_DIV(one, SIMD_ADD(SIMD_ADD(SIMD_MUL(e1x, px), SIMD_MUL(e1y, py)), SIMD_MUL(e1z, pz)));
+			sx = SIMD_SUB(ox, SIMD_SET1(tri[0]));
+			sy = SIMD_SUB(oy, SIMD_SET1(tri[1]));
+			sz = SIMD_SUB(oz, SIMD_SET1(tri[2]));
+			u = SIMD_MUL(SIMD_ADD(SIMD_ADD(SIMD_MUL(sx, px), SIMD_MUL(sy, py)), SIMD_MUL(sz, pz)), inv);
+			qx = SIMD_SUB(SIMD_MUL(sy, e1z), SIMD_MUL(sz, e1y));
+			qy = SIMD_SUB(SIMD_MUL(sz, e1x), SIMD_MUL(sx, e1z));
+			qz = SIMD_SUB(SIMD_MUL(sx, e1y), SIMD_MUL(sy, e1x));
+			v = SIMD_MUL(SIMD_ADD(SIMD_ADD(SIMD_MUL(dx, qx), SIMD_MUL(dy, qy)), SIMD_MUL(dz, qz)), inv);
+			dist = SIMD_MUL(SIMD_ADD(SIMD_ADD(SIMD_MUL(e2x, qx), SIMD_MUL(e2y, qy)), SIMD_MUL(e2z, qz)), inv);
+			mask = live & SIMD_MASKGE(u, zero) & SIMD_MASKGE(v, zero) & SIMD_MASKGE(one, SIMD_ADD(u, v)) &
+				SIMD_MASKGE(dist, zero) & SIMD_MASKGT(best, dist);
+			if(!mask)
+				continue;
+			SIMD_STORE(t, dist);
+			for(j = 0; j < SIMD_WIDTH; j++)
+			{
+				if(mask & (1 << j))
+				{
+					fractions[j] = t[j];
+					faces[j] = bvh->faces[node->first + k];
+				}
+			}
+			hits |= mask;
+			best = SIMD_LOAD(fractions);
+		}
+	}
+
+	return hits;
+}
+
+/*
+==========================
+MDL_TraceMesh()
+
+Finds where each of the traces first hits the mesh, as
+it was last posed, looking no further along each delta
+than its fraction. Hits on either side of a face count,
+and only the faces of the full levels are tested
+==========================
+*/
+void MDL_TraceMesh(mesh_t *mesh, trace_t *traces, int numtraces)
+{
+	submesh_t *submesh;
+	real_t rays[6 * SIMD_WIDTH], fractions[SIMD_WIDTH];
+	int faces[SIMD_WIDTH], i, j, count, live, hits;
+
+	for(i = 0; i < numtraces; i += SIMD_WIDTH)
+	{
+		count = numtraces - i < SIMD_WIDTH ? numtraces - i : SIMD_WIDTH;
+		live = (1 << count) - 1;
+		for(j = 0; j < SIMD_WIDTH; j++)
+		{
+			fractions[j] = 0;
+			if(j >= count)
+				continue;
+			fractions[j] = traces[i + j].fraction;
+			traces[i + j].submesh = NULL;
+			traces[i + j].face = -1;
+		}
+		for(submesh = mesh->submeshpool; submesh != NULL; submesh = submesh->next)
+		{
+			if(!submesh->bvh || !SubmeshRays(submesh, traces + i, count, rays))
+				continue;
+			hits = TraceSubmesh(submesh->bvh, rays, live, fractions, faces);
+			for(j = 0; j < count; j++)
+			{
+				if(hits & (1 << j))
+				{
+					traces[i + j].submesh = submesh;
+					traces[i + j].face = faces[j];
+				}
+			}
+		}
+		for(j = 0; j < count; j++)
+			traces[i + j].fraction = fractions[j];
+	}
+}
+
+/*
+==========================
+TraceMeshBrute()
+
+MDL_TraceMesh() the slow way, every ray against every
+triangle, for MDL_TraceBenchmark() to check it and to
+beat
+==========================
+*/
+void TraceMeshBrute(mesh_t *mesh, trace_t *traces, int numtraces)
+{
+	submesh_t *submesh;
+	trace_t *trace;
+	real_t rays[6 * SIMD_WIDTH], *tri, *r;
+	real_t p[3], s[3], q[3], inv, u, v, dist;
+	int i, k;
+
+	for(i = 0, trace = traces; i < numtraces; i++, trace++)
+	{
+		trace->submesh = NULL;
+		trace->face = -1;
+		for(submesh = mesh->submeshpool; submesh != NULL; submesh = submesh->next)
+		{
+			if(!submesh->bvh || !SubmeshRays(submesh, trace, 1, rays))
+				continue;
+			r = rays;
+			for(k = 0, tri = submesh->bvh->triangles; k < submesh->bvh->numtriangles; k++, tri += 9)
+			{
+				p[0] = r[4 * SIMD_WIDTH] * tri[8] - r[5 * SIMD_WIDTH] * tri[7];
+				p[1] = r[5 * SIMD_WIDTH] * tri[6] - r[3 * SIMD_WIDTH] * tri[8];
+				p[2] = r[3 * SIMD_WIDTH] * tri[7] - r[4 * SIMD_WIDTH] * tri[6];
+				inv = 1.0f / (tri[3] * p[0] + tri[4] * p[1] + tri[5] * p[2]);
+				s[0] = r[0] - tri[0];
+				s[1] = r[SIMD_WIDTH] - tri[1];
+				s[2] = r[2 * SIMD_WIDTH] - tri[2];
+				u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inv;
+				q[0] = s[1] * tri[5] - s[2] * tri[4];
+				q[1] = s[2] * tri[3] - s[0] * tri[5];
+				q[2] = s[0] * tri[4] - s[1] * tri[3];
+				v = (r[3 * SIMD_WIDTH] * q[0] + r[4 * SIMD_WIDTH] * q[1] + r[5 * SIMD_WIDTH] * q[2]) * inv;
+				dist = (tri[6] * q[0] + tri[7] * q[1] + tri[8] * q[2]) * inv;
+				if(u >= 0 && v >= 0 && u + v <= 1 && dist >= 0 && dist < trace->fraction)
+				{
+					trace->fraction = dist;
+					trace->submesh = submesh;
+					trace->face = submesh->bvh->faces[k];
+				}
+			}
+		}
+	}
+}
+
+/*
+==========================
+BenchRandom()
+
+0 to 1, repeatable so runs can be compared
+==========================
+*/
+real_t BenchRandom(unsigned int *seed)
+{
+	*seed = *seed * 1664525 + 1013904223;
+	return (real_t) (*seed >> 8) / 16777216.0f;
+}
+
+/*
+==========================
+MDL_TraceBenchmark()
+
+Run with -tracebench. Shoots a grid of rays across the
+view from each of TRACE_BENCHVIEWS places inside the
+mesh's bounds through the hierarchies, then as many of
+them, spread evenly, as TRACE_BENCHBRUTE triangle tests
+allow the brute force way, and reports both rates and
+any rays they disagree on
+==========================
+*/
+#define TRACE_BENCHVIEWS   16
+#define TRACE_BENCHSIDE    128        // rays across and down a view
+#define TRACE_BENCHBRUTE   100000000
+
+void MDL_TraceBenchmark(mesh_t *mesh)
+{
+	submesh_t *submesh;
+	trace_t *traces, *brute, *trace;
+	vec3_t size, forward, right, up, dir;
+	real_t length, a, b;
+	unsigned long int start, fastms, brutems;
+	unsigned int seed;
+	int numtraces, numbrute, stride, numtriangles, numhits, mismatches, view, i, j;
+
+	numtriangles = 0;
+	for(submesh = mesh->submeshpool; submesh != NULL; submesh = submesh->next)
+		if(submesh->bvh)
+			numtriangles += submesh->bvh->numtriangles;
+	if(!numtriangles)
+	{
+		Sys_Warn("MDL_TraceBenchmark: %s has nothing to trace\n", mesh->name ? mesh->name : "mesh");
+		return;
+	}
+
+	numtraces = TRACE_BENCHVIEWS * TRACE_BENCHSIDE * TRACE_BENCHSIDE;
+	traces = (trace_t *) Z_MallocUninit(sizeof(trace_t) * numtraces);
+	M_Vec3Subtract(&mesh->maxs, &mesh->mins, &size);
+	length = M_Vec3Magnitude(&size);
+	seed = 1;
+	trace = traces;
+	for(view = 0; view < TRACE_BENCHVIEWS; view++)
+	{
+		forward.x = BenchRandom(&seed) - 0.5f;
+		forward.y = BenchRandom(&seed) - 0.5f;
+		forward.z = BenchRandom(&seed) - 0.5f;
+		M_Vec3Normalize(&forward, &forward);
+		up.x = up.z = 0.0f;
+		up.y = 1.0f;
+		M_Vec3Cross(&forward, &up, &right);
+		M_Vec3Normalize(&right, &right);
+		M_Vec3Cross(&right, &forward, &up);
+		a = BenchRandom(&seed);
+		b = BenchRandom(&seed);
+		for(i = 0; i < TRACE_BENCHSIDE * TRACE_BENCHSIDE; i++, trace++)
+		{
+			trace->start.x = mesh->mins.x + size.x * a;
+			trace->start.y = mesh->mins.y + size.y * b;
+			trace->start.z = mesh->mins.z + size.z * 0.5f;
+			// a 90 degree view
+			dir.x = forward.x + right.x * ((i % TRACE_BENCHSIDE) * 2.0f / TRACE_BENCHSIDE - 1) +
+				up.x * ((i / TRACE_BENCHSIDE) * 2.0f / TRACE_BENCHSIDE - 1);
+			dir.y = forward.y + right.y * ((i % TRACE_BENCHSIDE) * 2.0f / TRACE_BENCHSIDE - 1) +
+				up.y * ((i / TRACE_BENCHSIDE) * 2.0f / TRACE_BENCHSIDE - 1);
+			dir.z = forward.z + right.z * ((i % TRACE_BENCHSIDE) * 2.0f / TRACE_BENCHSIDE - 1) +
+				up.z * ((i / TRACE_BENCHSIDE) * 2.0f / TRACE_BENCHSIDE - 1);
+			trace->delta.x = dir.x * length;
+			trace->delta.y = dir.y * length;
+			trace->delta.z = dir.z * length;
+			trace->fraction = 1;
+		}
+	}
+
+	numbrute = TRACE_BENCHBRUTE / numtriangles;
+	if(numbrute < 1)
+		numbrute = 1;
+	if(numbrute > numtraces)
+		numbrute = numtraces;
+	stride = numtraces / numbrute;
+	brute = (trace_t *) Z_MallocUninit(sizeof(trace_t) * numbrute);
+	for(i = 0; i < numbrute; i++)
+		brute[i] = traces[i * stride];
+
+	start = Sys_GetMilliseconds();
+	MDL_TraceMesh(mesh, traces, numtraces);
+	fastms = Sys_GetMilliseconds() - start;
+	start = Sys_GetMilliseconds();
+	TraceMeshBrute(mesh, brute, numbrute);
+	brutems = Sys_GetMilliseconds() - start;
+
+	// the same distance is as good as the same face, where faces meet
+	mismatches = 0;
+	for(i = 0; i < numbrute; i++)
+	{
+		j = i * stride;
+		if(fabs(traces[j].fraction - brute[i].fraction) > 1e-4f ||
+		   (traces[j].submesh == NULL) != (brute[i].submesh == NULL))
+			mismatches++;
+	}
+	numhits = 0;
+	for(i = 0; i < numtraces; i++)
+		if(traces[i].submesh)
+			numhits++;
+
+	Sys_Printf("MDL_TraceBenchmark: %i triangles, %i rays (%i hit) through the hierarchies in %lu ms, %.0f rays/s\n",
+			   numtriangles, numtraces, numhits, fastms, numtraces * 1000.0 / (fastms ? fastms : 1));
+	Sys_Printf("MDL_TraceBenchmark: %i rays brute force in %lu ms, %.0f rays/s\n",
+			   numbrute, brutems, numbrute * 1000.0 / (brutems ? brutems : 1));
+	if(mismatches)
+		Sys_Warn("MDL_TraceBenchmark: %i of %i rays hit differently\n", mismatches, numbrute);
+
+	Z_Free(brute);
+	Z_Free(traces);
+}
+
+/*
+=======================================================
+
+                  Occlusion culling
+
+The nearest and largest static submeshes in view are
+drawn as occluders into a small depth buffer on the CPU,
+and every other submesh's screen box is then tested
+against it. Depth is 1/w, which is linear across the
+screen, so a triangle's depth is a plane like its edges.
+Occluders only mark the pixels they cover whole, at the
+farthest depth they reach in each, and a box is only
+hidden if its nearest corner is behind every pixel it
+touches, so the buffer may miss occlusion but never
+makes any up. Each tile keeps the nearest and farthest of
+its depths, so most tests take a tile at a time, and rows
+of tiles are rasterised on as many threads as there are
+processors. Those threads are started by the first frame
+with enough triangles and then sleep between frames.
+Occluders come from the hierarchies'
+triangles, which outlive the submeshes' own arrays, so
+animated submeshes are only ever tested
+=======================================================
+*/
+
+#define OCC_MAXTRIANGLES     4096   // occluder triangles drawn a frame, before clipping
+#define OCC_MINSIZE          0.1f   // least radius over distance of an occluder's sphere
+#define OCC_THREADTRIANGLES  1024   // fewer aren't worth a thread
+#define OCC_TILEPIXELS       (OCC_TILE * OCC_TILE)
+#define OCC_GUARDBAND        1.1f   // how far past the sides of the view triangles are clipped
+#define OCC_CLIPPLANES       5
+#define OCC_MAXCLIPPED       (3 + OCC_CLIPPLANES)  // corners a clipped triangle can have
+
+typedef struct occtriangle_s
+{
+	real_t edges[3][3];  // a x + b y + c >= 0 where a pixel is inside an edge whole
+	real_t depth[3];     // 1/w = a x + b y + c, the farthest it gets in a pixel
+	int minx, miny;      // pixels the triangle may cover, inclusive
+	int maxx, maxy;
+} occtriangle_t;
+
+typedef struct occjob_s
+{
+	occlusion_t *occ;
+	occtriangle_t *triangles;
+	int numtriangles;
+	volatile int next;   // row of tiles to rasterise next
+} occjob_t;
+
+typedef struct
+{
+	submesh_t *submesh;
+	real_t size;         // radius over distance
+} occcandidate_t;
+
+static void *occworkers[SUBMESH_MAXTHREADS];
+static int numoccworkers;      // -1 once they couldn't be started
+static void *occstart;         // posted once per worker wanted on occjob
+static void *occdone;          // posted by each worker as it finishes
+static occjob_t *occjob;
+static volatile int occquit;
+
+static const real_t occlanes[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+
+// near, left, right, bottom and top, on x y z w in clip space. Triangles
+// reaching far off the sides are clipped too, as their depth planes would
+// lose too much precision
+static const real_t occclipplanes[OCC_CLIPPLANES][4] = {
+	{ 0, 0, 1, 1 }, { 1, 0, 0, OCC_GUARDBAND }, { -1, 0, 0, OCC_GUARDBAND },
+	{ 0, 1, 0, OCC_GUARDBAND }, { 0, -1, 0, OCC_GUARDBAND }
+};
+
+/*
+==========================
+MDL_ClearOcclusion()
+==========================
+*/
+void MDL_ClearOcclusion(occlusion_t *occ)
+{
+	memset(occ, 0, sizeof(occlusion_t));
+}
+
+/*
+==========================
+MDL_DrawOccluders()
+
+Draws the submeshes of mesh that look large enough into
+occ, the biggest first, as many as fit in the frame's
+triangle budget, and flags them as occluders. clip takes
+the mesh's space to clip space. Submeshes culled already
+are left out, so cull against the frustum first
+==========================
+*/
+void MDL_DrawOccluders(occlusion_t *occ, mesh_t *mesh, mat4x4_t *clip)
+{
+	occcandidate_t *candidates;
+	occjob_t job;
+	submesh_t *submesh;
+	real_t *m, w;
+	int count, numcandidates, numtriangles, i, numthreads;
+
+	m = (real_t *) clip;
+	// submeshes off the list are culled, so their flags are never read
+	count = 0;
+	for(submesh = MDL_FirstShown(mesh, &i); submesh != NULL; submesh = MDL_NextShown(mesh, submesh, &i))
+	{
+		submesh->occluder = false;
+		count++;
+	}
+	if(!count)
+		return;
+
+	candidates = (occcandidate_t *) Z_FrameAlloc(sizeof(occcandidate_t) * count, sizeof(void *));
+	numcandidates = 0;
+	numtriangles = 0;
+	for(submesh = MDL_FirstShown(mesh, &i); submesh != NULL; submesh = MDL_NextShown(mesh, submesh, &i))
+	{
+		if(submesh->culled || submesh->animated || !submesh->bvh || !submesh->bvh->numtriangles)
+			continue;
+		w = m[3] * submesh->centre.x + m[7] * submesh->centre.y + m[11] * submesh->centre.z + m[15];
+		candidates[numcandidates].submesh = submesh;
+		// the camera is in the sphere
+		candidates[numcandidates].size = (w > submesh->radius) ? submesh->radius / w : 1.0f;
+		if(candidates[numcandidates].size >= OCC_MINSIZE)
+			numcandidates++;
+	}
+	if(!numcandidates)
+		return;
+	qsort(candidates, numcandidates, sizeof(occcandidate_t), OccluderCompare);
+
+	for(i = 0; i < numcandidates; i++)
+	{
+		submesh = candidates[i].submesh;
+		if(occ->triangles + numtriangles + submesh->bvh->numtriangles > OCC_MAXTRIANGLES)
+			continue;
+		submesh->occluder = true;
+		numtriangles += submesh->bvh->numtriangles;
+	}
+	if(!numtriangles)
+		return;
+
+	job.triangles = (occtriangle_t *) Z_MallocUninit(sizeof(occtriangle_t) * (OCC_MAXCLIPPED - 2) * numtriangles);
+	job.numtriangles = 0;
+	for(i = 0; i < numcandidates; i++)
+	{
+		submesh = candidates[i].submesh;
+		if(!submesh->occluder)
+			continue;
+		job.numtriangles += SetupOccluder(submesh->bvh, m, job.triangles + job.numtriangles);
+		occ->occluders++;
+	}
+	occ->triangles += job.numtriangles;
+	job.occ = occ;
+	job.next = 0;
+
+	numthreads = 0;
+	if(job.numtriangles >= OCC_THREADTRIANGLES)
+	{
+		if(!numoccworkers)
+			StartOccluderWorkers();
+		if(numoccworkers > 0)
+			numthreads = numoccworkers;
+	}
+	// the semaphores order the job's writes before the workers' reads
+	occjob = &job;
+	if(numthreads)
+		Sys_PostSemaphore(occstart, numthreads);
+	RasteriseOccluders(&job);
+	for(i = 0; i < numthreads; i++)
+		Sys_WaitSemaphore(occdone);
+	occjob = NULL;
+
+	Z_Free(job.triangles);
+}
+
+/*
+==========================
+StartOccluderWorkers()
+
+One worker for each processor but this one, as the main
+thread rasterises too
+==========================
+*/
+void StartOccluderWorkers(void)
+{
+	int count, i;
+
+	count = Sys_NumProcessors();
+	if(count > OCC_TILESY)
+		count = OCC_TILESY;
+	if(count > SUBMESH_MAXTHREADS)
+		count = SUBMESH_MAXTHREADS;
+	count--;
+	numoccworkers = -1;
+	if(count < 1)
+		return;
+
+	occstart = Sys_CreateSemaphore(0);
+	occdone = Sys_CreateSemaphore(0);
+	occquit = 0;
+	for(i = 0; i < count; i++)
+	{
+		if((occworkers[i] = Sys_CreateThread(OccluderWorker, NULL)) == NULL)
+			break;
+	}
+	numoccworkers = i;
+	if(!numoccworkers)
+	{
+		Sys_DestroySemaphore(occstart);
+		Sys_DestroySemaphore(occdone);
+		occstart = occdone = NULL;
+		numoccworkers = -1;
+	}
+}
+
+/*
+==========================
+OccluderWorker()
+
+Sleeps until MDL_DrawOccluders() has a job for it
+==========================
+*/
+void OccluderWorker(void *data)
+{
+	while(1)
+	{
+		Sys_WaitSemaphore(occstart);
+		if(occquit)
+			break;
+		RasteriseOccluders(occjob);
+		Sys_PostSemaphore(occdone, 1);
+	}
+}
+
+/*
+==========================
+MDL_ShutdownOcclusion()
+
+Stops the occlusion workers, if they were started
+==========================
+*/
+void MDL_ShutdownOcclusion(void)
+{
+	int i;
+
+	if(numoccworkers > 0)
+	{
+		occquit = 1;
+		Sys_PostSemaphore(occstart, numoccworkers);
+		for(i = 0; i < numoccworkers; i++)
+			Sys_JoinThread(occworkers[i]);
+		Sys_DestroySemaphore(occstart);
+		Sys_DestroySemaphore(occdone);
+		occstart = occdone = NULL;
+	}
+	numoccworkers = 0;
+}
+
+/*
+==========================
+OccluderCompare()
+
+Biggest first
+==========================
+*/
+int OccluderCompare(const void *a, const void *b)
+{
+	real_t sa, sb;
+
+	sa = ((occcandidate_t *) a)->size;
+	sb = ((occcandidate_t *) b)->size;
+	if(sa > sb)
+		return -1;
+	if(sa < sb)
+		return 1;
+	return 0;
+}
+
+/*
+==========================
+SetupOccluder()
+
+Moves the triangles of a hierarchy into clip space by m,
+clips them and sets them up for rasterising into out.
+Returns how many were set up
+==========================
+*/
+int SetupOccluder(bvh_t *bvh, real_t *m, occtriangle_t *out)
+{
+	vec4_t polygons[2][OCC_MAXCLIPPED], *in, *clipped, *a, *b;
+	real_t *t, x, y, z, da, db, frac;
+	int i, j, k, p, numin, numclipped, numout;
+
+	numout = 0;
+	for(i = 0, t = bvh->triangles; i < bvh->numtriangles; i++, t += 9)
+	{
+		in = polygons[0];
+		for(j = 0; j < 3; j++)
+		{
+			x = t[0] + (j ? t[j * 3] : 0);
+			y = t[1] + (j ? t[j * 3 + 1] : 0);
+			z = t[2] + (j ? t[j * 3 + 2] : 0);
+			in[j].x = m[0] * x + m[4] * y + m[8] * z + m[12];
+			in[j].y = m[1] * x + m[5] * y + m[9] * z + m[13];
+			in[j].z = m[2] * x + m[6] * y + m[10] * z + m[14];
+			in[j].w = m[3] * x + m[7] * y + m[11] * z + m[15];
+		}
+
+		// keep the part inside each plane in turn
+		numin = 3;
+		for(p = 0; p < OCC_CLIPPLANES && numin >= 3; p++)
+		{
+			clipped = polygons[(p + 1) & 1];
+			numclipped = 0;
+			for(j = 0; j < numin; j++)
+			{
+				a = &in[j];
+				b = &in[(j + 1) % numin];
+				da = occclipplanes[p][0] * a->x + occclipplanes[p][1] * a->y +
+					 occclipplanes[p][2] * a->z + occclipplanes[p][3] * a->w;
+				db = occclipplanes[p][0] * b->x + occclipplanes[p][1] * b->y +
+					 occclipplanes[p][2] * b->z + occclipplanes[p][3] * b->w;
+				if(da >= 0)
+					clipped[numclipped++] = *a;
+				if((da >= 0) != (db >= 0))
+				{
+					frac = da / (da - db);
+					clipped[numclipped].x = a->x + frac * (b->x - a->x);
+					clipped[numclipped].y = a->y + frac * (b->y - a->y);
+					clipped[numclipped].z = a->z + frac * (b->z - a->z);
+					clipped[numclipped].w = a->w + frac * (b->w - a->w);
+					numclipped++;
+				}
+			}
+			in = clipped;
+			numin = numclipped;
+		}
+		for(k = 2; k < numin; k++)
+			numout += SetupOccluderTriangle(&in[0], &in[k - 1], &in[k], out + numout);
+	}
+
+	return numout;
+}
+
+/*
+==========================
+SetupOccluderTriangle()
+
+Projects a clipped triangle into the buffer and works out
+its edges and depth plane there. Returns 0 if it covers
+no pixel centres, else 1
+==========================
+*/
+int SetupOccluderTriangle(vec4_t *c0, vec4_t *c1, vec4_t *c2, occtriangle_t *out)
+{
+	vec4_t *corners[3];
+	real_t x[3], y[3], iw[3], area, da, db, minx, miny, maxx, maxy;
+	real_t *e;
+	int i, j;
+
+	corners[0] = c0;
+	corners[1] = c1;
+	corners[2] = c2;
+	for(i = 0; i < 3; i++)
+	{
+		iw[i] = 1.0f / corners[i]->w;
+		x[i] = (corners[i]->x * iw[i] * 0.5f + 0.5f) * OCC_WIDTH;
+		y[i] = (corners[i]->y * iw[i] * 0.5f + 0.5f) * OCC_HEIGHT;
+	}
+	area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+	if(area > -1e-6f && area < 1e-6f)
+		return 0;
+
+	minx = maxx = x[0];
+	miny = maxy = y[0];
+	for(i = 1; i < 3; i++)
+	{
+		if(x[i] < minx) minx = x[i];
+		if(x[i] > maxx) maxx = x[i];
+		if(y[i] < miny) miny = y[i];
+		if(y[i] > maxy) maxy = y[i];
+	}
+	if(maxx < 0 || minx >= OCC_WIDTH || maxy < 0 || miny >= OCC_HEIGHT)
+		return 0;
+	out->minx = (minx > 0) ? (int) minx : 0;
+	out->miny = (miny > 0) ? (int) miny : 0;
+	out->maxx = (maxx < OCC_WIDTH) ? (int) maxx : OCC_WIDTH - 1;
+	out->maxy = (maxy < OCC_HEIGHT) ? (int) maxy : OCC_HEIGHT - 1;
+
+	// both windings are drawn, so the inside is where the third corner is
+	for(i = 0; i < 3; i++)
+	{
+		j = (i + 1) % 3;
+		e = out->edges[i];
+		e[0] = y[i] - y[j];
+		e[1] = x[j] - x[i];
+		e[2] = x[i] * y[j] - x[j] * y[i];
+		if(area < 0)
+		{
+			e[0] = -e[0];
+			e[1] = -e[1];
+			e[2] = -e[2];
+		}
+		// from the pixel's centre to its farthest corner
+		e[2] -= 0.5f * ((real_t) fabs(e[0]) + (real_t) fabs(e[1]));
+	}
+
+	da = iw[1] - iw[0];
+	db = iw[2] - iw[0];
+	out->depth[0] = (da * (y[2] - y[0]) - db * (y[1] - y[0])) / area;
+	out->depth[1] = (db * (x[1] - x[0]) - da * (x[2] - x[0])) / area;
+	out->depth[2] = iw[0] - out->depth[0] * x[0] - out->depth[1] * y[0];
+	out->depth[2] -= 0.5f * ((real_t) fabs(out->depth[0]) + (real_t) fabs(out->depth[1]));
+
+	return 1;
+}
+
+/*
+==========================
+RasteriseOccluders()
+==========================
+*/
+void RasteriseOccluders(void *data)
+{
+	occjob_t *job;
+	int row;
+
+	job = (occjob_t *) data;
+	while((row = Sys_AtomicAdd(&job->next, 1) - 1) < OCC_TILESY)
+		RasteriseTileRow(job, row);
+}
+
+/*
+==========================
+RasteriseTileRow()
+
+Draws the job's triangles into one row of tiles,
+SIMD_WIDTH pixels of a tile's row at a time, then sets the
+tiles' nearest and farthest depths. Rows don't share any
+pixels, so threads can take one each
+==========================
+*/
+void RasteriseTileRow(occjob_t *job, int row)
+{
+	occlusion_t *occ;
+	occtriangle_t *t;
+	real_t *tile, *pixels, fy, c0, c1, c2, cd;
+	real_t lanemin[SIMD_WIDTH], lanemax[SIMD_WIDTH];
+	simd_t zero, lanes, a0, a1, a2, ad, xs, inside, depth, lo, hi;
+	int bottom, top, y0, y1, tx, y, x, i;
+
+	occ = job->occ;
+	zero = SIMD_SET1(0.0f);
+	lanes = SIMD_LOAD(occlanes);
+	bottom = row * OCC_TILE;
+	top = bottom + OCC_TILE - 1;
+	for(i = 0, t = job->triangles; i < job->numtriangles; i++, t++)
+	{
+		if(t->maxy < bottom || t->miny > top)
+			continue;
+		y0 = (t->miny > bottom) ? t->miny : bottom;
+		y1 = (t->maxy < top) ? t->maxy : top;
+		a0 = SIMD_SET1(t->edges[0][0]);
+		a1 = SIMD_SET1(t->edges[1][0]);
+		a2 = SIMD_SET1(t->edges[2][0]);
+		ad = SIMD_SET1(t->depth[0]);
+		for(tx = t->minx / OCC_TILE; tx <= t->maxx / OCC_TILE; tx++)
+		{
+			tile = occ->depth + (row * OCC_TILESX + tx) * OCC_TILEPIXELS;
+			for(y = y0; y <= y1; y++)
+			{
+				fy = y + 0.5f;
+				c0 = t->edges[0][1] * fy + t->edges[0][2];
+				c1 = t->edges[1][1] * fy + t->edges[1][2];
+				c2 = t->edges[2][1] * fy + t->edges[2][2];
+				cd = t->depth[1] * fy + t->depth[2];
+				pixels = tile + (y - bottom) * OCC_TILE;
+				for(x = 0; x < OCC_TILE; x += SIMD_WIDTH)
+				{
+					xs = SIMD_ADD(SIMD_SET1(tx * OCC_TILE + x + 0.5f), lanes);
+					inside = SIMD_MIN(SIMD_ADD(SIMD_MUL(a0, xs), SIMD_SET1(c0)),
+									  SIMD_ADD(SIMD_MUL(a1, xs), SIMD_SET1(c1)));
+					inside = SIMD_MIN(inside, SIMD_ADD(SIMD_MUL(a2, xs), SIMD_SET1(c2)));
+					depth = SIMD_ADD(SIMD_MUL(ad, xs), SIMD_SET1(cd));
+					// outside lanes offer 0, which never beats what's there
+					SIMD_STORE(pixels + x, SIMD_MAX(SIMD_LOAD(pixels + x), SIMD_SELECTGE(inside, zero, depth)));
+				}
+			}
+		}
+	}
+
+	for(tx = 0; tx < OCC_TILESX; tx++)
+	{
+		tile = occ->depth + (row * OCC_TILESX + tx) * OCC_TILEPIXELS;
+		lo = hi = SIMD_LOAD(tile);
+		for(x = SIMD_WIDTH; x < OCC_TILEPIXELS; x += SIMD_WIDTH)
+		{
+			lo = SIMD_MIN(lo, SIMD_LOAD(tile + x));
+			hi = SIMD_MAX(hi, SIMD_LOAD(tile + x));
+		}
+		SIMD_STORE(lanemin, lo);
+		SIMD_STORE(lanemax, hi);
+		for(x = 1; x < SIMD_WIDTH; x++)
+		{
+			if(lanemin[x] < lanemin[0])
+				lanemin[0] = lanemin[x];
+			if(lanemax[x] > lanemax[0])
+				lanemax[0] = lanemax[x];
+		}
+		occ->tilemin[row * OCC_TILESX + tx] = lanemin[0];
+		occ->tilemax[row * OCC_TILESX + tx] = lanemax[0];
+	}
+}
+
+/*
+==========================
+MDL_OccludeSubmeshes()
+
+Tests the submeshes of mesh that aren't culled or drawn as
+occluders against occ, and sets culled on those it hides.
+clip takes the mesh's space to clip space. Returns how
+many were culled
+==========================
+*/
+int MDL_OccludeSubmeshes(occlusion_t *occ, mesh_t *mesh, mat4x4_t *clip)
+{
+	submesh_t *submesh;
+	int culled, i;
+
+	culled = 0;
+	if(!occ->triangles)
+		return 0;
+	for(submesh = MDL_FirstShown(mesh, &i); submesh != NULL; submesh = MDL_NextShown(mesh, submesh, &i))
+	{
+		if(submesh->culled || submesh->occluder)
+			continue;
+		occ->tested++;
+		if(OccludedBox(occ, (real_t *) clip, &submesh->mins, &submesh->maxs))
+		{
+			submesh->culled = true;
+			culled++;
+		}
+	}
+	occ->occluded += culled;
+
+	return culled;
+}
+
+/*
+==========================
+OccludedBox()
+
+Whether a box is behind what is in occ over all of the
+pixels its corners project to. Boxes reaching through the
+near plane are never hidden
+==========================
+*/
+boolean_t OccludedBox(occlusion_t *occ, real_t *m, vec3_t *mins, vec3_t *maxs)
 {
-	char line[STRINGLEN];
-	char cvar[STRINGLEN];
-	char stringvalue[STRINGLEN];
-	real_t floatvalue;
-	int numvalue;
-	int linenr;
-	FILE *fp;
+	real_t x, y, z, w, iw, sx, sy, minx, miny, maxx, maxy, nearest;
+	real_t *tile;
+	int x0, y0, x1, y1, tx, ty, px, py, i;
+
+	nearest = 0;
+	minx = miny = 1e30f;
+	maxx = maxy = -1e30f;
+	for(i = 0; i < 8; i++)
+	{
+		x = (i & 1) ? maxs->x : mins->x;
+		y = (i & 2) ? maxs->y : mins->y;
+		z = (i & 4) ? maxs->z : mins->z;
+		w = m[3] * x + m[7] * y + m[11] * z + m[15];
+		if(m[2] * x + m[6] * y + m[10] * z + m[14] + w <= 0)
+			return false;
+		iw = 1.0f / w;
+		sx = ((m[0] * x + m[4] * y + m[8] * z + m[12]) * iw * 0.5f + 0.5f) * OCC_WIDTH;
+		sy = ((m[1] * x + m[5] * y + m[9] * z + m[13]) * iw * 0.5f + 0.5f) * OCC_HEIGHT;
+		if(sx < minx) minx = sx;
+		if(sx > maxx) maxx = sx;
+		if(sy < miny) miny = sy;
+		if(sy > maxy) maxy = sy;
+		if(iw > nearest)
+			nearest = iw;
+	}
+	// off the buffer is the frustum's business
+	if(maxx < 0 || minx >= OCC_WIDTH || maxy < 0 || miny >= OCC_HEIGHT)
+		return false;
+	x0 = (minx > 0) ? (int) minx : 0;
+	y0 = (miny > 0) ? (int) miny : 0;
+	x1 = (maxx < OCC_WIDTH) ? (int) maxx : OCC_WIDTH - 1;
+	y1 = (maxy < OCC_HEIGHT) ? (int) maxy : OCC_HEIGHT - 1;
 
-	if(FS_FOpenFile(AUTOEXEC_CFG, &fp, "r") < 0)
+	for(ty = y0 / OCC_TILE; ty <= y1 / OCC_TILE; ty++)
+	{
+		for(tx = x0 / OCC_TILE; tx <= x1 / OCC_TILE; tx++)
+		{
+			i = ty * OCC_TILESX + tx;
+			if(occ->tilemin[i] > nearest)
+				continue;
+			if(occ->tilemax[i] <= nearest)
+				return false;
+			tile = occ->depth + i * OCC_TILEPIXELS;
+			for(py = ty * OCC_TILE; py < (ty + 1) * OCC_TILE; py++)
+			{
+				if(py < y0 || py > y1)
+					continue;
+				for(px = tx * OCC_TILE; px < (tx + 1) * OCC_TILE; px++)
+				{
+					if(px < x0 || px > x1)
+						continue;
+					if(tile[(py % OCC_TILE) * OCC_TILE + px % OCC_TILE] <= nearest)
+						return false;
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+/*
+=======================================================
+
+                   Cells and portals
+
+An indoor level may come with a cell graph: its rooms as
+cells, each the union of some boxes, and the convex
+openings between them as portals. In the 3DS file a cell
+is every object named CELL_OBJECT "..." of one name, its
+boxes their bounds, and a portal is an object named
+CELL_PORTALOBJECT "...", outlined by the convex hull of
+its vertices.
+The same can be written in a side file named after the
+model with CELL_FILEEXT on the end, a line each of
+
+  cell <name> <minx> <miny> <minz> <maxx> <maxy> <maxz>
+  portal <x> <y> <z> <x> <y> <z> <x> <y> <z> ..
+
+in the mesh's space. A portal joins the nearest cell on
+each side of it. Submeshes belong to every cell their
+bounds reach into, and those in none, or animated, are
+only ever frustum culled.
+
+Each frame the view is followed from the camera's cell
+through the portals it can see into the cells beyond,
+with the frustum narrowed each time to the planes
+through the camera and the edges of the portal, clipped
+to what was seen through before. A cell's submeshes are
+only looked at if it is reached, and then against the
+frustum it was reached through. The submeshes shown are
+remembered, and only they are culled again the next
+frame. The passes after culling walk the same list with
+MDL_FirstShown() and MDL_NextShown(), so a frame costs
+what is in view rather than the size of the level
+=======================================================
+*/
+
+#define CELL_MAXPLANES   (CELL_MAXPOINTS + 1)  // a portal's edges and the portal itself
+#define CELL_MAXCLIPPED  (CELL_MAXPOINTS + CELL_MAXPLANES)  // clipping adds a point a plane
+#define CELL_MAXDEPTH    32        // portals deep the view is followed..
+#define CELL_MAXVISITS   1024      // ..and cells visited a frame, before leaving it to the frustum
+#define CELL_EPSILON     0.001f    // of a portal's size, how far a cell must reach past it
+
+typedef struct cellvisit_s
+{
+	cellgraph_t *graph;
+	vec3_t viewpos;
+	real_t margin;    // a camera this near a portal is taken to be in the doorway
+	int visits;
+	boolean_t overflow;
+	real_t *bounds;   // scratch for the longest submesh list
+	unsigned char *outside;
+} cellvisit_t;
+
+/*
+==========================
+ReadCellFile()
+
+Adds the cells and portals of the model's side file, if
+it has one, to those read from the model
+==========================
+*/
+void ReadCellFile(mdlload_t *load, char *modelfile)
+{
+	FILE *fp;
+	char cellfile[STRINGLEN], line[STRINGLEN], token[STRINGLEN], name[STRINGLEN], *p;
+	vec3_t points[CELL_MAXPOINTS + 1];
+	mdlcellobject_t *object;
+	float v[6];
+	int numpoints, linenr, n;
+
+	Common_snprintf(cellfile, STRINGLEN, "%s%s", modelfile, CELL_FILEEXT);
+	if(FS_FOpenFile(cellfile, &fp, "r") < 0)
 		return;
-	Sys_Printf("execing %s..\n", AUTOEXEC_CFG);
+
 	linenr = 0;
-	// parse all lines
-	while(fgets(line, 256, fp))
+	while(fgets(line, STRINGLEN, fp))
 	{
-		memset(stringvalue, 0, STRINGLEN);
-		floatvalue = 0.0f;
-		numvalue = 0;
-		// cvar, numerical floating point argument, enclosed in double quotes
-		if(sscanf(line, "%s \"%f\"", cvar, &floatvalue) == 2)
+		linenr++;
+		if(sscanf(line, "%s%n", token, &n) != 1 || token[0] == '#' || !strncmp(token, "//", 2))
+			continue;
+		p = line + n;
+		numpoints = 0;
+		if(!strcmp(token, "cell"))
 		{
-			// Is it a valid cvar?
-			if(Cvar_FindVar(cvar))
+			if(sscanf(p, "%s %f %f %f %f %f %f", name, &v[0], &v[1], &v[2], &v[3], &v[4], &v[5]) == 7)
 			{
-				Cvar_SetValue(cvar, floatvalue);
-				// goto next line
-				linenr++;
-				continue;
+				points[0].x = v[0];
+				points[0].y = v[1];
+				points[0].z = v[2];
+				points[1].x = v[3];
+				points[1].y = v[4];
+				points[1].z = v[5];
+				numpoints = 2;
 			}
 		}
-		// cvar, numerical integer argument, enclosed in double quotes
-		if(sscanf(line, "%s \"%d\"", cvar, &numvalue) == 2)
+		else if(!strcmp(token, "portal"))
 		{
-			// Is it a valid cvar?
-			if(Cvar_FindVar(cvar))
+			Common_snprintf(name, STRINGLEN, "portal line %i", linenr);
+			while(numpoints <= CELL_MAXPOINTS && sscanf(p, "%f %f %f%n", &v[0], &v[1], &v[2], &n) == 3)
 			{
-				// yes, set it
-				Cvar_SetValue(cvar, numvalue);
-				// goto next line
-				linenr++;
-				continue;
+				points[numpoints].x = v[0];
+				points[numpoints].y = v[1];
+				points[numpoints].z = v[2];
+				numpoints++;
+				p += n;
 			}
+			if(numpoints < 3 || numpoints > CELL_MAXPOINTS)
+				numpoints = 0;
 		}
-		// cvar, string argument
-		if(sscanf(line, "%s \"%s\"", cvar, stringvalue) == 2)
+		if(!numpoints)
 		{
-			// Is it a valid cvar?
-			if(Cvar_FindVar(cvar))
-			{
-				/*
-				** The above sscanf seems to take the ending double quote with
-				** it sometimes for some reason.. chop it off
-				*/
-				if(stringvalue[strlen(stringvalue) - 1] == '"')
-					stringvalue[strlen(stringvalue) - 1] = 0;
-				Cvar_Set(cvar, stringvalue);
-				// goto next line
-				linenr++;
+			Sys_Warn("ReadCellFile: %s line %i not understood, ignored\n", cellfile, linenr);
+			continue;
+		}
+
+		object = (mdlcellobject_t *) Z_PoolMalloc(sizeof(*object));
+		object->name = Common_CopyString(name);
+		object->portal = (token[0] == 'p') ? true : false;
+		object->numpoints = numpoints;
+		object->points = (vec3_t *) Z_TagMallocUninit(sizeof(vec3_t) * numpoints, TAG_MESH);
+		memcpy(object->points, points, sizeof(vec3_t) * numpoints);
+		object->next = load->cellobjects;
+		load->cellobjects = object;
+	}
+	FS_FCloseFile(fp);
+}
+
+/*
+==========================
+BuildCells()
+
+Turns the cell and portal outlines read into the mesh's
+cell graph, and puts each submesh in the cell its centre
+is in so merging keeps to one cell. Leaves mesh->cells
+NULL if there are no cells
+==========================
+*/
+void BuildCells(mdlload_t *load, mesh_t *mesh)
+{
+	cellgraph_t *graph;
+	cell_t *cell;
+	cellbox_t *box;
+	mdlcellobject_t *object, *other, *next, *reversed;
+	submesh_t *submesh;
+	vec3_t centre;
+	int numboxes, numportals, i;
+	cvar_t *dev;
+
+	mesh->cells = NULL;
+	// the list is in reverse order
+	reversed = NULL;
+	numboxes = numportals = 0;
+	for(object = load->cellobjects; object; object = next)
+	{
+		next = object->next;
+		object->next = reversed;
+		reversed = object;
+		if(object->portal)
+			numportals++;
+		else
+			numboxes++;
+	}
+	load->cellobjects = reversed;
+
+	if(numboxes)
+	{
+		graph = (cellgraph_t *) Z_TagMalloc(sizeof(cellgraph_t), TAG_MESH);
+		graph->cells = (cell_t *) Z_TagMalloc(sizeof(cell_t) * numboxes, TAG_MESH);
+		graph->boxes = (cellbox_t *) Z_TagMalloc(sizeof(cellbox_t) * numboxes, TAG_MESH);
+		graph->portals = (portal_t *) Z_TagMalloc(sizeof(portal_t) * (numportals + 1), TAG_MESH);
+
+		// the boxes of one cell go together
+		for(object = load->cellobjects; object; object = object->next)
+		{
+			if(object->portal)
+				continue;
+			for(other = load->cellobjects; other != object; other = other->next)
+				if(!other->portal && !strcasecmp(other->name, object->name))
+					break;
+			if(other != object)
 				continue;
+			cell = graph->cells + graph->numcells;
+			cell->name = Common_CopyString(object->name);
+			cell->firstbox = graph->numboxes;
+			for(other = object; other; other = other->next)
+			{
+				if(other->portal || strcasecmp(other->name, object->name))
+					continue;
+				box = graph->boxes + graph->numboxes++;
+				box->mins = box->maxs = other->points[0];
+				for(i = 1; i < other->numpoints; i++)
+				{
+					if(other->points[i].x < box->mins.x) box->mins.x = other->points[i].x;
+					if(other->points[i].y < box->mins.y) box->mins.y = other->points[i].y;
+					if(other->points[i].z < box->mins.z) box->mins.z = other->points[i].z;
+					if(other->points[i].x > box->maxs.x) box->maxs.x = other->points[i].x;
+					if(other->points[i].y > box->maxs.y) box->maxs.y = other->points[i].y;
+					if(other->points[i].z > box->maxs.z) box->maxs.z = other->points[i].z;
+				}
+				box->cell = graph->numcells;
+				cell->numboxes++;
 			}
+			graph->numcells++;
 		}
-		// cvar, numerical floating point argument, not enclosed in double quotes
-		if(sscanf(line, "%s %f", cvar, &floatvalue) == 2)
+
+		for(object = load->cellobjects; object; object = object->next)
+			if(object->portal && BuildPortal(graph, object, graph->portals + graph->numportals))
+				graph->numportals++;
+		LinkCellPortals(graph);
+		mesh->cells = graph;
+
+		for(submesh = mesh->submeshpool; submesh != NULL; submesh = submesh->next)
 		{
-			// Is it a valid cvar?
-			if(Cvar_FindVar(cvar))
+			centre.x = 0.5f * (submesh->mins.x + submesh->maxs.x);
+			centre.y = 0.5f * (submesh->mins.y + submesh->maxs.y);
+			centre.z = 0.5f * (submesh->mins.z + submesh->maxs.z);
+			submesh->cell = CellAt(graph, &centre);
+		}
+
+		dev = Cvar_Get("developer", 0);
+		if(dev && dev->value)
+			Sys_Printf("BuildCells: %i cells of %i boxes, %i portals\n",
+					   graph->numcells, graph->numboxes, graph->numportals);
+	}
+	else if(numportals)
+	{
+		Sys_Warn("BuildCells: %s has portals but no cells, ignored\n", load->filename);
+	}
+
+	for(object = load->cellobjects; object; object = next)
+	{
+		next = object->next;
+		Z_Free(object->name);
+		Z_Free(object->points);
+		Z_PoolFree(object);
+	}
+	load->cellobjects = NULL;
+}
+
+/*
+==========================
+PortalPointCompare()
+==========================
+*/
+int PortalPointCompare(const void *a, const void *b)
+{
+	const vec2_t *pa = (const vec2_t *) a;
+	const vec2_t *pb = (const vec2_t *) b;
+
+	if(pa->x != pb->x)
+		return (pa->x < pb->x) ? -1 : 1;
+	if(pa->y != pb->y)
+		return (pa->y < pb->y) ? -1 : 1;
+	return 0;
+}
+
+/*
+==========================
+BuildPortal()
+
+Flattens an outline onto the plane through its two
+longest spokes and keeps its convex hull, or its bounding
+rectangle on that plane if the hull has too many corners.
+Then finds the cell on each side. Returns false, with a
+warning, if it doesn't make a portal between two cells
+==========================
+*/
+boolean_t BuildPortal(cellgraph_t *graph, mdlcellobject_t *object, portal_t *portal)
+{
+	vec3_t centre, a, b, normal, u, v, d;
+	vec2_t *flat, *hull;
+	real_t len, best, radius, minu, minv, maxu, maxv;
+	int i, k, lower;
+
+	centre.x = centre.y = centre.z = 0;
+	for(i = 0; i < object->numpoints; i++)
+		M_Vec3Add(&centre, &object->points[i], &centre);
+	M_Vec3Divide(&centre, (real_t) object->numpoints, &centre);
+
+	// the farthest corner, then the one making the widest triangle with it
+	best = 0;
+	a.x = a.y = a.z = 0;
+	for(i = 0; i < object->numpoints; i++)
+	{
+		M_Vec3Subtract(&object->points[i], &centre, &d);
+		len = M_Vec3Dot(&d, &d);
+		if(len > best)
+		{
+			best = len;
+			a = d;
+		}
+	}
+	radius = (real_t) sqrt(best);
+	best = 0;
+	normal.x = normal.y = normal.z = 0;
+	for(i = 0; i < object->numpoints; i++)
+	{
+		M_Vec3Subtract(&object->points[i], &centre, &d);
+		M_Vec3Cross(&a, &d, &b);
+		len = M_Vec3Dot(&b, &b);
+		if(len > best)
+		{
+			best = len;
+			normal = b;
+		}
+	}
+	if(radius <= 0 || best <= radius * radius * radius * radius * CELL_EPSILON * CELL_EPSILON)
+	{
+		Sys_Warn("BuildPortal: %s is not a polygon, ignored\n", object->name);
+		return false;
+	}
+	M_Vec3Normalize(&normal, &normal);
+	M_Vec3Normalize(&a, &u);
+	M_Vec3Cross(&normal, &u, &v);
+
+	// Andrew's monotone chain, counterclockwise about the normal
+	flat = (vec2_t *) Z_MallocUninit(sizeof(vec2_t) * 3 * (object->numpoints + 1));
+	hull = flat + object->numpoints;
+	for(i = 0; i < object->numpoints; i++)
+	{
+		M_Vec3Subtract(&object->points[i], &centre, &d);
+		flat[i].x = M_Vec3Dot(&d, &u);
+		flat[i].y = M_Vec3Dot(&d, &v);
+	}
+	qsort(flat, object->numpoints, sizeof(vec2_t), PortalPointCompare);
+	k = 0;
+	for(i = 0; i < object->numpoints; i++)
+	{
+		while(k >= 2 && (hull[k - 1].x - hull[k - 2].x) * (flat[i].y - hull[k - 2].y) -
+			  (hull[k - 1].y - hull[k - 2].y) * (flat[i].x - hull[k - 2].x) <= 0)
+			k--;
+		hull[k++] = flat[i];
+	}
+	lower = k + 1;
+	for(i = object->numpoints - 2; i >= 0; i--)
+	{
+		while(k >= lower && (hull[k - 1].x - hull[k - 2].x) * (flat[i].y - hull[k - 2].y) -
+			  (hull[k - 1].y - hull[k - 2].y) * (flat[i].x - hull[k - 2].x) <= 0)
+			k--;
+		hull[k++] = flat[i];
+	}
+	// the last is the first again
+	k--;
+	if(k > CELL_MAXPOINTS)
+	{
+		// bigger rather than smaller, so nothing seen through it is lost
+		minu = maxu = hull[0].x;
+		minv = maxv = hull[0].y;
+		for(i = 1; i < k; i++)
+		{
+			if(hull[i].x < minu) minu = hull[i].x;
+			if(hull[i].x > maxu) maxu = hull[i].x;
+			if(hull[i].y < minv) minv = hull[i].y;
+			if(hull[i].y > maxv) maxv = hull[i].y;
+		}
+		hull[0].x = minu; hull[0].y = minv;
+		hull[1].x = maxu; hull[1].y = minv;
+		hull[2].x = maxu; hull[2].y = maxv;
+		hull[3].x = minu; hull[3].y = maxv;
+		k = 4;
+	}
+	portal->numpoints = k;
+	for(i = 0; i < k; i++)
+	{
+		portal->points[i].x = centre.x + hull[i].x * u.x + hull[i].y * v.x;
+		portal->points[i].y = centre.y + hull[i].x * u.y + hull[i].y * v.y;
+		portal->points[i].z = centre.z + hull[i].x * u.z + hull[i].y * v.z;
+	}
+	Z_Free(flat);
+
+	portal->plane.x = normal.x;
+	portal->plane.y = normal.y;
+	portal->plane.z = normal.z;
+	portal->plane.w = -M_Vec3Dot(&normal, &centre);
+	portal->cells[1] = PortalCell(graph, &centre, &normal, radius);
+	d.x = -normal.x;
+	d.y = -normal.y;
+	d.z = -normal.z;
+	portal->cells[0] = PortalCell(graph, &centre, &d, radius);
+	portal->visframe = 0;
+	if(portal->cells[0] < 0 || portal->cells[1] < 0 || portal->cells[0] == portal->cells[1])
+	{
+		Sys_Warn("BuildPortal: %s doesn't join two cells, ignored\n", object->name);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+==========================
+PortalCell()
+
+The cell whose box the ray from a portal's centre along
+dir reaches into first, no further than reach. Of boxes
+reached at once the one reaching furthest wins, so where
+two overlap around a doorway each side gets its own
+==========================
+*/
+int PortalCell(cellgraph_t *graph, vec3_t *centre, vec3_t *dir, real_t reach)
+{
+	cellbox_t *box;
+	real_t *o, *d, *mins, *maxs;
+	real_t enter, leave, t0, t1, t, bestenter, bestleave, epsilon;
+	int best, i, k;
+
+	o = (real_t *) centre;
+	d = (real_t *) dir;
+	epsilon = reach * CELL_EPSILON;
+	best = -1;
+	bestenter = reach;
+	bestleave = 0;
+	for(i = 0, box = graph->boxes; i < graph->numboxes; i++, box++)
+	{
+		mins = (real_t *) &box->mins;
+		maxs = (real_t *) &box->maxs;
+		enter = -1e30f;
+		leave = 1e30f;
+		for(k = 0; k < 3; k++)
+		{
+			if(fabs(d[k]) < 1e-6f)
 			{
-				// yes, set it
-				Cvar_SetValue(cvar, floatvalue);
-				// goto next line
-				linenr++;
+				if(o[k] < mins[k] - epsilon || o[k] > maxs[k] + epsilon)
+					break;
 				continue;
 			}
+			t0 = (mins[k] - o[k]) / d[k];
+			t1 = (maxs[k] - o[k]) / d[k];
+			if(t0 > t1)
+			{
+				t = t0;
+				t0 = t1;
+				t1 = t;
+			}
+			if(t0 > enter)
+				enter = t0;
+			if(t1 < leave)
+				leave = t1;
 		}
-		// cvar, numerical integer argument, not enclosed in double quotes
-		if(sscanf(line, "%s %d", cvar, &numvalue) == 2)
+		if(k < 3 || leave <= epsilon || enter > leave)
+			continue;
+		if(enter < 0)
+			enter = 0;
+		if(enter > bestenter || (enter == bestenter && leave <= bestleave))
+			continue;
+		best = box->cell;
+		bestenter = enter;
+		bestleave = leave;
+	}
+
+	return best;
+}
+
+/*
+==========================
+CellAt()
+
+The cell of the first box point is in, or -1
+==========================
+*/
+int CellAt(cellgraph_t *graph, vec3_t *point)
+{
+	cellbox_t *box;
+	int i;
+
+	for(i = 0, box = graph->boxes; i < graph->numboxes; i++, box++)
+	{
+		if(point->x >= box->mins.x && point->y >= box->mins.y && point->z >= box->mins.z &&
+		   point->x <= box->maxs.x && point->y <= box->maxs.y && point->z <= box->maxs.z)
+			return box->cell;
+	}
+	return -1;
+}
+
+/*
+==========================
+LinkCellPortals()
+
+Lists each cell's portals, in a run per cell
+==========================
+*/
+void LinkCellPortals(cellgraph_t *graph)
+{
+	cell_t *cell;
+	portal_t *portal;
+	int i, j, n;
+
+	for(i = 0, cell = graph->cells; i < graph->numcells; i++, cell++)
+		cell->numportals = 0;
+	for(i = 0, portal = graph->portals; i < graph->numportals; i++, portal++)
+		for(j = 0; j < 2; j++)
+			graph->cells[portal->cells[j]].numportals++;
+	n = 0;
+	for(i = 0, cell = graph->cells; i < graph->numcells; i++, cell++)
+	{
+		cell->firstportal = n;
+		n += cell->numportals;
+		cell->numportals = 0;
+	}
+	graph->cellportals = (int *) Z_TagMallocUninit(sizeof(int) * (n + 1), TAG_MESH);
+	for(i = 0, portal = graph->portals; i < graph->numportals; i++, portal++)
+	{
+		for(j = 0; j < 2; j++)
 		{
-			// Is it a valid cvar?
-			if(Cvar_FindVar(cvar))
+			cell = graph->cells + portal->cells[j];
+			graph->cellportals[cell->firstportal + cell->numportals++] = i;
+		}
+	}
+}
+
+/*
+==========================
+LinkCells()
+
+Puts the submeshes of a finished mesh in the cells their
+bounds reach into. Animated ones move, so they are left
+out with those in no cell
+==========================
+*/
+void LinkCells(mesh_t *mesh)
+{
+	cellgraph_t *graph;
+	cell_t *cell;
+	cellbox_t *box;
+	submesh_t *submesh;
+	int pass, last, i;
+	boolean_t inside;
+
+	graph = mesh->cells;
+	if(!graph)
+		return;
+
+	// count, then fill
+	for(pass = 0; pass < 2; pass++)
+	{
+		for(i = 0, cell = graph->cells; i < graph->numcells; i++, cell++)
+		{
+			if(pass)
+				cell->submeshes = (submesh_t **) Z_TagMallocUninit(sizeof(submesh_t *) * (cell->numsubmeshes + 1), TAG_MESH);
+			cell->numsubmeshes = 0;
+		}
+		if(pass)
+			graph->outside = (submesh_t **) Z_TagMallocUninit(sizeof(submesh_t *) * (graph->numoutside + 1), TAG_MESH);
+		graph->numoutside = 0;
+		graph->numsubmeshes = 0;
+
+		for(submesh = mesh->submeshpool; submesh != NULL; submesh = submesh->next)
+		{
+			graph->numsubmeshes++;
+			inside = false;
+			last = -1;
+			for(i = 0, box = graph->boxes; i < graph->numboxes && !submesh->animated; i++, box++)
 			{
-				// yes, set it
-				Cvar_SetValue(cvar, numvalue);
-				// goto next line
-				linenr++;
-				continue;
+				// a cell's boxes are together
+				if(box->cell == last)
+					continue;
+				if(submesh->maxs.x < box->mins.x || submesh->maxs.y < box->mins.y || submesh->maxs.z < box->mins.z ||
+				   submesh->mins.x > box->maxs.x || submesh->mins.y > box->maxs.y || submesh->mins.z > box->maxs.z)
+					continue;
+				cell = graph->cells + box->cell;
+				if(pass)
+					cell->submeshes[cell->numsubmeshes] = submesh;
+				cell->numsubmeshes++;
+				last = box->cell;
+				inside = true;
 			}
+			if(inside)
+				continue;
+			if(pass)
+				graph->outside[graph->numoutside] = submesh;
+			graph->numoutside++;
 		}
-		// eat comments
-		if(strstr(line, "//"))
-			continue;
-		/*
-		** If we get here we have an unrecognized line
-		*/
-		// FIXME: should we Sys_Printf here?
-		// nolog/logfile/nostdout maybe not yet initialized
-		//Sys_Printf("unrecognized variable and/or variable value at line %d\n", linenr);
-		linenr++;
 	}
+
+	graph->maxsubmeshes = graph->numoutside;
+	for(i = 0, cell = graph->cells; i < graph->numcells; i++, cell++)
+		if(cell->numsubmeshes > graph->maxsubmeshes)
+			graph->maxsubmeshes = cell->numsubmeshes;
+	graph->shown = (submesh_t **) Z_TagMallocUninit(sizeof(submesh_t *) * (graph->numsubmeshes + 1), TAG_MESH);
+	graph->numshown = 0;
+	graph->restculled = false;
 }
 
 /*
 ==========================
-Cvar_Init()
+MDL_FreeCells()
 ==========================
 */
-void Cvar_Init(void)
+void MDL_FreeCells(cellgraph_t *graph)
 {
-	// init default settings
-	Cvar_Get("developer", "0");
-	Cvar_Get("scr_height", "480");
-	Cvar_Get("scr_width", "640");
-	Cvar_Get("scr_fullscreen", "0");
-	Cvar_Get("scr_xpos", "100");
-	Cvar_Get("scr_ypos", "100");
-	Cvar_Get("r_nearclip", "0.1");
-	Cvar_Get("r_farclip", "4000");
-	Cvar_Get("r_texanisotropy", "0.0");
-	Cvar_Get("writecfg", "1");
-	Cvar_Get("in_mouse", "1");
-	Cvar_Get("in_dgamouse", "1");
-	Cvar_Get("sensitivity", "0.5");
-	Cvar_Get("m_filter", "0");
-	Cvar_Get("m_yaw", "0.022");
-	Cvar_Get("m_pitch", "0.022");
+	int i;
+
+	if(!graph)
+		return;
+	for(i = 0; i < graph->numcells; i++)
+	{
+		Z_Free(graph->cells[i].name);
+		if(graph->cells[i].submeshes)
+			Z_Free(graph->cells[i].submeshes);
+	}
+	Z_Free(graph->cells);
+	Z_Free(graph->boxes);
+	Z_Free(graph->portals);
+	Z_Free(graph->cellportals);
+	if(graph->outside)
+		Z_Free(graph->outside);
+	if(graph->shown)
+		Z_Free(graph->shown);
+	Z_Free(graph);
 }
 
 /*
 ==========================
-Cvar_Cleanup()
-
-Writes new autoexec.cfg with current
-cvar values and then deletes all cvars
-in memory
+MDL_CullCells()
+
+Sets culled on the submeshes of mesh that can't be seen
+through the portals from viewpos, both in the mesh's
+space, with the frustum planes, and clears it on the
+others. A camera closer than margin to a portal's plane
+sees through it unclipped, as the near plane may be past
+it. Returns how many were culled, or -1 if the mesh has
+no cells, the camera is in none or the view goes too
+deep, for the caller to fall back to MDL_CullSubmeshes().
+Only the submeshes shown last time are culled again, so
+anything else that clears culled has to clear restculled
+too. Main thread only
 ==========================
 */
-void Cvar_Cleanup(void)
+int MDL_CullCells(mesh_t *mesh, vec3_t *viewpos, vec4_t *planes, int numplanes, real_t margin)
 {
-	cvar_t *writecfg;
-	FILE *fp;
-	cvar_t *var, *var2;
-	char *cur_var;
-	int i;
-	boolean_t skip;
-	// variables that we don't want to write
-	const char *vars_to_skip[] = {
-		"nolog",
-		"nostdout",
-		NULL
-	};
-	
-	writecfg = Cvar_Get("writecfg", 0);
-	if(writecfg && writecfg->value)
+	cellgraph_t *graph;
+	cellvisit_t visit;
+	cellbox_t *box;
+	submesh_t *submesh;
+	int i, last;
+
+	graph = mesh->cells;
+	if(!graph)
+		return -1;
+	graph->visframe++;
+	graph->reached = graph->entered = 0;
+	if(CellAt(graph, viewpos) < 0)
 	{
-		FS_FOpenFile(AUTOEXEC_CFG, &fp, "w");
-		fprintf(fp, "// generated by %s on %s\n", appname, Sys_GetTimeString());
-		for(var = cvar_vars; var; var = var->next)
+		graph->restculled = false;
+		return -1;
+	}
+
+	if(graph->restculled)
+	{
+		for(i = 0; i < graph->numshown; i++)
+			graph->shown[i]->culled = true;
+	}
+	else
+	{
+		for(submesh = mesh->submeshpool; submesh != NULL; submesh = submesh->next)
+			submesh->culled = true;
+	}
+	graph->numshown = 0;
+
+	visit.graph = graph;
+	visit.viewpos = *viewpos;
+	visit.margin = margin;
+	visit.visits = 0;
+	visit.overflow = false;
+	visit.bounds = (real_t *) Z_FrameAlloc(sizeof(real_t) * CULL_ARRAYS * SIMD_PAD(graph->maxsubmeshes), 32);
+	visit.outside = (unsigned char *) Z_FrameAlloc(graph->maxsubmeshes + 1, 1);
+	UncullSubmeshes(&visit, graph->outside, graph->numoutside, planes, numplanes);
+	// the camera may be where the boxes of several cells overlap
+	last = -1;
+	for(i = 0, box = graph->boxes; i < graph->numboxes && !visit.overflow; i++, box++)
+	{
+		if(box->cell == last)
+			continue;
+		if(viewpos->x >= box->mins.x && viewpos->y >= box->mins.y && viewpos->z >= box->mins.z &&
+		   viewpos->x <= box->maxs.x && viewpos->y <= box->maxs.y && viewpos->z <= box->maxs.z)
 		{
-			skip = false;
-			i = 0;
-			// see if we should skip this
-			while((cur_var = (char *) vars_to_skip[i]) != NULL)
-			{
-				if(!strcmp(cur_var, var->name))
-				{
-					skip = true;
-					break;
-				}
-				i++;
-			}
-			if(skip)
-				continue;
-			fprintf(fp, "%s \"%s\"\n", var->name, var->string);
+			VisitCell(&visit, box->cell, planes, numplanes, -1, 0);
+			last = box->cell;
 		}
-		FS_FCloseFile(fp);
 	}
-
-	// free cvars
-	var = cvar_vars;
-	while(var != NULL)
+	if(visit.overflow)
 	{
-		var2 = var->next;
-		if(var->name)
-			Z_Free(var->name);
-		if(var->string)
-			Z_Free(var->string);
-		Z_Free(var);
-		var->next = NULL;
-		var = var2;
+		graph->restculled = false;
+		return -1;
 	}
-	// windows seems to think !nolog is false if we don't
-	// explicitly null these
-	nolog = NULL;
-	nostdout = NULL;
+	graph->restculled = true;
+
+	return graph->numsubmeshes - graph->numshown;
 }
 
 /*
 ==========================
-IMG_LoadTGA()
+MDL_FirstShown()
+
+Starts a walk over the submeshes of mesh that the last
+culling may have left unculled: the list the last
+MDL_CullCells() showed if it went through, every
+submesh otherwise. Those on it can still be culled, by
+occlusion say, so passes check culled as before:
+
+  for(submesh = MDL_FirstShown(mesh, &i); submesh; submesh = MDL_NextShown(mesh, submesh, &i))
 ==========================
 */
-#define  TGA_RGB      2   // uncompressed RGB
-#define  TGA_RLERGB   10  // run-lenght encoded RGB
-
-typedef struct {
-	unsigned char imageIDLength;
-	unsigned char colorMapType;
-	unsigned char imageTypeCode;
-	signed char colorMapOrigin;
-	signed short colorMapLength;
-	signed short colorMapEntrySize;
-	signed short imageXOrigin;
-	signed short imageYOrigin;
-	signed short imageWidth;
-	signed short imageHeight;
-	unsigned char bitCount;
-	unsigned char imageDescriptor;
-} tgaheader_t;
+submesh_t *MDL_FirstShown(mesh_t *mesh, int *i)
+{
+	*i = -1;
+	return MDL_NextShown(mesh, NULL, i);
+}
 
-boolean_t IMG_LoadTGA(image_t *newimage, char *imagefile)
+/*
+==========================
+MDL_NextShown()
+==========================
+*/
+submesh_t *MDL_NextShown(mesh_t *mesh, submesh_t *submesh, int *i)
 {
-	tgaheader_t tgaheader;
-	FILE *imgfd;
-	int channels;
-	int tgasize;
-	int i;
-	unsigned char *tempbuf;
-	unsigned char colorswap;
-	unsigned char *tgadata;
-	unsigned short pixels;
-	unsigned char r, g, b;
-	unsigned char rleid;
-	int colorsread;
-	unsigned char *pcolors;
+	cellgraph_t *graph;
 
-	tgadata = NULL;
-	channels = 0;
-	tgasize = 0;
-	i = 0;
+	graph = mesh->cells;
+	if(graph && graph->restculled)
+		return (++*i < graph->numshown) ? graph->shown[*i] : NULL;
+	return submesh ? submesh->next : mesh->submeshpool;
+}
 
-	if(FS_FOpenFile(imagefile, &imgfd, "rb") < 0)
+/*
+==========================
+UncullSubmeshes()
+
+Clears culled on those of count submeshes inside the
+planes, adding them to the graph's shown list
+==========================
+*/
+void UncullSubmeshes(cellvisit_t *visit, submesh_t **submeshes, int count, vec4_t *planes, int numplanes)
+{
+	submesh_t *submesh;
+	real_t *bounds;
+	unsigned char *outside;
+	int pad, i;
+
+	if(!count)
+		return;
+	pad = SIMD_PAD(count);
+	bounds = visit->bounds;
+	outside = visit->outside;
+	for(i = 0; i < count; i++)
 	{
-		Sys_Warn("IMG_LoadTGA: unable to open %s: %s\n", imagefile, strerror(errno));
-		return false;
+		submesh = submeshes[i];
+		bounds[i] = submesh->centre.x;
+		bounds[pad + i] = submesh->centre.y;
+		bounds[2 * pad + i] = submesh->centre.z;
+		bounds[3 * pad + i] = submesh->radius;
+		bounds[4 * pad + i] = 0.5f * (submesh->maxs.x - submesh->mins.x);
+		bounds[5 * pad + i] = 0.5f * (submesh->maxs.y - submesh->mins.y);
+		bounds[6 * pad + i] = 0.5f * (submesh->maxs.z - submesh->mins.z);
+	}
+	CullBounds(bounds, count, planes, numplanes, outside);
+	for(i = 0; i < count; i++)
+	{
+		// a submesh in several cells is only shown once
+		if(!outside[i] && submeshes[i]->culled)
+		{
+			submeshes[i]->culled = false;
+			visit->graph->shown[visit->graph->numshown++] = submeshes[i];
+		}
 	}
+}
 
-	// fill in the tga header
-	tempbuf = (unsigned char *) Z_Malloc(18 * sizeof(unsigned char));
-	fread(tempbuf, 18, 1, imgfd);
-	memcpy(&tgaheader.imageIDLength, tempbuf, sizeof(tgaheader.imageIDLength));
-	memcpy(&tgaheader.colorMapType, tempbuf + 1, sizeof(tgaheader.colorMapType));
-	memcpy(&tgaheader.imageTypeCode, tempbuf + 2, sizeof(tgaheader.imageTypeCode));
-	memcpy(&tgaheader.colorMapOrigin, tempbuf + 3, sizeof(tgaheader.colorMapOrigin));
-	memcpy(&tgaheader.colorMapLength, tempbuf + 5, sizeof(tgaheader.colorMapLength));
-	memcpy(&tgaheader.colorMapEntrySize, tempbuf + 7, sizeof(tgaheader.colorMapEntrySize));
-	memcpy(&tgaheader.imageXOrigin, tempbuf + 9, sizeof(tgaheader.imageXOrigin));
-	memcpy(&tgaheader.imageYOrigin, tempbuf + 11, sizeof(tgaheader.imageYOrigin));
-	memcpy(&tgaheader.imageWidth, tempbuf + 12, sizeof(tgaheader.imageWidth));
-	memcpy(&tgaheader.imageHeight, tempbuf + 14, sizeof(tgaheader.imageHeight));
-	memcpy(&tgaheader.bitCount, tempbuf + 16, sizeof(tgaheader.bitCount));
-	memcpy(&tgaheader.imageDescriptor, tempbuf + 17, sizeof(tgaheader.imageDescriptor));
-	Z_Free(tempbuf);
+/*
+==========================
+VisitCell()
 
-	// see if this is a supported TGA file
-	if((tgaheader.imageTypeCode != TGA_RGB) &&
-	   (tgaheader.imageTypeCode != TGA_RLERGB))
+Shows the submeshes of a cell inside the planes it is
+seen through, and follows every portal of it but the one
+it was entered by that faces the camera and shows through
+the planes
+==========================
+*/
+void VisitCell(cellvisit_t *visit, int cellnum, vec4_t *planes, int numplanes, int from, int depth)
+{
+	cellgraph_t *graph;
+	cell_t *cell;
+	portal_t *portal;
+	vec3_t clipped[CELL_MAXCLIPPED];
+	vec4_t narrowed[CELL_MAXPLANES];
+	real_t dist;
+	int numclipped, numnarrowed, i, p, side;
+
+	if(++visit->visits > CELL_MAXVISITS || depth > CELL_MAXDEPTH)
 	{
-		Sys_Warn("IMG_LoadTGA: %s doesn't look like a TGA image, skipping\n", imagefile);
-		FS_FCloseFile(imgfd);
-		return false;
+		visit->overflow = true;
+		return;
 	}
+	graph = visit->graph;
+	cell = graph->cells + cellnum;
+	if(cell->visframe != graph->visframe)
+	{
+		cell->visframe = graph->visframe;
+		graph->reached++;
+	}
+	UncullSubmeshes(visit, cell->submeshes, cell->numsubmeshes, planes, numplanes);
 
-	// Check if the image is RLE compressed or not
-	if(tgaheader.imageTypeCode != TGA_RLERGB)
+	for(i = 0; i < cell->numportals && !visit->overflow; i++)
 	{
-		// Check if the image is a 24 or 32-bit image
-		if(tgaheader.bitCount == 24 || tgaheader.bitCount == 32)
+		p = graph->cellportals[cell->firstportal + i];
+		if(p == from)
+			continue;
+		portal = graph->portals + p;
+		side = (portal->cells[0] == cellnum) ? 0 : 1;
+		dist = portal->plane.x * visit->viewpos.x + portal->plane.y * visit->viewpos.y +
+			portal->plane.z * visit->viewpos.z + portal->plane.w;
+		// looking through from the other cell's side
+		if(side ? (dist < -visit->margin) : (dist > visit->margin))
+			continue;
+
+		if(fabs(dist) <= visit->margin)
 		{
-			channels = tgaheader.bitCount / 8;
-			tgasize = tgaheader.imageWidth * tgaheader.imageHeight * channels;
-			tgadata = (unsigned char *) Z_Malloc(tgasize * sizeof(unsigned char));
+			numclipped = 0;
+			numnarrowed = 0;
+		}
+		else
+		{
+			numclipped = ClipPortal(portal, planes, numplanes, clipped);
+			if(numclipped < 3)
+				continue;
+			numnarrowed = (numclipped <= CELL_MAXPOINTS) ?
+				NarrowFrustum(&visit->viewpos, clipped, numclipped, &portal->plane, side, narrowed) : 0;
+		}
+		if(portal->visframe != graph->visframe)
+		{
+			portal->visframe = graph->visframe;
+			graph->entered++;
+		}
+		// what can't be narrowed is seen through as it was
+		if(numnarrowed)
+			VisitCell(visit, portal->cells[side ^ 1], narrowed, numnarrowed, p, depth + 1);
+		else
+			VisitCell(visit, portal->cells[side ^ 1], planes, numplanes, p, depth + 1);
+	}
+}
 
-			// Read in the TGA image data
-			fread(tgadata, sizeof(unsigned char), tgasize, imgfd);
+/*
+==========================
+ClipPortal()
 
-			// Change BGR to RGB
-			for(i = 0; i < tgasize; i += channels)
+Clips a portal's outline to the planes, Sutherland-Hodgman
+style, into out. Returns how many corners are left, or
+CELL_MAXCLIPPED if rounding made more than out can hold
+==========================
+*/
+int ClipPortal(portal_t *portal, vec4_t *planes, int numplanes, vec3_t *out)
+{
+	vec3_t buffer[2][CELL_MAXCLIPPED], *in, *to, *a, *b;
+	real_t da, db, t;
+	int numin, numto, i, j;
+
+	in = portal->points;
+	numin = portal->numpoints;
+	for(i = 0; i < numplanes && numin >= 3; i++)
+	{
+		to = (i == numplanes - 1) ? out : buffer[i & 1];
+		numto = 0;
+		for(j = 0; j < numin; j++)
+		{
+			a = in + j;
+			b = in + (j + 1) % numin;
+			da = planes[i].x * a->x + planes[i].y * a->y + planes[i].z * a->z + planes[i].w;
+			db = planes[i].x * b->x + planes[i].y * b->y + planes[i].z * b->z + planes[i].w;
+			if(numto >= CELL_MAXCLIPPED - 1)
+				return CELL_MAXCLIPPED;
+			if(da >= 0)
+				to[numto++] = *a;
+			if((da >= 0) != (db >= 0))
 			{
-				colorswap = tgadata[i];
-				tgadata[i] = tgadata[i + 2];
-				tgadata[i + 2] = colorswap;
+				t = da / (da - db);
+				to[numto].x = a->x + t * (b->x - a->x);
+				to[numto].y = a->y + t * (b->y - a->y);
+				to[numto].z = a->z + t * (b->z - a->z);
+				numto++;
 			}
 		}
-		// Check if the image is a 16 bit image (RGB stored in 1 unsigned short)
-		else if(tgaheader.bitCount == 16)
-		{
-			pixels = 0;
-			r = g = b = 0;
+		in = to;
+		numin = numto;
+	}
+	if(numin < 3)
+		return 0;
+	if(in != out)
+		memcpy(out, in, sizeof(vec3_t) * numin);
 
-			// Since we convert 16-bit images to 24 bit, we hardcode the channels to 3.
-			channels = 3;
-			tgasize = tgaheader.imageWidth * tgaheader.imageHeight * channels;
-			tgadata = (unsigned char *) Z_Malloc(tgasize * sizeof(unsigned char));
+	return numin;
+}
 
-			// Load in all the pixel data pixel by pixel
-			for(i = 0; i < tgaheader.imageWidth * tgaheader.imageHeight; i++)
-			{
-				// Read in the current pixel
-				fread(&pixels, sizeof(unsigned short), 1, imgfd);
+/*
+==========================
+NarrowFrustum()
 
-				// To convert a 16-bit pixel into an R, G, B, we need to
-				// do some masking and such to isolate each color value.
-				// 0x1f = 11111 in binary, so since 5 bits are reserved in
-				// each unsigned short for the R, G and B, we bit shift and mask
-				// to find each value.  We then bit shift up by 3 to get the full color.
-				b = (pixels & 0x1f) << 3;
-				g = ((pixels >> 5) & 0x1f) << 3;
-				r = ((pixels >> 10) & 0x1f) << 3;
+The planes through viewpos and each edge of a portal's
+clipped outline, facing in, and the portal's own plane
+facing away from the side seen from, into out. Returns
+how many, or 0 if the outline is too thin to make any
+==========================
+*/
+int NarrowFrustum(vec3_t *viewpos, vec3_t *points, int numpoints, vec4_t *plane, int side, vec4_t *out)
+{
+	vec3_t centre, a, b, normal;
+	real_t len;
+	int i, n;
 
-				// This essentially assigns the color to our array and swaps the
-				// B and R values at the same time.
-				tgadata[i * 3 + 0] = r;
-				tgadata[i * 3 + 1] = g;
-				tgadata[i * 3 + 2] = b;
-			}
-		}
-		else
+	centre.x = centre.y = centre.z = 0;
+	for(i = 0; i < numpoints; i++)
+		M_Vec3Add(&centre, &points[i], &centre);
+	M_Vec3Divide(&centre, (real_t) numpoints, &centre);
+
+	n = 0;
+	for(i = 0; i < numpoints; i++)
+	{
+		M_Vec3Subtract(&points[i], viewpos, &a);
+		M_Vec3Subtract(&points[(i + 1) % numpoints], viewpos, &b);
+		M_Vec3Cross(&a, &b, &normal);
+		len = M_Vec3Magnitude(&normal);
+		if(len <= 1e-12f)
+			continue;
+		M_Vec3Divide(&normal, len, &normal);
+		out[n].x = normal.x;
+		out[n].y = normal.y;
+		out[n].z = normal.z;
+		out[n].w = -M_Vec3Dot(&normal, viewpos);
+		if(M_Vec3Dot(&normal, &centre) + out[n].w < 0)
 		{
-			Sys_Warn("IMG_LoadTGA: %s has unsupported pixel format, not loading\n");
-			return false;
+			out[n].x = -out[n].x;
+			out[n].y = -out[n].y;
+			out[n].z = -out[n].z;
+			out[n].w = -out[n].w;
 		}
+		n++;
 	}
-	// Else, it must be Run-Length Encoded (RLE)
-	else
+	if(n < 3)
+		return 0;
+	out[n] = *plane;
+	if(side)
 	{
-		rleid = 0;
-		i = 0;
-		colorsread = 0;
-		channels = tgaheader.bitCount / 8;
-		tgasize = tgaheader.imageWidth * tgaheader.imageHeight * channels;
+		out[n].x = -out[n].x;
+		out[n].y = -out[n].y;
+		out[n].z = -out[n].z;
+		out[n].w = -out[n].w;
+	}
 
-		tgadata = (unsigned char *) Z_Malloc(tgasize * sizeof(unsigned char));
-		pcolors = (unsigned char *) Z_Malloc(channels * sizeof(unsigned char));
+	return n + 1;
+}
 
-		// Load in all the pixel data
-		while(i < tgaheader.imageWidth * tgaheader.imageHeight) {
-			// Read in the current color count + 1
-			fread(&rleid, sizeof(unsigned char), 1, imgfd);
+/*
+=======================================================
 
-			// Check if we don't have an encoded string of colors
-			if(rleid < 128)
-			{
-				// Increase the count by 1
-				rleid++;
+                  Keyframe animation
 
-				// Go through and read all the unique colors found
-				while(rleid)
-				{
-					// Read in the current color
-					fread(pcolors, sizeof(unsigned char) * channels, 1, imgfd);
+Objects with a keyframer track of more than one key are
+moved by their node each frame. Nodes are kept if they
+move or have a child that does, sorted so each depth of
+the hierarchy is a contiguous run. All keys live in two
+arrays, and every node's track values are evaluated into
+SoA curves, so the node transforms of one depth are built
+SIMD_WIDTH nodes at a time
+=======================================================
+*/
 
-					// Store the current pixel in our image array
-					tgadata[colorsread + 0] = pcolors[2];
-					tgadata[colorsread + 1] = pcolors[1];
-					tgadata[colorsread + 2] = pcolors[0];
+#define ANIM_MOVING     0x01  // has a track with more than one key
+#define ANIM_INHERITS   0x02  // is under a node that moves
+#define ANIM_KEPT       0x04  // moves or has something under it that does
 
-					// If we have a 4 channel 32-bit image, assign one more for the alpha
-					if(tgaheader.bitCount == 32)
-						tgadata[colorsread + 3] = pcolors[3];
+// curves holds, per track, the components of the keys on
+// each side of the frame and how far between them it is
+#define ANIM_CURVES     23
+static const int animcurvebase[ANIM_NUMTRACKS] = { 0, 7, 16 };
+static const int animcomponents[ANIM_NUMTRACKS] = { 3, 4, 3 };
+static const vec4_t animidentity[ANIM_NUMTRACKS] = { { 0, 0, 0, 1 }, { 0, 0, 0, 1 }, { 1, 1, 1, 1 } };
+static const real_t animidentitymatrix[12] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0 };
 
-					// Increase the current pixels read, decrease the amount
-					// of pixels left, and increase the starting index for the next pixel.
-					i++;
-					rleid--;
-					colorsread += channels;
-				}
+/*
+==========================
+BuildAnimation()
+
+Turns the nodes read from the keyframer into the mesh's
+animation, and points each moving object's submesh at
+its node. Leaves mesh->anim NULL if nothing moves
+==========================
+*/
+void BuildAnimation(mdlload_t *load, mesh_t *mesh)
+{
+	mdlnode_t **nodes, *node;
+	mdlmeshmatrix_t *meshmatrix;
+	animation_t *anim;
+	animnode_t *anode;
+	animtrack_t *track;
+	mdltrack_t *src;
+	submesh_t *submesh;
+	int *ids, *parents, *depths, *flags, *remap;
+	int numnodes, numkept, numkeys, maxid, i, j, k;
+
+	mesh->anim = NULL;
+	numnodes = 0;
+	maxid = 0;
+	for(node = load->nodes; node; node = node->next, numnodes++)
+		if(node->id > maxid)
+			maxid = node->id;
+	if(!numnodes)
+	{
+		FreeParseNodes(load);
+		return;
+	}
+
+	// the list is in reverse file order
+	nodes = (mdlnode_t **) Z_MallocUninit(sizeof(mdlnode_t *) * numnodes);
+	for(i = numnodes, node = load->nodes; node; node = node->next)
+		nodes[--i] = node;
+	ids = (int *) Z_MallocUninit(sizeof(int) * (maxid + 1));
+	for(i = 0; i <= maxid; i++)
+		ids[i] = -1;
+	for(i = 0; i < numnodes; i++)
+		if(ids[nodes[i]->id] < 0)
+			ids[nodes[i]->id] = i;
+
+	parents = (int *) Z_MallocUninit(sizeof(int) * numnodes);
+	depths = (int *) Z_MallocUninit(sizeof(int) * (numnodes + 1));
+	flags = (int *) Z_MallocUninit(sizeof(int) * numnodes);
+	remap = (int *) Z_MallocUninit(sizeof(int) * (numnodes + 1));
+	for(i = 0; i < numnodes; i++)
+	{
+		j = nodes[i]->parentid;
+		parents[i] = (j >= 0 && j <= maxid && ids[j] != i) ? ids[j] : -1;
+		flags[i] = 0;
+		for(k = 0; k < ANIM_NUMTRACKS; k++)
+			if(nodes[i]->tracks[k].numkeys > 1)
+				flags[i] = ANIM_MOVING;
+	}
+	// a node that can't reach the root is made one
+	for(i = 0; i < numnodes; i++)
+	{
+		depths[i] = 0;
+		for(j = parents[i]; j >= 0; j = parents[j])
+		{
+			if(++depths[i] > numnodes)
+			{
+				parents[i] = -1;
+				depths[i] = 0;
+				flags[i] &= ~ANIM_INHERITS;
+				break;
 			}
-			// Else, let's read in a string of the same character
+			if(flags[j] & ANIM_MOVING)
+				flags[i] |= ANIM_INHERITS;
+		}
+	}
+	numkept = 0;
+	for(i = 0; i < numnodes; i++)
+		if(flags[i] & (ANIM_MOVING | ANIM_INHERITS))
+			for(j = i; j >= 0 && !(flags[j] & ANIM_KEPT); j = parents[j], numkept++)
+				flags[j] |= ANIM_KEPT;
+
+	if(numkept)
+	{
+		anim = (animation_t *) Z_TagMalloc(sizeof(animation_t), TAG_MESH);
+		anim->numnodes = numkept;
+		anim->padnodes = SIMD_PAD(numkept) + SIMD_WIDTH;
+		anim->nodes = (animnode_t *) Z_TagMalloc(sizeof(animnode_t) * numkept, TAG_MESH);
+
+		// counting sort by depth, remap[] counts each depth first
+		for(i = 0; i <= numnodes; i++)
+			remap[i] = 0;
+		anim->numlevels = 0;
+		for(i = 0; i < numnodes; i++)
+		{
+			if(!(flags[i] & ANIM_KEPT))
+				continue;
+			remap[depths[i] + 1]++;
+			if(depths[i] + 1 > anim->numlevels)
+				anim->numlevels = depths[i] + 1;
+		}
+		anim->levels = (int *) Z_TagMallocUninit(sizeof(int) * (anim->numlevels + 1), TAG_MESH);
+		for(i = 0; i < anim->numlevels; i++)
+			remap[i + 1] += remap[i];
+		for(i = 0; i <= anim->numlevels; i++)
+			anim->levels[i] = remap[i];
+		for(i = 0; i < numnodes; i++)
+			if(flags[i] & ANIM_KEPT)
+				remap[i] = anim->levels[depths[i]]++;
 			else
+				remap[i] = -1;
+		for(i = anim->numlevels; i > 0; i--)
+			anim->levels[i] = anim->levels[i - 1];
+		anim->levels[0] = 0;
+
+		numkeys = 0;
+		for(i = 0; i < numnodes; i++)
+			if(flags[i] & ANIM_KEPT)
+				for(k = 0; k < ANIM_NUMTRACKS; k++)
+					numkeys += nodes[i]->tracks[k].numkeys;
+		anim->numkeys = numkeys;
+		anim->keyframes = (real_t *) Z_TagMallocUninit(sizeof(real_t) * numkeys + 1, TAG_MESH);
+		anim->keyvalues = (vec4_t *) Z_TagMallocUninit(sizeof(vec4_t) * numkeys + 1, TAG_MESH);
+		anim->curves = (real_t *) Z_TagMalloc(sizeof(real_t) * ANIM_CURVES * anim->padnodes, TAG_MESH);
+		anim->world = (real_t *) Z_TagMalloc(sizeof(real_t) * 12 * numkept, TAG_MESH);
+		anim->skin = (real_t *) Z_TagMalloc(sizeof(real_t) * 12 * numkept, TAG_MESH);
+
+		numkeys = 0;
+		for(i = 0; i < numnodes; i++)
+		{
+			if(remap[i] < 0)
+				continue;
+			anode = &anim->nodes[remap[i]];
+			anode->name = nodes[i]->name;
+			nodes[i]->name = NULL;
+			anode->parent = parents[i] >= 0 ? remap[parents[i]] : -1;
+			for(k = 0; k < ANIM_NUMTRACKS; k++)
 			{
-				// Minus the 128 ID + 1 (127) to get the color count that needs to be read
-				rleid -= 127;
-
-				// Read in the current color, which is the same for a while
-				fread(pcolors, sizeof(unsigned char) * channels, 1, imgfd);
-
-				// Go and read as many pixels as are the same
-				while(rleid) {
-                   // Assign the current pixel to the current index in our pixel array
-                   tgadata[colorsread + 0] = pcolors[2];
-                   tgadata[colorsread + 1] = pcolors[1];
-                   tgadata[colorsread + 2] = pcolors[0];
+				track = &anode->tracks[k];
+				src = &nodes[i]->tracks[k];
+				track->firstkey = numkeys;
+				track->numkeys = src->numkeys;
+				track->cursor = 0;
+				for(j = 0; j < src->numkeys; j++, numkeys++)
+				{
+					anim->keyframes[numkeys] = src->frames[j];
+					anim->keyvalues[numkeys] = src->values[j];
+				}
+			}
 
-                   // If we have a 4 channel 32-bit image, assign one more for the alpha
-                   if(tgaheader.bitCount == 32)
-                       tgadata[colorsread + 3] = pcolors[3];
+			// nodes are named after their object
+			for(submesh = mesh->submeshpool; submesh; submesh = submesh->next)
+				if(anode->name && submesh->name && !strcmp(anode->name, submesh->name))
+					break;
+			for(meshmatrix = load->meshmatrices; submesh && meshmatrix; meshmatrix = meshmatrix->next)
+				if(meshmatrix->submesh == submesh)
+					break;
+			BuildNodeInverse(anode, nodes[i], meshmatrix ? meshmatrix->matrix : NULL);
+			if(submesh && (flags[i] & (ANIM_MOVING | ANIM_INHERITS)))
+			{
+				submesh->animated = true;
+				submesh->node = remap[i];
+			}
+		}
 
-                   // Increase the current pixels read, decrease the amount
-                   // of pixels left, and increase the starting index for the next pixel.
-                   i++;
-                   rleid--;
-                   colorsread += channels;
-				}
+		anim->firstframe = (real_t) load->firstframe;
+		anim->lastframe = (real_t) load->lastframe;
+		if(anim->lastframe <= anim->firstframe && numkeys)
+		{
+			anim->firstframe = anim->lastframe = anim->keyframes[0];
+			for(i = 1; i < numkeys; i++)
+			{
+				if(anim->keyframes[i] < anim->firstframe)
+					anim->firstframe = anim->keyframes[i];
+				if(anim->keyframes[i] > anim->lastframe)
+					anim->lastframe = anim->keyframes[i];
 			}
 		}
-		Z_Free(pcolors);
+		mesh->anim = anim;
+		MDL_AnimateNodes(anim, anim->firstframe);
 	}
 
-	FS_FCloseFile(imgfd);
-
-	newimage->format = (channels == 3) ? IMG_RGB : IMG_RGBA;
-	newimage->width = tgaheader.imageWidth;
-	newimage->height = tgaheader.imageHeight;
-	newimage->data = tgadata;
-
-	return true;
+	Z_Free(nodes);
+	Z_Free(ids);
+	Z_Free(parents);
+	Z_Free(depths);
+	Z_Free(flags);
+	Z_Free(remap);
+	FreeParseNodes(load);
 }
 
 /*
-=========================================================
-
-3DS to mesh_t loader
-
-REFERENCES:
-
-  "3DS File Loader", www.gametutorials.com
-   http://www.gametutorials.com/Tutorials/opengl/OpenGL_Pg4.htm
+==========================
+BuildNodeInverse()
 
-   "3D Studio File Format Information", Jochen Wilhelmy
-   Available at http://www.wotsit.org/search.asp?s=3d
+Takes the object's vertices into the node's space: out
+of the object matrix, then so the pivot is the origin
+==========================
+*/
+void BuildNodeInverse(animnode_t *anode, mdlnode_t *node, real_t *m)
+{
+	real_t *inv, det;
+	int i;
 
-   "3ds format file reader", www.spacesimulator.net
-   http://www.spacesimulator.net/tut4_3dsloader.html
+	inv = anode->objectinverse;
+	memcpy(inv, animidentitymatrix, sizeof(animidentitymatrix));
+	if(m)
+	{
+		det = m[0] * (m[5] * m[10] - m[6] * m[9]) - m[1] * (m[4] * m[10] - m[6] * m[8]) +
+			m[2] * (m[4] * m[9] - m[5] * m[8]);
+		if(fabs(det) > 1e-12)
+		{
+			inv[0] = (m[5] * m[10] - m[6] * m[9]) / det;
+			inv[1] = (m[2] * m[9] - m[1] * m[10]) / det;
+			inv[2] = (m[1] * m[6] - m[2] * m[5]) / det;
+			inv[4] = (m[6] * m[8] - m[4] * m[10]) / det;
+			inv[5] = (m[0] * m[10] - m[2] * m[8]) / det;
+			inv[6] = (m[2] * m[4] - m[0] * m[6]) / det;
+			inv[8] = (m[4] * m[9] - m[5] * m[8]) / det;
+			inv[9] = (m[1] * m[8] - m[0] * m[9]) / det;
+			inv[10] = (m[0] * m[5] - m[1] * m[4]) / det;
+			for(i = 0; i < 12; i += 4)
+				inv[i + 3] = -(inv[i] * m[3] + inv[i + 1] * m[7] + inv[i + 2] * m[11]);
+		}
+	}
+	inv[3] -= node->pivot.x;
+	inv[7] -= node->pivot.y;
+	inv[11] -= node->pivot.z;
+}
 
-=========================================================
+/*
+==========================
+FreeParseNodes()
+==========================
 */
+void FreeParseNodes(mdlload_t *load)
+{
+	mdlnode_t *node, *nextnode;
+	mdlmeshmatrix_t *meshmatrix, *nextmatrix;
+	int k;
+
+	for(node = load->nodes; node; node = nextnode)
+	{
+		nextnode = node->next;
+		if(node->name)
+			Z_Free(node->name);
+		for(k = 0; k < ANIM_NUMTRACKS; k++)
+		{
+			Z_Free(node->tracks[k].frames);
+			Z_Free(node->tracks[k].values);
+		}
+		Z_PoolFree(node);
+	}
+	load->nodes = NULL;
+	for(meshmatrix = load->meshmatrices; meshmatrix; meshmatrix = nextmatrix)
+	{
+		nextmatrix = meshmatrix->next;
+		Z_PoolFree(meshmatrix);
+	}
+	load->meshmatrices = NULL;
+}
 
 /*
-** 3ds chunks
+==========================
+MDL_FreeAnimation()
+==========================
 */
-#define CHUNK_MAIN                        0x4D4D    // main
-#define   CHUNK_VERSION                   0x0002    // 3ds version
-#define   CHUNK_OBJECTINFO                0x3D3D    // 3D editor
-#define     CHUNK_MATERIAL                0xAFFF    // material block
-#define       CHUNK_MATNAME               0xA000    // - material name
-#define       CHUNK_MATAMBIENT            0xA010    // - material ambient
-#define       CHUNK_MATDIFFUSE            0xA020    // - material diffuse
-#define       CHUNK_MATSPECULAR           0xA030    // - material specular
-#define       CHUNK_MATSHININESS          0xA040    // - material specular shininess
-#define       CHUNK_MATTEXMAP1            0xA200    // - material texture map 1
-#define       CHUNK_MATTEXMAP2            0xA33A    // - material texture map 2
-#define       CHUNK_MATBUMPMAP            0xA230    // - material bump map
-#define         CHUNK_MATMAPFILE          0xA300    //   - material tex/bump map texture filename
-#define     CHUNK_OBJECT                  0x4000    // object block 
-#define       CHUNK_OBJECT_MESH           0x4100    // - triangle mesh
-#define         CHUNK_OBJECT_VERTICES     0x4110    //   - vertex list
-#define         CHUNK_OBJECT_FACES        0x4120    //   - face list
-#define           CHUNK_OBJECT_MATERIAL   0x4130    //     - faces material list
-#define         CHUNK_OBJECT_UV           0x4140    //   - UV tex coords
-#define   CHUNK_EDITKEYFRAME              0xB000    // keyframer block
+void MDL_FreeAnimation(animation_t *anim)
+{
+	int i;
 
-static chunk_t *curchunk;
-static chunk_t *tmpchunk;
-static FILE *mesh_fd;
+	if(!anim)
+		return;
+	for(i = 0; i < anim->numnodes; i++)
+		if(anim->nodes[i].name)
+			Z_Free(anim->nodes[i].name);
+	Z_Free(anim->nodes);
+	Z_Free(anim->levels);
+	Z_Free(anim->keyframes);
+	Z_Free(anim->keyvalues);
+	Z_Free(anim->curves);
+	Z_Free(anim->world);
+	Z_Free(anim->skin);
+	Z_Free(anim);
+}
 
 /*
 ==========================
-MDL_Load3DS()
+EvaluateTrack()
+
+Finds the keys on each side of frame and how far it is
+from a to b. Playback mostly moves forward a little at a
+time, so the search starts where the last one ended
 ==========================
 */
-boolean_t MDL_Load3DS(mesh_t *newmesh, char *modelfile)
+void EvaluateTrack(animation_t *anim, animtrack_t *track, real_t frame, vec4_t *a, vec4_t *b, real_t *t)
 {
-	if(FS_FOpenFile(modelfile, &mesh_fd, "rb") < 0)
+	real_t *frames;
+	vec4_t *values;
+	int k, last;
+
+	frames = anim->keyframes + track->firstkey;
+	values = anim->keyvalues + track->firstkey;
+	last = track->numkeys - 1;
+	*t = 0;
+	if(last == 0 || frame <= frames[0])
 	{
-		Sys_Warn("MDL_Load3DS: unable to open %s: %s\n", modelfile, strerror(errno));
-		return false;
+		*a = *b = values[0];
+		return;
 	}
-
-	curchunk = (chunk_t *) Z_Malloc(sizeof(chunk_t));
-	ReadNextChunk(curchunk);
-
-    if(curchunk->id != CHUNK_MAIN)
+	if(frame >= frames[last])
 	{
-		Sys_Warn("MDL_Load3DS: invalid main chunk (!=0x4D4D) for %s, not loading\n", modelfile);
-		FS_FCloseFile(mesh_fd);
-		Z_Free(curchunk);
-		return false;
+		*a = *b = values[last];
+		return;
 	}
 
-	tmpchunk = (chunk_t *) Z_Malloc(sizeof(*tmpchunk));
-
-	ProcessNextChunk(newmesh, curchunk);
-	ComputeNormals(newmesh);
-	GL_PostProcessMesh(newmesh);
-
-	Z_Free(tmpchunk);
-	Z_Free(curchunk);
-	FS_FCloseFile(mesh_fd);
-
-	return true;
+	k = track->cursor;
+	if(k >= last || frames[k] > frame)
+		k = 0;
+	while(frames[k + 1] <= frame)
+		k++;
+	track->cursor = k;
+	*a = values[k];
+	*b = values[k + 1];
+	*t = (frame - frames[k]) / (frames[k + 1] - frames[k]);
 }
 
 /*
 ==========================
-ProcessNextChunk()
+GatherCurves()
+
+Fills the SoA curves for frame. Lanes past the last node
+and tracks without keys get identity values
 ==========================
 */
-void ProcessNextChunk(mesh_t *mesh, chunk_t *prevchunk)
+void GatherCurves(animation_t *anim, real_t frame)
 {
-	chunk_t *parentchunk;
-	material_t *tmpmat;
-	submesh_t *newsubmesh;
-    unsigned int version = 0;
-    int buffer[BIGBUFFERLEN];
-	char strbuffer[STRINGLEN + 1];
+	animtrack_t *track;
+	vec4_t a, b;
+	real_t t, *c;
+	int i, j, k, n;
 
-	parentchunk = prevchunk;
-	curchunk = (chunk_t *) Z_Malloc(sizeof(chunk_t));
-	while(prevchunk->bytesread < prevchunk->length)
+	for(i = 0; i < anim->padnodes; i++)
 	{
-		ReadNextChunk(curchunk);
-		switch(curchunk->id)
+		for(k = 0; k < ANIM_NUMTRACKS; k++)
 		{
-		case CHUNK_VERSION:
-			curchunk->bytesread += fread(&version, 1, curchunk->length - curchunk->bytesread, mesh_fd);
-			if(version > 0x03)
-				Sys_Warn("ProcessNextChunk: version > 3\n");
-			break;
-		case CHUNK_OBJECTINFO:
-			ReadNextChunk(tmpchunk);
-			tmpchunk->bytesread += fread(&version, 1, tmpchunk->length - tmpchunk->bytesread, mesh_fd);
-			curchunk->bytesread += tmpchunk->bytesread;
-			ProcessNextChunk(mesh, curchunk);
-			break;
-		case CHUNK_MATERIAL:
-			tmpmat = GL_CreateNULLMaterial();
-			ProcessNextMaterialChunk(tmpmat, curchunk);
-			break;
-		case CHUNK_OBJECT:
-			newsubmesh = (submesh_t *) Z_Malloc(sizeof(*newsubmesh));
-			curchunk->bytesread += GetString(strbuffer);
-			newsubmesh->name = Common_CopyString(strbuffer);
-			newsubmesh->parent = mesh;
-			newsubmesh->next = NULL;
-			GL_AddSubmesh(mesh, newsubmesh);
-			ProcessNextObjectChunk(mesh, newsubmesh, curchunk);
-			break;
-		case CHUNK_EDITKEYFRAME:
-			//ProcessNextKeyFrameChunk(mesh, curchunk);
-			curchunk->bytesread += fread(buffer, 1, curchunk->length - curchunk->bytesread, mesh_fd);
-			break;
-		default:
-			curchunk->bytesread += fread(buffer, 1, curchunk->length - curchunk->bytesread, mesh_fd);
-			break;
+			track = i < anim->numnodes ? &anim->nodes[i].tracks[k] : NULL;
+			if(track && track->numkeys)
+				EvaluateTrack(anim, track, frame, &a, &b, &t);
+			else
+			{
+				a = b = animidentity[k];
+				t = 0;
+			}
+			// rotations take the short way round
+			if(k == ANIM_ROTATION && a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w < 0)
+			{
+				b.x = -b.x;
+				b.y = -b.y;
+				b.z = -b.z;
+				b.w = -b.w;
+			}
+			n = animcomponents[k];
+			c = anim->curves + animcurvebase[k] * anim->padnodes + i;
+			for(j = 0; j < n; j++)
+			{
+				c[j * anim->padnodes] = (&a.x)[j];
+				c[(n + j) * anim->padnodes] = (&b.x)[j];
+			}
+			c[2 * n * anim->padnodes] = t;
 		}
-		// Add the bytes read from the last chunk to the previous chunk passed in.
-		prevchunk->bytesread += curchunk->bytesread;
 	}
-	Z_Free(curchunk);
-	curchunk = parentchunk;
 }
 
 /*
 ==========================
-ProcessNextObjectChunk()
+AnimConcat()
+
+out = a * b for SIMD_WIDTH 3x4 row major matrices
 ==========================
 */
-void ProcessNextObjectChunk(mesh_t *mesh, submesh_t *submesh, chunk_t *prevchunk)
+static INLINE void AnimConcat(simd_t *a, simd_t *b, simd_t *out)
 {
-	chunk_t *parentchunk;
-	int buffer[BIGBUFFERLEN];
+	int r;
+
+	for(r = 0; r < 12; r += 4)
+	{
+		out[r] = SIMD_ADD(SIMD_ADD(SIMD_MUL(a[r], b[0]), SIMD_MUL(a[r + 1], b[4])), SIMD_MUL(a[r + 2], b[8]));
+		out[r + 1] = SIMD_ADD(SIMD_ADD(SIMD_MUL(a[r], b[1]), SIMD_MUL(a[r + 1], b[5])), SIMD_MUL(a[r + 2], b[9]));
+		out[r + 2] = SIMD_ADD(SIMD_ADD(SIMD_MUL(a[r], b[2]), SIMD_MUL(a[r + 1], b[6])), SIMD_MUL(a[r + 2], b[10]));
+		out[r + 3] = SIMD_ADD(SIMD_ADD(SIMD_ADD(SIMD_MUL(a[r], b[3]), SIMD_MUL(a[r + 1], b[7])),
+									   SIMD_MUL(a[r + 2], b[11])), a[r + 3]);
+	}
+}
+
+/*
+==========================
+MDL_AnimateNodes()
 
-	parentchunk = prevchunk;
-	curchunk = (chunk_t *) Z_Malloc(sizeof(chunk_t));
+Evaluates every node at frame, looped over the segment.
+Positions and scales are lerped and rotations nlerped,
+then each node's local transform is put together and
+concatenated with its parent's a whole depth at a time
+==========================
+*/
+void MDL_AnimateNodes(animation_t *anim, real_t frame)
+{
+	real_t len, *c, *src;
+	real_t g[24][SIMD_WIDTH];
+	simd_t v[10], local[12], parent[12], world[12], skin[12];
+	simd_t t, s, xx, yy, zz, xy, xz, yz, wx, wy, wz;
+	simd_t one = SIMD_SET1(1.0f);
+	simd_t two = SIMD_SET1(2.0f);
+	int i, j, k, l, m, n, node, end, pad;
+
+	len = anim->lastframe - anim->firstframe;
+	if(len > 0)
+	{
+		frame = (real_t) fmod(frame - anim->firstframe, len);
+		if(frame < 0)
+			frame += len;
+		frame += anim->firstframe;
+	}
+	else
+		frame = anim->firstframe;
+	GatherCurves(anim, frame);
 
-	while (prevchunk->bytesread < prevchunk->length)
+	pad = anim->padnodes;
+	for(l = 0; l < anim->numlevels; l++)
 	{
-		ReadNextChunk(curchunk);
-		switch (curchunk->id)
+		end = anim->levels[l + 1];
+		for(i = anim->levels[l]; i < end; i += SIMD_WIDTH)
 		{
-		case CHUNK_OBJECT_MESH:
-			ProcessNextObjectChunk(mesh, submesh, curchunk);
-			break;
-		case CHUNK_OBJECT_VERTICES:
-			ReadVertices(submesh, curchunk);
-			break;
-		case CHUNK_OBJECT_FACES:
-			ReadVertexIndices(submesh, curchunk);
-			break;
-		case CHUNK_OBJECT_MATERIAL:
-			ReadObjectMaterial(mesh, submesh, curchunk);
-			break;
-		case CHUNK_OBJECT_UV:
-			ReadUVCoordinates(submesh, curchunk);
-			break;
-		default:  
-			curchunk->bytesread += fread(buffer, 1, curchunk->length - curchunk->bytesread, mesh_fd);
-			break;
+			// v[] is the position, rotation and scale
+			for(k = 0, j = 0; k < ANIM_NUMTRACKS; k++)
+			{
+				c = anim->curves + animcurvebase[k] * pad + i;
+				n = animcomponents[k];
+				t = SIMD_LOAD(c + 2 * n * pad);
+				for(m = 0; m < n; m++, j++)
+				{
+					s = SIMD_LOAD(c + m * pad);
+					v[j] = SIMD_ADD(s, SIMD_MUL(SIMD_SUB(SIMD_LOAD(c + (n + m) * pad), s), t));
+				}
+			}
+
+			// the nlerped rotation isn't unit length, s
+			// scales it back while making the matrix
+			s = SIMD_DIV(two, SIMD_ADD(SIMD_ADD(SIMD_MUL(v[3], v[3]), SIMD_MUL(v[4], v[4])),
+									   SIMD_ADD(SIMD_MUL(v[5], v[5]), SIMD_MUL(v[6], v[6]))));
+			xx = SIMD_MUL(SIMD_MUL(v[3], v[3]), s);
+			yy = SIMD_MUL(SIMD_MUL(v[4], v[4]), s);
+			zz = SIMD_MUL(SIMD_MUL(v[5], v[5]), s);
+			xy = SIMD_MUL(SIMD_MUL(v[3], v[4]), s);
+			xz = SIMD_MUL(SIMD_MUL(v[3], v[5]), s);
+			yz = SIMD_MUL(SIMD_MUL(v[4], v[5]), s);
+			wx = SIMD_MUL(SIMD_MUL(v[6], v[3]), s);
+			wy = SIMD_MUL(SIMD_MUL(v[6], v[4]), s);
+			wz = SIMD_MUL(SIMD_MUL(v[6], v[5]), s);
+			local[0] = SIMD_MUL(SIMD_SUB(one, SIMD_ADD(yy, zz)), v[7]);
+			local[1] = SIMD_MUL(SIMD_SUB(xy, wz), v[8]);
+			local[2] = SIMD_MUL(SIMD_ADD(xz, wy), v[9]);
+			local[3] = v[0];
+			local[4] = SIMD_MUL(SIMD_ADD(xy, wz), v[7]);
+			local[5] = SIMD_MUL(SIMD_SUB(one, SIMD_ADD(xx, zz)), v[8]);
+			local[6] = SIMD_MUL(SIMD_SUB(yz, wx), v[9]);
+			local[7] = v[1];
+			local[8] = SIMD_MUL(SIMD_SUB(xz, wy), v[7]);
+			local[9] = SIMD_MUL(SIMD_ADD(yz, wx), v[8]);
+			local[10] = SIMD_MUL(SIMD_SUB(one, SIMD_ADD(xx, yy)), v[9]);
+			local[11] = v[2];
+
+			// parents are a depth up, so they're done already
+			for(j = 0; j < SIMD_WIDTH; j++)
+			{
+				node = i + j < end ? anim->nodes[i + j].parent : -1;
+				src = node >= 0 ? anim->world + node * 12 : (real_t *) animidentitymatrix;
+				for(k = 0; k < 12; k++)
+					g[k][j] = src[k];
+				src = i + j < end ? anim->nodes[i + j].objectinverse : (real_t *) animidentitymatrix;
+				for(k = 0; k < 12; k++)
+					g[12 + k][j] = src[k];
+			}
+			for(k = 0; k < 12; k++)
+			{
+				parent[k] = SIMD_LOAD(g[k]);
+				skin[k] = SIMD_LOAD(g[12 + k]);
+			}
+			AnimConcat(parent, local, world);
+			AnimConcat(world, skin, local);
+			for(k = 0; k < 12; k++)
+			{
+				SIMD_STORE(g[k], world[k]);
+				SIMD_STORE(g[12 + k], local[k]);
+			}
+			for(j = 0; j < SIMD_WIDTH && i + j < end; j++)
+			{
+				for(k = 0; k < 12; k++)
+				{
+					anim->world[(i + j) * 12 + k] = g[k][j];
+					anim->skin[(i + j) * 12 + k] = g[12 + k][j];
+				}
+			}
 		}
-		prevchunk->bytesread += curchunk->bytesread;
 	}
-	Z_Free(curchunk);
-	curchunk = parentchunk;
 }
 
 /*
 ==========================
-ProcessNextMaterialChunk()
+MDL_PoseSubmesh()
+
+Writes the submesh's vertices moved by its node to out,
+a position and a normal per vertex, and updates its
+bounds and sphere. out is only written, so it can be a
+write-only buffer mapping. Normals go through the
+cofactors of the transform, which keeps them right under
+any scale
 ==========================
 */
-void ProcessNextMaterialChunk(material_t *material, chunk_t *prevchunk)
+void MDL_PoseSubmesh(submesh_t *submesh, animation_t *anim, real_t *out)
 {
-	chunk_t *parentchunk;
-	int buffer[BIGBUFFERLEN];
-	char strbuffer[STRINGLEN + 1];
-
-	parentchunk = prevchunk;
-	curchunk = (chunk_t *) Z_Malloc(sizeof(chunk_t));
+	real_t *m, c[9], det, *o;
+	real_t g[6][SIMD_WIDTH];
+	simd_t k[12], cf[9], x, y, z, nx, ny, nz, len2;
+	simd_t tiny = SIMD_SET1(1e-30f);
+	simd_t one = SIMD_SET1(1.0f);
+	vec3_t *v, *n;
+	int i, j;
 
-	while(prevchunk->bytesread < prevchunk->length)
+	m = anim->skin + submesh->node * 12;
+	c[0] = m[5] * m[10] - m[6] * m[9];
+	c[1] = m[6] * m[8] - m[4] * m[10];
+	c[2] = m[4] * m[9] - m[5] * m[8];
+	c[3] = m[2] * m[9] - m[1] * m[10];
+	c[4] = m[0] * m[10] - m[2] * m[8];
+	c[5] = m[1] * m[8] - m[0] * m[9];
+	c[6] = m[1] * m[6] - m[2] * m[5];
+	c[7] = m[2] * m[4] - m[0] * m[6];
+	c[8] = m[0] * m[5] - m[1] * m[4];
+	// a mirroring transform would turn the normals inside out
+	det = m[0] * c[0] + m[1] * c[1] + m[2] * c[2];
+	for(i = 0; i < 12; i++)
+		k[i] = SIMD_SET1(m[i]);
+	for(i = 0; i < 9; i++)
+		cf[i] = SIMD_SET1(det < 0 ? -c[i] : c[i]);
+
+	if(submesh->numvertices)
+	{
+		submesh->mins.x = submesh->mins.y = submesh->mins.z = (real_t) 1e30f;
+		submesh->maxs.x = submesh->maxs.y = submesh->maxs.z = (real_t) -1e30f;
+	}
+	for(i = 0; i < submesh->numvertices; i += SIMD_WIDTH)
 	{
-		ReadNextChunk(curchunk);
-		switch (curchunk->id)
+		for(j = 0; j < SIMD_WIDTH; j++)
 		{
-		case CHUNK_MATNAME:
-			curchunk->bytesread += fread(strbuffer, 1, curchunk->length - curchunk->bytesread, mesh_fd);
-			if(material->name)
-				Z_Free(material->name);
-			material->name = Common_CopyString(strbuffer);
-			break;
-		case CHUNK_MATAMBIENT:
-		case CHUNK_MATDIFFUSE:
-		case CHUNK_MATSPECULAR:
-			ReadColorChunk(material, curchunk);
-			break;
-		case CHUNK_MATTEXMAP1:
-		case CHUNK_MATTEXMAP2:
-		case CHUNK_MATBUMPMAP:
-			ProcessNextMaterialChunk(material, curchunk);
-			break;
-		case CHUNK_MATMAPFILE:
-			curchunk->bytesread += fread(strbuffer, 1, curchunk->length - curchunk->bytesread, mesh_fd);
-			AddMaterialMapfile(strbuffer, material, prevchunk);
-			break;
-		default:  
-			curchunk->bytesread += fread(buffer, 1, curchunk->length - curchunk->bytesread, mesh_fd);
-			break;
+			if(i + j < submesh->numvertices)
+			{
+				v = &submesh->vertexdata[i + j];
+				n = &submesh->normaldata[i + j];
+				g[0][j] = v->x; g[1][j] = v->y; g[2][j] = v->z;
+				g[3][j] = n->x; g[4][j] = n->y; g[5][j] = n->z;
+			}
+			else
+				g[0][j] = g[1][j] = g[2][j] = g[3][j] = g[4][j] = g[5][j] = 0;
+		}
+		x = SIMD_LOAD(g[0]);
+		y = SIMD_LOAD(g[1]);
+		z = SIMD_LOAD(g[2]);
+		SIMD_STORE(g[0], SIMD_ADD(SIMD_ADD(SIMD_MUL(k[0], x), SIMD_MUL(k[1], y)), SIMD_ADD(SIMD_MUL(k[2], z), k[3])));
+		SIMD_STORE(g[1], SIMD_ADD(SIMD_ADD(SIMD_MUL(k[4], x), SIMD_MUL(k[5], y)), SIMD_ADD(SIMD_MUL(k[6], z), k[7])));
+		SIMD_STORE(g[2], SIMD_ADD(SIMD_ADD(SIMD_MUL(k[8], x), SIMD_MUL(k[9], y)), SIMD_ADD(SIMD_MUL(k[10], z), k[11])));
+		x = SIMD_LOAD(g[3]);
+		y = SIMD_LOAD(g[4]);
+		z = SIMD_LOAD(g[5]);
+		nx = SIMD_ADD(SIMD_ADD(SIMD_MUL(cf[0], x), SIMD_MUL(cf[1], y)), SIMD_MUL(cf[2], z));
+		ny = SIMD_ADD(SIMD_ADD(SIMD_MUL(cf[3], x), SIMD_MUL(cf[4], y)), SIMD_MUL(cf[5], z));
+		nz = SIMD_ADD(SIMD_ADD(SIMD_MUL(cf[6], x), SIMD_MUL(cf[7], y)), SIMD_MUL(cf[8], z));
+		// unused vertices have zero normals, keep them that way
+		len2 = SIMD_ADD(SIMD_ADD(SIMD_MUL(nx, nx), SIMD_MUL(ny, ny)), SIMD_ADD(SIMD_MUL(nz, nz), tiny));
+		len2 = SIMD_DIV(one, SIMD_SQRT(len2));
+		SIMD_STORE(g[3], SIMD_MUL(nx, len2));
+		SIMD_STORE(g[4], SIMD_MUL(ny, len2));
+		SIMD_STORE(g[5], SIMD_MUL(nz, len2));
+
+		for(j = 0; j < SIMD_WIDTH && i + j < submesh->numvertices; j++)
+		{
+			o = out + (i + j) * 6;
+			o[0] = g[0][j]; o[1] = g[1][j]; o[2] = g[2][j];
+			o[3] = g[3][j]; o[4] = g[4][j]; o[5] = g[5][j];
+			if(g[0][j] < submesh->mins.x) submesh->mins.x = g[0][j];
+			if(g[1][j] < submesh->mins.y) submesh->mins.y = g[1][j];
+			if(g[2][j] < submesh->mins.z) submesh->mins.z = g[2][j];
+			if(g[0][j] > submesh->maxs.x) submesh->maxs.x = g[0][j];
+			if(g[1][j] > submesh->maxs.y) submesh->maxs.y = g[1][j];
+			if(g[2][j] > submesh->maxs.z) submesh->maxs.z = g[2][j];
 		}
-		prevchunk->bytesread += curchunk->bytesread;
 	}
-	Z_Free(curchunk);
-	curchunk = parentchunk;
+	// a pass over the posed vertices for a tighter sphere isn't worth it
+	submesh->centre.x = 0.5f * (submesh->mins.x + submesh->maxs.x);
+	submesh->centre.y = 0.5f * (submesh->mins.y + submesh->maxs.y);
+	submesh->centre.z = 0.5f * (submesh->mins.z + submesh->maxs.z);
+	submesh->radius = 0.5f * (real_t) sqrt((submesh->maxs.x - submesh->mins.x) * (submesh->maxs.x - submesh->mins.x) +
+										   (submesh->maxs.y - submesh->mins.y) * (submesh->maxs.y - submesh->mins.y) +
+										   (submesh->maxs.z - submesh->mins.z) * (submesh->maxs.z - submesh->mins.z));
 }
 
-void AddMaterialMapfile(char *mapfile, material_t *material, chunk_t *chunk)
+/*
+=======================================================
+
+                       Mesh cache
+
+A 3ds file is only parsed and optimised once. The result
+goes to <file>.cache next to it, and later loads map the
+cache and give its arrays to the GL as they are. The
+cache is keyed on the size, time and checksum of the
+source and is rebuilt when any of them change.
+
+Layout, in the writer's byte order and real_t: header,
+materials, map files, submeshes, ranges and names, then
+the vertices, normals, texcoords and faces (those of
+every level) of each submesh, every array MDL_CACHEALIGN
+aligned
+=======================================================
+*/
+#define MDL_CACHEIDENT        (('C' << 24) + ('M' << 16) + ('D' << 8) + 'M')  // "MDMC"
+#define MDL_CACHEVERSION      4
+#define MDL_CACHEALIGN        16
+#define MDL_CACHEALIGNSIZE(x) (((x) + (MDL_CACHEALIGN - 1)) & ~(MDL_CACHEALIGN - 1))
+
+// every ofs is from the start of the file
+typedef struct mdlcacheheader_s
 {
-	cvar_t *dev;
+	int ident;
+	int version;
+	int realsize;             // sizeof(real_t) of the writer
+	int flags;                // the MDL_MERGE and MDL_LOD the mesh was built with
+	int length;               // of the whole file, so a short write shows
+	int sourcelength;
+	unsigned int sourcetime;
+	unsigned int sourcesum;
+	int nummaterials;
+	int materialofs;
+	int nummapfiles;
+	int mapfileofs;
+	int numsubmeshes;
+	int submeshofs;
+	int numranges;
+	int rangeofs;
+	int numcells;
+	int cellofs;
+	int numcellboxes;
+	int cellboxofs;           // cellbox_t as they are
+	int numportals;
+	int portalofs;
+	int namelength;
+	int nameofs;
+	vec3_t mins;
+	vec3_t maxs;
+} mdlcacheheader_t;
+
+// names are offsets from nameofs, -1 for none
+typedef struct
+{
+	int name;
+	color4_t color;
+	color4_t ambient;
+	color4_t diffuse;
+	color4_t specular;
+	color4_t emission;
+	real_t shininess;
+	int facebits;
+} mdlcachematerial_t;
+
+typedef struct
+{
+	int material;
+	int id;
+	int name;
+} mdlcachemapfile_t;
 
-	Common_strtolower(mapfile);
-	dev = Cvar_Get("developer", 0);
-	switch(chunk->id)
+typedef struct
+{
+	int name;
+	int material;             // -1 for none
+	int numvertices;
+	int numfaces;
+	int numtexcoords;
+	int firstrange;
+	int numranges;
+	int numlods;
+	submeshlod_t lods[MDL_MAXLODS];
+	real_t loadacmr;
+	real_t acmr;
+	vec3_t mins;
+	vec3_t maxs;
+	vec3_t centre;
+	real_t radius;
+	int vertexofs;
+	int normalofs;
+	int texcoordofs;
+	int faceofs;
+} mdlcachesubmesh_t;
+
+typedef struct
+{
+	int name;
+	int firstface;
+	int numfaces;
+} mdlcacherange_t;
+
+typedef struct
+{
+	int name;
+	int firstbox;
+	int numboxes;
+} mdlcachecell_t;
+
+typedef struct
+{
+	int cells[2];
+	vec4_t plane;
+	int numpoints;
+	vec3_t points[CELL_MAXPOINTS];
+} mdlcacheportal_t;
+
+/*
+==========================
+MDL_ParseCached()
+
+MDL_Parse3DS() through the mesh cache. flags are
+MDL_MERGE to merge the submeshes with GL_MergeSubmeshes(),
+MDL_LOD to build their levels of detail after, MDL_BVH
+to build their hierarchies for MDL_TraceMesh() and
+MDL_NOCACHE to bypass the cache. Submeshes loaded
+from the cache are flagged mapped and their arrays point
+into mesh->cache, which the mesh keeps until it's
+uploaded. Safe on any thread, like MDL_Parse3DS()
+==========================
+*/
+boolean_t MDL_ParseCached(mdlload_t *load, mesh_t *newmesh, char *modelfile, int flags)
+{
+	filemap_t source;
+	mdlcacheheader_t key;
+	char cachefile[STRINGLEN];
+	char cellfile[STRINGLEN];
+
+	if(flags & MDL_NOCACHE)
 	{
-	case CHUNK_MATTEXMAP1:
-		if(dev && dev->value)
-			Sys_Printf("AddMaterialMapFile: texmap1\n");
-		GL_LoadTexture(&material->texmap1, mapfile, true);
-		material->hastexmap1 = true;
-		break;
-	case CHUNK_MATTEXMAP2:
-		if(dev && dev->value)
-			Sys_Printf("AddMaterialMapFile: texmap2\n");
-		GL_LoadTexture(&material->texmap2, mapfile, true);
-		material->hastexmap2 = true;
-		break;
-	case CHUNK_MATBUMPMAP:
-		if(dev && dev->value)
-			Sys_Printf("AddMaterialMapFile: bumpmap\n");
-		GL_LoadTexture(&material->bumpmap, mapfile, true);
-		material->hasbumpmap = true;
-		break;
-	default:
-		break;
+		if(!MDL_Parse3DS(load, newmesh, modelfile))
+			return false;
+		if(flags & MDL_MERGE)
+			GL_MergeSubmeshes(newmesh);
+		if(flags & MDL_LOD)
+			ProcessSubmeshes(newmesh, BuildSubmeshLods);
+		if(flags & MDL_BVH)
+			ProcessSubmeshes(newmesh, BuildSubmeshBvh);
+		LinkCells(newmesh);
+		return true;
+	}
+
+	if(!FS_MapFile(modelfile, &source))
+	{
+		Sys_Warn("MDL_Load3DS: unable to open %s: %s\n", modelfile, strerror(errno));
+		return false;
+	}
+	memset(&key, 0, sizeof(key));
+	key.flags = flags & (MDL_MERGE | MDL_LOD);
+	key.sourcelength = source.length;
+	key.sourcetime = source.mtime;
+	key.sourcesum = MDL_ChecksumBytes(2166136261u, source.data, source.length);
+	FS_UnmapFile(&source);
+	// the cells decide what may merge, so their file is part of the source
+	Common_snprintf(cellfile, STRINGLEN, "%s%s", modelfile, CELL_FILEEXT);
+	if(FS_MapFile(cellfile, &source))
+	{
+		key.sourcesum = MDL_ChecksumBytes(key.sourcesum, source.data, source.length);
+		FS_UnmapFile(&source);
+	}
+
+	Common_snprintf(cachefile, STRINGLEN, "%s.cache", modelfile);
+	// the hierarchies aren't cached, but built again on each load
+	if(ReadMeshCache(load, newmesh, cachefile, &key))
+	{
+		if(flags & MDL_BVH)
+			ProcessSubmeshes(newmesh, BuildSubmeshBvh);
+		LinkCells(newmesh);
+		return true;
 	}
+
+	if(!MDL_Parse3DS(load, newmesh, modelfile))
+		return false;
+	if(flags & MDL_MERGE)
+		GL_MergeSubmeshes(newmesh);
+	if(flags & MDL_LOD)
+		ProcessSubmeshes(newmesh, BuildSubmeshLods);
+	WriteMeshCache(load, newmesh, cachefile, &key);
+	if(flags & MDL_BVH)
+		ProcessSubmeshes(newmesh, BuildSubmeshBvh);
+	LinkCells(newmesh);
+
+	return true;
 }
 
 /*
 ==========================
-ReadNextChunk()
+CacheArray()
 
-Reads in a chunk id and the chunks length
+Checks that count elements of size bytes at ofs are
+aligned and inside the cache
 ==========================
 */
-void ReadNextChunk(chunk_t *chunk)
+boolean_t CacheArray(filemap_t *map, int ofs, int count, int size)
 {
-	chunk->bytesread = fread(&chunk->id, 1, 2, mesh_fd);
-	chunk->bytesread += fread(&chunk->length, 1, 4, mesh_fd);
+	if(ofs < 0 || count < 0 || (ofs & (MDL_CACHEALIGN - 1)) || ofs > map->length)
+		return false;
+	return count <= (map->length - ofs) / size;
 }
 
 /*
 ==========================
-GetString()
+CacheName()
+
+Returns a copy of the name at ofs, or NULL for -1
 ==========================
 */
-int GetString(char *buffer)
+char *CacheName(filemap_t *map, int ofs)
 {
-	int index = 0;
+	mdlcacheheader_t *header;
 
-	fread(buffer, 1, 1, mesh_fd);
-	while(*(buffer + index++) != 0)
-		fread(buffer + index, 1, 1, mesh_fd);
-	return strlen(buffer) + 1;
+	if(ofs < 0)
+		return NULL;
+	header = (mdlcacheheader_t *) map->data;
+	return Common_CopyString((char *) map->data + header->nameofs + ofs);
 }
 
 /*
 ==========================
-ReadColorChunk()
+CheckMeshCache()
+
+A cache is only used if it was built from this source
+by this build and nothing in it points outside the file
 ==========================
 */
-void ReadColorChunk(material_t *material, chunk_t *chunk)
+#define CACHENAMEOK(h, ofs)  ((ofs) == -1 || ((ofs) >= 0 && (ofs) < (h)->namelength))
+
+boolean_t CheckMeshCache(filemap_t *map, mdlcacheheader_t *key)
 {
-	unsigned char color[3];
-	color4_t matcolor;
+	mdlcacheheader_t *header;
+	mdlcachematerial_t *materials;
+	mdlcachemapfile_t *mapfiles;
+	mdlcachesubmesh_t *submeshes, *csub;
+	mdlcacherange_t *ranges;
+	mdlcachecell_t *cells;
+	cellbox_t *boxes;
+	mdlcacheportal_t *portals;
+	face_t *faces;
+	int i, j, k, numfaces;
+
+	if(!CacheArray(map, 0, 1, sizeof(mdlcacheheader_t)))
+		return false;
+	header = (mdlcacheheader_t *) map->data;
+	if(header->ident != MDL_CACHEIDENT || header->version != MDL_CACHEVERSION ||
+	   header->realsize != sizeof(real_t) || header->length != map->length)
+		return false;
+	if(header->flags != key->flags || header->sourcelength != key->sourcelength ||
+	   header->sourcetime != key->sourcetime || header->sourcesum != key->sourcesum)
+		return false;
 
-	ReadNextChunk(tmpchunk);
-	tmpchunk->bytesread += fread(color, 1, tmpchunk->length - tmpchunk->bytesread, mesh_fd);
+	if(!CacheArray(map, header->materialofs, header->nummaterials, sizeof(mdlcachematerial_t)) ||
+	   !CacheArray(map, header->mapfileofs, header->nummapfiles, sizeof(mdlcachemapfile_t)) ||
+	   !CacheArray(map, header->submeshofs, header->numsubmeshes, sizeof(mdlcachesubmesh_t)) ||
+	   !CacheArray(map, header->rangeofs, header->numranges, sizeof(mdlcacherange_t)) ||
+	   !CacheArray(map, header->cellofs, header->numcells, sizeof(mdlcachecell_t)) ||
+	   !CacheArray(map, header->cellboxofs, header->numcellboxes, sizeof(cellbox_t)) ||
+	   !CacheArray(map, header->portalofs, header->numportals, sizeof(mdlcacheportal_t)) ||
+	   !CacheArray(map, header->nameofs, header->namelength, 1))
+		return false;
+	// a terminated name table keeps every name inside it
+	if(header->namelength && map->data[header->nameofs + header->namelength - 1])
+		return false;
 
-	matcolor.r = (real_t) ((real_t) color[0] / 255.0f);
-	matcolor.g = (real_t) ((real_t) color[1] / 255.0f);
-	matcolor.b = (real_t) ((real_t) color[2] / 255.0f);
-	matcolor.a = (real_t) 1.0f;
-	switch(chunk->id)
+	materials = (mdlcachematerial_t *) (map->data + header->materialofs);
+	for(i = 0; i < header->nummaterials; i++)
+		if(!CACHENAMEOK(header, materials[i].name))
+			return false;
+	mapfiles = (mdlcachemapfile_t *) (map->data + header->mapfileofs);
+	for(i = 0; i < header->nummapfiles; i++)
+		if(mapfiles[i].name < 0 || !CACHENAMEOK(header, mapfiles[i].name) ||
+		   mapfiles[i].material < 0 || mapfiles[i].material >= header->nummaterials)
+			return false;
+	ranges = (mdlcacherange_t *) (map->data + header->rangeofs);
+	submeshes = (mdlcachesubmesh_t *) (map->data + header->submeshofs);
+	for(i = 0, csub = submeshes; i < header->numsubmeshes; i++, csub++)
 	{
-	case CHUNK_MATAMBIENT:
-		material->ambient = matcolor;
-		break;
-	case CHUNK_MATDIFFUSE:
-		material->diffuse = matcolor;
-		break;
-	case CHUNK_MATSPECULAR:
-		material->specular = matcolor;
-		break;
-	default:
-		break;
+		if(!CACHENAMEOK(header, csub->name) || csub->material < -1 || csub->material >= header->nummaterials)
+			return false;
+		// the levels follow each other, the full one first
+		if(csub->numlods < 0 || csub->numlods > MDL_MAXLODS)
+			return false;
+		numfaces = csub->numfaces;
+		if(csub->numlods)
+		{
+			if(csub->lods[0].firstface != 0 || csub->lods[0].numfaces != csub->numfaces)
+				return false;
+			for(j = 1; j < csub->numlods; j++)
+			{
+				if(csub->lods[j].firstface != numfaces || csub->lods[j].numfaces < 0 ||
+				   csub->lods[j].numfaces > 0x7fffffff - numfaces)
+					return false;
+				numfaces += csub->lods[j].numfaces;
+			}
+		}
+		if(!CacheArray(map, csub->vertexofs, csub->numvertices, sizeof(vec3_t)) ||
+		   !CacheArray(map, csub->normalofs, csub->numvertices, sizeof(vec3_t)) ||
+		   !CacheArray(map, csub->texcoordofs, csub->numtexcoords, sizeof(vec2_t)) ||
+		   !CacheArray(map, csub->faceofs, numfaces, sizeof(face_t)))
+			return false;
+		if(csub->numranges < 0 || csub->firstrange < 0 || csub->firstrange > header->numranges ||
+		   csub->numranges > header->numranges - csub->firstrange)
+			return false;
+		for(j = 0; j < csub->numranges; j++)
+			if(!CACHENAMEOK(header, ranges[csub->firstrange + j].name))
+				return false;
+		// the GL would read past the arrays on a bad index
+		faces = (face_t *) (map->data + csub->faceofs);
+		for(j = 0; j < numfaces; j++)
+			for(k = 0; k < 3; k++)
+				if(faces[j].vertexindex[k] >= (unsigned int) csub->numvertices)
+					return false;
 	}
 
-	chunk->bytesread += tmpchunk->bytesread;
+	cells = (mdlcachecell_t *) (map->data + header->cellofs);
+	for(i = 0; i < header->numcells; i++)
+		if(cells[i].name < 0 || !CACHENAMEOK(header, cells[i].name) || cells[i].firstbox < 0 ||
+		   cells[i].numboxes < 0 || cells[i].firstbox > header->numcellboxes ||
+		   cells[i].numboxes > header->numcellboxes - cells[i].firstbox)
+			return false;
+	boxes = (cellbox_t *) (map->data + header->cellboxofs);
+	for(i = 0; i < header->numcellboxes; i++)
+		if(boxes[i].cell < 0 || boxes[i].cell >= header->numcells)
+			return false;
+	portals = (mdlcacheportal_t *) (map->data + header->portalofs);
+	for(i = 0; i < header->numportals; i++)
+		if(portals[i].cells[0] < 0 || portals[i].cells[0] >= header->numcells ||
+		   portals[i].cells[1] < 0 || portals[i].cells[1] >= header->numcells ||
+		   portals[i].numpoints < 3 || portals[i].numpoints > CELL_MAXPOINTS)
+			return false;
+	return true;
 }
 
 /*
 ==========================
-ReadVertexIndices()
+ReadMeshCache()
+
+Fills load and newmesh from the cache like a parse
+would. Returns false, leaving both empty, if there's no
+usable cache
 ==========================
 */
-void ReadVertexIndices(submesh_t *submesh, chunk_t *prevchunk)
+boolean_t ReadMeshCache(mdlload_t *load, mesh_t *newmesh, char *cachefile, mdlcacheheader_t *key)
 {
-	unsigned short index = 0;
-	unsigned int i, j;
+	filemap_t map;
+	mdlcacheheader_t *header;
+	mdlcachematerial_t *cmat;
+	mdlcachemapfile_t *cmapfile;
+	mdlcachesubmesh_t *csub;
+	mdlcacherange_t *cranges;
+	mdlcachecell_t *ccell;
+	mdlcacheportal_t *cportal;
+	material_t **materials, **mattail, *mat;
+	mdlmapfile_t **maptail, *mapfile;
+	submesh_t *submesh;
+	cellgraph_t *graph;
+	cvar_t *dev;
+	int i, j;
 
-	prevchunk->bytesread += fread(&submesh->numfaces, 1, 2, mesh_fd);
-	submesh->faces = (face_t *) Z_Malloc(sizeof(face_t) * submesh->numfaces);
-	memset(submesh->faces, 0, sizeof(face_t) * submesh->numfaces);
+	load->filename = cachefile;
+	load->mesh = newmesh;
+	load->materials = NULL;
+	load->mapfiles = NULL;
+	load->nodes = NULL;
+	load->meshmatrices = NULL;
+	load->cellobjects = NULL;
 
-	for(i = 0; i < submesh->numfaces; i++)
+	// no cache yet is not worth a word
+	if(!FS_MapFile(cachefile, &map))
+		return false;
+	dev = Cvar_Get("developer", 0);
+	if(!CheckMeshCache(&map, key))
+	{
+		if(dev && dev->value)
+			Sys_Printf("MDL_ParseCached: %s is stale, rebuilding\n", cachefile);
+		FS_UnmapFile(&map);
+		return false;
+	}
+	header = (mdlcacheheader_t *) map.data;
+
+	// keep the list orders the parse produced
+	materials = (material_t **) Z_MallocUninit(sizeof(material_t *) * (header->nummaterials + 1));
+	mattail = &load->materials;
+	cmat = (mdlcachematerial_t *) (map.data + header->materialofs);
+	for(i = 0; i < header->nummaterials; i++, cmat++)
+	{
+		mat = GL_NewMaterial();
+		mat->name = CacheName(&map, cmat->name);
+		mat->color = cmat->color;
+		mat->ambient = cmat->ambient;
+		mat->diffuse = cmat->diffuse;
+		mat->specular = cmat->specular;
+		mat->emission = cmat->emission;
+		mat->shininess = cmat->shininess;
+		mat->facebits = (unsigned char) cmat->facebits;
+		*mattail = materials[i] = mat;
+		mattail = &mat->next;
+	}
+
+	maptail = &load->mapfiles;
+	cmapfile = (mdlcachemapfile_t *) (map.data + header->mapfileofs);
+	for(i = 0; i < header->nummapfiles; i++, cmapfile++)
 	{
-		for(j = 0; j < 4; j++)
+		mapfile = (mdlmapfile_t *) Z_PoolMalloc(sizeof(*mapfile));
+		mapfile->material = materials[cmapfile->material];
+		mapfile->id = (unsigned short int) cmapfile->id;
+		mapfile->name = CacheName(&map, cmapfile->name);
+		*maptail = mapfile;
+		maptail = &mapfile->next;
+	}
+
+	// GL_AddSubmesh() puts each in front, so go backwards
+	cranges = (mdlcacherange_t *) (map.data + header->rangeofs);
+	csub = (mdlcachesubmesh_t *) (map.data + header->submeshofs) + header->numsubmeshes;
+	for(i = 0; i < header->numsubmeshes; i++)
+	{
+		csub--;
+		submesh = (submesh_t *) Z_PoolMalloc(sizeof(*submesh));
+		submesh->name = CacheName(&map, csub->name);
+		submesh->material = csub->material >= 0 ? materials[csub->material] : NULL;
+		submesh->numvertices = csub->numvertices;
+		submesh->numfaces = csub->numfaces;
+		submesh->numtexcoords = csub->numtexcoords;
+		submesh->vertexdata = (vec3_t *) (map.data + csub->vertexofs);
+		submesh->normaldata = (vec3_t *) (map.data + csub->normalofs);
+		submesh->texcoords = csub->numtexcoords ? (vec2_t *) (map.data + csub->texcoordofs) : NULL;
+		submesh->faces = (face_t *) (map.data + csub->faceofs);
+		submesh->numlods = csub->numlods;
+		memcpy(submesh->lods, csub->lods, sizeof(submeshlod_t) * csub->numlods);
+		submesh->loadacmr = csub->loadacmr;
+		submesh->acmr = csub->acmr;
+		submesh->mins = csub->mins;
+		submesh->maxs = csub->maxs;
+		submesh->centre = csub->centre;
+		submesh->radius = csub->radius;
+		submesh->mapped = true;
+		if(csub->numranges)
 		{
-			prevchunk->bytesread += fread(&index, 1, sizeof(index), mesh_fd);
-			if(j < 3)
+			submesh->numranges = csub->numranges;
+			submesh->ranges = (drawrange_t *) Z_TagMallocUninit(sizeof(drawrange_t) * csub->numranges, TAG_MESH);
+			for(j = 0; j < csub->numranges; j++)
 			{
-				submesh->faces[i].vertexindex[j] = index;
+				submesh->ranges[j].name = CacheName(&map, cranges[csub->firstrange + j].name);
+				submesh->ranges[j].firstface = cranges[csub->firstrange + j].firstface;
+				submesh->ranges[j].numfaces = cranges[csub->firstrange + j].numfaces;
 			}
 		}
+		submesh->parent = newmesh;
+		submesh->next = NULL;
+		GL_AddSubmesh(newmesh, submesh);
+	}
+	Z_Free(materials);
+
+	newmesh->cells = NULL;
+	if(header->numcells)
+	{
+		graph = (cellgraph_t *) Z_TagMalloc(sizeof(cellgraph_t), TAG_MESH);
+		graph->numcells = header->numcells;
+		graph->cells = (cell_t *) Z_TagMalloc(sizeof(cell_t) * header->numcells, TAG_MESH);
+		ccell = (mdlcachecell_t *) (map.data + header->cellofs);
+		for(i = 0; i < header->numcells; i++, ccell++)
+		{
+			graph->cells[i].name = CacheName(&map, ccell->name);
+			graph->cells[i].firstbox = ccell->firstbox;
+			graph->cells[i].numboxes = ccell->numboxes;
+		}
+		graph->numboxes = header->numcellboxes;
+		graph->boxes = (cellbox_t *) Z_TagMallocUninit(sizeof(cellbox_t) * (header->numcellboxes + 1), TAG_MESH);
+		memcpy(graph->boxes, map.data + header->cellboxofs, sizeof(cellbox_t) * header->numcellboxes);
+		graph->numportals = header->numportals;
+		graph->portals = (portal_t *) Z_TagMalloc(sizeof(portal_t) * (header->numportals + 1), TAG_MESH);
+		cportal = (mdlcacheportal_t *) (map.data + header->portalofs);
+		for(i = 0; i < header->numportals; i++, cportal++)
+		{
+			graph->portals[i].cells[0] = cportal->cells[0];
+			graph->portals[i].cells[1] = cportal->cells[1];
+			graph->portals[i].plane = cportal->plane;
+			graph->portals[i].numpoints = cportal->numpoints;
+			memcpy(graph->portals[i].points, cportal->points, sizeof(vec3_t) * cportal->numpoints);
+		}
+		LinkCellPortals(graph);
+		newmesh->cells = graph;
 	}
+
+	newmesh->mins = header->mins;
+	newmesh->maxs = header->maxs;
+	newmesh->cache = map;
+	if(dev && dev->value)
+		Sys_Printf("MDL_ParseCached: loaded %s\n", cachefile);
+
+	return true;
 }
 
 /*
 ==========================
-ReadUVCoordinates()
+CacheNameOfs()
+
+Hands out name offsets in the order the names are written
 ==========================
 */
-void ReadUVCoordinates(submesh_t *submesh, chunk_t *prevchunk)
+int CacheNameOfs(char *name, int *namelength)
 {
-	prevchunk->bytesread += fread(&submesh->numtexcoords, 1, 2, mesh_fd);
-	submesh->texcoords = (vec2_t *) Z_Malloc(sizeof(vec2_t) * submesh->numtexcoords);
-	prevchunk->bytesread += fread(submesh->texcoords, 1, prevchunk->length - prevchunk->bytesread, mesh_fd);
+	int ofs;
+
+	if(!name)
+		return -1;
+	ofs = *namelength;
+	*namelength += strlen(name) + 1;
+	return ofs;
 }
 
 /*
 ==========================
-ReadVertices()
+CachePad()
+
+Pads len bytes out to MDL_CACHEALIGN
 ==========================
 */
-void ReadVertices(submesh_t *submesh, chunk_t *prevchunk)
+boolean_t CachePad(FILE *fp, int len)
 {
-	real_t tmp;
-	unsigned int i;
-
-	prevchunk->bytesread += fread(&(submesh->numvertices), 1, 2, mesh_fd);
-	submesh->vertexdata = (vec3_t *) Z_Malloc(sizeof(vec3_t) * submesh->numvertices);
-	memset(submesh->vertexdata, 0, sizeof(vec3_t) * submesh->numvertices);
-	prevchunk->bytesread += fread(submesh->vertexdata, 1, prevchunk->length - prevchunk->bytesread, mesh_fd);
+	static const unsigned char pad[MDL_CACHEALIGN] = { 0 };
+	int padding;
 
-	// swap Y and Z
-	for(i = 0; i < submesh->numvertices; i++)
-	{
-		tmp = submesh->vertexdata[i].y;
-		submesh->vertexdata[i].y = submesh->vertexdata[i].z;
-		submesh->vertexdata[i].z = -tmp;
-	}
+	padding = MDL_CACHEALIGNSIZE(len) - len;
+	return padding == 0 || (int) fwrite(pad, 1, padding, fp) == padding;
 }
 
 /*
 ==========================
-ReadObjectMaterial()
+CacheWrite()
 ==========================
 */
-void ReadObjectMaterial(mesh_t *mesh, submesh_t *submesh, chunk_t *prevchunk)
+boolean_t CacheWrite(FILE *fp, const void *data, int len)
 {
-	char matname[BIGSTRINGLEN + 1];
-	int buffer[BIGBUFFERLEN];
-	material_t *mat;
+	if(len > 0 && (int) fwrite(data, 1, len, fp) != len)
+		return false;
+	return CachePad(fp, len);
+}
 
-	prevchunk->bytesread += GetString(matname);
-	mat = GL_GetMaterial(matname);
-	if(mat)
-		submesh->material = mat;
-	else
-		submesh->material = NULL;
+/*
+==========================
+CacheWriteName()
+==========================
+*/
+boolean_t CacheWriteName(FILE *fp, char *name)
+{
+	int len;
 
-	prevchunk->bytesread += fread(buffer, 1, prevchunk->length - prevchunk->bytesread, mesh_fd);
+	if(!name)
+		return true;
+	len = strlen(name) + 1;
+	return (int) fwrite(name, 1, len, fp) == len;
 }
 
 /*
 ==========================
-ComputeNormals()
+WriteMeshCache()
+
+Writes a freshly parsed mesh out for the next load. The
+file is built under a name of its own and renamed into
+place, so a reader never sees half of one
 ==========================
 */
-void ComputeNormals(mesh_t *mesh)
+void WriteMeshCache(mdlload_t *load, mesh_t *mesh, char *cachefile, mdlcacheheader_t *key)
 {
-	vec3_t poly[3], v1, v2, normal, sum, zero;
+	FILE *fp;
+	char tmpfile[STRINGLEN], tmppath[STRINGLEN];
+	mdlcacheheader_t header;
+	mdlcachematerial_t *cmats;
+	mdlcachemapfile_t *cmapfiles;
+	mdlcachesubmesh_t *csubs;
+	mdlcacherange_t *cranges;
+	mdlcachecell_t *ccells;
+	mdlcacheportal_t *cportals;
+	cellgraph_t *graph;
+	material_t *mat;
+	mdlmapfile_t *mapfile;
 	submesh_t *submesh;
-	vec3_t *normals, *tmpnormals;
-	int i, j;
-	int shared;
+	cvar_t *dev;
+	int i, j, ofs, namelength;
+	boolean_t ok;
 
-	if(mesh->submeshpool == NULL)
+	// the cache has no room for keyframes, animated meshes are parsed every time
+	if(mesh->anim)
 		return;
 
+	header = *key;
+	header.ident = MDL_CACHEIDENT;
+	header.version = MDL_CACHEVERSION;
+	header.realsize = sizeof(real_t);
+	header.nummaterials = header.nummapfiles = header.numsubmeshes = header.numranges = 0;
+	for(mat = load->materials; mat; mat = mat->next)
+		header.nummaterials++;
+	for(mapfile = load->mapfiles; mapfile; mapfile = mapfile->next)
+		header.nummapfiles++;
 	for(submesh = mesh->submeshpool; submesh; submesh = submesh->next)
 	{
-		normals = (vec3_t *) Z_Malloc(sizeof(vec3_t) * submesh->numfaces);
-		tmpnormals  = (vec3_t *) Z_Malloc(sizeof(vec3_t) * submesh->numfaces);
-		submesh->normaldata = (vec3_t *) Z_Malloc(sizeof(vec3_t) * submesh->numvertices);
+		// only what's still in system memory can be written
+		if(submesh->numvertices && (!submesh->vertexdata || !submesh->normaldata))
+			return;
+		if(submesh->numfaces && !submesh->faces)
+			return;
+		header.numsubmeshes++;
+		header.numranges += submesh->numranges;
+	}
 
-		for(i = 0; i < submesh->numfaces; i++)
+	cmats = (mdlcachematerial_t *) Z_Malloc(sizeof(mdlcachematerial_t) * header.nummaterials + 1);
+	cmapfiles = (mdlcachemapfile_t *) Z_Malloc(sizeof(mdlcachemapfile_t) * header.nummapfiles + 1);
+	csubs = (mdlcachesubmesh_t *) Z_Malloc(sizeof(mdlcachesubmesh_t) * header.numsubmeshes + 1);
+	cranges = (mdlcacherange_t *) Z_Malloc(sizeof(mdlcacherange_t) * header.numranges + 1);
+	graph = mesh->cells;
+	header.numcells = graph ? graph->numcells : 0;
+	header.numcellboxes = graph ? graph->numboxes : 0;
+	header.numportals = graph ? graph->numportals : 0;
+	ccells = (mdlcachecell_t *) Z_Malloc(sizeof(mdlcachecell_t) * header.numcells + 1);
+	cportals = (mdlcacheportal_t *) Z_Malloc(sizeof(mdlcacheportal_t) * header.numportals + 1);
+
+	// the names go in the order they are handed out here
+	namelength = 0;
+	for(i = 0, mat = load->materials; mat; mat = mat->next, i++)
+	{
+		cmats[i].name = CacheNameOfs(mat->name, &namelength);
+		cmats[i].color = mat->color;
+		cmats[i].ambient = mat->ambient;
+		cmats[i].diffuse = mat->diffuse;
+		cmats[i].specular = mat->specular;
+		cmats[i].emission = mat->emission;
+		cmats[i].shininess = mat->shininess;
+		cmats[i].facebits = mat->facebits;
+	}
+	for(i = 0, mapfile = load->mapfiles; mapfile; mapfile = mapfile->next, i++)
+	{
+		for(j = 0, mat = load->materials; mat && mat != mapfile->material; mat = mat->next)
+			j++;
+		cmapfiles[i].material = j;
+		cmapfiles[i].id = mapfile->id;
+		cmapfiles[i].name = CacheNameOfs(mapfile->name, &namelength);
+	}
+	header.numranges = 0;
+	for(i = 0, submesh = mesh->submeshpool; submesh; submesh = submesh->next, i++)
+	{
+		csubs[i].name = CacheNameOfs(submesh->name, &namelength);
+		csubs[i].material = -1;
+		for(j = 0, mat = load->materials; mat; mat = mat->next, j++)
+			if(mat == submesh->material)
+				csubs[i].material = j;
+		csubs[i].numvertices = submesh->numvertices;
+		csubs[i].numfaces = submesh->numfaces;
+		csubs[i].numtexcoords = submesh->texcoords ? submesh->numtexcoords : 0;
+		csubs[i].firstrange = header.numranges;
+		csubs[i].numranges = submesh->numranges;
+		csubs[i].numlods = submesh->numlods;
+		memcpy(csubs[i].lods, submesh->lods, sizeof(submeshlod_t) * submesh->numlods);
+		csubs[i].loadacmr = submesh->loadacmr;
+		csubs[i].acmr = submesh->acmr;
+		csubs[i].mins = submesh->mins;
+		csubs[i].maxs = submesh->maxs;
+		csubs[i].centre = submesh->centre;
+		csubs[i].radius = submesh->radius;
+		for(j = 0; j < submesh->numranges; j++, header.numranges++)
 		{
-			poly[0] = submesh->vertexdata[submesh->faces[i].vertexindex[0]];
-			poly[1] = submesh->vertexdata[submesh->faces[i].vertexindex[1]];
-			poly[2] = submesh->vertexdata[submesh->faces[i].vertexindex[2]];
+			cranges[header.numranges].name = CacheNameOfs(submesh->ranges[j].name, &namelength);
+			cranges[header.numranges].firstface = submesh->ranges[j].firstface;
+			cranges[header.numranges].numfaces = submesh->ranges[j].numfaces;
+		}
+	}
+	for(i = 0; i < header.numcells; i++)
+	{
+		ccells[i].name = CacheNameOfs(graph->cells[i].name, &namelength);
+		ccells[i].firstbox = graph->cells[i].firstbox;
+		ccells[i].numboxes = graph->cells[i].numboxes;
+	}
+	for(i = 0; i < header.numportals; i++)
+	{
+		cportals[i].cells[0] = graph->portals[i].cells[0];
+		cportals[i].cells[1] = graph->portals[i].cells[1];
+		cportals[i].plane = graph->portals[i].plane;
+		cportals[i].numpoints = graph->portals[i].numpoints;
+		memcpy(cportals[i].points, graph->portals[i].points, sizeof(cportals[i].points));
+	}
+
+	ofs = MDL_CACHEALIGNSIZE(sizeof(header));
+	header.materialofs = ofs;
+	ofs += MDL_CACHEALIGNSIZE(sizeof(mdlcachematerial_t) * header.nummaterials);
+	header.mapfileofs = ofs;
+	ofs += MDL_CACHEALIGNSIZE(sizeof(mdlcachemapfile_t) * header.nummapfiles);
+	header.submeshofs = ofs;
+	ofs += MDL_CACHEALIGNSIZE(sizeof(mdlcachesubmesh_t) * header.numsubmeshes);
+	header.rangeofs = ofs;
+	ofs += MDL_CACHEALIGNSIZE(sizeof(mdlcacherange_t) * header.numranges);
+	header.cellofs = ofs;
+	ofs += MDL_CACHEALIGNSIZE(sizeof(mdlcachecell_t) * header.numcells);
+	header.cellboxofs = ofs;
+	ofs += MDL_CACHEALIGNSIZE(sizeof(cellbox_t) * header.numcellboxes);
+	header.portalofs = ofs;
+	ofs += MDL_CACHEALIGNSIZE(sizeof(mdlcacheportal_t) * header.numportals);
+	header.nameofs = ofs;
+	header.namelength = namelength;
+	ofs += MDL_CACHEALIGNSIZE(namelength);
+	for(i = 0, submesh = mesh->submeshpool; submesh; submesh = submesh->next, i++)
+	{
+		csubs[i].vertexofs = ofs;
+		ofs += MDL_CACHEALIGNSIZE(sizeof(vec3_t) * csubs[i].numvertices);
+		csubs[i].normalofs = ofs;
+		ofs += MDL_CACHEALIGNSIZE(sizeof(vec3_t) * csubs[i].numvertices);
+		csubs[i].texcoordofs = ofs;
+		ofs += MDL_CACHEALIGNSIZE(sizeof(vec2_t) * csubs[i].numtexcoords);
+		csubs[i].faceofs = ofs;
+		ofs += MDL_CACHEALIGNSIZE(sizeof(face_t) * MDL_NumFaces(submesh));
+	}
+	header.length = ofs;
+	header.mins = mesh->mins;
+	header.maxs = mesh->maxs;
 
-			// face normals
-			M_Vec3Subtract(&poly[0], &poly[2], &v1);
-			M_Vec3Subtract(&poly[2], &poly[1], &v2);
-			M_Vec3Cross(&v1, &v2, &normal);
-			tmpnormals[i] = normal;
-			M_Vec3Normalize(&normal, &normal);
-			normals[i] = normal;
+	// loads of the same file may be writing at once
+	dev = Cvar_Get("developer", 0);
+	Common_snprintf(tmpfile, STRINGLEN, "%s.%lx", cachefile, (unsigned long) load);
+	ok = false;
+	if(FS_FOpenFile(tmpfile, &fp, "wb") >= 0)
+	{
+		ok = CacheWrite(fp, &header, sizeof(header)) &&
+			CacheWrite(fp, cmats, sizeof(mdlcachematerial_t) * header.nummaterials) &&
+			CacheWrite(fp, cmapfiles, sizeof(mdlcachemapfile_t) * header.nummapfiles) &&
+			CacheWrite(fp, csubs, sizeof(mdlcachesubmesh_t) * header.numsubmeshes) &&
+			CacheWrite(fp, cranges, sizeof(mdlcacherange_t) * header.numranges) &&
+			CacheWrite(fp, ccells, sizeof(mdlcachecell_t) * header.numcells) &&
+			CacheWrite(fp, graph ? graph->boxes : NULL, sizeof(cellbox_t) * header.numcellboxes) &&
+			CacheWrite(fp, cportals, sizeof(mdlcacheportal_t) * header.numportals);
+		for(mat = load->materials; ok && mat; mat = mat->next)
+			ok = CacheWriteName(fp, mat->name);
+		for(mapfile = load->mapfiles; ok && mapfile; mapfile = mapfile->next)
+			ok = CacheWriteName(fp, mapfile->name);
+		for(submesh = mesh->submeshpool; ok && submesh; submesh = submesh->next)
+		{
+			ok = CacheWriteName(fp, submesh->name);
+			for(j = 0; ok && j < submesh->numranges; j++)
+				ok = CacheWriteName(fp, submesh->ranges[j].name);
 		}
-		sum.x = 0.0;
-		sum.y = 0.0;
-		sum.z = 0.0;
-		zero = sum;
-		shared = 0;
-		for(i = 0; i < submesh->numvertices; i++)
+		for(i = 0; ok && i < header.numcells; i++)
+			ok = CacheWriteName(fp, graph->cells[i].name);
+		ok = ok && CachePad(fp, namelength);
+		for(i = 0, submesh = mesh->submeshpool; ok && submesh; submesh = submesh->next, i++)
 		{
-			for(j = 0; j < submesh->numfaces; j++)
-			{
-				if(submesh->faces[j].vertexindex[0] == i ||
-				   submesh->faces[j].vertexindex[1] == i ||
-				   submesh->faces[j].vertexindex[2] == i)
-				{
-					M_Vec3Add(&sum, &tmpnormals[j], &sum);
-					shared++;
-				}
-			}
-			M_Vec3Divide(&sum, (real_t) (-shared), &submesh->normaldata[i]);
-			M_Vec3Normalize(&submesh->normaldata[i], &submesh->normaldata[i]);
-			sum = zero;
-			shared = 0;
+			ok = CacheWrite(fp, submesh->vertexdata, sizeof(vec3_t) * csubs[i].numvertices) &&
+				CacheWrite(fp, submesh->normaldata, sizeof(vec3_t) * csubs[i].numvertices) &&
+				CacheWrite(fp, submesh->texcoords, sizeof(vec2_t) * csubs[i].numtexcoords) &&
+				CacheWrite(fp, submesh->faces, sizeof(face_t) * MDL_NumFaces(submesh));
+		}
+		if(fflush(fp) || ferror(fp))
+			ok = false;
+		FS_FCloseFile(fp);
+		if(ok)
+			ok = FS_RenameFile(tmpfile, cachefile);
+		if(!ok)
+		{
+			FS_DataPath(tmpfile, tmppath);
+			remove(tmppath);
 		}
-		Z_Free(tmpnormals);
-		Z_Free(normals);
 	}
+	if(dev && dev->value)
+		Sys_Printf("MDL_ParseCached: %s %s\n", ok ? "wrote" : "couldn't write", cachefile);
+
+	Z_Free(cmats);
+	Z_Free(cmapfiles);
+	Z_Free(csubs);
+	Z_Free(cranges);
+	Z_Free(ccells);
+	Z_Free(cportals);
 }
 
 /*
@@ -1687,23 +9288,9 @@ FS_FOpenFile("file.tga", fd);
 */
 int FS_FOpenFile(char *filename, FILE **file, const char *mode)
 {
-	char *tmp;
-	char datadir2[STRINGLEN];
 	char openfile[STRINGLEN];
 
-	// check if file already includes datadir
-	if(strlen(filename) > (strlen(datadir) + 1))
-	{
-		tmp = Common_CopyString(filename);
-		tmp[strlen(datadir) + 1] = 0;
-		Common_snprintf(datadir2, STRINGLEN, "%s/", datadir);
-		if(!strcasecmp(tmp, datadir2)) // datadir already there
-			Common_snprintf(openfile, STRINGLEN, filename);
-		else                           // else add datadir
-			Common_snprintf(openfile, STRINGLEN, "%s/%s", datadir, filename);
-		Z_Free(tmp);
-	}
-
+	FS_DataPath(filename, openfile);
 	*file = fopen(openfile, mode);
 
 	if(*file)
@@ -1712,3 +9299,103 @@ int FS_FOpenFile(char *filename, FILE **file, const char *mode)
 	}
 	return -1;
 }
+
+/*
+==========================
+FS_DataPath()
+
+Puts DEMO_DATADIR in front of filename unless it's
+already there
+==========================
+*/
+static void FS_DataPath(char *filename, char *path)
+{
+	char datadir2[STRINGLEN];
+	int len;
+
+	Common_snprintf(datadir2, STRINGLEN, "%s/", datadir);
+	len = strlen(datadir2);
+	if(!strncasecmp(filename, datadir2, len)) // datadir already there
+		Common_snprintf(path, STRINGLEN, "%s", filename);
+	else                                     // else add datadir
+		Common_snprintf(path, STRINGLEN, "%s/%s", datadir, filename);
+}
+
+/*
+==========================
+FS_RenameFile()
+
+Replaces to with from, both in the data dir
+==========================
+*/
+boolean_t FS_RenameFile(char *from, char *to)
+{
+	char frompath[STRINGLEN];
+	char topath[STRINGLEN];
+
+	FS_DataPath(from, frompath);
+	FS_DataPath(to, topath);
+	// win32 won't rename over an existing file
+	remove(topath);
+	return rename(frompath, topath) ? false : true;
+}
+
+/*
+==========================
+FS_MapFile()
+
+Gives read-only access to a whole file in the data dir,
+mapped if the platform allows it and read into the zone
+in a single fread() otherwise
+==========================
+*/
+boolean_t FS_MapFile(char *filename, filemap_t *map)
+{
+	FILE *fp;
+	struct stat st;
+	int length;
+
+	map->data = NULL;
+	map->length = 0;
+	map->mapped = false;
+	map->mtime = 0;
+	if((length = FS_FOpenFile(filename, &fp, "rb")) < 0)
+		return false;
+
+	map->length = length;
+	if(!fstat(fileno(fp), &st))
+		map->mtime = (unsigned int) st.st_mtime;
+	if(length > 0 && (map->data = (unsigned char *) Sys_MapFile(fp, length)) != NULL)
+	{
+		map->mapped = true;
+	}
+	else
+	{
+		map->data = (unsigned char *) Z_MallocUninit(length + 1);
+		if((int) fread(map->data, 1, length, fp) != length)
+		{
+			Z_Free(map->data);
+			map->data = NULL;
+			FS_FCloseFile(fp);
+			return false;
+		}
+	}
+	FS_FCloseFile(fp);
+	return true;
+}
+
+/*
+==========================
+FS_UnmapFile()
+==========================
+*/
+void FS_UnmapFile(filemap_t *map)
+{
+	if(!map->data)
+		return;
+	if(map->mapped)
+		Sys_UnmapFile(map->data, map->length);
+	else
+		Z_Free(map->data);
+	map->data = NULL;
+}
@@ -33,6 +33,32 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 //===================================
 #define PRECISION PRECISION_SINGLE
 
+//===================================
+// zone heap profiler, 1 records the
+// allocation site of every zone block
+//===================================
+#ifndef Z_PROFILE
+#define Z_PROFILE 0
+#endif
+
+//===================================
+// SIMD kernels for mesh processing:
+// 0 off, 1 SSE, 2 AVX. Follows the
+// compiler's target flags, and needs
+// single precision
+//===================================
+#ifndef USE_SIMD
+  #if PRECISION != PRECISION_SINGLE
+    #define USE_SIMD 0
+  #elif defined(__AVX__)
+    #define USE_SIMD 2
+  #elif defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+    #define USE_SIMD 1
+  #else
+    #define USE_SIMD 0
+  #endif
+#endif
+
 #define PLATFORM_WIN32 1
 #define PLATFORM_LINUX 2
 
@@ -59,8 +85,10 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
   #define snprintf    _snprintf
   #define vsnprintf   _vsnprintf
   #define strcasecmp  _stricmp
+  #define strncasecmp _strnicmp
   #define	MAX_NUM_ARGVS	128
   #define INLINE __inline
+  #define THREADLOCAL __declspec(thread)
 #endif
 
 // GNU/Linux settings
@@ -75,6 +103,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
   #else
     #define INLINE __inline__
   #endif
+  #define THREADLOCAL __thread
 #endif
 
 #ifndef M_PI
@@ -90,6 +119,13 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #define BIGSTRINGLEN   1024
 #define BIGBUFFERLEN   65536
 
+// zone memory tags, Z_FreeTags() releases a whole tag at once
+#define TAG_GENERAL    0
+#define TAG_MESH       1
+#define TAG_TEXTURE    2
+#define TAG_STRING     3
+#define Z_MAXTAGS      16
+
 #define IMG_RGB   1
 #define IMG_RGBA  2
 
@@ -260,6 +296,7 @@ typedef struct material_s
 	unsigned char facebits;
 	unsigned int bumpmap;
 	boolean_t hasbumpmap;
+	unsigned int sortid;  // numbers materials for render queue keys
 	struct material_s *next;
 } material_t;
 
@@ -268,8 +305,60 @@ typedef struct
 	unsigned int vertexindex[3];
 } face_t;
 
+typedef struct
+{
+	unsigned char *data;
+	int length;
+	boolean_t mapped;  // false if data is a zone copy of the file
+	unsigned int mtime;  // modification time of the file
+} filemap_t;
+
 struct mesh_s;
 
+// one source object inside a merged submesh
+typedef struct
+{
+	char *name;
+	int firstface;
+	int numfaces;
+} drawrange_t;
+
+// a level of detail: a run of faces over the submesh's vertices
+typedef struct
+{
+	int firstface;
+	int numfaces;
+	real_t error;  // how far the level strays from the full one, in mesh units
+} submeshlod_t;
+
+#define MDL_MAXLODS        4     // levels a submesh can have, the full one included
+
+// a node of a submesh's bounding volume hierarchy
+typedef struct
+{
+	vec3_t mins;
+	int first;   // a leaf's first triangle, or an inner node's second child
+	vec3_t maxs;
+	int count;   // a leaf's triangles, or -1 - the axis an inner node is split on
+} bvhnode_t;
+
+// the full level's triangles, sorted into the leaves of a hierarchy
+typedef struct
+{
+	int numnodes;
+	bvhnode_t *nodes;      // depth first, so an inner node's first child follows it
+	int numtriangles;
+	real_t *triangles;     // a corner and the edges from it to the others, 9 per triangle
+	int *faces;            // face each triangle is
+} bvh_t;
+
+// submesh vertex stream formats
+#define VF_INTERLEAVED     0x01  // one stream holds every attribute, else one per attribute
+#define VF_QUANTISED       0x02  // positions are shorts across the submesh bounds
+#define VF_SHORTNORMALS    0x04  // quantised normals are shorts rather than bytes
+#define VF_HALFTEXCOORDS   0x08  // quantised texcoords are half floats rather than shorts
+#define VF_ANIMATED        0x10  // positions and normals are posed into one stream each frame
+
 typedef struct submesh_s
 {
 	char *name;
@@ -280,10 +369,43 @@ typedef struct submesh_s
 	unsigned int vertexvboid;
 	unsigned int normalvboid;
 	unsigned int texcoordvboid;
+	unsigned int indexvboid;
+	unsigned int indextype;      // GL type of the indices in indexvboid
+	int vertexformat;            // VF_ flags the stream was built with
+	int vertexstride;            // bytes per vertex in the interleaved stream
+	void *streamdata;            // interleaved stream when there are no VBOs
+	real_t positionscale;        // position = positionbias + stored * positionscale
+	vec3_t positionbias;
+	vec2_t texcoordscale;        // texcoord = texcoordbias + stored * texcoordscale
+	vec2_t texcoordbias;
 	vec3_t *vertexdata;
 	vec3_t *normaldata;
 	vec2_t *texcoords;
 	face_t *faces;
+	unsigned int *smoothgroups;  // per face, only kept until normals are built
+	real_t loadacmr;             // vertex cache misses per face as loaded..
+	real_t acmr;                 // ..and as drawn
+	int numranges;               // objects merged into this one, 0 if not merged
+	drawrange_t *ranges;
+	int numlods;                 // 0 if the faces are the only level, else the first is them
+	submeshlod_t lods[MDL_MAXLODS];  // coarser levels follow the full one in faces
+	int lod;                     // level to draw, from GL_SelectMeshLods()
+	bvh_t *bvh;                  // for MDL_TraceMesh(), NULL if not built
+	vec3_t mins;
+	vec3_t maxs;
+	vec3_t centre;               // bounding sphere, centred on the box
+	real_t radius;
+	boolean_t culled;            // outside the view at the last GL_CullMesh(), or hidden
+	boolean_t occluder;          // drawn into the occlusion buffer at the last MDL_DrawOccluders()
+	unsigned int queryid;        // GL occlusion query, 0 until the first one is issued
+	int queryframe;              // query frame the query in flight went out in, 0 if none
+	int queryphase;              // staggers the re-checks of visible submeshes
+	boolean_t queryhidden;       // the last query passed no samples
+	int queryseen;               // query frame it was last in view at GL_QueryMesh()
+	int cell;                    // cell its centre is in, -1 if none, so merges keep to a cell
+	boolean_t mapped;            // arrays point into the parent's cache mapping
+	boolean_t animated;          // moved by a keyframer node, vertexdata is the rest pose
+	int node;                    // index of the node in the parent's animation
 	boolean_t hasvertexprogram;
 	unsigned int vertexprogramid;
 	boolean_t hasfragmentprogram;
@@ -292,13 +414,148 @@ typedef struct submesh_s
 	struct submesh_s *next;
 } submesh_t;
 
+// keyframer tracks of a node
+#define ANIM_POSITION    0
+#define ANIM_ROTATION    1
+#define ANIM_SCALE       2
+#define ANIM_NUMTRACKS   3
+
+#define ANIM_FPS         30  // keyframer frames a second
+
+// a run of keys in the animation's key arrays
+typedef struct
+{
+	int firstkey;
+	int numkeys;
+	int cursor;  // key the last evaluation ended up at
+} animtrack_t;
+
+typedef struct
+{
+	char *name;
+	int parent;                          // index of the parent node, -1 at the root
+	animtrack_t tracks[ANIM_NUMTRACKS];
+	real_t objectinverse[12];            // mesh vertices to the node's space, 3x4 row major
+} animnode_t;
+
+// the nodes of a mesh that move, and their static ancestors.
+// Nodes are sorted by depth, so parents come before children
+typedef struct animation_s
+{
+	int numnodes;
+	int padnodes;      // numnodes rounded up to the SIMD width
+	animnode_t *nodes;
+	int numlevels;
+	int *levels;       // first node of each depth, numlevels + 1 entries
+	int numkeys;
+	real_t *keyframes;
+	vec4_t *keyvalues; // positions and scales in x y z, rotations as quaternions
+	real_t firstframe; // the segment that plays, looped
+	real_t lastframe;
+	real_t *curves;    // SoA scratch the tracks are evaluated into
+	real_t *world;     // 3x4 row major per node, as last evaluated
+	real_t *skin;      // 3x4 row major per node, rest pose vertices to posed ones
+} animation_t;
+
+// cells and portals come as 3DS objects named starting with exactly
+// these, or from a side file named after the model plus CELL_FILEEXT
+#define CELL_OBJECT        "cell_"
+#define CELL_PORTALOBJECT  "portal_"
+#define CELL_FILEEXT       ".portals"
+#define CELL_MAXPOINTS     16  // corners a portal may have
+
+// a room of an indoor level, the union of its boxes
+typedef struct
+{
+	char *name;
+	int firstbox;
+	int numboxes;
+	int firstportal;        // into the graph's cellportals
+	int numportals;
+	int numsubmeshes;       // those whose bounds reach into one of the boxes
+	submesh_t **submeshes;
+	int visframe;           // cull frame it was last reached in
+} cell_t;
+
+typedef struct
+{
+	vec3_t mins;
+	vec3_t maxs;
+	int cell;
+} cellbox_t;
+
+// a convex opening from the cell behind its plane to the one in front
+typedef struct
+{
+	int cells[2];
+	vec4_t plane;           // unit normal and w, so dot + w is the distance in front
+	int numpoints;
+	vec3_t points[CELL_MAXPOINTS];  // wound counterclockwise about the normal
+	int visframe;           // cull frame it was last seen through in
+} portal_t;
+
+typedef struct cellgraph_s
+{
+	int numcells;
+	cell_t *cells;
+	int numboxes;
+	cellbox_t *boxes;
+	int numportals;
+	portal_t *portals;
+	int *cellportals;       // the portals of each cell, one run per cell
+	int numoutside;         // submeshes in no cell or animated, only frustum culled
+	submesh_t **outside;
+	int maxsubmeshes;       // in the longest of the lists
+	int numsubmeshes;       // in the mesh
+	int numshown;           // submeshes shown at the last MDL_CullCells()..
+	submesh_t **shown;
+	boolean_t restculled;   // ..with every other one culled since
+	int visframe;
+	int reached;            // cells reached at the last MDL_CullCells()..
+	int entered;            // ..and portals seen through
+} cellgraph_t;
+
 typedef struct mesh_s
 {
 	char *name;
 	submesh_t *submeshpool;
+	vec3_t mins;
+	vec3_t maxs;
+	filemap_t cache;     // mesh cache the submesh arrays were loaded from, until uploaded
+	animation_t *anim;   // NULL if nothing in the mesh moves
+	cellgraph_t *cells;  // NULL if the mesh has no cells and portals
 	struct mesh_s *next;
 } mesh_t;
 
+// a ray through a mesh, in the mesh's space
+typedef struct
+{
+	vec3_t start;
+	vec3_t delta;         // start to the far end of the ray
+	real_t fraction;      // how far along delta to look, then where the nearest hit is
+	submesh_t *submesh;   // hit, NULL if none
+	int face;             // hit face of the submesh
+} trace_t;
+
+// a small depth buffer occluders are drawn into on the CPU.
+// Depths are 1/w, so bigger is nearer and 0 is nothing drawn
+#define OCC_WIDTH    256
+#define OCC_HEIGHT   192
+#define OCC_TILE     8     // pixels a side, each tile's are contiguous
+#define OCC_TILESX   (OCC_WIDTH / OCC_TILE)
+#define OCC_TILESY   (OCC_HEIGHT / OCC_TILE)
+
+typedef struct
+{
+	real_t depth[OCC_WIDTH * OCC_HEIGHT];     // tile by tile, a tile's rows bottom up
+	real_t tilemin[OCC_TILESX * OCC_TILESY];  // farthest depth in each tile..
+	real_t tilemax[OCC_TILESX * OCC_TILESY];  // ..and nearest
+	int occluders;   // submeshes drawn since the last MDL_ClearOcclusion()
+	int triangles;   // their triangles, after clipping
+	int tested;      // submeshes tested against the buffer..
+	int occluded;    // ..and found hidden
+} occlusion_t;
+
 typedef struct
 {
 	unsigned int format;
@@ -311,9 +568,73 @@ typedef struct
 {
     unsigned short int id;
     unsigned int length;
-    unsigned int bytesread;
+    unsigned char *data;  // first byte after the chunk header
+    unsigned char *end;   // one past the last byte of the chunk
 } chunk_t;
 
+typedef struct mdlmapfile_s
+{
+	material_t *material;
+	unsigned short int id;  // the map chunk naming the file
+	char *name;
+	struct mdlmapfile_s *next;
+} mdlmapfile_t;
+
+// keyframer track as read, before the nodes are sorted
+typedef struct
+{
+	int numkeys;
+	real_t *frames;
+	vec4_t *values;
+} mdltrack_t;
+
+typedef struct mdlnode_s
+{
+	char *name;
+	int id;        // hierarchy number parents are named by
+	int parentid;  // -1 at the root
+	vec3_t pivot;
+	mdltrack_t tracks[ANIM_NUMTRACKS];
+	struct mdlnode_s *next;
+} mdlnode_t;
+
+typedef struct mdlmeshmatrix_s
+{
+	submesh_t *submesh;
+	real_t matrix[12];  // object space to the mesh's, 3x4 row major
+	struct mdlmeshmatrix_s *next;
+} mdlmeshmatrix_t;
+
+// cell box or portal outline as read, before the graph is built
+typedef struct mdlcellobject_s
+{
+	char *name;
+	boolean_t portal;
+	int numpoints;
+	vec3_t *points;
+	struct mdlcellobject_s *next;
+} mdlcellobject_t;
+
+// MDL_ParseCached() flags
+#define MDL_MERGE    0x01  // merge submeshes that share a material
+#define MDL_NOCACHE  0x02  // neither read nor write the mesh cache
+#define MDL_LOD      0x04  // build coarser levels of detail
+#define MDL_BVH      0x08  // build hierarchies for MDL_TraceMesh()
+
+// state of one mesh load, so several can run at once
+typedef struct
+{
+	char *filename;
+	mesh_t *mesh;
+	material_t *materials;   // not in the material pool until MDL_Finish3DS()
+	mdlmapfile_t *mapfiles;  // textures for MDL_Finish3DS() to load
+	mdlnode_t *nodes;        // keyframer nodes and object matrices,
+	mdlmeshmatrix_t *meshmatrices;  // only while parsing
+	mdlcellobject_t *cellobjects;   // cells and portals, only while parsing
+	int firstframe;          // keyframer segment
+	int lastframe;
+} mdlload_t;
+
 #define PITCH         0
 #define YAW           1
 #define ROLL          2
@@ -343,7 +664,30 @@ extern void DM_MouseMotionInput(int, int);
 extern void Z_Free(void *);
 extern void Z_Stats_f(void);
 extern void Z_FreeTags(int);
+extern void *Z_TagMalloc(int, int);
+extern void *Z_TagMallocUninit(int, int);
 extern void *Z_Malloc(int);
+extern void *Z_MallocUninit(int);
+#if Z_PROFILE
+extern void *Z_TagMallocSite(int, int, boolean_t, const char *, int);
+extern void Z_Profile_f(void);
+extern void Z_ProfileDump(char *);
+#define Z_TagMalloc(size, tag)        Z_TagMallocSite((size), (tag), true, __FILE__, __LINE__)
+#define Z_TagMallocUninit(size, tag)  Z_TagMallocSite((size), (tag), false, __FILE__, __LINE__)
+#define Z_Malloc(size)                Z_TagMallocSite((size), TAG_GENERAL, true, __FILE__, __LINE__)
+#define Z_MallocUninit(size)          Z_TagMallocSite((size), TAG_GENERAL, false, __FILE__, __LINE__)
+#endif
+extern void *Z_PoolMalloc(int);
+extern void Z_PoolFree(void *);
+extern void *Z_FrameAlloc(int, int);
+extern void Z_FrameReset(void);
+typedef boolean_t (*zevictfunc_t)(int, int);
+extern void Z_SetBudget(int, char *);
+extern void Z_SetEvictCallback(int, zevictfunc_t);
+extern void Z_RunEvictions(void);
+extern void Z_EnableThreads(void);
+extern void Z_ThreadShutdown(void);
+extern void Z_Benchmark_f(void);
 extern void Common_PreFrame(void);
 extern void Common_PostFrame(void);
 extern void Common_snprintf(char *, int, char *, ...);
@@ -363,6 +707,7 @@ extern INLINE real_t M_Vec3Dot(vec3_t *, vec3_t *);
 extern INLINE void M_Vec3Cross(vec3_t *, vec3_t *, vec3_t *);
 extern INLINE void M_Vec3Normalize(vec3_t *, vec3_t *);
 extern INLINE void M_MakeIdentity4x4(mat4x4_t *);
+extern void M_MultMatrix4x4(mat4x4_t *, mat4x4_t *, mat4x4_t *);
 extern real_t Cvar_VariableValue(char *);
 extern char *Cvar_VariableString(char *);
 extern cvar_t *Cvar_Get(char *, char *);
@@ -373,9 +718,33 @@ extern void Cvar_Init(void);
 extern void Cvar_Cleanup(void);
 extern boolean_t IMG_LoadTGA(image_t *, char *);
 extern boolean_t MDL_Load3DS(mesh_t *, char *);
+extern boolean_t MDL_Parse3DS(mdlload_t *, mesh_t *, char *);
+extern boolean_t MDL_ParseCached(mdlload_t *, mesh_t *, char *, int);
+extern void MDL_Finish3DS(mdlload_t *);
+extern void MDL_Abort3DS(mdlload_t *);
+extern void MDL_LoadTest(char **, int *, int, int);
+extern int MDL_NumFaces(submesh_t *);
+extern void MDL_SubmeshSphere(submesh_t *);
+extern int MDL_CullSubmeshes(mesh_t *, vec4_t *, int);
+extern void MDL_TraceMesh(mesh_t *, trace_t *, int);
+extern void MDL_TraceBenchmark(mesh_t *);
+extern void MDL_ClearOcclusion(occlusion_t *);
+extern void MDL_DrawOccluders(occlusion_t *, mesh_t *, mat4x4_t *);
+extern void MDL_ShutdownOcclusion(void);
+extern int MDL_OccludeSubmeshes(occlusion_t *, mesh_t *, mat4x4_t *);
+extern int MDL_CullCells(mesh_t *, vec3_t *, vec4_t *, int, real_t);
+extern submesh_t *MDL_FirstShown(mesh_t *, int *);
+extern submesh_t *MDL_NextShown(mesh_t *, submesh_t *, int *);
+extern void MDL_FreeCells(cellgraph_t *);
+extern void MDL_AnimateNodes(animation_t *, real_t);
+extern void MDL_PoseSubmesh(submesh_t *, animation_t *, real_t *);
+extern void MDL_FreeAnimation(animation_t *);
 extern int FS_FileLength(FILE *);
 extern void FS_FCloseFile(FILE *);
 extern int FS_FOpenFile(char *, FILE **, const char *);
+extern boolean_t FS_MapFile(char *, filemap_t *);
+extern void FS_UnmapFile(filemap_t *);
+extern boolean_t FS_RenameFile(char *, char *);
 
 // common_[linux|win32].c
 extern void Sys_Printf(char *, ...);
@@ -384,6 +753,24 @@ extern void Sys_Warn(char *, ...);
 extern void Sys_Log(const char *, int);
 extern void Sys_Init(void);
 extern unsigned long int Sys_GetMilliseconds(void);
+extern void *Sys_PageAlloc(int, boolean_t, boolean_t);
+extern void Sys_PageFree(void *, int);
+extern void *Sys_MapFile(FILE *, int);
+extern void Sys_UnmapFile(void *, int);
+extern void *Sys_CreateThread(void (*)(void *), void *);
+extern void Sys_JoinThread(void *);
+extern int Sys_NumProcessors(void);
+extern void *Sys_CreateMutex(void);
+extern void Sys_DestroyMutex(void *);
+extern void Sys_LockMutex(void *);
+extern void Sys_UnlockMutex(void *);
+extern void *Sys_CreateSemaphore(int);
+extern void Sys_DestroySemaphore(void *);
+extern void Sys_PostSemaphore(void *, int);
+extern void Sys_WaitSemaphore(void *);
+extern void *Sys_AtomicCompareExchangePtr(void *volatile *, void *, void *);
+extern void *Sys_AtomicExchangePtr(void *volatile *, void *);
+extern int Sys_AtomicAdd(volatile int *, int);
 extern void GLw_Init(void);
 extern void GLw_SetMode(void);
 extern void GLw_Shutdown(void);
@@ -39,17 +39,67 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include <GL/glu.h>
 
 mesh_t *GL_LoadMesh(char *, char *);
+meshload_t *GL_LoadMeshAsync(char *, char *, meshloadfunc_t);
+static void GL_MeshLoadThread(void *);
+static boolean_t GL_StepMeshLoad(meshload_t *, int, int *);
+static void GL_EndMeshLoad(meshload_t *);
+mesh_t *GL_WaitMeshLoad(meshload_t *);
+void GL_UpdateMeshLoads(void);
+void GL_FinishMeshLoads(void);
 mesh_t *GL_CreateMesh(char *);
 mesh_t *GL_GetMesh(char *);
 void GL_AddSubmesh(mesh_t *, submesh_t *);
 submesh_t *GL_GetSubmesh(mesh_t *, char *);
 void GL_DeleteSubmesh(mesh_t *, submesh_t *);
+static void GL_FreeSubmesh(submesh_t *);
 void GL_DeleteSubmeshPool(mesh_t *);
+void GL_MergeSubmeshes(mesh_t *);
+static boolean_t GL_CanMergeSubmeshes(submesh_t *, submesh_t *);
+static void GL_MergeSubmeshGroup(mesh_t *, submesh_t *);
 void GL_DeleteMesh(mesh_t *);
+void GL_FreeMesh(mesh_t *);
 void GL_DeleteMeshPool(void);
 void GL_GetSubmeshRenderoperation(submesh_t *, renderoperation_t *);
+static void GL_SetVertexAttrib(vertexattrib_t *, int, GLenum, int, int, unsigned int *, void *);
+static char *GL_BindVertexAttrib(vertexattrib_t *, GLuint *);
 void GL_RenderRenderoperation(renderoperation_t *);
+static boolean_t GL_DrawWithPrograms(renderoperation_t *);
+static void GL_DrawRenderoperation(renderoperation_t *);
+static void GL_SetStreamDecode(vertexformat_t *);
+void GL_QueueRenderoperation(renderoperation_t *, material_t *, int, real_t);
+static void GL_GrowRenderQueue(void);
+void GL_FlushRenderQueue(void);
+static sortkey_t GL_RenderKey(renderitem_t *, real_t);
+static renderkey_t *GL_SortRenderKeys(renderkey_t *, renderkey_t *, int);
+static void GL_SetRenderPass(int);
 void GL_PostProcessMesh(mesh_t *);
+static int GL_UploadSubmesh(submesh_t *, int);
+static int GL_UploadSubmeshIndices(submesh_t *);
+static int GL_UploadAnimatedSubmesh(submesh_t *);
+void GL_AnimateMesh(mesh_t *, real_t);
+void GL_SelectMeshLods(mesh_t *, vec3_t *);
+void GL_ViewFrustum(frustum_t *, vec3_t *);
+void GL_CullMesh(mesh_t *, vec3_t *);
+void GL_PickRay(int, int, vec3_t *, trace_t *);
+static void GL_MeshClip(vec3_t *, mat4x4_t *);
+void GL_ClearOcclusion(void);
+void GL_DrawOccluders(mesh_t *, vec3_t *);
+void GL_OccludeMesh(mesh_t *, vec3_t *);
+void GL_DrawOcclusionBuffer(void);
+void GL_DrawPortals(mesh_t *);
+static boolean_t GL_QueriesEnabled(void);
+static void GL_IssueQuery(submesh_t *);
+static boolean_t GL_QueryResult(submesh_t *, boolean_t);
+void GL_BeginQueries(void);
+void GL_QueryMesh(mesh_t *);
+static void GL_EndQuery(void);
+void GL_QuerySubmeshes(mesh_t *, vec3_t *);
+static void GL_DrawBox(vec3_t *, vec3_t *);
+static void GL_FreeSubmeshArrays(submesh_t *, boolean_t);
+static int GL_VertexFormat(void);
+static int GL_StreamLayout(int, boolean_t, int *, int *);
+static short int GL_QuantiseShort(real_t);
+static void *GL_InterleaveSubmesh(submesh_t *, int);
 void GL_PrintMeshInfo(mesh_t *);
 static int GL_GuessMeshType(char *);
 static void GL_LinkSubmesh(mesh_t *, submesh_t *);
@@ -62,11 +112,17 @@ boolean_t GL_LoadTexture(GLuint *, char *, boolean_t);
 void GL_DeleteAllTextures(material_t *);
 static GLenum GL_ScaleImage(image_t *, int, int);
 static GLenum GL_BuildMipmaps(image_t *, int *, char *);
+material_t *GL_NewMaterial(void);
 material_t *GL_CreateNULLMaterial(void);
+void GL_AddMaterial(material_t *);
 void GL_BindMaterial(material_t *);
+static void GL_SetMaterial(material_t *);
 material_t *GL_GetMaterial(char *);
 void GL_DeleteMaterialPool(void);
-static void GL_DeleteMaterial(material_t *);
+void GL_DeleteMaterial(material_t *);
+void GL_FreeMaterial(material_t *);
+static boolean_t GL_MaterialInUse(material_t *);
+boolean_t GL_EvictMaterials(int, int);
 static void GL_LinkMaterial(material_t *);
 static void GL_UnlinkMaterial(material_t *);
 void GL_SetViewport(void);
@@ -83,11 +139,23 @@ boolean_t GL_LoadFragmentProgram(submesh_t *, char *);
 const char *GL_ErrorString(GLenum);
 
 gl_capabilities_t glcaps;
+gl_stats_t glstats;
 
 static GLuint fontlist;
 static GLuint fonttex;
 static mesh_t *meshpool = NULL;
+static meshload_t *meshloads = NULL;  // background loads, oldest first
 static material_t *materialpool = NULL;
+static mat4x4_t projectionmatrix;  // as last built by GL_Perspective()..
+static mat4x4_t viewmatrix;        // ..and GL_CameraLookAt()
+static occlusion_t *occlusion = NULL;  // allocated by the first GL_ClearOcclusion()
+static int queryframe = 0;             // counts GL_BeginQueries()
+static int querynextphase = 0;
+static renderitem_t *renderqueue = NULL;  // queued since the last GL_FlushRenderQueue()
+static renderkey_t *renderkeys = NULL;    // twice the room, the sort goes back and forth
+static int renderqueuelength = 0;
+static int renderqueuesize = 0;
+static unsigned int nextmaterialsortid = 0;
 
 extern int errno;
 
@@ -160,6 +228,232 @@ mesh_t *GL_LoadMesh(char *meshfile, char *meshname)
 	return NULL;
 }
 
+/*
+==========================
+GL_LoadMeshAsync()
+
+Starts loading a mesh on a worker thread and returns at
+once. The worker reads, parses and builds normals; what
+needs GL is done by GL_UpdateMeshLoads() a frame at a time,
+so only r_uploadbudget kilobytes of vertex data go to the
+GL per frame. When the mesh is linked in, callback (if any)
+gets it on the main thread, or gets NULL if it failed.
+
+The handle is valid until the callback has run
+==========================
+*/
+meshload_t *GL_LoadMeshAsync(char *meshfile, char *meshname, meshloadfunc_t callback)
+{
+	meshload_t *ml, **tail;
+	cvar_t *dev;
+
+	if(!meshfile)
+		return NULL;
+
+	dev = Cvar_Get("developer", 0);
+	if(dev && dev->value)
+		Sys_Printf("GL_LoadMeshAsync: loading %s..\n", meshfile);
+
+	ml = (meshload_t *) Z_PoolMalloc(sizeof(*ml));
+	ml->meshfile = Common_CopyString(meshfile);
+	ml->meshname = meshname ? Common_CopyString(meshname) : NULL;
+	ml->callback = callback;
+	ml->mesh = GL_CreateMesh(NULL);
+	ml->flags = MDL_BVH;
+	if(Cvar_VariableValue("r_mergesubmeshes"))
+		ml->flags |= MDL_MERGE;
+	if(!Cvar_VariableValue("r_meshcache"))
+		ml->flags |= MDL_NOCACHE;
+	if(Cvar_VariableValue("r_lod"))
+		ml->flags |= MDL_LOD;
+	ml->vertexformat = GL_VertexFormat();
+	ml->parsed = 0;
+	ml->finished = false;
+	ml->upload = NULL;
+	ml->next = NULL;
+	for(tail = &meshloads; *tail != NULL; tail = &(*tail)->next)
+		;
+	*tail = ml;
+
+	ml->thread = Sys_CreateThread(GL_MeshLoadThread, ml);
+	if(!ml->thread)
+		GL_MeshLoadThread(ml);
+
+	return ml;
+}
+
+/*
+==========================
+GL_MeshLoadThread()
+==========================
+*/
+void GL_MeshLoadThread(void *data)
+{
+	meshload_t *ml;
+
+	ml = (meshload_t *) data;
+	if(GL_GuessMeshType(ml->meshfile) == MDL_UNKNOWN)
+		Sys_Warn("GL_LoadMeshAsync: couldn't guess mesh type for %s, trying to load..\n", ml->meshfile);
+	if(!MDL_ParseCached(&ml->load, ml->mesh, ml->meshfile, ml->flags))
+	{
+		Sys_AtomicAdd(&ml->parsed, -1);
+		return;
+	}
+	Sys_AtomicAdd(&ml->parsed, 1);
+}
+
+/*
+==========================
+GL_StepMeshLoad()
+
+Takes a load as far as it can go this frame, uploading
+submeshes until uploaded reaches budget. Returns true
+once the load is over, successful or not
+==========================
+*/
+boolean_t GL_StepMeshLoad(meshload_t *ml, int budget, int *uploaded)
+{
+	if(Sys_AtomicAdd(&ml->parsed, 0) == 0)
+		return false;
+	if(ml->thread)
+	{
+		Sys_JoinThread(ml->thread);
+		ml->thread = NULL;
+	}
+	if(ml->parsed < 0)
+	{
+		GL_DeleteMesh(ml->mesh);
+		ml->mesh = NULL;
+		return true;
+	}
+
+	if(!ml->finished)
+	{
+		MDL_Finish3DS(&ml->load);
+		ml->finished = true;
+		ml->upload = ml->mesh->submeshpool;
+	}
+	// always let one submesh through so a large one can't stall
+	while(ml->upload && (*uploaded == 0 || *uploaded < budget))
+	{
+		*uploaded += GL_UploadSubmesh(ml->upload, ml->vertexformat);
+		ml->upload = ml->upload->next;
+	}
+	if(ml->upload)
+		return false;
+	if(extgl_Extensions.ARB_vertex_buffer_object)
+		FS_UnmapFile(&ml->mesh->cache);
+
+	if(ml->meshname)
+	{
+		if(ml->mesh->name)
+			Z_Free(ml->mesh->name);
+		ml->mesh->name = Common_CopyString(ml->meshname);
+	}
+	GL_LinkMesh(ml->mesh);
+	return true;
+}
+
+/*
+==========================
+GL_EndMeshLoad()
+
+Hands a finished load to its callback and frees it.
+It must already be off the load list
+==========================
+*/
+void GL_EndMeshLoad(meshload_t *ml)
+{
+	if(ml->callback)
+		ml->callback(ml->mesh, ml->meshfile);
+	Z_Free(ml->meshfile);
+	if(ml->meshname)
+		Z_Free(ml->meshname);
+	Z_PoolFree(ml);
+}
+
+/*
+==========================
+GL_WaitMeshLoad()
+
+Finishes one background load right away, ignoring the
+upload budget, and returns the mesh (NULL on failure).
+The callback still runs, and the handle is gone after
+==========================
+*/
+mesh_t *GL_WaitMeshLoad(meshload_t *ml)
+{
+	meshload_t **prev;
+	mesh_t *mesh;
+	int uploaded;
+
+	if(!ml)
+		return NULL;
+	if(ml->thread)
+	{
+		Sys_JoinThread(ml->thread);
+		ml->thread = NULL;
+	}
+	uploaded = 0;
+	GL_StepMeshLoad(ml, 0x7fffffff, &uploaded);
+
+	for(prev = &meshloads; *prev != ml; prev = &(*prev)->next)
+		;
+	*prev = ml->next;
+	mesh = ml->mesh;
+	GL_EndMeshLoad(ml);
+
+	return mesh;
+}
+
+/*
+==========================
+GL_UpdateMeshLoads()
+
+Called once a frame on the main thread
+==========================
+*/
+void GL_UpdateMeshLoads(void)
+{
+	meshload_t *ml, **prev;
+	cvar_t *uploadbudget;
+	int budget, uploaded;
+
+	if(!meshloads)
+		return;
+
+	uploadbudget = Cvar_Get("r_uploadbudget", 0);
+	budget = uploadbudget ? (int) uploadbudget->value * 1024 : 0;
+	if(budget <= 0)
+		budget = 0x7fffffff;
+
+	uploaded = 0;
+	prev = &meshloads;
+	while((ml = *prev) != NULL)
+	{
+		if(GL_StepMeshLoad(ml, budget, &uploaded))
+		{
+			*prev = ml->next;
+			GL_EndMeshLoad(ml);
+		}
+		else
+			prev = &ml->next;
+	}
+}
+
+/*
+==========================
+GL_FinishMeshLoads()
+
+Waits for every background load to complete
+==========================
+*/
+void GL_FinishMeshLoads(void)
+{
+	while(meshloads)
+		GL_WaitMeshLoad(meshloads);
+}
+
 /*
 ==========================
 GL_CreateMesh()
@@ -172,13 +466,16 @@ mesh_t *GL_CreateMesh(char *meshname)
 {
 	mesh_t *newmesh;
 
-	newmesh = (mesh_t *) Z_Malloc(sizeof(*newmesh));
+	newmesh = (mesh_t *) Z_PoolMalloc(sizeof(*newmesh));
 
 	if(meshname)
 		newmesh->name = Common_CopyString(meshname);
 	else
 		newmesh->name = NULL;
 	newmesh->submeshpool = NULL;
+	newmesh->cache.data = NULL;
+	newmesh->anim = NULL;
+	newmesh->cells = NULL;
 	newmesh->next = NULL;
 
 	return newmesh;
@@ -235,243 +532,2104 @@ submesh_t *GL_GetSubmesh(mesh_t *mesh, char *submeshname)
 
 /*
 ==========================
-GL_DeleteSubmesh()
+GL_DeleteSubmesh()
+==========================
+*/
+void GL_DeleteSubmesh(mesh_t *mesh, submesh_t *submesh)
+{
+	cvar_t *dev;
+
+	if(mesh == NULL || submesh == NULL)
+		return;
+
+	dev = Cvar_Get("developer", 0);
+	if(dev && dev->value)
+		Sys_Printf("GL_DeleteSubmesh: deleting submesh %s from %s..\n",
+				   submesh->name, mesh->name);
+	GL_UnlinkSubmesh(mesh, submesh);
+	if(submesh->queryid)
+	{
+		if(glcaps.occlusionqueries == QUERY_ARB)
+			glDeleteQueriesARB(1, &submesh->queryid);
+		else
+			glDeleteOcclusionQueriesNV(1, &submesh->queryid);
+	}
+	if(submesh->vertexvboid)
+	{
+		glDeleteBuffersARB(1, &submesh->vertexvboid);
+		glDeleteBuffersARB(1, &submesh->normalvboid);
+		glDeleteBuffersARB(1, &submesh->texcoordvboid);
+		glDeleteBuffersARB(1, &submesh->indexvboid);
+	}
+	GL_FreeSubmesh(submesh);
+}
+
+/*
+==========================
+GL_FreeSubmesh()
+
+Frees an unlinked submesh's system memory. Doesn't
+touch GL, so any thread may call it
+==========================
+*/
+static void GL_FreeSubmesh(submesh_t *submesh)
+{
+	int i;
+
+	if(submesh->name)
+		Z_Free(submesh->name);
+	// mapped arrays go with the parent's cache
+	if(submesh->vertexdata && !submesh->mapped)
+		Z_Free(submesh->vertexdata);
+	if(submesh->normaldata && !submesh->mapped)
+		Z_Free(submesh->normaldata);
+	if(submesh->texcoords && !submesh->mapped)
+		Z_Free(submesh->texcoords);
+	if(submesh->faces && !submesh->mapped)
+		Z_Free(submesh->faces);
+	if(submesh->streamdata)
+		Z_Free(submesh->streamdata);
+	if(submesh->smoothgroups)
+		Z_Free(submesh->smoothgroups);
+	if(submesh->bvh)
+		Z_Free(submesh->bvh);
+	for(i = 0; i < submesh->numranges; i++)
+		if(submesh->ranges[i].name)
+			Z_Free(submesh->ranges[i].name);
+	if(submesh->ranges)
+		Z_Free(submesh->ranges);
+	Z_PoolFree(submesh);
+}
+
+/*
+==========================
+GL_DeleteSubmeshPool()
+==========================
+*/
+void GL_DeleteSubmeshPool(mesh_t *mesh)
+{
+	submesh_t *submesh, *submesh2;
+
+	if(!mesh)
+		return;	
+	submesh = mesh->submeshpool;
+	while(submesh != NULL)
+	{
+		submesh2 = submesh->next;
+		GL_DeleteSubmesh(mesh, submesh);
+		submesh = submesh2;
+	}
+}
+
+/*
+==========================
+GL_MergeSubmeshes()
+
+Folds submeshes that draw with the same material and
+programs into one, so a mesh costs about one draw call
+per material. Each source object is kept as a named
+range of faces in the submesh it went into.
+
+Only submeshes still in system memory are merged, so
+this has to run before the mesh is uploaded. Doesn't
+touch GL, so a loader thread may call it
+==========================
+*/
+void GL_MergeSubmeshes(mesh_t *mesh)
+{
+	submesh_t *submesh, *other;
+
+	if(!mesh)
+		return;
+	for(submesh = mesh->submeshpool; submesh != NULL; submesh = submesh->next)
+	{
+		for(other = submesh->next; other != NULL; other = other->next)
+			if(GL_CanMergeSubmeshes(submesh, other))
+				break;
+		if(other)
+			GL_MergeSubmeshGroup(mesh, submesh);
+	}
+}
+
+/*
+==========================
+GL_CanMergeSubmeshes()
+==========================
+*/
+static boolean_t GL_CanMergeSubmeshes(submesh_t *a, submesh_t *b)
+{
+	if(!a->vertexdata || !b->vertexdata || !a->normaldata || !b->normaldata)
+		return false;
+	if(a->mapped || b->mapped)
+		return false;
+	// each moves with its own node
+	if(a->animated || b->animated)
+		return false;
+	// levels of detail are built over the merged submeshes
+	if(a->numlods || b->numlods)
+		return false;
+	// a mesh with cells is culled a cell at a time
+	if(a->cell != b->cell)
+		return false;
+	if(a->material != b->material)
+		return false;
+	if(a->hasvertexprogram != b->hasvertexprogram ||
+	   (a->hasvertexprogram && a->vertexprogramid != b->vertexprogramid))
+		return false;
+	if(a->hasfragmentprogram != b->hasfragmentprogram ||
+	   (a->hasfragmentprogram && a->fragmentprogramid != b->fragmentprogramid))
+		return false;
+	return true;
+}
+
+/*
+==========================
+GL_MergeSubmeshGroup()
+
+Appends every later submesh that can merge with first
+to it, and deletes them. Texcoords are zero for vertices
+of objects that had none
+==========================
+*/
+static void GL_MergeSubmeshGroup(mesh_t *mesh, submesh_t *first)
+{
+	submesh_t *submesh, *next;
+	vec3_t *vertexdata, *normaldata;
+	vec2_t *texcoords;
+	face_t *faces;
+	drawrange_t *ranges;
+	int numvertices, numfaces, numranges, i, j, k, n;
+	boolean_t hastexcoords;
+	real_t loadmisses, misses;
+
+	numvertices = numfaces = numranges = 0;
+	hastexcoords = false;
+	for(submesh = first; submesh != NULL; submesh = submesh->next)
+	{
+		if(submesh != first && !GL_CanMergeSubmeshes(first, submesh))
+			continue;
+		numvertices += submesh->numvertices;
+		numfaces += submesh->numfaces;
+		numranges += submesh->numranges ? submesh->numranges : 1;
+		if(submesh->texcoords && submesh->numtexcoords)
+			hastexcoords = true;
+	}
+
+	vertexdata = (vec3_t *) Z_TagMallocUninit(sizeof(vec3_t) * numvertices, TAG_MESH);
+	normaldata = (vec3_t *) Z_TagMallocUninit(sizeof(vec3_t) * numvertices, TAG_MESH);
+	texcoords = hastexcoords ? (vec2_t *) Z_TagMalloc(sizeof(vec2_t) * numvertices, TAG_MESH) : NULL;
+	faces = (face_t *) Z_TagMallocUninit(sizeof(face_t) * numfaces, TAG_MESH);
+	ranges = (drawrange_t *) Z_TagMallocUninit(sizeof(drawrange_t) * numranges, TAG_MESH);
+
+	numvertices = numfaces = numranges = 0;
+	loadmisses = misses = 0;
+	for(submesh = first; submesh != NULL; submesh = next)
+	{
+		next = submesh->next;
+		if(submesh != first && !GL_CanMergeSubmeshes(first, submesh))
+			continue;
+
+		memcpy(vertexdata + numvertices, submesh->vertexdata, sizeof(vec3_t) * submesh->numvertices);
+		memcpy(normaldata + numvertices, submesh->normaldata, sizeof(vec3_t) * submesh->numvertices);
+		if(texcoords && submesh->texcoords)
+		{
+			n = submesh->numtexcoords < submesh->numvertices ? submesh->numtexcoords : submesh->numvertices;
+			memcpy(texcoords + numvertices, submesh->texcoords, sizeof(vec2_t) * n);
+		}
+		for(i = 0; i < submesh->numfaces; i++)
+			for(k = 0; k < 3; k++)
+				faces[numfaces + i].vertexindex[k] = submesh->faces[i].vertexindex[k] + numvertices;
+
+		// the ranges take the names over from the submeshes
+		if(submesh->numranges)
+		{
+			for(j = 0; j < submesh->numranges; j++)
+			{
+				ranges[numranges] = submesh->ranges[j];
+				ranges[numranges++].firstface += numfaces;
+				submesh->ranges[j].name = NULL;
+			}
+		}
+		else
+		{
+			ranges[numranges].name = submesh->name ? Common_CopyString(submesh->name) : NULL;
+			ranges[numranges].firstface = numfaces;
+			ranges[numranges++].numfaces = submesh->numfaces;
+		}
+
+		if(submesh->mins.x < first->mins.x) first->mins.x = submesh->mins.x;
+		if(submesh->mins.y < first->mins.y) first->mins.y = submesh->mins.y;
+		if(submesh->mins.z < first->mins.z) first->mins.z = submesh->mins.z;
+		if(submesh->maxs.x > first->maxs.x) first->maxs.x = submesh->maxs.x;
+		if(submesh->maxs.y > first->maxs.y) first->maxs.y = submesh->maxs.y;
+		if(submesh->maxs.z > first->maxs.z) first->maxs.z = submesh->maxs.z;
+		loadmisses += submesh->loadacmr * submesh->numfaces;
+		misses += submesh->acmr * submesh->numfaces;
+		numvertices += submesh->numvertices;
+		numfaces += submesh->numfaces;
+		if(submesh != first)
+		{
+			GL_UnlinkSubmesh(mesh, submesh);
+			GL_FreeSubmesh(submesh);
+		}
+	}
+
+	Z_Free(first->vertexdata);
+	first->vertexdata = vertexdata;
+	Z_Free(first->normaldata);
+	first->normaldata = normaldata;
+	if(first->texcoords)
+		Z_Free(first->texcoords);
+	first->texcoords = texcoords;
+	if(first->faces)
+		Z_Free(first->faces);
+	first->faces = faces;
+	if(first->ranges)
+		Z_Free(first->ranges);
+	first->ranges = ranges;
+	first->numranges = numranges;
+	first->numvertices = numvertices;
+	first->numtexcoords = texcoords ? numvertices : 0;
+	first->numfaces = numfaces;
+	if(numfaces)
+	{
+		first->loadacmr = loadmisses / numfaces;
+		first->acmr = misses / numfaces;
+	}
+	MDL_SubmeshSphere(first);
+}
+
+/*
+==========================
+GL_DeleteMesh()
+==========================
+*/
+void GL_DeleteMesh(mesh_t *mesh)
+{
+	cvar_t *dev;
+
+	if(!mesh)
+		return;
+
+	dev = Cvar_Get("developer", 0);
+	if(dev && dev->value)
+		Sys_Printf("GL_DeleteMesh: deleting %s..\n", mesh->name ? mesh->name : "(null)");
+
+	GL_UnlinkMesh(mesh);
+	GL_DeleteSubmeshPool(mesh);
+	GL_FreeMesh(mesh);
+}
+
+/*
+==========================
+GL_FreeMesh()
+
+Frees a mesh that was never linked into the mesh pool
+nor uploaded, such as one a parse is thrown away from.
+Doesn't touch GL or the pool, so any thread may call it
+==========================
+*/
+void GL_FreeMesh(mesh_t *mesh)
+{
+	submesh_t *submesh, *nextsubmesh;
+
+	if(!mesh)
+		return;
+
+	for(submesh = mesh->submeshpool; submesh; submesh = nextsubmesh)
+	{
+		nextsubmesh = submesh->next;
+		GL_FreeSubmesh(submesh);
+	}
+	mesh->submeshpool = NULL;
+	FS_UnmapFile(&mesh->cache);
+	MDL_FreeAnimation(mesh->anim);
+	mesh->anim = NULL;
+	MDL_FreeCells(mesh->cells);
+	mesh->cells = NULL;
+	if(mesh->name)
+	{
+		Z_Free(mesh->name);
+		mesh->name = NULL;
+	}
+	Z_PoolFree(mesh);
+}
+
+/*
+==========================
+GL_DeleteMeshPool()
+==========================
+*/
+void GL_DeleteMeshPool(void)
+{
+	mesh_t *mesh, *mesh2;
+
+	mesh = meshpool;
+	while(mesh != NULL)
+	{
+		mesh2 = mesh->next;
+		GL_DeleteMesh(mesh);
+		mesh = mesh2;
+	}
+}
+
+/*
+==========================
+GL_GetSubmeshRenderoperation()
+==========================
+*/
+void GL_GetSubmeshRenderoperation(submesh_t *submesh, renderoperation_t *ro)
+{
+	vertexformat_t *fmt;
+	unsigned int *vboptr;
+	GLenum type;
+	int stride, normalofs, texcoordofs, texcomponents;
+	boolean_t vbo;
+
+	type = (PRECISION == PRECISION_SINGLE) ? GL_FLOAT : GL_DOUBLE;
+	vbo = extgl_Extensions.ARB_vertex_buffer_object ? true : false;
+	fmt = &ro->format;
+
+	ro->rendermode = RM_TRIANGLES;
+	ro->numvertices = submesh->numvertices * 3;
+	texcomponents = submesh->numtexcoords ? 2 : 0;
+	if(submesh->vertexformat & VF_ANIMATED)
+	{
+		// the posed stream changes every frame, the texcoords never do
+		stride = submesh->vertexstride;
+		vboptr = vbo ? &submesh->vertexvboid : NULL;
+		GL_SetVertexAttrib(&fmt->vertex, 3, type, stride, 0, vboptr, submesh->streamdata);
+		GL_SetVertexAttrib(&fmt->normal, 3, type, stride, 3 * sizeof(real_t), vboptr, submesh->streamdata);
+		GL_SetVertexAttrib(&fmt->texcoord, texcomponents, type, 2 * sizeof(real_t), 0,
+						   vbo ? &submesh->texcoordvboid : NULL, submesh->texcoords);
+	}
+	else if(submesh->vertexformat & VF_INTERLEAVED)
+	{
+		stride = GL_StreamLayout(submesh->vertexformat, texcomponents != 0, &normalofs, &texcoordofs);
+		vboptr = vbo ? &submesh->vertexvboid : NULL;
+		if(submesh->vertexformat & VF_QUANTISED)
+		{
+			GL_SetVertexAttrib(&fmt->vertex, 3, GL_SHORT, stride, 0, vboptr, submesh->streamdata);
+			GL_SetVertexAttrib(&fmt->normal, 3, (submesh->vertexformat & VF_SHORTNORMALS) ? GL_SHORT : GL_BYTE,
+							   stride, normalofs, vboptr, submesh->streamdata);
+			GL_SetVertexAttrib(&fmt->texcoord, texcomponents,
+							   (submesh->vertexformat & VF_HALFTEXCOORDS) ? GL_HALF_FLOAT_NV : GL_SHORT,
+							   stride, texcoordofs, vboptr, submesh->streamdata);
+		}
+		else
+		{
+			GL_SetVertexAttrib(&fmt->vertex, 3, type, stride, 0, vboptr, submesh->streamdata);
+			GL_SetVertexAttrib(&fmt->normal, 3, type, stride, normalofs, vboptr, submesh->streamdata);
+			GL_SetVertexAttrib(&fmt->texcoord, texcomponents, type, stride, texcoordofs, vboptr, submesh->streamdata);
+		}
+	}
+	else
+	{
+		GL_SetVertexAttrib(&fmt->vertex, 3, type, 3 * sizeof(real_t), 0,
+						   vbo ? &submesh->vertexvboid : NULL, submesh->vertexdata);
+		GL_SetVertexAttrib(&fmt->normal, (vbo || submesh->normaldata) ? 3 : 0, type, 3 * sizeof(real_t), 0,
+						   vbo ? &submesh->normalvboid : NULL, submesh->normaldata);
+		GL_SetVertexAttrib(&fmt->texcoord, texcomponents, type, 2 * sizeof(real_t), 0,
+						   vbo ? &submesh->texcoordvboid : NULL, submesh->texcoords);
+	}
+	fmt->decodeposition = (submesh->vertexformat & VF_QUANTISED) ? true : false;
+	fmt->positionscale = submesh->positionscale;
+	fmt->positionbias = submesh->positionbias;
+	fmt->decodetexcoord = (submesh->vertexformat & VF_QUANTISED) && !(submesh->vertexformat & VF_HALFTEXCOORDS);
+	fmt->texcoordscale = submesh->texcoordscale;
+	fmt->texcoordbias = submesh->texcoordbias;
+
+	if(vbo)
+	{
+		ro->indexvboptr = &submesh->indexvboid;
+		ro->indextype = submesh->indextype;
+	}
+	else
+	{
+		ro->indexvboptr = NULL;
+		ro->indextype = GL_UNSIGNED_INT;
+	}
+	ro->usefaceindices = true;
+	if(submesh->numlods)
+	{
+		ro->firstfaceindex = submesh->lods[submesh->lod].firstface * 3;
+		ro->numfaceindices = submesh->lods[submesh->lod].numfaces * 3;
+	}
+	else
+	{
+		ro->firstfaceindex = 0;
+		ro->numfaceindices = submesh->numfaces * 3;
+	}
+	ro->faceindices = submesh->faces;
+	ro->hasvp = submesh->hasvertexprogram;
+	ro->vpidptr = &submesh->vertexprogramid;
+	ro->hasfp = submesh->hasfragmentprogram;
+	ro->fpidptr = &submesh->fragmentprogramid;
+}
+
+/*
+==========================
+GL_SetVertexAttrib()
+==========================
+*/
+static void GL_SetVertexAttrib(vertexattrib_t *attrib, int components, GLenum type, int stride,
+							   int offset, unsigned int *vboptr, void *data)
+{
+	attrib->components = components;
+	attrib->type = type;
+	attrib->stride = stride;
+	attrib->offset = offset;
+	attrib->vboptr = vboptr;
+	attrib->data = vboptr ? NULL : data;
+}
+
+/*
+==========================
+GL_BindVertexAttrib()
+
+Binds the attribute's buffer unless it's bound already,
+and returns the pointer to hand to gl*Pointer()
+==========================
+*/
+static char *GL_BindVertexAttrib(vertexattrib_t *attrib, GLuint *bound)
+{
+	GLuint buffer;
+
+	if(extgl_Extensions.ARB_vertex_buffer_object)
+	{
+		buffer = attrib->vboptr ? *attrib->vboptr : 0;
+		if(buffer != *bound)
+		{
+			glBindBufferARB(GL_ARRAY_BUFFER_ARB, buffer);
+			*bound = buffer;
+		}
+	}
+	return (char *) attrib->data + attrib->offset;
+}
+
+/*
+==========================
+GL_RenderRenderoperation()
+
+Draws with the renderoperation's programs turned on for
+just the draw. GL_QueueRenderoperation() leaves them on
+across draws that share them
+==========================
+*/
+void GL_RenderRenderoperation(renderoperation_t *ro)
+{
+	if(!GL_DrawWithPrograms(ro))
+		return;
+	glstats.draws++;
+	// each is turned on and off again
+	if(ro->hasvp)
+		glstats.programchanges += 2;
+	if(ro->hasfp)
+		glstats.programchanges += 2;
+}
+
+/*
+==========================
+GL_DrawWithPrograms()
+
+GL_RenderRenderoperation() without adding to glstats,
+for draws that aren't part of the frame's picture.
+Returns false if there was nothing to draw
+==========================
+*/
+static boolean_t GL_DrawWithPrograms(renderoperation_t *ro)
+{
+	if(!ro || !ro->rendermode || !ro->numvertices)
+		return false;
+
+	if(ro->hasvp)
+	{
+		glEnable(GL_VERTEX_PROGRAM_ARB);
+		glBindProgramARB(GL_VERTEX_PROGRAM_ARB, *ro->vpidptr);
+	}
+	if(ro->hasfp)
+	{
+		glEnable(GL_FRAGMENT_PROGRAM_ARB);
+		glBindProgramARB(GL_FRAGMENT_PROGRAM_ARB, *ro->fpidptr);
+	}
+	GL_DrawRenderoperation(ro);
+	if(ro->hasfp)
+		glDisable(GL_FRAGMENT_PROGRAM_ARB);
+	if(ro->hasvp)
+		glDisable(GL_VERTEX_PROGRAM_ARB);
+
+	return true;
+}
+
+/*
+==========================
+GL_DrawRenderoperation()
+
+Draws with whatever programs are bound, which have to be
+the renderoperation's. Attributes the format leaves out
+have their client arrays turned off for the draw. The
+caller counts the draw
+==========================
+*/
+static void GL_DrawRenderoperation(renderoperation_t *ro)
+{
+	GLenum rm;
+	vertexformat_t *fmt;
+	GLuint bound;
+	int indexsize;
+
+	fmt = &ro->format;
+	if(ro->hasvp)
+		GL_SetStreamDecode(fmt);
+	else
+	{
+		// the fixed pipeline decodes with the matrices
+		if(fmt->decodeposition)
+		{
+			glPushMatrix();
+			glTranslatef((GLfloat) fmt->positionbias.x, (GLfloat) fmt->positionbias.y, (GLfloat) fmt->positionbias.z);
+			glScalef((GLfloat) fmt->positionscale, (GLfloat) fmt->positionscale, (GLfloat) fmt->positionscale);
+			glEnable(GL_NORMALIZE);
+		}
+		if(fmt->decodetexcoord)
+		{
+			glMatrixMode(GL_TEXTURE);
+			glPushMatrix();
+			glTranslatef((GLfloat) fmt->texcoordbias.x, (GLfloat) fmt->texcoordbias.y, 0.0f);
+			glScalef((GLfloat) fmt->texcoordscale.x, (GLfloat) fmt->texcoordscale.y, 1.0f);
+			glMatrixMode(GL_MODELVIEW);
+		}
+	}
+
+	bound = (GLuint) -1;
+	if(fmt->normal.components)
+		glNormalPointer(fmt->normal.type, fmt->normal.stride, GL_BindVertexAttrib(&fmt->normal, &bound));
+	else
+		glDisableClientState(GL_NORMAL_ARRAY);
+	if(fmt->texcoord.components)
+		glTexCoordPointer(fmt->texcoord.components, fmt->texcoord.type, fmt->texcoord.stride,
+						  GL_BindVertexAttrib(&fmt->texcoord, &bound));
+	else
+		glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glVertexPointer(fmt->vertex.components, fmt->vertex.type, fmt->vertex.stride,
+					GL_BindVertexAttrib(&fmt->vertex, &bound));
+
+	switch(ro->rendermode)
+	{
+	case RM_TRIANGLES:      rm = GL_TRIANGLES;       break;
+	case RM_TRIANGLE_STRIP: rm = GL_TRIANGLE_STRIP;  break;
+	case RM_TRIANGLE_FAN:   rm = GL_TRIANGLE_FAN;    break;
+	case RM_POLYGON:        rm = GL_POLYGON;         break;
+	case RM_QUADS:          rm = GL_QUADS;           break;
+	case RM_QUAD_STRIP:     rm = GL_QUAD_STRIP;      break;
+	case RM_POINTS:         rm = GL_POINTS;          break;
+	case RM_LINES:          rm = GL_LINES;           break;
+	case RM_LINE_STRIP:     rm = GL_LINE_STRIP;      break;
+	case RM_LINE_LOOP:      rm = GL_LINE_LOOP;       break;
+	}
+	indexsize = (ro->indextype == GL_UNSIGNED_SHORT) ? sizeof(unsigned short int) : sizeof(unsigned int);
+	if(ro->usefaceindices && ro->indexvboptr)
+	{
+		glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, *ro->indexvboptr);
+		glDrawElements(rm, ro->numfaceindices, ro->indextype, (char *) NULL + ro->firstfaceindex * indexsize);
+		glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, 0);
+	}
+	else if(ro->usefaceindices)
+		glDrawElements(rm, ro->numfaceindices, ro->indextype,
+					   (char *) ro->faceindices + ro->firstfaceindex * indexsize);
+	else
+		glDrawArrays(rm, 0, ro->numvertices);
+
+	if(!fmt->normal.components)
+		glEnableClientState(GL_NORMAL_ARRAY);
+	if(!fmt->texcoord.components)
+		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	if(!ro->hasvp)
+	{
+		if(fmt->decodetexcoord)
+		{
+			glMatrixMode(GL_TEXTURE);
+			glPopMatrix();
+			glMatrixMode(GL_MODELVIEW);
+		}
+		if(fmt->decodeposition)
+		{
+			glDisable(GL_NORMALIZE);
+			glPopMatrix();
+		}
+	}
+}
+
+/*
+==========================
+GL_SetStreamDecode()
+
+Loads the VP_ENV_ parameters for the bound vertex program
+==========================
+*/
+static void GL_SetStreamDecode(vertexformat_t *fmt)
+{
+	if(fmt->decodeposition)
+	{
+		glProgramEnvParameter4fARB(GL_VERTEX_PROGRAM_ARB, VP_ENV_POSITIONSCALE, (GLfloat) fmt->positionscale,
+								   (GLfloat) fmt->positionscale, (GLfloat) fmt->positionscale, 0.0f);
+		glProgramEnvParameter4fARB(GL_VERTEX_PROGRAM_ARB, VP_ENV_POSITIONBIAS, (GLfloat) fmt->positionbias.x,
+								   (GLfloat) fmt->positionbias.y, (GLfloat) fmt->positionbias.z, 1.0f);
+	}
+	else
+	{
+		glProgramEnvParameter4fARB(GL_VERTEX_PROGRAM_ARB, VP_ENV_POSITIONSCALE, 1.0f, 1.0f, 1.0f, 1.0f);
+		glProgramEnvParameter4fARB(GL_VERTEX_PROGRAM_ARB, VP_ENV_POSITIONBIAS, 0.0f, 0.0f, 0.0f, 0.0f);
+	}
+	if(fmt->decodetexcoord)
+	{
+		glProgramEnvParameter4fARB(GL_VERTEX_PROGRAM_ARB, VP_ENV_TEXCOORDSCALE, (GLfloat) fmt->texcoordscale.x,
+								   (GLfloat) fmt->texcoordscale.y, 1.0f, 1.0f);
+		glProgramEnvParameter4fARB(GL_VERTEX_PROGRAM_ARB, VP_ENV_TEXCOORDBIAS, (GLfloat) fmt->texcoordbias.x,
+								   (GLfloat) fmt->texcoordbias.y, 0.0f, 0.0f);
+	}
+	else
+	{
+		glProgramEnvParameter4fARB(GL_VERTEX_PROGRAM_ARB, VP_ENV_TEXCOORDSCALE, 1.0f, 1.0f, 1.0f, 1.0f);
+		glProgramEnvParameter4fARB(GL_VERTEX_PROGRAM_ARB, VP_ENV_TEXCOORDBIAS, 0.0f, 0.0f, 0.0f, 0.0f);
+	}
+}
+
+/*
+==========================
+GL_QueueRenderoperation()
+
+Queues a draw for GL_FlushRenderQueue(), which draws the
+queue sorted so that draws sharing programs, texture and
+material follow each other. depth is the distance from
+the camera. With r_renderqueue 0 it draws at once, as
+GL_BindMaterial() and GL_RenderRenderoperation() would.
+The renderoperation is copied, but what it points to has
+to last until the flush
+==========================
+*/
+void GL_QueueRenderoperation(renderoperation_t *ro, material_t *material, int pass, real_t depth)
+{
+	renderitem_t *item;
+
+	if(!ro || !ro->rendermode || !ro->numvertices)
+		return;
+	if(!Cvar_VariableValue("r_renderqueue"))
+	{
+		if(material)
+			GL_BindMaterial(material);
+		GL_RenderRenderoperation(ro);
+		return;
+	}
+
+	if(renderqueuelength == renderqueuesize)
+		GL_GrowRenderQueue();
+	item = &renderqueue[renderqueuelength++];
+	item->pass = (pass == RQ_TRANSLUCENT) ? RQ_TRANSLUCENT : RQ_OPAQUE;
+	item->depth = depth;
+	item->material = material;
+	item->ro = *ro;
+}
+
+/*
+==========================
+GL_GrowRenderQueue()
+
+Doubles the room in the queue. It's kept from frame to
+frame, so this stops once it's big enough for a frame
+==========================
+*/
+static void GL_GrowRenderQueue(void)
+{
+	renderitem_t *items;
+	int size;
+
+	size = renderqueuesize ? renderqueuesize * 2 : 256;
+	items = (renderitem_t *) Z_MallocUninit(sizeof(renderitem_t) * size);
+	if(renderqueue)
+	{
+		memcpy(items, renderqueue, sizeof(renderitem_t) * renderqueuelength);
+		Z_Free(renderqueue);
+		Z_Free(renderkeys);
+	}
+	renderqueue = items;
+	renderkeys = (renderkey_t *) Z_MallocUninit(sizeof(renderkey_t) * size * 2);
+	renderqueuesize = size;
+}
+
+/*
+==========================
+GL_FlushRenderQueue()
+
+Draws and empties the queue, in order of the sort keys.
+A program, texture or material is only changed when it
+differs from the draw before's, and programs stay on
+until the end. Everything in the queue is drawn with the
+matrices current at the flush
+==========================
+*/
+void GL_FlushRenderQueue(void)
+{
+	renderkey_t *keys;
+	renderitem_t *item;
+	material_t *material;
+	GLuint vp, fp, itemvp, itemfp, texture;
+	real_t farclip;
+	int pass, i;
+
+	if(!renderqueuelength)
+		return;
+
+	farclip = Cvar_VariableValue("r_farclip");
+	for(i = 0; i < renderqueuelength; i++)
+	{
+		renderkeys[i].key = GL_RenderKey(&renderqueue[i], farclip);
+		renderkeys[i].item = i;
+	}
+	keys = GL_SortRenderKeys(renderkeys, renderkeys + renderqueuesize, renderqueuelength);
+
+	// 0 is never a program's name, so it stands for none
+	pass = RQ_OPAQUE;
+	vp = fp = 0;
+	material = NULL;
+	texture = 0;
+	for(i = 0; i < renderqueuelength; i++)
+	{
+		item = &renderqueue[keys[i].item];
+		if(item->pass != pass)
+		{
+			GL_SetRenderPass(item->pass);
+			pass = item->pass;
+		}
+		itemvp = item->ro.hasvp ? *item->ro.vpidptr : 0;
+		if(itemvp != vp)
+		{
+			if(!itemvp)
+				glDisable(GL_VERTEX_PROGRAM_ARB);
+			else
+			{
+				if(!vp)
+					glEnable(GL_VERTEX_PROGRAM_ARB);
+				glBindProgramARB(GL_VERTEX_PROGRAM_ARB, itemvp);
+			}
+			vp = itemvp;
+			glstats.programchanges++;
+		}
+		itemfp = item->ro.hasfp ? *item->ro.fpidptr : 0;
+		if(itemfp != fp)
+		{
+			if(!itemfp)
+				glDisable(GL_FRAGMENT_PROGRAM_ARB);
+			else
+			{
+				if(!fp)
+					glEnable(GL_FRAGMENT_PROGRAM_ARB);
+				glBindProgramARB(GL_FRAGMENT_PROGRAM_ARB, itemfp);
+			}
+			fp = itemfp;
+			glstats.programchanges++;
+		}
+		if(item->material && item->material != material)
+		{
+			material = item->material;
+			GL_SetMaterial(material);
+			// texture starts at 0 as what's bound before the flush isn't known
+			if(material->texmap1 && material->texmap1 != texture)
+			{
+				glBindTexture(GL_TEXTURE_2D, material->texmap1);
+				texture = material->texmap1;
+				glstats.texturechanges++;
+			}
+		}
+		GL_DrawRenderoperation(&item->ro);
+		glstats.draws++;
+	}
+	if(fp)
+		glDisable(GL_FRAGMENT_PROGRAM_ARB);
+	if(vp)
+		glDisable(GL_VERTEX_PROGRAM_ARB);
+	if(pass != RQ_OPAQUE)
+		GL_SetRenderPass(RQ_OPAQUE);
+	renderqueuelength = 0;
+}
+
+/*
+==========================
+GL_RenderKey()
+
+Packs the item's pass, programs, texture, material and
+depth into its sort key, most significant first. Names
+too big for their fields wrap, which only costs sorting.
+Translucent draws sort on depth right after the pass, so
+they are drawn back to front whatever they bind
+==========================
+*/
+static sortkey_t GL_RenderKey(renderitem_t *item, real_t farclip)
+{
+	sortkey_t key, state;
+	unsigned int vp, fp, texture, material, depth;
+	real_t d;
+
+	vp = item->ro.hasvp ? *item->ro.vpidptr : 0;
+	fp = item->ro.hasfp ? *item->ro.fpidptr : 0;
+	texture = item->material ? item->material->texmap1 : 0;
+	material = item->material ? item->material->sortid : 0;
+
+	d = (farclip > 0) ? item->depth / farclip : 0;
+	if(d < 0)
+		d = 0;
+	else if(d > 1)
+		d = 1;
+	depth = (unsigned int) (d * ((1 << RQ_DEPTHBITS) - 1));
+
+	state = vp & ((1 << RQ_PROGRAMBITS) - 1);
+	state = (state << RQ_PROGRAMBITS) | (fp & ((1 << RQ_PROGRAMBITS) - 1));
+	state = (state << RQ_TEXTUREBITS) | (texture & ((1 << RQ_TEXTUREBITS) - 1));
+	state = (state << RQ_MATERIALBITS) | (material & ((1 << RQ_MATERIALBITS) - 1));
+
+	key = item->pass;
+	if(item->pass == RQ_TRANSLUCENT)
+	{
+		depth = ((1 << RQ_DEPTHBITS) - 1) - depth;
+		key = (key << RQ_DEPTHBITS) | depth;
+		key = (key << (64 - RQ_PASSBITS - RQ_DEPTHBITS)) | state;
+	}
+	else
+	{
+		key = (key << (64 - RQ_PASSBITS - RQ_DEPTHBITS)) | state;
+		key = (key << RQ_DEPTHBITS) | depth;
+	}
+	return key;
+}
+
+/*
+==========================
+GL_SortRenderKeys()
+
+Least significant digit radix sort of the keys a byte at
+a time, going back and forth between keys and scratch.
+Bytes that are the same in every key are skipped, which
+in a frame are most of them. Equal keys keep the order
+they were queued in. Returns whichever holds the result
+==========================
+*/
+static renderkey_t *GL_SortRenderKeys(renderkey_t *keys, renderkey_t *scratch, int count)
+{
+	int counts[8][256];
+	renderkey_t *swap;
+	sortkey_t key;
+	int digit, offset, n, i;
+
+	memset(counts, 0, sizeof(counts));
+	for(i = 0; i < count; i++)
+	{
+		key = keys[i].key;
+		for(digit = 0; digit < 8; digit++)
+			counts[digit][(unsigned int) (key >> (digit * 8)) & 255]++;
+	}
+
+	for(digit = 0; digit < 8; digit++)
+	{
+		if(counts[digit][(unsigned int) (keys[0].key >> (digit * 8)) & 255] == count)
+			continue;
+		offset = 0;
+		for(i = 0; i < 256; i++)
+		{
+			n = counts[digit][i];
+			counts[digit][i] = offset;
+			offset += n;
+		}
+		for(i = 0; i < count; i++)
+			scratch[counts[digit][(unsigned int) (keys[i].key >> (digit * 8)) & 255]++] = keys[i];
+		swap = keys;
+		keys = scratch;
+		scratch = swap;
+	}
+	return keys;
+}
+
+/*
+==========================
+GL_SetRenderPass()
+
+Sets up the blending and depth writes of a render queue
+pass
+==========================
+*/
+static void GL_SetRenderPass(int pass)
+{
+	if(pass == RQ_TRANSLUCENT)
+	{
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		glDepthMask(GL_FALSE);
+	}
+	else
+	{
+		glDisable(GL_BLEND);
+		glDepthMask(GL_TRUE);
+	}
+}
+
+/*
+==========================
+GL_PostProcessMesh()
+
+Uploads the mesh. Once in VBOs, system memory copies are
+only kept for animated submeshes, which are posed from
+them every frame
+==========================
+*/
+void GL_PostProcessMesh(mesh_t *mesh)
+{
+	submesh_t *submesh;
+	int vertexformat;
+
+	if(Cvar_VariableValue("r_mergesubmeshes"))
+		GL_MergeSubmeshes(mesh);
+	vertexformat = GL_VertexFormat();
+	for(submesh = mesh->submeshpool; submesh != NULL; submesh = submesh->next)
+		GL_UploadSubmesh(submesh, vertexformat);
+	// nothing is drawn from the cache once it's all in VBOs
+	if(extgl_Extensions.ARB_vertex_buffer_object)
+		FS_UnmapFile(&mesh->cache);
+}
+
+/*
+==========================
+GL_UploadSubmesh()
+
+Moves one submesh into VBOs and returns the number
+of bytes uploaded. Mapped arrays go to the GL straight
+from the mesh cache. Indices are stored in 16 bits
+whenever they all fit.
+
+With VF_INTERLEAVED the vertex attributes go into one
+stream, so a draw binds one buffer and each vertex is
+fetched from one place. Without VBOs the stream is kept
+in system memory for the client arrays
+==========================
+*/
+int GL_UploadSubmesh(submesh_t *submesh, int vertexformat)
+{
+	int vertexsize, texcoordsize, streamsize;
+	void *stream;
+
+	if(submesh->animated && submesh->vertexdata && submesh->normaldata)
+		return GL_UploadAnimatedSubmesh(submesh);
+
+	stream = NULL;
+	if((vertexformat & VF_INTERLEAVED) && submesh->vertexdata && submesh->normaldata)
+		stream = GL_InterleaveSubmesh(submesh, vertexformat);
+	if(!extgl_Extensions.ARB_vertex_buffer_object)
+	{
+		if(stream)
+		{
+			submesh->streamdata = stream;
+			GL_FreeSubmeshArrays(submesh, false);
+		}
+		return 0;
+	}
+
+	vertexsize = submesh->numvertices * (3 * sizeof(real_t));
+	texcoordsize = submesh->numtexcoords * (2 * sizeof(real_t));
+
+	if(stream)
+	{
+		streamsize = submesh->numvertices * submesh->vertexstride;
+		glGenBuffersARB(1, &submesh->vertexvboid);
+		glBindBufferARB(GL_ARRAY_BUFFER_ARB, submesh->vertexvboid);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, streamsize, stream, GL_STATIC_DRAW_ARB);
+		Z_Free(stream);
+	}
+	else
+	{
+		streamsize = 2 * vertexsize + texcoordsize;
+		glGenBuffersARB(1, &submesh->vertexvboid);
+		glGenBuffersARB(1, &submesh->normalvboid);
+		glGenBuffersARB(1, &submesh->texcoordvboid);
+
+		glBindBufferARB(GL_ARRAY_BUFFER_ARB, submesh->vertexvboid);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, vertexsize, submesh->vertexdata, GL_STATIC_DRAW_ARB);
+
+		glBindBufferARB(GL_ARRAY_BUFFER_ARB, submesh->normalvboid);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, vertexsize, submesh->normaldata, GL_STATIC_DRAW_ARB);
+
+		glBindBufferARB(GL_ARRAY_BUFFER_ARB, submesh->texcoordvboid);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, texcoordsize, submesh->texcoords, GL_STATIC_DRAW_ARB);
+	}
+	streamsize += GL_UploadSubmeshIndices(submesh);
+
+	GL_FreeSubmeshArrays(submesh, true);
+
+	return streamsize;
+}
+
+/*
+==========================
+GL_UploadSubmeshIndices()
+
+Puts the faces of every level in an element array VBO
+and returns its size
+==========================
+*/
+static int GL_UploadSubmeshIndices(submesh_t *submesh)
+{
+	unsigned int *faceindices;
+	unsigned short int *shortindices;
+	void *indices;
+	int indexsize, numindices, i;
+
+	faceindices = (unsigned int *) submesh->faces;
+	numindices = MDL_NumFaces(submesh) * 3;
+	if(submesh->numvertices <= 0x10000)
+	{
+		indexsize = numindices * sizeof(unsigned short int);
+		shortindices = (unsigned short int *) Z_MallocUninit(indexsize + 1);
+		for(i = 0; i < numindices; i++)
+			shortindices[i] = (unsigned short int) faceindices[i];
+		indices = shortindices;
+		submesh->indextype = GL_UNSIGNED_SHORT;
+	}
+	else
+	{
+		indexsize = numindices * sizeof(unsigned int);
+		indices = faceindices;
+		submesh->indextype = GL_UNSIGNED_INT;
+	}
+
+	glGenBuffersARB(1, &submesh->indexvboid);
+	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, submesh->indexvboid);
+	glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER_ARB, indexsize, indices, GL_STATIC_DRAW_ARB);
+	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER_ARB, 0);
+	if(indices != faceindices)
+		Z_Free(indices);
+
+	return indexsize;
+}
+
+/*
+==========================
+GL_UploadAnimatedSubmesh()
+
+Animated submeshes keep their rest pose in system memory
+and are posed into one stream of positions and normals
+every frame. The stream gets a GL_STREAM_DRAW VBO and the
+texcoords and faces static ones. Without VBOs the stream
+is kept in system memory for the client arrays
+==========================
+*/
+static int GL_UploadAnimatedSubmesh(submesh_t *submesh)
+{
+	int streamsize, texcoordsize, n;
+	real_t *stream;
+	vec2_t *texcoords;
+	animation_t *anim;
+
+	// the texcoords are read for every vertex, zero for those without
+	if(submesh->texcoords && submesh->numtexcoords != submesh->numvertices)
+	{
+		texcoords = (vec2_t *) Z_TagMalloc(sizeof(vec2_t) * submesh->numvertices, TAG_MESH);
+		n = submesh->numtexcoords < submesh->numvertices ? submesh->numtexcoords : submesh->numvertices;
+		memcpy(texcoords, submesh->texcoords, sizeof(vec2_t) * n);
+		Z_Free(submesh->texcoords);
+		submesh->texcoords = texcoords;
+		submesh->numtexcoords = submesh->numvertices;
+	}
+
+	submesh->vertexformat = VF_ANIMATED;
+	submesh->vertexstride = 6 * sizeof(real_t);
+	streamsize = submesh->numvertices * submesh->vertexstride;
+	stream = (real_t *) Z_TagMallocUninit(streamsize + 1, TAG_MESH);
+	anim = submesh->parent->anim;
+	MDL_PoseSubmesh(submesh, anim, stream);
+	if(!extgl_Extensions.ARB_vertex_buffer_object)
+	{
+		submesh->streamdata = stream;
+		return 0;
+	}
+
+	texcoordsize = submesh->numtexcoords * (2 * sizeof(real_t));
+	glGenBuffersARB(1, &submesh->vertexvboid);
+	glBindBufferARB(GL_ARRAY_BUFFER_ARB, submesh->vertexvboid);
+	glBufferDataARB(GL_ARRAY_BUFFER_ARB, streamsize, stream, GL_STREAM_DRAW_ARB);
+	Z_Free(stream);
+	glGenBuffersARB(1, &submesh->texcoordvboid);
+	glBindBufferARB(GL_ARRAY_BUFFER_ARB, submesh->texcoordvboid);
+	glBufferDataARB(GL_ARRAY_BUFFER_ARB, texcoordsize, submesh->texcoords, GL_STATIC_DRAW_ARB);
+	glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
+
+	texcoordsize += GL_UploadSubmeshIndices(submesh);
+	if(submesh->texcoords)
+		Z_Free(submesh->texcoords);
+	submesh->texcoords = NULL;
+	if(submesh->faces)
+		Z_Free(submesh->faces);
+	submesh->faces = NULL;
+
+	return streamsize + texcoordsize;
+}
+
+/*
+==========================
+GL_AnimateMesh()
+
+Poses the mesh seconds into its animation. Each animated
+submesh's stream VBO is orphaned before it's mapped, so
+the driver hands out fresh memory instead of waiting for
+draws still reading last frame's pose
+==========================
+*/
+void GL_AnimateMesh(mesh_t *mesh, real_t seconds)
+{
+	submesh_t *submesh;
+	animation_t *anim;
+	real_t *stream;
+	int streamsize;
+	boolean_t vbo;
+
+	if(!mesh || !mesh->anim)
+		return;
+	anim = mesh->anim;
+	MDL_AnimateNodes(anim, seconds * ANIM_FPS);
+
+	vbo = extgl_Extensions.ARB_vertex_buffer_object ? true : false;
+	for(submesh = mesh->submeshpool; submesh != NULL; submesh = submesh->next)
+	{
+		if(!(submesh->vertexformat & VF_ANIMATED))
+			continue;
+		if(!vbo)
+		{
+			MDL_PoseSubmesh(submesh, anim, (real_t *) submesh->streamdata);
+			continue;
+		}
+
+		streamsize = submesh->numvertices * submesh->vertexstride;
+		glBindBufferARB(GL_ARRAY_BUFFER_ARB, submesh->vertexvboid);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, streamsize, NULL, GL_STREAM_DRAW_ARB);
+		stream = (real_t *) glMapBufferARB(GL_ARRAY_BUFFER_ARB, GL_WRITE_ONLY_ARB);
+		if(stream)
+		{
+			MDL_PoseSubmesh(submesh, anim, stream);
+			// a lost mapping just shows this frame's pose a frame late
+			glUnmapBufferARB(GL_ARRAY_BUFFER_ARB);
+		}
+		else
+		{
+			stream = (real_t *) Z_MallocUninit(streamsize + 1);
+			MDL_PoseSubmesh(submesh, anim, stream);
+			glBufferSubDataARB(GL_ARRAY_BUFFER_ARB, 0, streamsize, stream);
+			Z_Free(stream);
+		}
+	}
+	if(vbo)
+		glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
+
+	// the submeshes' bounds moved with them
+	for(submesh = mesh->submeshpool; submesh != NULL; submesh = submesh->next)
+	{
+		if(submesh == mesh->submeshpool)
+		{
+			mesh->mins = submesh->mins;
+			mesh->maxs = submesh->maxs;
+			continue;
+		}
+		if(submesh->mins.x < mesh->mins.x) mesh->mins.x = submesh->mins.x;
+		if(submesh->mins.y < mesh->mins.y) mesh->mins.y = submesh->mins.y;
+		if(submesh->mins.z < mesh->mins.z) mesh->mins.z = submesh->mins.z;
+		if(submesh->maxs.x > mesh->maxs.x) mesh->maxs.x = submesh->maxs.x;
+		if(submesh->maxs.y > mesh->maxs.y) mesh->maxs.y = submesh->maxs.y;
+		if(submesh->maxs.z > mesh->maxs.z) mesh->maxs.z = submesh->maxs.z;
+	}
+}
+
+/*
+==========================
+GL_SelectMeshLods()
+
+Picks the level each submesh is drawn at from viewpos,
+in the mesh's space. The coarsest level whose error
+projects to no more than r_lodbias pixels from the
+nearest point of the submesh's bounds is drawn, and one
+coarser than the last drawn has to get under
+LOD_HYSTERESIS of that, so a submesh sitting at the
+distance between two levels doesn't keep swapping them.
+r_lodbias 0 draws everything at the full level
+==========================
+*/
+#define LOD_HYSTERESIS  0.75f
+
+void GL_SelectMeshLods(mesh_t *mesh, vec3_t *viewpos)
+{
+	submesh_t *submesh;
+	real_t bias, height, pixels, distance, limit, dx, dy, dz;
+	int lod, i;
+
+	if(!mesh)
+		return;
+	bias = Cvar_VariableValue("r_lodbias");
+	height = Cvar_VariableValue("scr_height");
+	if(height <= 0)
+		height = 480;
+	// pixels a unit across one unit away covers
+	pixels = height / (2 * (real_t) tan(GL_FOVY / 2 * M_PI / 180));
+
+	// the rest get theirs when they come into view, before they're drawn
+	for(submesh = MDL_FirstShown(mesh, &i); submesh != NULL; submesh = MDL_NextShown(mesh, submesh, &i))
+	{
+		if(!submesh->numlods)
+			continue;
+		dx = viewpos->x - 0.5f * (submesh->mins.x + submesh->maxs.x);
+		dy = viewpos->y - 0.5f * (submesh->mins.y + submesh->maxs.y);
+		dz = viewpos->z - 0.5f * (submesh->mins.z + submesh->maxs.z);
+		distance = (real_t) sqrt(dx * dx + dy * dy + dz * dz);
+		dx = submesh->maxs.x - submesh->mins.x;
+		dy = submesh->maxs.y - submesh->mins.y;
+		dz = submesh->maxs.z - submesh->mins.z;
+		distance -= 0.5f * (real_t) sqrt(dx * dx + dy * dy + dz * dz);
+
+		lod = 0;
+		if(bias > 0 && distance > 0)
+		{
+			for(lod = submesh->numlods - 1; lod > 0; lod--)
+			{
+				limit = (lod > submesh->lod) ? bias * LOD_HYSTERESIS : bias;
+				if(submesh->lods[lod].error * pixels <= limit * distance)
+					break;
+			}
+		}
+		submesh->lod = lod;
+	}
+}
+
+/*
+==========================
+GL_ViewFrustum()
+
+The planes bounding what the last GL_Perspective() and
+GL_CameraLookAt() show, taken straight from the rows of
+their product (Gribb and Hartmann). They are moved into
+the space of whatever is drawn translated by origin, and
+normalised so a plane's distance is in units
+==========================
+*/
+void GL_ViewFrustum(frustum_t *frustum, vec3_t *origin)
+{
+	mat4x4_t clip;
+	real_t *m, len;
+	vec4_t *p;
+	int i, row, sign;
+
+	M_MultMatrix4x4(&projectionmatrix, &viewmatrix, &clip);
+	m = (real_t *) &clip;
+	for(i = 0, p = frustum->planes; i < FRUSTUM_PLANES; i++, p++)
+	{
+		// the fourth row plus or minus the first, second and third
+		row = i / 2;
+		sign = (i & 1) ? -1 : 1;
+		p->x = m[3] + sign * m[row];
+		p->y = m[7] + sign * m[4 + row];
+		p->z = m[11] + sign * m[8 + row];
+		p->w = m[15] + sign * m[12 + row];
+		p->w += p->x * origin->x + p->y * origin->y + p->z * origin->z;
+		len = (real_t) sqrt(p->x * p->x + p->y * p->y + p->z * p->z);
+		if(len > 0)
+		{
+			p->x /= len;
+			p->y /= len;
+			p->z /= len;
+			p->w /= len;
+		}
+	}
+}
+
+/*
+==========================
+GL_CullMesh()
+
+Marks the submeshes of a mesh drawn translated by origin
+that are out of view as culled, and counts them in
+glstats. A mesh with cells is seen through its portals
+from the camera's cell when r_portals is set, and only
+frustum culled if the camera is in none. r_cull 0 leaves
+everything to be drawn
+==========================
+*/
+void GL_CullMesh(mesh_t *mesh, vec3_t *origin)
+{
+	frustum_t frustum;
+	submesh_t *submesh;
+	vec3_t viewpos;
+	real_t margin;
+	int culled;
+
+	if(!mesh)
+		return;
+	GL_ViewFrustum(&frustum, origin);
+	if(mesh->cells && Cvar_VariableValue("r_cull") && Cvar_VariableValue("r_portals"))
+	{
+		// as far as the corners of the near plane can reach
+		margin = 2 * Cvar_VariableValue("r_nearclip");
+		if(margin <= 0)
+			margin = 0.2f;
+		M_Vec3Subtract(&common.campos, origin, &viewpos);
+		// only touches what was and is in view
+		culled = MDL_CullCells(mesh, &viewpos, frustum.planes, FRUSTUM_PLANES, margin);
+		if(culled >= 0)
+		{
+			glstats.submeshes += mesh->cells->numsubmeshes;
+			glstats.portalculled += culled;
+			glstats.cells += mesh->cells->reached;
+			glstats.portals += mesh->cells->entered;
+			return;
+		}
+	}
+
+	if(mesh->cells)
+		mesh->cells->restculled = false;
+	for(submesh = mesh->submeshpool; submesh != NULL; submesh = submesh->next)
+	{
+		submesh->culled = false;
+		glstats.submeshes++;
+	}
+	if(!Cvar_VariableValue("r_cull"))
+		return;
+	glstats.frustumculled += MDL_CullSubmeshes(mesh, frustum.planes, FRUSTUM_PLANES);
+}
+
+/*
+==========================
+GL_MeshClip()
+
+The matrix taking what is drawn translated by origin to
+clip space, in the view the last GL_Perspective() and
+GL_CameraLookAt() set up
+==========================
+*/
+static void GL_MeshClip(vec3_t *origin, mat4x4_t *clip)
+{
+	mat4x4_t translate, view;
+
+	M_MakeIdentity4x4(&translate);
+	translate.m41 = origin->x;
+	translate.m42 = origin->y;
+	translate.m43 = origin->z;
+	M_MultMatrix4x4(&projectionmatrix, &viewmatrix, &view);
+	M_MultMatrix4x4(&view, &translate, clip);
+}
+
+/*
+==========================
+GL_ClearOcclusion()
+
+Empties the occlusion buffer for a new frame. With
+r_occlusion 0 it does nothing and nothing is occluded
+==========================
+*/
+void GL_ClearOcclusion(void)
+{
+	if(!Cvar_VariableValue("r_occlusion"))
+		return;
+	if(!occlusion)
+		occlusion = (occlusion_t *) Z_MallocUninit(sizeof(occlusion_t));
+	MDL_ClearOcclusion(occlusion);
+}
+
+/*
+==========================
+GL_DrawOccluders()
+
+Draws the largest submeshes of a mesh drawn translated by
+origin into the occlusion buffer. Every mesh's occluders
+should be in before any mesh is tested with
+GL_OccludeMesh(), and after GL_CullMesh()
+==========================
+*/
+void GL_DrawOccluders(mesh_t *mesh, vec3_t *origin)
+{
+	mat4x4_t clip;
+
+	if(!mesh || !occlusion || !Cvar_VariableValue("r_occlusion"))
+		return;
+	GL_MeshClip(origin, &clip);
+	MDL_DrawOccluders(occlusion, mesh, &clip);
+	glstats.occluders = occlusion->occluders;
+	glstats.occludertriangles = occlusion->triangles;
+}
+
+/*
+==========================
+GL_OccludeMesh()
+
+Marks the submeshes of a mesh drawn translated by origin
+that are hidden behind the occluders as culled, and
+counts them in glstats
+==========================
+*/
+void GL_OccludeMesh(mesh_t *mesh, vec3_t *origin)
+{
+	mat4x4_t clip;
+
+	if(!mesh || !occlusion || !Cvar_VariableValue("r_occlusion"))
+		return;
+	GL_MeshClip(origin, &clip);
+	glstats.occlusionculled += MDL_OccludeSubmeshes(occlusion, mesh, &clip);
+}
+
+/*
+==========================
+GL_DrawOcclusionBuffer()
+
+Shows the occlusion buffer in the bottom right of the
+screen when r_showocclusion is set, nearer brighter
+==========================
+*/
+void GL_DrawOcclusionBuffer(void)
+{
+	cvar_t *scrwidth, *scrheight;
+	unsigned char *pixels;
+	real_t nearest, *depth;
+	int x, y, width, height;
+	boolean_t textured;
+
+	if(!occlusion || !Cvar_VariableValue("r_occlusion") || !Cvar_VariableValue("r_showocclusion"))
+		return;
+
+	nearest = 0;
+	for(x = 0; x < OCC_TILESX * OCC_TILESY; x++)
+		if(occlusion->tilemax[x] > nearest)
+			nearest = occlusion->tilemax[x];
+	pixels = (unsigned char *) Z_FrameAlloc(OCC_WIDTH * OCC_HEIGHT, 1);
+	for(y = 0; y < OCC_HEIGHT; y++)
+	{
+		for(x = 0; x < OCC_WIDTH; x++)
+		{
+			depth = occlusion->depth + ((y / OCC_TILE) * OCC_TILESX + x / OCC_TILE) * OCC_TILE * OCC_TILE;
+			pixels[y * OCC_WIDTH + x] = (unsigned char) ((nearest > 0) ?
+				depth[(y % OCC_TILE) * OCC_TILE + x % OCC_TILE] / nearest * 255 : 0);
+		}
+	}
+
+	scrwidth = Cvar_Get("scr_width", 0);
+	scrheight = Cvar_Get("scr_height", 0);
+	width = (scrwidth && scrwidth->value) ? (int) scrwidth->value : 640;
+	height = (scrheight && scrheight->value) ? (int) scrheight->value : 480;
+
+	textured = glIsEnabled(GL_TEXTURE_2D);
+	glDisable(GL_TEXTURE_2D);
+	glDisable(GL_DEPTH_TEST);
+
+	glMatrixMode(GL_PROJECTION);
+	glPushMatrix();
+	  glLoadIdentity();
+	  glOrtho(0.0f, (GLdouble) width, 0.0f, (GLdouble) height, -1.0f, 1.0f);
+	  glMatrixMode(GL_MODELVIEW);
+	  glPushMatrix();
+	    glLoadIdentity();
+		glRasterPos2i((width > OCC_WIDTH + 10) ? width - OCC_WIDTH - 10 : 0, 10);
+		glDrawPixels(OCC_WIDTH, OCC_HEIGHT, GL_LUMINANCE, GL_UNSIGNED_BYTE, pixels);
+		glMatrixMode(GL_PROJECTION);
+	  glPopMatrix();
+	  glMatrixMode(GL_MODELVIEW);
+	glPopMatrix();
+
+	glEnable(GL_DEPTH_TEST);
+	if(textured)
+		glEnable(GL_TEXTURE_2D);
+}
+
+/*
+==========================
+GL_DrawPortals()
+
+Outlines the portals of a mesh when r_showportals is
+set, those seen through at the last GL_CullMesh() in
+green and the rest in red. Call with the modelview the
+mesh is drawn with
+==========================
+*/
+void GL_DrawPortals(mesh_t *mesh)
+{
+	cellgraph_t *graph;
+	portal_t *portal;
+	boolean_t textured, lit;
+	int i, j;
+
+	if(!mesh || !mesh->cells || !Cvar_VariableValue("r_showportals"))
+		return;
+
+	graph = mesh->cells;
+	textured = glIsEnabled(GL_TEXTURE_2D);
+	lit = glIsEnabled(GL_LIGHTING);
+	glDisable(GL_TEXTURE_2D);
+	glDisable(GL_LIGHTING);
+	glDisable(GL_DEPTH_TEST);
+	for(i = 0, portal = graph->portals; i < graph->numportals; i++, portal++)
+	{
+		if(portal->visframe == graph->visframe)
+			glColor3f(0.0f, 1.0f, 0.0f);
+		else
+			glColor3f(1.0f, 0.0f, 0.0f);
+		glBegin(GL_LINE_LOOP);
+		for(j = 0; j < portal->numpoints; j++)
+			glVertex3f((GLfloat) portal->points[j].x, (GLfloat) portal->points[j].y, (GLfloat) portal->points[j].z);
+		glEnd();
+	}
+	glColor3f(1.0f, 1.0f, 1.0f);
+	glEnable(GL_DEPTH_TEST);
+	if(lit)
+		glEnable(GL_LIGHTING);
+	if(textured)
+		glEnable(GL_TEXTURE_2D);
+}
+
+/*
+==========================
+GL_QueriesEnabled()
+==========================
+*/
+static boolean_t GL_QueriesEnabled(void)
+{
+	return (glcaps.occlusionqueries && Cvar_VariableValue("r_queries")) ? true : false;
+}
+
+/*
+==========================
+GL_IssueQuery()
+
+Starts counting the samples drawn for submesh, with the
+ARB query if there is one, else the NV one. The submesh
+gets its query object the first time
+==========================
+*/
+static void GL_IssueQuery(submesh_t *submesh)
+{
+	if(!submesh->queryid)
+	{
+		if(glcaps.occlusionqueries == QUERY_ARB)
+			glGenQueriesARB(1, &submesh->queryid);
+		else
+			glGenOcclusionQueriesNV(1, &submesh->queryid);
+		submesh->queryphase = querynextphase++;
+	}
+	if(glcaps.occlusionqueries == QUERY_ARB)
+		glBeginQueryARB(GL_SAMPLES_PASSED_ARB, submesh->queryid);
+	else
+		glBeginOcclusionQueryNV(submesh->queryid);
+	submesh->queryframe = queryframe;
+	glstats.queries++;
+}
+
+/*
+==========================
+GL_QueryResult()
+
+Reads the result of submesh's query in flight into
+queryhidden if it's in, or waits for it when wait is
+set. Returns false if it isn't in yet
+==========================
+*/
+static boolean_t GL_QueryResult(submesh_t *submesh, boolean_t wait)
+{
+	GLuint available, samples;
+
+	if(glcaps.occlusionqueries == QUERY_ARB)
+		glGetQueryObjectuivARB(submesh->queryid, GL_QUERY_RESULT_AVAILABLE_ARB, &available);
+	else
+		glGetOcclusionQueryuivNV(submesh->queryid, GL_PIXEL_COUNT_AVAILABLE_NV, &available);
+	if(!available)
+	{
+		if(!wait)
+			return false;
+		glstats.querywaits++;
+	}
+	if(glcaps.occlusionqueries == QUERY_ARB)
+		glGetQueryObjectuivARB(submesh->queryid, GL_QUERY_RESULT_ARB, &samples);
+	else
+		glGetOcclusionQueryuivNV(submesh->queryid, GL_PIXEL_COUNT_NV, &samples);
+	submesh->queryhidden = samples ? false : true;
+	submesh->queryframe = 0;
+	return true;
+}
+
+/*
+==========================
+GL_BeginQueries()
+
+Starts a new query frame, once per frame before any
+GL_QueryMesh()
+==========================
+*/
+void GL_BeginQueries(void)
+{
+	queryframe++;
+}
+
+/*
+==========================
+GL_QueryMesh()
+
+Picks up the results of queries issued a frame or two
+ago, waiting only for those QUERY_MAXLATENCY frames old,
+and marks the submeshes of mesh the last result found
+hidden as culled. Call after the other culling, as
+submeshes culled already forget their results. Only the
+submeshes shown are looked at, so one culled since the
+last frame forgets them when it's next in view
+==========================
+*/
+void GL_QueryMesh(mesh_t *mesh)
+{
+	submesh_t *submesh;
+	boolean_t enabled;
+	int age, i;
+
+	if(!mesh)
+		return;
+	enabled = GL_QueriesEnabled();
+	for(submesh = MDL_FirstShown(mesh, &i); submesh != NULL; submesh = MDL_NextShown(mesh, submesh, &i))
+	{
+		if(submesh->culled || !enabled || submesh->queryseen != queryframe - 1)
+		{
+			// the query in flight is reissued or deleted before it's read
+			submesh->queryhidden = false;
+			submesh->queryframe = 0;
+			if(submesh->culled || !enabled)
+				continue;
+		}
+		submesh->queryseen = queryframe;
+		if(submesh->queryframe)
+		{
+			age = queryframe - submesh->queryframe;
+			if(age >= QUERY_MINLATENCY)
+				GL_QueryResult(submesh, (age >= QUERY_MAXLATENCY) ? true : false);
+		}
+		if(submesh->queryhidden)
+		{
+			submesh->culled = true;
+			glstats.queryculled++;
+		}
+	}
+}
+
+/*
+==========================
+GL_EndQuery()
 ==========================
 */
-void GL_DeleteSubmesh(mesh_t *mesh, submesh_t *submesh)
+static void GL_EndQuery(void)
 {
-	cvar_t *dev;
-
-	if(mesh == NULL || submesh == NULL)
-		return;
-
-	dev = Cvar_Get("developer", 0);
-	if(dev && dev->value)
-		Sys_Printf("GL_DeleteSubmesh: deleting submesh %s from %s..\n",
-				   submesh->name, mesh->name);
-	GL_UnlinkSubmesh(mesh, submesh);
-	if(submesh->name)
-		Z_Free(submesh->name);
-	if(submesh->vertexdata)
-		Z_Free(submesh->vertexdata);
-	if(submesh->normaldata)
-		Z_Free(submesh->normaldata);
-	if(submesh->texcoords)
-		Z_Free(submesh->texcoords);
-	if(submesh->faces)
-		Z_Free(submesh->faces);
-	Z_Free(submesh);
-	submesh->next = NULL;
-	submesh = NULL;
+	if(glcaps.occlusionqueries == QUERY_ARB)
+		glEndQueryARB(GL_SAMPLES_PASSED_ARB);
+	else
+		glEndOcclusionQueryNV();
 }
 
 /*
 ==========================
-GL_DeleteSubmeshPool()
+GL_QuerySubmeshes()
+
+Issues this frame's queries for the submeshes of a mesh
+drawn translated by origin, once everything else is drawn
+and with the same modelview, without touching the colour
+or depth buffers. Those hidden last time get their
+bounding boxes queried. Visible ones are drawn again
+against the finished depth buffer, each every
+r_queryinterval frames, in turns; querying them as they
+are first drawn would see only what was drawn before them.
+A camera inside a box would see none of its faces, so
+that submesh is taken as visible instead
 ==========================
 */
-void GL_DeleteSubmeshPool(mesh_t *mesh)
+void GL_QuerySubmeshes(mesh_t *mesh, vec3_t *origin)
 {
-	submesh_t *submesh, *submesh2;
+	submesh_t *submesh;
+	renderoperation_t ro;
+	vec3_t viewpos;
+	real_t margin;
+	int interval, i;
+	GLint depthfunc;
+	boolean_t textured, culling, started;
+
+	if(!mesh || !GL_QueriesEnabled())
+		return;
 
-	if(!mesh)
-		return;	
-	submesh = mesh->submeshpool;
-	while(submesh != NULL)
+	// as far as the corners of the near plane can reach
+	margin = 2 * Cvar_VariableValue("r_nearclip");
+	if(margin <= 0)
+		margin = 0.2f;
+	interval = (int) Cvar_VariableValue("r_queryinterval");
+	M_Vec3Subtract(&common.campos, origin, &viewpos);
+	started = false;
+	textured = culling = false;
+	depthfunc = GL_LEQUAL;
+	// the hidden ones GL_QueryMesh() left culled are on the list too
+	for(submesh = MDL_FirstShown(mesh, &i); submesh != NULL; submesh = MDL_NextShown(mesh, submesh, &i))
 	{
-		submesh2 = submesh->next;
-		GL_DeleteSubmesh(mesh, submesh);
-		submesh = submesh2;
+		if(submesh->queryframe)
+			continue;
+		if(submesh->queryhidden)
+		{
+			if(viewpos.x > submesh->mins.x - margin && viewpos.x < submesh->maxs.x + margin &&
+			   viewpos.y > submesh->mins.y - margin && viewpos.y < submesh->maxs.y + margin &&
+			   viewpos.z > submesh->mins.z - margin && viewpos.z < submesh->maxs.z + margin)
+			{
+				submesh->queryhidden = false;
+				continue;
+			}
+		}
+		else if(submesh->culled)
+			continue;
+		else if(interval > 1 && submesh->queryid && (queryframe + submesh->queryphase) % interval)
+			continue;
+
+		if(!started)
+		{
+			textured = glIsEnabled(GL_TEXTURE_2D);
+			culling = glIsEnabled(GL_CULL_FACE);
+			glGetIntegerv(GL_DEPTH_FUNC, &depthfunc);
+			glDisable(GL_TEXTURE_2D);
+			glDepthFunc(GL_LEQUAL);
+			glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+			glDepthMask(GL_FALSE);
+			started = true;
+		}
+		GL_IssueQuery(submesh);
+		if(submesh->queryhidden)
+		{
+			glDisable(GL_CULL_FACE);
+			GL_DrawBox(&submesh->mins, &submesh->maxs);
+		}
+		else
+		{
+			// what was drawn passes GL_LEQUAL against itself
+			if(culling)
+				glEnable(GL_CULL_FACE);
+			GL_GetSubmeshRenderoperation(submesh, &ro);
+			// counted in queries, not with the frame's draws
+			GL_DrawWithPrograms(&ro);
+		}
+		GL_EndQuery();
 	}
+	if(!started)
+		return;
+
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	glDepthMask(GL_TRUE);
+	glDepthFunc((GLenum) depthfunc);
+	if(textured)
+		glEnable(GL_TEXTURE_2D);
+	if(culling)
+		glEnable(GL_CULL_FACE);
+	else
+		glDisable(GL_CULL_FACE);
 }
 
 /*
 ==========================
-GL_DeleteMesh()
+GL_DrawBox()
 ==========================
 */
-void GL_DeleteMesh(mesh_t *mesh)
+static void GL_DrawBox(vec3_t *mins, vec3_t *maxs)
 {
-	cvar_t *dev;
-
-	if(!mesh)
-		return;
-
-	dev = Cvar_Get("developer", 0);
-	if(dev && dev->value)
-		Sys_Printf("GL_DeleteMesh: deleting %s..\n", mesh->name ? mesh->name : "(null)");
-
-	GL_UnlinkMesh(mesh);
-	GL_DeleteSubmeshPool(mesh);
-	if(mesh->name)
+	static const int faces[6][4] = {
+		{ 0, 2, 3, 1 }, { 4, 5, 7, 6 }, { 0, 1, 5, 4 },
+		{ 2, 6, 7, 3 }, { 0, 4, 6, 2 }, { 1, 3, 7, 5 }
+	};
+	int i, j, corner;
+
+	glBegin(GL_QUADS);
+	for(i = 0; i < 6; i++)
 	{
-		Z_Free(mesh->name);
-		mesh->name = NULL;
+		for(j = 0; j < 4; j++)
+		{
+			corner = faces[i][j];
+			glVertex3f((GLfloat) ((corner & 1) ? maxs->x : mins->x),
+					   (GLfloat) ((corner & 2) ? maxs->y : mins->y),
+					   (GLfloat) ((corner & 4) ? maxs->z : mins->z));
+		}
 	}
-	Z_Free(mesh);
-	mesh->next = NULL;
-	mesh = NULL;
+	glEnd();
 }
 
 /*
 ==========================
-GL_DeleteMeshPool()
+GL_PickRay()
+
+Sets trace up for MDL_TraceMesh() along the line through
+window pixel x, y, counted from the top left, from the
+near plane to the far, in the space of what is drawn
+translated by origin. The view is the one the last
+GL_Perspective() and GL_CameraLookAt() set up
 ==========================
 */
-void GL_DeleteMeshPool(void)
+void GL_PickRay(int x, int y, vec3_t *origin, trace_t *trace)
 {
-	mesh_t *mesh, *mesh2;
+	mat4x4_t translate, modelview;
+	GLdouble model[16], proj[16], nearx, neary, nearz, farx, fary, farz;
+	GLint viewport[4];
+	int i;
 
-	mesh = meshpool;
-	while(mesh != NULL)
+	M_MakeIdentity4x4(&translate);
+	translate.m41 = origin->x;
+	translate.m42 = origin->y;
+	translate.m43 = origin->z;
+	M_MultMatrix4x4(&viewmatrix, &translate, &modelview);
+	for(i = 0; i < 16; i++)
 	{
-		mesh2 = mesh->next;
-		GL_DeleteMesh(mesh);
-		mesh = mesh2;
+		model[i] = ((real_t *) &modelview)[i];
+		proj[i] = ((real_t *) &projectionmatrix)[i];
 	}
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	// through the middle of the pixel, and the GL counts up from the bottom
+	gluUnProject(x + 0.5, viewport[3] - y - 0.5, 0.0, model, proj, viewport, &nearx, &neary, &nearz);
+	gluUnProject(x + 0.5, viewport[3] - y - 0.5, 1.0, model, proj, viewport, &farx, &fary, &farz);
+
+	trace->start.x = (real_t) nearx;
+	trace->start.y = (real_t) neary;
+	trace->start.z = (real_t) nearz;
+	trace->delta.x = (real_t) (farx - nearx);
+	trace->delta.y = (real_t) (fary - neary);
+	trace->delta.z = (real_t) (farz - nearz);
+	trace->fraction = 1;
+	trace->submesh = NULL;
+	trace->face = -1;
 }
 
 /*
 ==========================
-GL_GetSubmeshRenderoperation()
+GL_FreeSubmeshArrays()
+
+Drops the per attribute arrays, and the faces too once
+they are in a VBO
 ==========================
 */
-void GL_GetSubmeshRenderoperation(submesh_t *submesh, renderoperation_t *ro)
+static void GL_FreeSubmeshArrays(submesh_t *submesh, boolean_t faces)
 {
-	ro->rendermode = RM_TRIANGLES;
-	if(extgl_Extensions.ARB_vertex_buffer_object)
-	{
-		ro->vertexvboptr = &submesh->vertexvboid;
-		ro->normalvboptr = &submesh->normalvboid;
-		ro->texcoordvboptr = &submesh->texcoordvboid;
-	}
-	else
+	if(!submesh->mapped)
 	{
-		ro->vertexvboptr = NULL;
-		ro->normalvboptr = NULL;
-		ro->texcoordvboptr = NULL;
+		if(submesh->vertexdata)
+			Z_Free(submesh->vertexdata);
+		if(submesh->normaldata)
+			Z_Free(submesh->normaldata);
+		if(submesh->texcoords)
+			Z_Free(submesh->texcoords);
+		if(faces && submesh->faces)
+			Z_Free(submesh->faces);
 	}
-	ro->numvertices = submesh->numvertices * 3;
-	ro->vertexdata = (real_t *) submesh->vertexdata;
-	ro->normaldata = (real_t *) submesh->normaldata;
-	ro->numtexcoords = submesh->numtexcoords;
-	ro->texcoorddata = (real_t *) submesh->texcoords;
-	ro->usefaceindices = true;
-	ro->numfaceindices = submesh->numfaces * 3;
-	ro->faceindices = (unsigned int *) submesh->faces;
-	ro->hasvp = submesh->hasvertexprogram;
-	ro->vpidptr = &submesh->vertexprogramid;
-	ro->hasfp = submesh->hasfragmentprogram;
-	ro->fpidptr = &submesh->fragmentprogramid;
+	submesh->vertexdata = NULL;
+	submesh->normaldata = NULL;
+	submesh->texcoords = NULL;
+	if(faces)
+		submesh->faces = NULL;
 }
 
 /*
 ==========================
-GL_RenderRenderoperation()
+GL_VertexFormat()
+
+The VF_ flags meshes are uploaded with, from
+r_interleave and r_vertexformat
 ==========================
 */
-void GL_RenderRenderoperation(renderoperation_t *ro)
+static int GL_VertexFormat(void)
 {
-	GLenum rm;
-	GLenum type;
-
-	if(!ro || !ro->rendermode || !ro->numvertices)
-		return;
+	int format, compact;
 
-	if(ro->hasvp)
-	{
-		glEnable(GL_VERTEX_PROGRAM_ARB);
-		glBindProgramARB(GL_VERTEX_PROGRAM_ARB, *ro->vpidptr);
-	}
-	if(ro->hasfp)
+	if(!Cvar_VariableValue("r_interleave"))
+		return 0;
+	format = VF_INTERLEAVED;
+	compact = (int) Cvar_VariableValue("r_vertexformat");
+	if(compact >= 1)
 	{
-		glEnable(GL_FRAGMENT_PROGRAM_ARB);
-		glBindProgramARB(GL_FRAGMENT_PROGRAM_ARB, *ro->fpidptr);
+		format |= VF_QUANTISED;
+		if(compact >= 2)
+			format |= VF_SHORTNORMALS;
+		if(extgl_Extensions.NV_half_float)
+			format |= VF_HALFTEXCOORDS;
 	}
+	return format;
+}
 
-	type = (PRECISION == PRECISION_SINGLE) ? GL_FLOAT : GL_DOUBLE;
+/*
+==========================
+GL_StreamLayout()
 
-	if(extgl_Extensions.ARB_vertex_buffer_object)
+Returns the bytes per vertex of an interleaved stream
+and where its normal and texcoords are. Quantised
+attributes are padded to four bytes
+==========================
+*/
+static int GL_StreamLayout(int format, boolean_t hastexcoords, int *normalofs, int *texcoordofs)
+{
+	int stride;
+
+	if(format & VF_QUANTISED)
 	{
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, *ro->normalvboptr);
-		glNormalPointer(type, 0, (char *) NULL);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, *ro->texcoordvboptr);
-		glTexCoordPointer(2, type, 0, (char *) NULL);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, *ro->vertexvboptr);
-		glVertexPointer(3, type, 0, (char *) NULL);
+		stride = 4 * sizeof(short int);
+		*normalofs = stride;
+		stride += (format & VF_SHORTNORMALS) ? 4 * sizeof(short int) : 4;
+		*texcoordofs = stride;
+		if(hastexcoords)
+			stride += 2 * sizeof(short int);
 	}
 	else
 	{
-		if(ro->normaldata)
-			glNormalPointer(type, 0, ro->normaldata);
-		if(ro->numtexcoords)
-			glTexCoordPointer(2, type, 0, ro->texcoorddata);
-		glVertexPointer(3, type, 0, ro->vertexdata);
-	}
-	switch(ro->rendermode)
-	{
-	case RM_TRIANGLES:      rm = GL_TRIANGLES;       break;
-	case RM_TRIANGLE_STRIP: rm = GL_TRIANGLE_STRIP;  break;
-	case RM_TRIANGLE_FAN:   rm = GL_TRIANGLE_FAN;    break;
-	case RM_POLYGON:        rm = GL_POLYGON;         break;
-	case RM_QUADS:          rm = GL_QUADS;           break;
-	case RM_QUAD_STRIP:     rm = GL_QUAD_STRIP;      break;
-	case RM_POINTS:         rm = GL_POINTS;          break;
-	case RM_LINES:          rm = GL_LINES;           break;
-	case RM_LINE_STRIP:     rm = GL_LINE_STRIP;      break;
-	case RM_LINE_LOOP:      rm = GL_LINE_LOOP;       break;
+		*normalofs = 3 * sizeof(real_t);
+		*texcoordofs = 6 * sizeof(real_t);
+		stride = (hastexcoords ? 8 : 6) * sizeof(real_t);
 	}
-	if(ro->usefaceindices)
-		glDrawElements(rm, ro->numfaceindices, GL_UNSIGNED_INT, ro->faceindices);
-	else
-		glDrawArrays(rm, 0, ro->numvertices);
-	if(ro->hasfp)
-		glDisable(GL_FRAGMENT_PROGRAM_ARB);
-	if(ro->hasvp)
-		glDisable(GL_VERTEX_PROGRAM_ARB);
+	return stride;
 }
 
 /*
 ==========================
-GL_PostProcessMesh()
-
-Currently deletes mesh data from system memory
-if VBOs are available.. this should be changed when
-mesh animation support is implemented
+GL_QuantiseShort()
 ==========================
 */
-void GL_PostProcessMesh(mesh_t *mesh)
+static short int GL_QuantiseShort(real_t x)
 {
-	submesh_t *submesh;
+	x = (real_t) floor(x + 0.5);
+	if(x < -32768)
+		return -32768;
+	if(x > 32767)
+		return 32767;
+	return (short int) x;
+}
 
-	if(extgl_Extensions.ARB_vertex_buffer_object)
+/*
+==========================
+GL_InterleaveSubmesh()
+
+Packs the attributes of each vertex next to each other.
+Quantised positions are scaled evenly on all axes, so
+normals still transform right and only need rescaling.
+Vertices past the last texcoord get zero ones
+==========================
+*/
+static void *GL_InterleaveSubmesh(submesh_t *submesh, int format)
+{
+	unsigned char *stream, *out;
+	real_t *f;
+	short int *pos, *snormal, *st;
+	signed char *bnormal;
+	vec3_t mins, maxs, *v, *n;
+	vec2_t uvmins, uvmaxs, *uv;
+	int i, k, numtexcoords, normalofs, texcoordofs;
+	real_t extent, zero[2];
+
+	numtexcoords = submesh->texcoords ? submesh->numtexcoords : 0;
+	if(numtexcoords > submesh->numvertices)
+		numtexcoords = submesh->numvertices;
+	submesh->vertexformat = format;
+	submesh->vertexstride = GL_StreamLayout(format, submesh->numtexcoords > 0, &normalofs, &texcoordofs);
+	stream = (unsigned char *) Z_TagMallocUninit(submesh->numvertices * submesh->vertexstride + 1, TAG_MESH);
+	zero[0] = zero[1] = 0;
+
+	submesh->positionscale = 1;
+	submesh->positionbias.x = submesh->positionbias.y = submesh->positionbias.z = 0;
+	submesh->texcoordscale.x = submesh->texcoordscale.y = 1;
+	submesh->texcoordbias.x = submesh->texcoordbias.y = 0;
+	if(!(format & VF_QUANTISED))
 	{
-		for(submesh = mesh->submeshpool; submesh != NULL; submesh = submesh->next)
+		for(i = 0, out = stream; i < submesh->numvertices; i++, out += submesh->vertexstride)
 		{
-			glGenBuffersARB(1, &submesh->vertexvboid);
-			glGenBuffersARB(1, &submesh->normalvboid);
-			glGenBuffersARB(1, &submesh->texcoordvboid);
-
-			glBindBufferARB(GL_ARRAY_BUFFER_ARB, submesh->vertexvboid);
-			glBufferDataARB(GL_ARRAY_BUFFER_ARB, submesh->numvertices * (3 * sizeof(real_t)),
-							submesh->vertexdata, GL_STATIC_DRAW_ARB);
+			f = (real_t *) out;
+			f[0] = submesh->vertexdata[i].x;
+			f[1] = submesh->vertexdata[i].y;
+			f[2] = submesh->vertexdata[i].z;
+			f[3] = submesh->normaldata[i].x;
+			f[4] = submesh->normaldata[i].y;
+			f[5] = submesh->normaldata[i].z;
+			if(submesh->numtexcoords)
+			{
+				f[6] = i < numtexcoords ? submesh->texcoords[i].x : 0;
+				f[7] = i < numtexcoords ? submesh->texcoords[i].y : 0;
+			}
+		}
+		return stream;
+	}
 
-			glBindBufferARB(GL_ARRAY_BUFFER_ARB, submesh->normalvboid);
-			glBufferDataARB(GL_ARRAY_BUFFER_ARB, submesh->numvertices * (3 * sizeof(real_t)),
-							submesh->normaldata, GL_STATIC_DRAW_ARB);
+	// positions span -32767..32767 around the middle of the box
+	mins = maxs = submesh->vertexdata[0];
+	for(i = 1, v = submesh->vertexdata + 1; i < submesh->numvertices; i++, v++)
+	{
+		if(v->x < mins.x) mins.x = v->x;
+		if(v->y < mins.y) mins.y = v->y;
+		if(v->z < mins.z) mins.z = v->z;
+		if(v->x > maxs.x) maxs.x = v->x;
+		if(v->y > maxs.y) maxs.y = v->y;
+		if(v->z > maxs.z) maxs.z = v->z;
+	}
+	extent = maxs.x - mins.x;
+	if(maxs.y - mins.y > extent)
+		extent = maxs.y - mins.y;
+	if(maxs.z - mins.z > extent)
+		extent = maxs.z - mins.z;
+	submesh->positionscale = extent > 0 ? extent / 65534 : 1;
+	submesh->positionbias.x = (mins.x + maxs.x) * 0.5f;
+	submesh->positionbias.y = (mins.y + maxs.y) * 0.5f;
+	submesh->positionbias.z = (mins.z + maxs.z) * 0.5f;
+
+	// short texcoords span -32768..32767 across their own box
+	if(numtexcoords && !(format & VF_HALFTEXCOORDS))
+	{
+		uvmins = uvmaxs = submesh->texcoords[0];
+		for(i = 1, uv = submesh->texcoords + 1; i < numtexcoords; i++, uv++)
+		{
+			if(uv->x < uvmins.x) uvmins.x = uv->x;
+			if(uv->y < uvmins.y) uvmins.y = uv->y;
+			if(uv->x > uvmaxs.x) uvmaxs.x = uv->x;
+			if(uv->y > uvmaxs.y) uvmaxs.y = uv->y;
+		}
+		submesh->texcoordscale.x = uvmaxs.x > uvmins.x ? (uvmaxs.x - uvmins.x) / 65535 : 1;
+		submesh->texcoordscale.y = uvmaxs.y > uvmins.y ? (uvmaxs.y - uvmins.y) / 65535 : 1;
+		submesh->texcoordbias.x = uvmins.x + 32768 * submesh->texcoordscale.x;
+		submesh->texcoordbias.y = uvmins.y + 32768 * submesh->texcoordscale.y;
+	}
 
-			glBindBufferARB(GL_ARRAY_BUFFER_ARB, submesh->texcoordvboid);
-			glBufferDataARB(GL_ARRAY_BUFFER_ARB, submesh->numtexcoords * (2 * sizeof(real_t)),
-							submesh->texcoords, GL_STATIC_DRAW_ARB);
+	for(i = 0, out = stream; i < submesh->numvertices; i++, out += submesh->vertexstride)
+	{
+		v = &submesh->vertexdata[i];
+		pos = (short int *) out;
+		pos[0] = GL_QuantiseShort((v->x - submesh->positionbias.x) / submesh->positionscale);
+		pos[1] = GL_QuantiseShort((v->y - submesh->positionbias.y) / submesh->positionscale);
+		pos[2] = GL_QuantiseShort((v->z - submesh->positionbias.z) / submesh->positionscale);
+		pos[3] = 0;
+
+		n = &submesh->normaldata[i];
+		if(format & VF_SHORTNORMALS)
+		{
+			snormal = (short int *) (out + normalofs);
+			snormal[0] = GL_QuantiseShort(n->x * 32767);
+			snormal[1] = GL_QuantiseShort(n->y * 32767);
+			snormal[2] = GL_QuantiseShort(n->z * 32767);
+			snormal[3] = 0;
+		}
+		else
+		{
+			bnormal = (signed char *) (out + normalofs);
+			for(k = 0; k < 3; k++)
+				bnormal[k] = (signed char) (GL_QuantiseShort((&n->x)[k] * 127));
+			bnormal[3] = 0;
+		}
 
-			Z_Free(submesh->vertexdata);
-			submesh->vertexdata = NULL;
-			Z_Free(submesh->normaldata);
-			submesh->normaldata = NULL;
-			Z_Free(submesh->texcoords);
-			submesh->texcoords = NULL;
+		if(!submesh->numtexcoords)
+			continue;
+		uv = i < numtexcoords ? &submesh->texcoords[i] : (vec2_t *) zero;
+		st = (short int *) (out + texcoordofs);
+		if(format & VF_HALFTEXCOORDS)
+		{
+			st[0] = (short int) ftoh((float) uv->x);
+			st[1] = (short int) ftoh((float) uv->y);
+		}
+		else
+		{
+			st[0] = GL_QuantiseShort((uv->x - submesh->texcoordbias.x) / submesh->texcoordscale.x);
+			st[1] = GL_QuantiseShort((uv->y - submesh->texcoordbias.y) / submesh->texcoordscale.y);
 		}
 	}
+	return stream;
 }
 
 /*
@@ -483,6 +2641,8 @@ void GL_PrintMeshInfo(mesh_t *mesh)
 {
 	submesh_t *submesh;
 	material_t *material;
+	int i;
+
 	Sys_Printf("mesh: %s\n", mesh->name ? mesh->name : "(null)");
 	for(submesh = mesh->submeshpool; submesh != NULL; submesh = submesh->next)
 	{
@@ -490,6 +2650,23 @@ void GL_PrintMeshInfo(mesh_t *mesh)
 		Sys_Printf("   - submesh->numvertices: %d\n", submesh->numvertices);
 		Sys_Printf("   - submesh->numfaces: %d\n", submesh->numfaces);
 		Sys_Printf("   - submesh->numtexcoords: %d\n", submesh->numtexcoords);
+		Sys_Printf("   - ACMR: %.3f as loaded, %.3f optimised\n", submesh->loadacmr, submesh->acmr);
+		Sys_Printf("   - bounds: %.2f %.2f %.2f to %.2f %.2f %.2f\n", submesh->mins.x, submesh->mins.y,
+				   submesh->mins.z, submesh->maxs.x, submesh->maxs.y, submesh->maxs.z);
+		Sys_Printf("   - sphere: %.2f %.2f %.2f radius %.2f\n", submesh->centre.x, submesh->centre.y,
+				   submesh->centre.z, submesh->radius);
+		if(submesh->animated)
+			Sys_Printf("   - animated by node %d\n", submesh->node);
+		for(i = 1; i < submesh->numlods; i++)
+			Sys_Printf("   - level %d: %d faces, error %.3f\n", i, submesh->lods[i].numfaces, submesh->lods[i].error);
+		if(submesh->vertexformat & VF_INTERLEAVED)
+			Sys_Printf("   - %d bytes per vertex%s\n", submesh->vertexstride,
+					   (submesh->vertexformat & VF_QUANTISED) ? ", quantised" : "");
+		else
+			Sys_Printf("   - %d bytes per vertex\n", (int) ((submesh->numtexcoords ? 8 : 6) * sizeof(real_t)));
+		for(i = 0; i < submesh->numranges; i++)
+			Sys_Printf("   - range %s: %d faces from %d\n", submesh->ranges[i].name ? submesh->ranges[i].name : "(null)",
+					   submesh->ranges[i].numfaces, submesh->ranges[i].firstface);
 		if(submesh->material)
 		{
 			material = submesh->material;
@@ -733,9 +2910,9 @@ void GL_SetViewport(void)
 	nearclip = Cvar_Get("r_nearclip", 0);
 	farclip = Cvar_Get("r_farclip", 0);
 	if(nearclip && nearclip->value && farclip && farclip->value)
-		GL_Perspective(45.0f, (GLfloat) width / (GLfloat) height, nearclip->value, farclip->value);
+		GL_Perspective(GL_FOVY, (GLfloat) width / (GLfloat) height, nearclip->value, farclip->value);
 	else
-		GL_Perspective(45.0f, (GLfloat) width / (GLfloat) height, 0.1f, 1000.0f);
+		GL_Perspective(GL_FOVY, (GLfloat) width / (GLfloat) height, 0.1f, 1000.0f);
 
 	glMatrixMode(GL_MODELVIEW);
 }
@@ -767,6 +2944,7 @@ void GL_Perspective(real_t fovy, real_t aspect, real_t znear, real_t zfar)
 	m.m34 = -1;
 	m.m43 = -2 * znear * zfar / deltaz;
 	m.m44 = 0;
+	projectionmatrix = m;
 
 #if PRECISION == PRECISION_SINGLE
 	glMultMatrixf((const GLfloat *) &m);
@@ -784,6 +2962,21 @@ void GL_Shutdown(void)
 {
 	glDeleteLists(fontlist, 256);
 
+	if(occlusion)
+	{
+		Z_Free(occlusion);
+		occlusion = NULL;
+	}
+	MDL_ShutdownOcclusion();
+	if(renderqueue)
+	{
+		Z_Free(renderqueue);
+		Z_Free(renderkeys);
+		renderqueue = NULL;
+		renderkeys = NULL;
+		renderqueuelength = renderqueuesize = 0;
+	}
+	GL_FinishMeshLoads();
 	GL_DeleteMeshPool();
 	GL_DeleteMaterialPool();
 }
@@ -843,14 +3036,16 @@ void GL_Printf(GLint x, GLint y, color3_t *color, boolean_t italics, const char
 {
 	cvar_t *scrwidth, *scrheight;
 	va_list argptr;
-	char text[BIGSTRINGLEN + 1];
+	char *text;
 
 	if(fmt == NULL)
 		return;
 
+	text = (char *) Z_FrameAlloc(BIGSTRINGLEN + 1, 1);
 	va_start(argptr, fmt);
-	vsprintf(text, fmt, argptr);
+	vsnprintf(text, BIGSTRINGLEN + 1, fmt, argptr);
 	va_end(argptr);
+	text[BIGSTRINGLEN] = 0;
 
 	scrwidth = Cvar_Get("scr_width", 0);
 	scrheight = Cvar_Get("scr_height", 0);
@@ -1089,15 +3284,16 @@ static GLenum GL_BuildMipmaps(image_t *image, int *num_mipmaps, char *imagefile)
 
 /*
 ==========================
-GL_CreateNULLMaterial()
+GL_NewMaterial()
 
 Creates an "empty" material with black
 color, properties set to reflect all light,
 shininess 40.0, no texture or bumpmap, and NULL
-name.
+name. The material is not added to the
+material pool, so this is safe off the main thread
 ==========================
 */
-material_t *GL_CreateNULLMaterial(void)
+material_t *GL_NewMaterial(void)
 {
 	material_t *newmat;
 	color4_t defmat_color;
@@ -1108,7 +3304,7 @@ material_t *GL_CreateNULLMaterial(void)
 	real_t defmat_shininess;
 	unsigned char facebits;
 
-	newmat = (material_t *) Z_Malloc(sizeof(*newmat));
+	newmat = (material_t *) Z_PoolMalloc(sizeof(*newmat));
 
 	defmat_color.r = 0.0f;
 	defmat_color.g = 0.0f;
@@ -1147,18 +3343,62 @@ material_t *GL_CreateNULLMaterial(void)
 	newmat->facebits = facebits;
 	newmat->bumpmap = 0;
 	newmat->hasbumpmap = false;
+	newmat->next = NULL;
+
+	return newmat;
+}
+
+/*
+==========================
+GL_CreateNULLMaterial()
+
+GL_NewMaterial() added to the material pool
+==========================
+*/
+material_t *GL_CreateNULLMaterial(void)
+{
+	material_t *newmat;
 
+	newmat = GL_NewMaterial();
 	GL_LinkMaterial(newmat);
 
 	return newmat;
 }
 
+/*
+==========================
+GL_AddMaterial()
+==========================
+*/
+void GL_AddMaterial(material_t *material)
+{
+	GL_LinkMaterial(material);
+}
+
 /*
 ==========================
 GL_BindMaterial()
 ==========================
 */
 void GL_BindMaterial(material_t *material)
+{
+	GL_SetMaterial(material);
+	if(material->texmap1)
+	{
+		glBindTexture(GL_TEXTURE_2D, material->texmap1);
+		glstats.texturechanges++;
+	}
+}
+
+/*
+==========================
+GL_SetMaterial()
+
+The lighting and colour of a material, without its
+texture
+==========================
+*/
+static void GL_SetMaterial(material_t *material)
 {
 	GLenum face;
 
@@ -1175,9 +3415,7 @@ void GL_BindMaterial(material_t *material)
 	glMaterialf(face, GL_SHININESS, (GLfloat) material->shininess);
 	glMaterialfv(face, GL_EMISSION, (GLfloat *) &material->emission);
 	glColor4fv((GLfloat *) &material->color);
-
-	if(material->texmap1)
-		glBindTexture(GL_TEXTURE_2D, material->texmap1);
+	glstats.materialchanges++;
 }
 
 /*
@@ -1203,7 +3441,7 @@ material_t *GL_GetMaterial(char *matname)
 GL_DeleteMaterial()
 ==========================
 */
-static void GL_DeleteMaterial(material_t *material)
+void GL_DeleteMaterial(material_t *material)
 {
 	cvar_t *dev;
 
@@ -1215,12 +3453,26 @@ static void GL_DeleteMaterial(material_t *material)
 		Sys_Printf("GL_DeleteMaterial: deleting %s..\n", material->name ? material->name : "(null)");
 
 	GL_UnlinkMaterial(material);
+	GL_DeleteAllTextures(material);
+	GL_FreeMaterial(material);
+}
+
+/*
+==========================
+GL_FreeMaterial()
+
+Frees a material that never went into the material pool.
+Its textures are only loaded once it has, so this doesn't
+touch GL and any thread may call it
+==========================
+*/
+void GL_FreeMaterial(material_t *material)
+{
+	if(!material)
+		return;
 	if(material->name)
 		Z_Free(material->name);
-	GL_DeleteAllTextures(material);
-	Z_Free(material);
-	material->next = NULL;
-	material = NULL;
+	Z_PoolFree(material);
 }
 
 /*
@@ -1241,6 +3493,68 @@ void GL_DeleteMaterialPool(void)
 	}
 }
 
+/*
+==========================
+GL_MaterialInUse()
+
+Looks for the material on the submeshes of the mesh pool
+and of loads that have handed theirs to the pool but
+aren't linked yet
+==========================
+*/
+static boolean_t GL_MaterialInUse(material_t *material)
+{
+	mesh_t *mesh;
+	submesh_t *submesh;
+	meshload_t *ml;
+
+	for(mesh = meshpool; mesh; mesh = mesh->next)
+		for(submesh = mesh->submeshpool; submesh; submesh = submesh->next)
+			if(submesh->material == material)
+				return true;
+	for(ml = meshloads; ml; ml = ml->next)
+	{
+		if(!ml->finished || !ml->mesh)
+			continue;
+		for(submesh = ml->mesh->submeshpool; submesh; submesh = submesh->next)
+			if(submesh->material == material)
+				return true;
+	}
+
+	return false;
+}
+
+/*
+==========================
+GL_EvictMaterials()
+
+Eviction callback for the textures budget. Deletes the
+materials no submesh draws with, textures and all, which
+pile up as meshes are deleted. Texture memory is the
+driver's, so the zone only sees the names go
+==========================
+*/
+boolean_t GL_EvictMaterials(int tag, int bytes)
+{
+	material_t *mat, *nextmat;
+	int deleted;
+
+	deleted = 0;
+	for(mat = materialpool; mat; mat = nextmat)
+	{
+		nextmat = mat->next;
+		if(GL_MaterialInUse(mat))
+			continue;
+		GL_DeleteMaterial(mat);
+		deleted++;
+	}
+	if(deleted)
+		Sys_Printf("GL_EvictMaterials: %i KB over budget, deleted %i unused materials\n",
+				   bytes / 1024, deleted);
+
+	return deleted ? true : false;
+}
+
 /*
 ==========================
 GL_LinkMaterial()
@@ -1250,6 +3564,7 @@ static void GL_LinkMaterial(material_t *mat)
 {
 	if(!mat)
 		return;
+	mat->sortid = nextmaterialsortid++;
 	mat->next = materialpool;
 	materialpool = mat;
 }
@@ -1482,6 +3797,12 @@ void GL_CameraLookAt(void)
 	m.m13 = zvec.x; m.m23 = zvec.y; m.m33 = zvec.z; m.m43 = 0.0f;
 	m.m14 = 0.0f;   m.m24 = 0.0f;   m.m34 = 0.0f;   m.m44 = 1.0f;
 
+	// the whole view, translate included, for GL_ViewFrustum()
+	viewmatrix = m;
+	viewmatrix.m41 = -M_Vec3Dot(&xvec, &common.campos);
+	viewmatrix.m42 = -M_Vec3Dot(&yvec, &common.campos);
+	viewmatrix.m43 = -M_Vec3Dot(&zvec, &common.campos);
+
 #if PRECISION == PRECISION_SINGLE
 	glMultMatrixf((const GLfloat *) &m);
 #else
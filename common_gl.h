@@ -24,14 +24,54 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #ifndef __COMMON_GL_H__
 #define __COMMON_GL_H__
 
+// occlusion query extensions, best first
+#define QUERY_ARB  1  // ARB_occlusion_query
+#define QUERY_NV   2  // NV_occlusion_query
+
+#define QUERY_MINLATENCY  1  // frames before a query's result is looked for..
+#define QUERY_MAXLATENCY  2  // ..and before it's waited for
+
 typedef struct
 {
 	int texunits;
 	real_t maxanisotropy;
+	int occlusionqueries;  // QUERY_ARB, QUERY_NV or 0 if neither
 } gl_capabilities_t;
 
 extern gl_capabilities_t glcaps;
 
+#define GL_FOVY  45.0f  // vertical field of view, in degrees
+
+// what the last frame drew, cleared by the demo each frame
+typedef struct
+{
+	int submeshes;       // submeshes tested for visibility
+	int frustumculled;   // of them, outside the view frustum
+	int occluders;       // drawn into the occlusion buffer
+	int occludertriangles;
+	int occlusionculled; // hidden behind the occluders
+	int portalculled;    // not reached from the camera's cell, in view or not
+	int cells;           // reached through the portals..
+	int portals;         // ..and the portals seen through
+	int queries;         // occlusion queries issued
+	int queryculled;     // hidden by the results of earlier ones
+	int querywaits;      // results that weren't in yet and were waited for
+	int draws;           // renderoperations drawn, leaving out those for queries
+	int programchanges;  // vertex or fragment program bound, turned on or off
+	int texturechanges;
+	int materialchanges;
+} gl_stats_t;
+
+extern gl_stats_t glstats;
+
+// left, right, bottom, top, near and far, normals facing in
+#define FRUSTUM_PLANES  6
+
+typedef struct
+{
+	vec4_t planes[FRUSTUM_PLANES];
+} frustum_t;
+
 typedef enum
 {
 	RM_POINTS = 1,
@@ -46,46 +86,157 @@ typedef enum
 	RM_POLYGON
 } rendermode_t;
 
+// where one vertex attribute is read from
+typedef struct
+{
+	int components;          // 0 if the vertices don't have it
+	GLenum type;
+	int stride;              // bytes from one vertex to the next
+	int offset;              // bytes from the start of the stream
+	unsigned int *vboptr;    // stream buffer, NULL for client memory
+	void *data;              // start of the stream in client memory
+} vertexattrib_t;
+
+// attributes sharing a stream are interleaved in it
+typedef struct
+{
+	vertexattrib_t vertex;
+	vertexattrib_t normal;
+	vertexattrib_t texcoord;
+	boolean_t decodeposition;    // position = positionbias + stored * positionscale
+	real_t positionscale;
+	vec3_t positionbias;
+	boolean_t decodetexcoord;    // texcoord = texcoordbias + stored * texcoordscale
+	vec2_t texcoordscale;
+	vec2_t texcoordbias;
+} vertexformat_t;
+
+// vertex program env parameters holding the stream decode,
+// identity when a stream needs none:
+//   position = vertex.position * env[0] + env[1]
+//   texcoord = vertex.texcoord[0] * env[2] + env[3]
+#define VP_ENV_POSITIONSCALE   0
+#define VP_ENV_POSITIONBIAS    1
+#define VP_ENV_TEXCOORDSCALE   2
+#define VP_ENV_TEXCOORDBIAS    3
+
 typedef struct
 {
 	rendermode_t rendermode;
-	unsigned int *vertexvboptr;
-	unsigned int *normalvboptr;
-	unsigned int *texcoordvboptr;
 	int numvertices;
-	real_t *vertexdata;
-	real_t *normaldata;
-	int numtexcoords;
-	real_t *texcoorddata;
+	vertexformat_t format;
 	boolean_t usefaceindices;
+	int firstfaceindex;            // where in the indices the draw starts
 	int numfaceindices;
-	unsigned int *faceindices;
+	GLenum indextype;              // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+	unsigned int *indexvboptr;     // NULL to draw from faceindices
+	void *faceindices;
 	boolean_t hasvp;
 	unsigned int *vpidptr;
 	boolean_t hasfp;
 	unsigned int *fpidptr;
 } renderoperation_t;
 
+// render queue passes, drawn in this order
+#define RQ_OPAQUE       0  // front to back within each state
+#define RQ_TRANSLUCENT  1  // back to front, blended, no depth writes
+#define RQ_NUMPASSES    2
+
+// render queue sort keys, from the most significant field:
+//   pass, vertex program, fragment program, texture, material, depth
+// with depth right after pass in RQ_TRANSLUCENT
+#define RQ_PASSBITS      4
+#define RQ_PROGRAMBITS   12  // each of the vertex and fragment programs
+#define RQ_TEXTUREBITS   12
+#define RQ_MATERIALBITS  10
+#define RQ_DEPTHBITS     14
+
+#if defined(_MSC_VER)
+typedef unsigned __int64 sortkey_t;  // MSVC6 has no long long
+#else
+typedef unsigned long long sortkey_t;
+#endif
+
+typedef struct
+{
+	sortkey_t key;
+	int item;                      // index in the queue
+} renderkey_t;
+
+typedef struct
+{
+	int pass;                      // RQ_OPAQUE or RQ_TRANSLUCENT
+	real_t depth;                  // distance from the camera
+	material_t *material;          // NULL to leave the last one bound
+	renderoperation_t ro;
+} renderitem_t;
+
+// called on the main thread when a background load ends,
+// with mesh NULL if it failed
+typedef void (*meshloadfunc_t)(mesh_t *, char *);
+
+typedef struct meshload_s
+{
+	char *meshfile;
+	char *meshname;
+	meshloadfunc_t callback;
+	mesh_t *mesh;
+	mdlload_t load;
+	void *thread;
+	volatile int parsed;   // 0 while parsing, 1 when parsed, -1 on failure
+	int flags;             // MDL_ParseCached() flags from when the load started
+	int vertexformat;      // VF_ flags to upload with
+	boolean_t finished;    // materials and textures are in
+	submesh_t *upload;     // next submesh to upload
+	struct meshload_s *next;
+} meshload_t;
+
 extern mesh_t *GL_LoadMesh(char *, char *);
+extern meshload_t *GL_LoadMeshAsync(char *, char *, meshloadfunc_t);
+extern mesh_t *GL_WaitMeshLoad(meshload_t *);
+extern void GL_UpdateMeshLoads(void);
+extern void GL_FinishMeshLoads(void);
 extern mesh_t *GL_CreateMesh(char *);
 extern mesh_t *GL_GetMesh(char *);
 extern void GL_AddSubmesh(mesh_t *, submesh_t *);
 extern submesh_t *GL_GetSubmesh(mesh_t *, char *);
 extern void GL_DeleteSubmesh(mesh_t *, submesh_t *);
+extern void GL_MergeSubmeshes(mesh_t *);
 extern void GL_DeleteSubmeshPool(mesh_t *);
 extern void GL_DeleteMesh(mesh_t *);
+extern void GL_FreeMesh(mesh_t *);
 extern void GL_DeleteMeshPool(void);
 extern void GL_GetSubmeshRenderoperation(submesh_t *, renderoperation_t *);
 extern void GL_PrintMeshInfo(mesh_t *);
 extern void GL_PostProcessMesh(mesh_t *);
+extern void GL_AnimateMesh(mesh_t *, real_t);
+extern void GL_SelectMeshLods(mesh_t *, vec3_t *);
+extern void GL_ViewFrustum(frustum_t *, vec3_t *);
+extern void GL_CullMesh(mesh_t *, vec3_t *);
+extern void GL_PickRay(int, int, vec3_t *, trace_t *);
+extern void GL_ClearOcclusion(void);
+extern void GL_DrawOccluders(mesh_t *, vec3_t *);
+extern void GL_OccludeMesh(mesh_t *, vec3_t *);
+extern void GL_DrawOcclusionBuffer(void);
+extern void GL_DrawPortals(mesh_t *);
+extern void GL_BeginQueries(void);
+extern void GL_QueryMesh(mesh_t *);
+extern void GL_QuerySubmeshes(mesh_t *, vec3_t *);
 extern void GL_RenderRenderoperation(renderoperation_t *);
+extern void GL_QueueRenderoperation(renderoperation_t *, material_t *, int, real_t);
+extern void GL_FlushRenderQueue(void);
 extern boolean_t GL_LoadTexture(GLuint *, char *, boolean_t);
 extern void GL_DeleteAllTextures(material_t *);
 extern image_t *GL_LoadImage(char *);
+extern material_t *GL_NewMaterial(void);
 extern material_t *GL_CreateNULLMaterial(void);
+extern void GL_AddMaterial(material_t *);
 extern void GL_BindMaterial(material_t *);
 extern material_t *GL_GetMaterial(char *);
+extern void GL_DeleteMaterial(material_t *);
+extern void GL_FreeMaterial(material_t *);
 extern void GL_DeleteMaterialPool(void);
+extern boolean_t GL_EvictMaterials(int, int);
 extern void GL_SetViewport(void);
 extern void GL_Perspective(real_t, real_t, real_t, real_t);
 extern void GL_Shutdown(void);
@@ -35,6 +35,10 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include <signal.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <errno.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/keysym.h>
@@ -48,6 +52,8 @@ void Sys_Warn(char *, ...);
 void Sys_Log(const char *, int);
 void Sys_Init(void);
 unsigned long int Sys_GetMilliseconds(void);
+void *Sys_PageAlloc(int, boolean_t, boolean_t);
+void Sys_PageFree(void *, int);
 void GLw_Init(void);
 void GLw_SetMode(void);
 void GLw_Shutdown(void);
@@ -198,6 +204,304 @@ unsigned long int Sys_GetMilliseconds(void)
 	return ((unsigned long int) (tp.tv_sec - secbase) * 1000 + (tp.tv_usec - microsecbase) * 0.001);
 }
 
+/*
+==========================
+Sys_PageAlloc()
+
+Maps zeroed anonymous memory. populate prefaults the
+whole range up front, hugepages asks for transparent
+huge pages. Returns NULL on failure
+==========================
+*/
+void *Sys_PageAlloc(int size, boolean_t populate, boolean_t hugepages)
+{
+	void *ptr;
+	int flags;
+
+	flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_POPULATE
+	if(populate)
+		flags |= MAP_POPULATE;
+#endif
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if(ptr == MAP_FAILED)
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	if(hugepages)
+		madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+	return ptr;
+}
+
+/*
+==========================
+Sys_PageFree()
+==========================
+*/
+void Sys_PageFree(void *ptr, int size)
+{
+	munmap(ptr, size);
+}
+
+/*
+==========================
+Sys_MapFile()
+
+Maps length bytes of an open file read-only. The mapping
+stays valid after the file is closed. Returns NULL on
+failure
+==========================
+*/
+void *Sys_MapFile(FILE *fp, int length)
+{
+	void *ptr;
+
+	ptr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+	if(ptr == MAP_FAILED)
+		return NULL;
+#ifdef MADV_SEQUENTIAL
+	madvise(ptr, length, MADV_SEQUENTIAL);
+#endif
+	return ptr;
+}
+
+/*
+==========================
+Sys_UnmapFile()
+==========================
+*/
+void Sys_UnmapFile(void *ptr, int length)
+{
+	munmap(ptr, length);
+}
+
+/*
+==========================
+Sys_ThreadStart()
+==========================
+*/
+typedef struct
+{
+	void (*func)(void *);
+	void *arg;
+} systhreadstart_t;
+
+static void *Sys_ThreadStart(void *data)
+{
+	systhreadstart_t start;
+
+	start = *(systhreadstart_t *) data;
+	free(data);
+	start.func(start.arg);
+	Z_ThreadShutdown();
+	return NULL;
+}
+
+/*
+==========================
+Sys_CreateThread()
+
+Runs func(arg) in a new thread. Returns a handle for
+Sys_JoinThread(), or NULL on failure
+==========================
+*/
+void *Sys_CreateThread(void (*func)(void *), void *arg)
+{
+	pthread_t *thread;
+	systhreadstart_t *start;
+	int err;
+
+	// the zone has to start locking before the thread runs
+	Z_EnableThreads();
+
+	thread = malloc(sizeof(pthread_t));
+	start = malloc(sizeof(systhreadstart_t));
+	if(!thread || !start)
+		Sys_Error("Sys_CreateThread: out of memory\n");
+	start->func = func;
+	start->arg = arg;
+	if((err = pthread_create(thread, NULL, Sys_ThreadStart, start)) != 0)
+	{
+		Sys_Warn("Sys_CreateThread: %s\n", strerror(err));
+		free(start);
+		free(thread);
+		return NULL;
+	}
+	return thread;
+}
+
+/*
+==========================
+Sys_JoinThread()
+==========================
+*/
+void Sys_JoinThread(void *thread)
+{
+	pthread_join(*(pthread_t *) thread, NULL);
+	free(thread);
+}
+
+/*
+==========================
+Sys_NumProcessors()
+==========================
+*/
+int Sys_NumProcessors(void)
+{
+	long num;
+
+	num = sysconf(_SC_NPROCESSORS_ONLN);
+	return (num < 1) ? 1 : (int) num;
+}
+
+/*
+==========================
+Sys_CreateMutex()
+
+Mutexes are recursive, so a Sys_Error() raised while
+holding one can still shut down cleanly
+==========================
+*/
+void *Sys_CreateMutex(void)
+{
+	pthread_mutex_t *mutex;
+	pthread_mutexattr_t attr;
+
+	mutex = malloc(sizeof(pthread_mutex_t));
+	if(!mutex)
+		Sys_Error("Sys_CreateMutex: out of memory\n");
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+	return mutex;
+}
+
+/*
+==========================
+Sys_DestroyMutex()
+==========================
+*/
+void Sys_DestroyMutex(void *mutex)
+{
+	pthread_mutex_destroy((pthread_mutex_t *) mutex);
+	free(mutex);
+}
+
+/*
+==========================
+Sys_LockMutex()
+==========================
+*/
+void Sys_LockMutex(void *mutex)
+{
+	pthread_mutex_lock((pthread_mutex_t *) mutex);
+}
+
+/*
+==========================
+Sys_UnlockMutex()
+==========================
+*/
+void Sys_UnlockMutex(void *mutex)
+{
+	pthread_mutex_unlock((pthread_mutex_t *) mutex);
+}
+
+/*
+==========================
+Sys_CreateSemaphore()
+==========================
+*/
+void *Sys_CreateSemaphore(int count)
+{
+	sem_t *sem;
+
+	sem = malloc(sizeof(sem_t));
+	if(!sem)
+		Sys_Error("Sys_CreateSemaphore: out of memory\n");
+	sem_init(sem, 0, count);
+	return sem;
+}
+
+/*
+==========================
+Sys_DestroySemaphore()
+==========================
+*/
+void Sys_DestroySemaphore(void *sem)
+{
+	sem_destroy((sem_t *) sem);
+	free(sem);
+}
+
+/*
+==========================
+Sys_PostSemaphore()
+
+Adds count to the semaphore, waking as many waiters
+==========================
+*/
+void Sys_PostSemaphore(void *sem, int count)
+{
+	while(count-- > 0)
+		sem_post((sem_t *) sem);
+}
+
+/*
+==========================
+Sys_WaitSemaphore()
+==========================
+*/
+void Sys_WaitSemaphore(void *sem)
+{
+	// signals interrupt the wait
+	while(sem_wait((sem_t *) sem) != 0 && errno == EINTR)
+		;
+}
+
+/*
+==========================
+Sys_AtomicCompareExchangePtr()
+
+Stores exchange in *dest if it still holds comparand.
+Returns the value *dest had, with a full barrier
+==========================
+*/
+void *Sys_AtomicCompareExchangePtr(void *volatile *dest, void *exchange, void *comparand)
+{
+	return __sync_val_compare_and_swap(dest, comparand, exchange);
+}
+
+/*
+==========================
+Sys_AtomicExchangePtr()
+==========================
+*/
+void *Sys_AtomicExchangePtr(void *volatile *dest, void *exchange)
+{
+	void *old;
+
+	// __sync_lock_test_and_set() is only an acquire barrier
+	do
+	{
+		old = *dest;
+	} while(__sync_val_compare_and_swap(dest, old, exchange) != old);
+	return old;
+}
+
+/*
+==========================
+Sys_AtomicAdd()
+
+Returns the new value
+==========================
+*/
+int Sys_AtomicAdd(volatile int *dest, int value)
+{
+	return __sync_add_and_fetch(dest, value);
+}
+
 /*
 =======================================================
 
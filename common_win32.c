@@ -29,12 +29,31 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 #include "extgl.h"
 #include "common.h"
+#include <io.h>
 
 void Sys_Printf(char *, ...);
 void Sys_Error(char *, ...);
 void Sys_Warn(char *, ...);
 void Sys_Init(void);
 unsigned long int Sys_GetMilliseconds(void);
+void *Sys_PageAlloc(int, boolean_t, boolean_t);
+void Sys_PageFree(void *, int);
+void *Sys_MapFile(FILE *, int);
+void Sys_UnmapFile(void *, int);
+void *Sys_CreateThread(void (*)(void *), void *);
+void Sys_JoinThread(void *);
+int Sys_NumProcessors(void);
+void *Sys_CreateMutex(void);
+void Sys_DestroyMutex(void *);
+void Sys_LockMutex(void *);
+void Sys_UnlockMutex(void *);
+void *Sys_CreateSemaphore(int);
+void Sys_DestroySemaphore(void *);
+void Sys_PostSemaphore(void *, int);
+void Sys_WaitSemaphore(void *);
+void *Sys_AtomicCompareExchangePtr(void *volatile *, void *, void *);
+void *Sys_AtomicExchangePtr(void *volatile *, void *);
+int Sys_AtomicAdd(volatile int *, int);
 void GLw_Init(void);
 void GLw_SetMode(void);
 void GLw_Shutdown(void);
@@ -164,6 +183,274 @@ unsigned long int Sys_GetMilliseconds(void)
 	return (timeGetTime() - timebase);
 }
 
+/*
+==========================
+Sys_PageAlloc()
+
+VirtualAlloc'd memory is committed and zeroed. Large
+pages need SeLockMemoryPrivilege so populate and
+hugepages are ignored here
+==========================
+*/
+void *Sys_PageAlloc(int size, boolean_t populate, boolean_t hugepages)
+{
+	return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+
+/*
+==========================
+Sys_PageFree()
+==========================
+*/
+void Sys_PageFree(void *ptr, int size)
+{
+	VirtualFree(ptr, 0, MEM_RELEASE);
+}
+
+/*
+==========================
+Sys_MapFile()
+
+Maps length bytes of an open file read-only. The view
+keeps the file open after fclose(). Returns NULL on
+failure
+==========================
+*/
+void *Sys_MapFile(FILE *fp, int length)
+{
+	HANDLE mapping;
+	void *ptr;
+
+	mapping = CreateFileMapping((HANDLE) _get_osfhandle(_fileno(fp)), NULL, PAGE_READONLY, 0, 0, NULL);
+	if(!mapping)
+		return NULL;
+	ptr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, length);
+	CloseHandle(mapping);
+	return ptr;
+}
+
+/*
+==========================
+Sys_UnmapFile()
+==========================
+*/
+void Sys_UnmapFile(void *ptr, int length)
+{
+	UnmapViewOfFile(ptr);
+}
+
+/*
+==========================
+Sys_ThreadStart()
+==========================
+*/
+typedef struct
+{
+	void (*func)(void *);
+	void *arg;
+} systhreadstart_t;
+
+static DWORD WINAPI Sys_ThreadStart(LPVOID data)
+{
+	systhreadstart_t start;
+
+	start = *(systhreadstart_t *) data;
+	free(data);
+	start.func(start.arg);
+	Z_ThreadShutdown();
+	return 0;
+}
+
+/*
+==========================
+Sys_CreateThread()
+
+Runs func(arg) in a new thread. Returns a handle for
+Sys_JoinThread(), or NULL on failure
+==========================
+*/
+void *Sys_CreateThread(void (*func)(void *), void *arg)
+{
+	systhreadstart_t *start;
+	HANDLE thread;
+	DWORD id;
+
+	// the zone has to start locking before the thread runs
+	Z_EnableThreads();
+
+	start = malloc(sizeof(systhreadstart_t));
+	if(!start)
+		Sys_Error("Sys_CreateThread: out of memory\n");
+	start->func = func;
+	start->arg = arg;
+	thread = CreateThread(NULL, 0, Sys_ThreadStart, start, 0, &id);
+	if(!thread)
+	{
+		Sys_Warn("Sys_CreateThread: CreateThread failed, error %i\n", (int) GetLastError());
+		free(start);
+		return NULL;
+	}
+	return (void *) thread;
+}
+
+/*
+==========================
+Sys_JoinThread()
+==========================
+*/
+void Sys_JoinThread(void *thread)
+{
+	WaitForSingleObject((HANDLE) thread, INFINITE);
+	CloseHandle((HANDLE) thread);
+}
+
+/*
+==========================
+Sys_NumProcessors()
+==========================
+*/
+int Sys_NumProcessors(void)
+{
+	SYSTEM_INFO info;
+
+	GetSystemInfo(&info);
+	return (info.dwNumberOfProcessors < 1) ? 1 : (int) info.dwNumberOfProcessors;
+}
+
+/*
+==========================
+Sys_CreateMutex()
+
+Critical sections are recursive, so a Sys_Error() raised
+while holding one can still shut down cleanly
+==========================
+*/
+void *Sys_CreateMutex(void)
+{
+	CRITICAL_SECTION *mutex;
+
+	mutex = malloc(sizeof(CRITICAL_SECTION));
+	if(!mutex)
+		Sys_Error("Sys_CreateMutex: out of memory\n");
+	InitializeCriticalSection(mutex);
+	return mutex;
+}
+
+/*
+==========================
+Sys_DestroyMutex()
+==========================
+*/
+void Sys_DestroyMutex(void *mutex)
+{
+	DeleteCriticalSection((CRITICAL_SECTION *) mutex);
+	free(mutex);
+}
+
+/*
+==========================
+Sys_LockMutex()
+==========================
+*/
+void Sys_LockMutex(void *mutex)
+{
+	EnterCriticalSection((CRITICAL_SECTION *) mutex);
+}
+
+/*
+==========================
+Sys_UnlockMutex()
+==========================
+*/
+void Sys_UnlockMutex(void *mutex)
+{
+	LeaveCriticalSection((CRITICAL_SECTION *) mutex);
+}
+
+/*
+==========================
+Sys_CreateSemaphore()
+==========================
+*/
+void *Sys_CreateSemaphore(int count)
+{
+	HANDLE sem;
+
+	sem = CreateSemaphore(NULL, count, 0x7fffffff, NULL);
+	if(!sem)
+		Sys_Error("Sys_CreateSemaphore: CreateSemaphore failed, error %i\n", (int) GetLastError());
+	return sem;
+}
+
+/*
+==========================
+Sys_DestroySemaphore()
+==========================
+*/
+void Sys_DestroySemaphore(void *sem)
+{
+	CloseHandle((HANDLE) sem);
+}
+
+/*
+==========================
+Sys_PostSemaphore()
+
+Adds count to the semaphore, waking as many waiters
+==========================
+*/
+void Sys_PostSemaphore(void *sem, int count)
+{
+	if(count > 0)
+		ReleaseSemaphore((HANDLE) sem, count, NULL);
+}
+
+/*
+==========================
+Sys_WaitSemaphore()
+==========================
+*/
+void Sys_WaitSemaphore(void *sem)
+{
+	WaitForSingleObject((HANDLE) sem, INFINITE);
+}
+
+/*
+==========================
+Sys_AtomicCompareExchangePtr()
+
+Stores exchange in *dest if it still holds comparand.
+Returns the value *dest had. The Interlocked calls are
+full barriers; pointers are 32 bits on the x86 builds
+==========================
+*/
+void *Sys_AtomicCompareExchangePtr(void *volatile *dest, void *exchange, void *comparand)
+{
+	return (void *) InterlockedCompareExchange((LONG volatile *) dest, (LONG) exchange, (LONG) comparand);
+}
+
+/*
+==========================
+Sys_AtomicExchangePtr()
+==========================
+*/
+void *Sys_AtomicExchangePtr(void *volatile *dest, void *exchange)
+{
+	return (void *) InterlockedExchange((LONG volatile *) dest, (LONG) exchange);
+}
+
+/*
+==========================
+Sys_AtomicAdd()
+
+Returns the new value
+==========================
+*/
+int Sys_AtomicAdd(volatile int *dest, int value)
+{
+	return (int) InterlockedExchangeAdd((LONG volatile *) dest, (LONG) value) + value;
+}
+
 /*
 =======================================================
 
@@ -22,6 +22,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 */
 
 #include <stdio.h>
+#include <string.h>
 #include "extgl.h"
 #include "common.h"
 #include "common_gl.h"
@@ -39,7 +40,9 @@ static void DM_Shutdown(void);
 void DM_KeyInput(int, boolean_t);
 void DM_MouseButtonInput(int, boolean_t, int, int);
 void DM_MouseMotionInput(int, int);
+static void DM_Pick(void);
 static void GL_Init(void);
+static void GL_MeshLoaded(mesh_t *, char *);
 static void GL_CheckExtensions(void);
 
 #define DEMO_NAME       "Demo Template"
@@ -87,6 +90,24 @@ static color3_t color[5];
 #define BIGROOM       0
 #define NUM_MESHES    1
 static mesh_t *meshes[NUM_MESHES];
+static real_t animtime;  // seconds the meshes have been animating
+static vec3_t roomorigin = {0.0f, -80.0f, -340.0f};  // where bigroom is drawn
+static char *meshfiles[NUM_MESHES] = {
+	"data/bigroom.3DS"
+};
+
+// -loadtest parses the same file into different meshes at once
+#define NUM_LOADTESTS 3
+static char *loadtestfiles[NUM_LOADTESTS] = {
+	"data/bigroom.3DS",
+	"data/bigroom.3DS",
+	"data/bigroom.3DS"
+};
+static int loadtestflags[NUM_LOADTESTS] = {
+	0,
+	MDL_MERGE | MDL_LOD,
+	MDL_BVH
+};
 
 /*
 ==========================
@@ -97,6 +118,9 @@ static void GL_BeginFrame(void)
 {
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     glLoadIdentity();
+	memset(&glstats, 0, sizeof(glstats));
+	GL_ClearOcclusion();
+	GL_BeginQueries();
 
 	GL_CameraLookAt();
 }
@@ -110,18 +134,43 @@ static void GL_RenderFrame(void)
 {
 	renderoperation_t ro;
 	submesh_t *submesh;
+	vec3_t viewpos, delta;
+	int i;
 
 	glPushMatrix();
-	glTranslatef(0.0f, -80.0f, -340.0f);
-	submesh = meshes[BIGROOM]->submeshpool;
+	glTranslatef(roomorigin.x, roomorigin.y, roomorigin.z);
+	if(!meshes[BIGROOM])
+	{
+		glPopMatrix();
+		return;
+	}
+	animtime += common.frameinterval * 0.001f;
+	GL_AnimateMesh(meshes[BIGROOM], animtime);
+	// after animating, the bounds have to be where the submeshes are drawn
+	GL_CullMesh(meshes[BIGROOM], &roomorigin);
+	GL_DrawOccluders(meshes[BIGROOM], &roomorigin);
+	GL_OccludeMesh(meshes[BIGROOM], &roomorigin);
+	GL_QueryMesh(meshes[BIGROOM]);
+	// the camera in the mesh's space, undoing the translate above
+	M_Vec3Subtract(&common.campos, &roomorigin, &viewpos);
+	GL_SelectMeshLods(meshes[BIGROOM], &viewpos);
+	// only what the portals showed, if they did
+	submesh = MDL_FirstShown(meshes[BIGROOM], &i);
 	while(submesh != NULL)
 	{
+		if(submesh->culled)
+		{
+			submesh = MDL_NextShown(meshes[BIGROOM], submesh, &i);
+			continue;
+		}
 		GL_GetSubmeshRenderoperation(submesh, &ro);
-		if(submesh->material)
-			GL_BindMaterial(submesh->material);
-		GL_RenderRenderoperation(&ro);
-		submesh = submesh->next;
+		M_Vec3Subtract(&submesh->centre, &viewpos, &delta);
+		GL_QueueRenderoperation(&ro, submesh->material, RQ_OPAQUE, M_Vec3Magnitude(&delta));
+		submesh = MDL_NextShown(meshes[BIGROOM], submesh, &i);
 	}
+	GL_FlushRenderQueue();
+	GL_QuerySubmeshes(meshes[BIGROOM], &roomorigin);
+	GL_DrawPortals(meshes[BIGROOM]);
 	glPopMatrix();
 }
 
@@ -132,13 +181,41 @@ GL_PostFrame()
 */
 static void GL_EndFrame(void)
 {
+	int		drawn, tested;
 #if DEBUG_MODE == 1
 	int		err;
 	err = glGetError();
 	if(err != GL_NO_ERROR)
 		Sys_Error("GL_PostFrame() failed: %s\n", GL_ErrorString(err));
 #endif
+	GL_DrawOcclusionBuffer();
 	GL_Printf(10, 10, &color[WHITE], false, "fps: %.2f", common.curfps);
+	if(Cvar_VariableValue("r_speeds"))
+	{
+		drawn = glstats.submeshes - glstats.frustumculled - glstats.portalculled
+			  - glstats.occlusionculled - glstats.queryculled;
+		tested = glstats.submeshes - glstats.frustumculled - glstats.portalculled;
+		GL_Printf(10, 26, &color[WHITE], false, "submeshes: %d drawn, %d culled, %d behind portals, %d occluded, %d hidden by queries",
+				  drawn, glstats.frustumculled, glstats.portalculled, glstats.occlusionculled, glstats.queryculled);
+		GL_Printf(10, 42, &color[WHITE], false, "cells: %d seen through %d portals",
+				  glstats.cells, glstats.portals);
+		GL_Printf(10, 58, &color[WHITE], false, "occluders: %d, %d triangles, %.0f%% of the rest hidden",
+				  glstats.occluders, glstats.occludertriangles,
+				  tested ? 100.0f * glstats.occlusionculled / tested : 0.0f);
+		GL_Printf(10, 74, &color[WHITE], false, "queries: %d issued, %d waited for",
+				  glstats.queries, glstats.querywaits);
+		GL_Printf(10, 90, &color[WHITE], false, "draws: %d, changing %d programs, %d textures, %d materials",
+				  glstats.draws, glstats.programchanges, glstats.texturechanges, glstats.materialchanges);
+		if(Cvar_VariableValue("r_speeds") >= 2)
+			Sys_Printf("r_speeds: %d submeshes, %d drawn, %d frustum culled, %d behind portals (%d cells, %d portals), "
+					   "%d occluded by %d occluders (%d triangles), %d hidden by queries, %d queries, %d waited for, "
+					   "%d draws, %d program changes, %d texture changes, %d material changes\n",
+					   glstats.submeshes, drawn, glstats.frustumculled, glstats.portalculled,
+					   glstats.cells, glstats.portals, glstats.occlusionculled,
+					   glstats.occluders, glstats.occludertriangles, glstats.queryculled,
+					   glstats.queries, glstats.querywaits, glstats.draws, glstats.programchanges,
+					   glstats.texturechanges, glstats.materialchanges);
+	}
 	glFlush();
 }
 
@@ -155,6 +232,7 @@ static void DM_MainLoop(void)
 		IN_Frame();
 		IN_HandleEvents();
 		Common_PreFrame();
+		GL_UpdateMeshLoads();
 		GL_BeginFrame();
 		GL_RenderFrame();
 		GL_EndFrame();
@@ -209,6 +287,40 @@ void DM_KeyInput(int key, boolean_t pressed)
 		common.cam_sidestep = 0;
 }
 
+/*
+==========================
+DM_Pick()
+
+Reports what's under the middle of the screen. The mouse
+steers the camera, so that's where it points
+==========================
+*/
+static void DM_Pick(void)
+{
+	trace_t trace;
+	char *name;
+	int i;
+
+	if(!meshes[BIGROOM])
+		return;
+	GL_PickRay((int) Cvar_VariableValue("scr_width") / 2, (int) Cvar_VariableValue("scr_height") / 2,
+			   &roomorigin, &trace);
+	MDL_TraceMesh(meshes[BIGROOM], &trace, 1);
+	if(!trace.submesh)
+	{
+		Sys_Printf("DM_Pick: nothing\n");
+		return;
+	}
+	// a merged submesh still knows its objects' faces
+	name = trace.submesh->name;
+	for(i = 0; i < trace.submesh->numranges; i++)
+		if(trace.face >= trace.submesh->ranges[i].firstface &&
+		   trace.face < trace.submesh->ranges[i].firstface + trace.submesh->ranges[i].numfaces)
+			name = trace.submesh->ranges[i].name;
+	Sys_Printf("DM_Pick: %s, face %d, %.2f units away\n", name ? name : "unnamed", trace.face,
+			   trace.fraction * M_Vec3Magnitude(&trace.delta));
+}
+
 /*
 ==========================
 DM_MouseButtonInput()
@@ -217,7 +329,7 @@ DM_MouseButtonInput()
 void DM_MouseButtonInput(int button, boolean_t pressed, int x, int y)
 {
 	if(button == K_MOUSE1 && !pressed)
-		printf("mouse1 released, x %d, y %d\n", x, y);
+		DM_Pick();
 	if(button == K_MOUSE2 && !pressed)
 		printf("mouse2 released, x %d, y %d\n", x, y);
 	if(button == K_MOUSE3 && !pressed)
@@ -240,8 +352,6 @@ GL_Init()
 */
 static void GL_Init(void)
 {
-	cvar_t *dev;
-
 	Sys_Printf("---------- glinfo ----------\n");
 	Sys_Printf("GL_VENDOR: %s\n", glGetString(GL_VENDOR));
 	Sys_Printf("GL_RENDERER: %s\n", glGetString(GL_RENDERER));
@@ -294,6 +404,7 @@ static void GL_Init(void)
 	color[BLACK].r  =  0.0; color[BLACK].g  =  0.0; color[BLACK].b  =  0.0;
 
 	GL_BuildFonts();
+	Z_SetEvictCallback(TAG_TEXTURE, GL_EvictMaterials);
 
 	// init camera position
 	common.campos.x = 0.0f;
@@ -306,14 +417,37 @@ static void GL_Init(void)
 	// camera speed
 	common.camspeed = 1.0f;
 
-	meshes[BIGROOM] = GL_LoadMesh("data/bigroom.3DS", "bigroom_mesh");
-	GL_LoadVertexProgram(meshes[BIGROOM]->submeshpool, "testvp.arbvp");
-	GL_LoadFragmentProgram(meshes[BIGROOM]->submeshpool, "testfp.arbfp");
+	GL_LoadMeshAsync(meshfiles[BIGROOM], "bigroom_mesh", GL_MeshLoaded);
+	if(Cvar_VariableValue("loadtest"))
+		MDL_LoadTest(loadtestfiles, loadtestflags, NUM_LOADTESTS, Sys_NumProcessors());
+}
+
+/*
+==========================
+GL_MeshLoaded()
+
+Picks up meshes as their background loads finish
+==========================
+*/
+static void GL_MeshLoaded(mesh_t *mesh, char *meshfile)
+{
+	cvar_t *dev;
+
+	if(!mesh)
+		Sys_Error("GL_MeshLoaded: couldn't load %s\n", meshfile);
+	if(!strcmp(meshfile, meshfiles[BIGROOM]))
+	{
+		meshes[BIGROOM] = mesh;
+		GL_LoadVertexProgram(mesh->submeshpool, "testvp.arbvp");
+		GL_LoadFragmentProgram(mesh->submeshpool, "testfp.arbfp");
+	}
+	if(Cvar_VariableValue("tracebench"))
+		MDL_TraceBenchmark(mesh);
 
 	dev = Cvar_Get("developer", 0);
 	// this generates a lot of output!
 	//if(dev && dev->value)
-	//	GL_PrintMeshInfo(meshes[BIGROOM]);
+	//	GL_PrintMeshInfo(mesh);
 }
 
 /*
@@ -350,6 +484,20 @@ static void GL_CheckExtensions(void)
 		Sys_Printf("      - ARB_fragment_program found\n");
 	else
 		Sys_Printf("      - ARB_fragment_program not found\n");
+	if(extgl_Extensions.ARB_occlusion_query)
+	{
+		Sys_Printf("      - ARB_occlusion_query found\n");
+		glcaps.occlusionqueries = QUERY_ARB;
+	}
+	else if(extgl_Extensions.NV_occlusion_query)
+	{
+		Sys_Printf("      - NV_occlusion_query found\n");
+		glcaps.occlusionqueries = QUERY_NV;
+	}
+	else
+	{
+		Sys_Printf("      - ARB_occlusion_query and NV_occlusion_query not found, r_queries ineffective\n");
+	}
 	Sys_Printf("\n");
 }
 
@@ -979,6 +979,17 @@ glGetBufferParameterivARBPROC glGetBufferParameterivARB = NULL;
 glGetBufferPointervARBPROC glGetBufferPointervARB = NULL;
 #endif /* GL_ARB_vertex_buffer_object */
 
+#ifdef GL_ARB_occlusion_query
+glGenQueriesARBPROC glGenQueriesARB = NULL;
+glDeleteQueriesARBPROC glDeleteQueriesARB = NULL;
+glIsQueryARBPROC glIsQueryARB = NULL;
+glBeginQueryARBPROC glBeginQueryARB = NULL;
+glEndQueryARBPROC glEndQueryARB = NULL;
+glGetQueryivARBPROC glGetQueryivARB = NULL;
+glGetQueryObjectivARBPROC glGetQueryObjectivARB = NULL;
+glGetQueryObjectuivARBPROC glGetQueryObjectuivARB = NULL;
+#endif /* GL_ARB_occlusion_query */
+
 #ifdef GL_EXT_depth_bounds_test
 glDepthBoundsEXTPROC glDepthBoundsEXT = NULL;
 #endif /* GL_EXT_depth_bounds_test */
@@ -1275,6 +1286,22 @@ void extgl_InitARBVertexBufferObject()
 #endif /* GL_ARB_vertex_buffer_object */
 }
 
+void extgl_InitARBOcclusionQuery()
+{
+#ifdef GL_ARB_occlusion_query
+    if (!extgl_Extensions.ARB_occlusion_query)
+        return;
+    glGenQueriesARB = (glGenQueriesARBPROC) extgl_GetProcAddress("glGenQueriesARB");
+    glDeleteQueriesARB = (glDeleteQueriesARBPROC) extgl_GetProcAddress("glDeleteQueriesARB");
+    glIsQueryARB = (glIsQueryARBPROC) extgl_GetProcAddress("glIsQueryARB");
+    glBeginQueryARB = (glBeginQueryARBPROC) extgl_GetProcAddress("glBeginQueryARB");
+    glEndQueryARB = (glEndQueryARBPROC) extgl_GetProcAddress("glEndQueryARB");
+    glGetQueryivARB = (glGetQueryivARBPROC) extgl_GetProcAddress("glGetQueryivARB");
+    glGetQueryObjectivARB = (glGetQueryObjectivARBPROC) extgl_GetProcAddress("glGetQueryObjectivARB");
+    glGetQueryObjectuivARB = (glGetQueryObjectuivARBPROC) extgl_GetProcAddress("glGetQueryObjectuivARB");
+#endif /* GL_ARB_occlusion_query */
+}
+
 
 void extgl_InitEXTBlendMinmax()
 {
@@ -2343,6 +2370,7 @@ void extgl_InitSupportedExtensions()
     extgl_Extensions.ARB_matrix_palette = QueryExtension("GL_ARB_matrix_palette");
     extgl_Extensions.ARB_multisample = QueryExtension("GL_ARB_multisample");
     extgl_Extensions.ARB_multitexture = QueryExtension("GL_ARB_multitexture");
+    extgl_Extensions.ARB_occlusion_query = QueryExtension("GL_ARB_occlusion_query");
     extgl_Extensions.ARB_point_parameters = QueryExtension("GL_ARB_point_parameters");
     extgl_Extensions.ARB_shadow = QueryExtension("GL_ARB_shadow");
     extgl_Extensions.ARB_shadow_ambient = QueryExtension("GL_ARB_shadow_ambient");
@@ -2451,6 +2479,7 @@ int extgl_Initialize()
     extgl_InitARBMatrixPalette();
     extgl_InitARBMultisample();
     extgl_InitARBMultitexture();
+    extgl_InitARBOcclusionQuery();
     extgl_InitARBPointParameters();
     extgl_InitARBTextureCompression();
     extgl_InitARBTransposeMatrix();
@@ -73,6 +73,7 @@ GL_ARB_imaging
 GL_ARB_matrix_palette
 GL_ARB_multisample
 GL_ARB_multitexture
+GL_ARB_occlusion_query
 GL_ARB_point_parameters
 GL_ARB_shadow
 GL_ARB_shadow_ambient
@@ -5149,6 +5150,39 @@ extern glGetBufferPointervARBPROC glGetBufferPointervARB;
 
 #endif /* GL_ARB_vertex_buffer_object */
 
+/*-------------------------------------------------------------------*/
+/*------------GL_ARB_OCCLUSION_QUERY---------------------------------*/
+/*-------------------------------------------------------------------*/
+
+#ifndef GL_ARB_occlusion_query
+#define GL_ARB_occlusion_query 1
+
+#define GL_QUERY_COUNTER_BITS_ARB                               0x8864
+#define GL_CURRENT_QUERY_ARB                                    0x8865
+#define GL_QUERY_RESULT_ARB                                     0x8866
+#define GL_QUERY_RESULT_AVAILABLE_ARB                           0x8867
+#define GL_SAMPLES_PASSED_ARB                                   0x8914
+
+typedef void (APIENTRY * glGenQueriesARBPROC) (GLsizei n, GLuint *ids);
+typedef void (APIENTRY * glDeleteQueriesARBPROC) (GLsizei n, const GLuint *ids);
+typedef GLboolean (APIENTRY * glIsQueryARBPROC) (GLuint id);
+typedef void (APIENTRY * glBeginQueryARBPROC) (GLenum target, GLuint id);
+typedef void (APIENTRY * glEndQueryARBPROC) (GLenum target);
+typedef void (APIENTRY * glGetQueryivARBPROC) (GLenum target, GLenum pname, GLint *params);
+typedef void (APIENTRY * glGetQueryObjectivARBPROC) (GLuint id, GLenum pname, GLint *params);
+typedef void (APIENTRY * glGetQueryObjectuivARBPROC) (GLuint id, GLenum pname, GLuint *params);
+
+extern glGenQueriesARBPROC glGenQueriesARB;
+extern glDeleteQueriesARBPROC glDeleteQueriesARB;
+extern glIsQueryARBPROC glIsQueryARB;
+extern glBeginQueryARBPROC glBeginQueryARB;
+extern glEndQueryARBPROC glEndQueryARB;
+extern glGetQueryivARBPROC glGetQueryivARB;
+extern glGetQueryObjectivARBPROC glGetQueryObjectivARB;
+extern glGetQueryObjectuivARBPROC glGetQueryObjectuivARB;
+
+#endif /* GL_ARB_occlusion_query */
+
 /*-------------------------------------------------------------------*/
 /*------------GL_EXT_TEXTURE_RECTANGLE-------------------------------*/
 /*-------------------------------------------------------------------*/
@@ -5529,6 +5563,7 @@ struct ExtensionTypes
     int ARB_matrix_palette;
     int ARB_multisample;
     int ARB_multitexture;
+    int ARB_occlusion_query;
     int ARB_point_parameters;
     int ARB_shadow;
     int ARB_shadow_ambient;